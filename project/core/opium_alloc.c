@@ -18,7 +18,7 @@ opium_malloc(size_t size, opium_log_t *log)
       opium_log_debug(log, "Malloc failed(size: %zu)\n", size);
    }
 
-   opium_log_debug(log, "Allocate pointer. Size: %zu\n", size);
+   opium_log_bin(log, "Allocate pointer. Size: %zu\n", size);
 
    return ptr;
 }
@@ -117,6 +117,9 @@ opium_arena_alloc(opium_arena_t *arena, size_t size)
    opium_slab_t *slab = &arena->slabs[index];
 
    void *ptr = opium_slab_alloc(slab);
+   if (!ptr) {
+      return NULL;
+   }
 
    /*
     * We store a label indicating which slab allocated this block.
@@ -126,8 +129,8 @@ opium_arena_alloc(opium_arena_t *arena, size_t size)
    opium_slab_header_t *header = opium_slab_slot_header(ptr);
    header->index = index;
 
-   printf("ptr: %p, header: %p, value: %d\n",
-         ptr, header, header->index);
+   opium_log_bin(arena->log, "ptr: %p, header: %p, value: %d\n",
+         ptr, (void*)header, (int)header->index);
 
    return ptr;
 }
@@ -160,12 +163,11 @@ opium_arena_free(opium_arena_t *arena, void *ptr)
     */
 
    opium_slab_header_t *header = opium_slab_slot_header(ptr);
-   printf("DELETE ptr: %p, header: %p, value: %d\n",
-         ptr, header, header->index);
+   opium_log_bin(arena->log, "DELETE ptr: %p, header: %p, value: %d\n",
+         ptr, (void*)header, (int)header->index);
 
    opium_slab_t *slab = &arena->slabs[header->index];
 
-   void *slot_ptr = (u_char*)ptr - OPIUM_SLAB_SLOT_HEADER;
-
-   opium_slab_free(slab, slot_ptr);
+   /* The pointer opium_slab_alloc() returned, it steps over the header itself */
+   opium_slab_free(slab, ptr);
 }
@@ -0,0 +1,38 @@
+#ifndef OPIUM_ATOMIC_INCLUDE_H
+#define OPIUM_ATOMIC_INCLUDE_H
+
+#include "core/opium_core.h"
+
+/*
+ * Small building blocks for code that waits on other threads.
+ *
+ * opium_cpu_relax() goes into every busy-wait loop: on x86 'pause' tells
+ * the core it is spinning, which saves power and frees the pipeline for the
+ * sibling hyperthread.
+ *
+ * The futex helpers park a thread on a 32-bit word until another thread
+ * changes it and wakes it up. The kernel only sleeps if *addr still holds
+ * 'val', so a wake between the check and the sleep is never lost.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define opium_cpu_relax()  __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define opium_cpu_relax()  __asm__ __volatile__("yield" ::: "memory")
+#else
+#define opium_cpu_relax()  __asm__ __volatile__("" ::: "memory")
+#endif
+
+   static inline long
+opium_futex_wait(_Atomic opium_u32_t *addr, opium_u32_t val)
+{
+   return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+   static inline long
+opium_futex_wake(_Atomic opium_u32_t *addr, opium_u32_t count)
+{
+   return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+#endif /* OPIUM_ATOMIC_INCLUDE_H */
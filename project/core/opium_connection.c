@@ -0,0 +1,167 @@
+/* opium_connection.c
+ *
+ * Preallocated connection objects with generation-tagged handles.
+ *
+ * The slots are one array, the free list is threaded through them by
+ * index. A slot keeps its generation across frees, the handle of the
+ * previous owner stops matching as soon as the slot is released.
+ *
+ */
+
+#include "core/opium_core.h"
+
+   static opium_conn_handle_t
+opium_conn_make_handle(opium_u32_t index, opium_u32_t gen)
+{
+   return (gen << OPIUM_CONN_INDEX_BITS) | index;
+}
+
+   opium_s32_t
+opium_conn_pool_init(opium_conn_pool_t *pool, opium_u32_t capacity, opium_log_t *log)
+{
+   opium_memzero(pool, sizeof(*pool));
+   pool->log = log;
+   pool->free = OPIUM_CONN_NONE;
+
+   if (capacity < 1 || capacity > OPIUM_CONN_MAX) {
+      opium_log_err(log, "Connection pool capacity %u is out of range (1..%u)\n",
+            capacity, OPIUM_CONN_MAX);
+      return OPIUM_RET_ERR;
+   }
+
+   pool->conns = opium_memalign(OPIUM_CACHE_LINE, (size_t)capacity * sizeof(opium_connection_t), log);
+   if (!pool->conns) {
+      opium_log_err(log, "Failed to allocate %u connections\n", capacity);
+      return OPIUM_RET_ERR;
+   }
+
+   /* Touch everything now, not on the first burst of accepts */
+   opium_memzero(pool->conns, (size_t)capacity * sizeof(opium_connection_t));
+
+   /* Lowest index first: a small load stays on few pages */
+   for (opium_u32_t index = capacity; index-- > 0;) {
+      opium_connection_t *conn = &pool->conns[index];
+
+      conn->fd = -1;
+      conn->handle = opium_conn_make_handle(index, 1);
+      conn->next = pool->free;
+      pool->free = index;
+   }
+
+   pool->capacity = capacity;
+
+   return OPIUM_RET_OK;
+}
+
+   void
+opium_conn_pool_exit(opium_conn_pool_t *pool)
+{
+   if (!pool->conns) {
+      return;
+   }
+
+   if (pool->used > 0) {
+      opium_log_err(pool->log, "Connection pool released with %u connections in use\n", pool->used);
+   }
+
+   opium_free(pool->conns, pool->log);
+   pool->conns = NULL;
+   pool->capacity = 0;
+   pool->used = 0;
+   pool->free = OPIUM_CONN_NONE;
+}
+
+   opium_connection_t *
+opium_conn_get(opium_conn_pool_t *pool, opium_socket_fd_t fd,
+      const struct sockaddr *addr, socklen_t socklen)
+{
+   opium_connection_t  *conn;
+   opium_conn_handle_t  handle;
+   opium_u32_t          next;
+
+   pool->ngets++;
+
+   if (pool->free == OPIUM_CONN_NONE) {
+      pool->nfails++;
+      return NULL;
+   }
+
+   conn = &pool->conns[pool->free];
+   next = conn->next;
+   handle = conn->handle;
+
+   opium_memzero(conn, offsetof(opium_connection_t, addr));
+   conn->fd = fd;
+   conn->handle = handle;
+   conn->next = OPIUM_CONN_NONE;
+   conn->used = 1;
+   conn->sockaddr = (struct sockaddr*)&conn->addr;
+
+   if (addr && socklen > 0) {
+      conn->socklen = opium_min(socklen, (socklen_t)sizeof(conn->addr));
+      opium_memcpy(&conn->addr, (void*)addr, conn->socklen);
+   }
+
+   pool->free = next;
+   pool->used++;
+   pool->peak = opium_max(pool->peak, pool->used);
+
+   return conn;
+}
+
+   void
+opium_conn_free(opium_conn_pool_t *pool, opium_connection_t *conn)
+{
+   opium_u32_t index = opium_conn_handle_index(conn->handle);
+   opium_u32_t gen = opium_conn_handle_gen(conn->handle);
+
+   if (!conn->used) {
+      opium_log_err(pool->log, "Connection %u freed twice\n", index);
+      return;
+   }
+
+   /* Invalidate every outstanding handle, skipping the reserved 0 */
+   gen = (gen + 1) & OPIUM_CONN_GEN_MASK;
+   if (gen == 0) {
+      gen = 1;
+   }
+
+   conn->used = 0;
+   conn->fd = -1;
+   conn->data = NULL;
+   conn->handle = opium_conn_make_handle(index, gen);
+
+   conn->next = pool->free;
+   pool->free = index;
+   pool->used--;
+}
+
+   opium_connection_t *
+opium_conn_lookup(opium_conn_pool_t *pool, opium_conn_handle_t handle)
+{
+   opium_connection_t *conn;
+   opium_u32_t         index = opium_conn_handle_index(handle);
+
+   if (handle == OPIUM_CONN_HANDLE_INVALID || index >= pool->capacity) {
+      return NULL;
+   }
+
+   conn = &pool->conns[index];
+   if (!conn->used || conn->handle != handle) {
+      pool->nstale++;
+      return NULL;
+   }
+
+   return conn;
+}
+
+   void
+opium_conn_pool_stats(opium_conn_pool_t *pool)
+{
+   opium_log_debug(pool->log, "Connections: capacity %u, used %u, peak %u, "
+         "gets %llu, fails %llu, stale %llu, %zu bytes\n",
+         pool->capacity, pool->used, pool->peak,
+         (unsigned long long)pool->ngets, (unsigned long long)pool->nfails,
+         (unsigned long long)pool->nstale,
+         (size_t)pool->capacity * sizeof(opium_connection_t));
+}
@@ -3,6 +3,30 @@
 
 #include "core/opium_core.h"
 
+/*
+ * Handle = generation << OPIUM_CONN_INDEX_BITS | slot index.
+ * The generation moves on every free, so an event carrying the handle of a
+ * connection that was closed and reused (same fd, same slot) no longer
+ * resolves. Generation 0 is never handed out: handle 0 is always invalid.
+ *
+ * 12 bits leave 4095 generations per slot. They wrap: a handle kept across
+ * exactly 4095 reuses of its slot matches again and resolves to whoever
+ * holds the slot now (ABA). Handles are meant for events in flight on the
+ * loop, which live for a few iterations, not for the 4095 connections
+ * that would have to come and go on one slot in between.
+ */
+#define OPIUM_CONN_INDEX_BITS      20
+#define OPIUM_CONN_INDEX_MASK      ((1u << OPIUM_CONN_INDEX_BITS) - 1)
+#define OPIUM_CONN_GEN_MASK        ((1u << (32 - OPIUM_CONN_INDEX_BITS)) - 1)
+#define OPIUM_CONN_MAX             OPIUM_CONN_INDEX_MASK
+
+#define OPIUM_CONN_HANDLE_INVALID  0
+
+/* Free list terminator */
+#define OPIUM_CONN_NONE            ((opium_u32_t)-1)
+
+typedef opium_u32_t opium_conn_handle_t;
+
 struct opium_listening_s {
    opium_socket_fd_t fd;
 
@@ -18,15 +42,69 @@ struct opium_listening_s {
 struct opium_connection_s {
    opium_socket_fd_t fd;
 
-   struct sockaddr  *sockaddr;
+   struct sockaddr  *sockaddr;   /* Points at 'addr' */
    socklen_t         socklen;
 
    opium_u32_t       session_id;
 
    unsigned          authorized:1;
+   unsigned          used:1;
 
    size_t            sendbuf;
    size_t            recvbuf;
+
+   void             *data;
+
+   opium_conn_handle_t handle;
+   opium_u32_t       next;       /* Free list, slot index */
+
+   struct sockaddr_storage addr;
 };
 
+/*
+ * Every connection the process may hold, allocated once at init.
+ * Free slots are chained by index, get and free are O(1), nothing is
+ * allocated or released while serving. Loop thread only.
+ */
+struct opium_conn_pool_s {
+   opium_connection_t *conns;
+   opium_u32_t       capacity;
+
+   opium_u32_t       free;       /* Head of the free list */
+   opium_u32_t       used;
+   opium_u32_t       peak;
+
+   /* Statistics */
+   opium_u64_t       ngets;
+   opium_u64_t       nfails;     /* Pool was empty */
+   opium_u64_t       nstale;     /* Lookups with an outdated handle */
+
+   opium_log_t      *log;
+};
+
+opium_s32_t opium_conn_pool_init(opium_conn_pool_t *pool, opium_u32_t capacity, opium_log_t *log);
+void opium_conn_pool_exit(opium_conn_pool_t *pool);
+
+/* NULL when every slot is taken */
+opium_connection_t *opium_conn_get(opium_conn_pool_t *pool, opium_socket_fd_t fd,
+      const struct sockaddr *addr, socklen_t socklen);
+void opium_conn_free(opium_conn_pool_t *pool, opium_connection_t *conn);
+
+/* NULL when the handle is invalid or its connection is gone */
+opium_connection_t *opium_conn_lookup(opium_conn_pool_t *pool, opium_conn_handle_t handle);
+
+void opium_conn_pool_stats(opium_conn_pool_t *pool);
+
+static inline opium_u32_t
+opium_conn_handle_index(opium_conn_handle_t handle)
+{
+   return handle & OPIUM_CONN_INDEX_MASK;
+}
+
+static inline opium_u32_t
+opium_conn_handle_gen(opium_conn_handle_t handle)
+{
+   return handle >> OPIUM_CONN_INDEX_BITS;
+}
+
 #endif /* OPIUM_CONNECTION_INCLUDE_H */
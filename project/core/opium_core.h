@@ -15,6 +15,9 @@
 #define OPIUM_RET_ERR  -1  /* Generic error */
 #define OPIUM_RET_FULL -2  /* Resource full / cannot allocate */
 
+/* Cache line size, used to keep hot shared fields apart */
+#define OPIUM_CACHE_LINE 64
+
 /* Limits for optimized memcpy / memset routines */
 #define OPIUM_MEMCPY_LIMIT 2048
 #define OPIUM_MEMSET_LIMIT 2048
@@ -58,6 +61,8 @@ typedef int          opium_err_t;
 /* Definitions */
 
 typedef struct opium_log_s         opium_log_t;
+typedef struct opium_log_async_s   opium_log_async_t;
+typedef struct opium_log_site_s    opium_log_site_t;
 typedef struct opium_list_head_s   opium_list_head_t;
 typedef struct opium_slab_s        opium_slab_t;
 typedef struct opium_arena_s       opium_arena_t;
@@ -65,6 +70,20 @@ typedef struct opium_arena_s       opium_arena_t;
 typedef struct opium_rbt_s         opium_rbt_t;
 typedef struct opium_thread_s      opium_thread_t;
 typedef struct opium_event_s       opium_event_t;
+typedef struct opium_task_s        opium_task_t;
+typedef struct opium_task_group_s  opium_task_group_t;
+typedef struct opium_wpool_s       opium_wpool_t;
+typedef struct opium_cpuinfo_s     opium_cpuinfo_t;
+typedef struct opium_ebr_s         opium_ebr_t;
+typedef struct opium_ebr_thread_s  opium_ebr_thread_t;
+typedef struct opium_uring_s       opium_uring_t;
+typedef struct opium_uring_bufs_s  opium_uring_bufs_t;
+typedef struct opium_listening_s   opium_listening_t;
+typedef struct opium_connection_s  opium_connection_t;
+typedef struct opium_conn_pool_s   opium_conn_pool_t;
+typedef struct opium_server_s      opium_server_t;
+typedef struct opium_file_s        opium_file_t;
+typedef struct opium_file_cache_s  opium_file_cache_t;
 
 /* Includes */
 #include "opium_log.h"
@@ -76,12 +95,22 @@ typedef struct opium_event_s       opium_event_t;
 #include "opium_arena.h"
 
 #include "opium_rbt.h"
+#include "opium_atomic.h"
+#include "opium_lock.h"
+#include "opium_ebr.h"
+#include "opium_cpu.h"
 #include "opium_thread.h"
+#include "opium_wpool.h"
+#include "opium_log_async.h"
+#include "opium_log_bin.h"
+#include "opium_uring.h"
 #include "opium_event.h"
 
 #include "opium_network.h"
-#include "opium_server.h"
+#include "opium_udp.h"
 #include "opium_connection.h"
+#include "opium_server.h"
+#include "opium_file.h"
 
 /* Utility macros */
 #define opium_min(a,b) ((a) < (b) ? (a) : (b))
@@ -91,7 +120,4 @@ typedef struct opium_event_s       opium_event_t;
 #define opium_likely(exp)   __builtin_expect(!!(exp), 1)
 #define opium_unlikely(exp) __builtin_expect(!!(exp), 0)
 
-/* Utility to print CPU info */
-void opium_cpuinfo(void);
-
 #endif /* OPIUM_CORE_INCLUDE_H */
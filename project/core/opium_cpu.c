@@ -0,0 +1,384 @@
+/* opium_cpu.c
+ *
+ * CPU topology discovery and thread placement.
+ *
+ * Pinning worker N to CPU N looks fine until:
+ *   - CPU N and CPU N+1 are two hyperthreads of the same core, so two
+ *     "independent" event loops share one set of execution units;
+ *   - the container only allows CPUs 8-15, so half of the threads cannot
+ *     be pinned at all;
+ *   - the machine has two sockets and every thread lands on the first one.
+ *
+ * So we read the real picture first:
+ *
+ *   sched_getaffinity()                          -> CPUs we may use
+ *   cpuN/topology/thread_siblings_list           -> physical core (SMT)
+ *   cpuN/topology/physical_package_id            -> socket
+ *   cpuN/cache/indexK (highest level)            -> last level cache domain
+ *   /sys/devices/system/node/nodeM/cpulist       -> NUMA node
+ *
+ * and then hand out CPUs according to a placement policy. Every missing
+ * sysfs file falls back to "one of each" so containers without /sys still
+ * get a usable (flat) topology.
+ *
+ */
+
+#include "core/opium_core.h"
+
+#define OPIUM_CPU_SYSFS       "/sys/devices/system/cpu"
+#define OPIUM_CPU_NODE_SYSFS  "/sys/devices/system/node"
+
+   static ssize_t
+opium_cpu_read(const char *path, char *buf, size_t size)
+{
+   opium_fd_t fd;
+   ssize_t    n;
+
+   fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd == -1) {
+      return -1;
+   }
+
+   n = read(fd, buf, size - 1);
+   close(fd);
+
+   if (n <= 0) {
+      return -1;
+   }
+
+   buf[n] = '\0';
+
+   return n;
+}
+
+   static opium_s32_t
+opium_cpu_read_int(const char *path, opium_s32_t fallback)
+{
+   char buf[32];
+
+   if (opium_cpu_read(path, buf, sizeof(buf)) == -1) {
+      return fallback;
+   }
+
+   return atoi(buf);
+}
+
+/*
+ * Parse a sysfs CPU list, e.g. "0-3,8,10-11\n".
+ */
+   static void
+opium_cpu_parse_list(const char *str, cpu_set_t *set)
+{
+   char *end;
+   long  lo, hi;
+
+   CPU_ZERO(set);
+
+   while (*str) {
+      if (!isdigit((u_char)*str)) {
+         str++;
+         continue;
+      }
+
+      lo = strtol(str, &end, 10);
+      hi = lo;
+      str = end;
+
+      if (*str == '-') {
+         hi = strtol(str + 1, &end, 10);
+         str = end;
+      }
+
+      for (long cpu = lo; cpu <= hi && cpu < OPIUM_CPU_MAX; cpu++) {
+         CPU_SET(cpu, set);
+      }
+   }
+}
+
+   static opium_s32_t
+opium_cpu_first(cpu_set_t *set)
+{
+   for (opium_s32_t cpu = 0; cpu < OPIUM_CPU_MAX; cpu++) {
+      if (CPU_ISSET(cpu, set)) {
+         return cpu;
+      }
+   }
+
+   return -1;
+}
+
+/* First CPU of the highest level data/unified cache shared with 'cpu' */
+   static opium_s32_t
+opium_cpu_llc(opium_s32_t cpu, opium_s32_t fallback)
+{
+   char        path[PATH_MAX], buf[256];
+   opium_s32_t level, best = -1, llc = fallback;
+   cpu_set_t   set;
+
+   for (opium_s32_t index = 0; index < 16; index++) {
+      snprintf(path, sizeof(path), OPIUM_CPU_SYSFS "/cpu%d/cache/index%d/type", cpu, index);
+      if (opium_cpu_read(path, buf, sizeof(buf)) == -1) {
+         break;
+      }
+
+      if (strncmp(buf, "Instruction", 11) == 0) {
+         continue;
+      }
+
+      snprintf(path, sizeof(path), OPIUM_CPU_SYSFS "/cpu%d/cache/index%d/level", cpu, index);
+      level = opium_cpu_read_int(path, -1);
+      if (level <= best) {
+         continue;
+      }
+
+      snprintf(path, sizeof(path), OPIUM_CPU_SYSFS "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+      if (opium_cpu_read(path, buf, sizeof(buf)) == -1) {
+         continue;
+      }
+
+      opium_cpu_parse_list(buf, &set);
+      if (opium_cpu_first(&set) != -1) {
+         best = level;
+         llc = opium_cpu_first(&set);
+      }
+   }
+
+   return llc;
+}
+
+   static void
+opium_cpu_nodes(opium_s32_t *node_of)
+{
+   char           path[PATH_MAX], buf[4096];
+   DIR           *dir;
+   struct dirent *entry;
+   cpu_set_t      set;
+   int            node;
+
+   for (opium_s32_t cpu = 0; cpu < OPIUM_CPU_MAX; cpu++) {
+      node_of[cpu] = 0;
+   }
+
+   dir = opendir(OPIUM_CPU_NODE_SYSFS);
+   if (!dir) {
+      return;
+   }
+
+   while ((entry = readdir(dir)) != NULL) {
+      if (sscanf(entry->d_name, "node%d", &node) != 1 || node < 0 || node >= OPIUM_CPU_MAX) {
+         continue;
+      }
+
+      snprintf(path, sizeof(path), OPIUM_CPU_NODE_SYSFS "/node%d/cpulist", node);
+      if (opium_cpu_read(path, buf, sizeof(buf)) == -1) {
+         continue;
+      }
+
+      opium_cpu_parse_list(buf, &set);
+      for (opium_s32_t cpu = 0; cpu < OPIUM_CPU_MAX; cpu++) {
+         if (CPU_ISSET(cpu, &set)) {
+            node_of[cpu] = node;
+         }
+      }
+   }
+
+   closedir(dir);
+}
+
+/* Turn a raw sysfs id into a dense index */
+   static opium_s32_t
+opium_cpu_dense(opium_s32_t *map, opium_u32_t *count, opium_s32_t key)
+{
+   if (key < 0 || key >= OPIUM_CPU_MAX) {
+      key = 0;
+   }
+
+   if (map[key] == -1) {
+      map[key] = (*count)++;
+   }
+
+   return map[key];
+}
+
+   opium_s32_t
+opium_cpuinfo_init(opium_cpuinfo_t *info, opium_log_t *log)
+{
+   char         path[PATH_MAX], buf[4096];
+   cpu_set_t    allowed, siblings;
+   opium_s32_t *node_of, *core_map, *llc_map, *node_map, *pkg_map;
+   opium_s32_t  core, llc, package;
+
+   opium_memzero(info, sizeof(opium_cpuinfo_t));
+
+   if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+      opium_log_err(log, "sched_getaffinity() failed: %s\n", strerror(errno));
+      return OPIUM_RET_ERR;
+   }
+
+   node_of = opium_malloc(5 * OPIUM_CPU_MAX * sizeof(opium_s32_t), log);
+   if (!node_of) {
+      return OPIUM_RET_ERR;
+   }
+
+   core_map = node_of + OPIUM_CPU_MAX;
+   llc_map = core_map + OPIUM_CPU_MAX;
+   node_map = llc_map + OPIUM_CPU_MAX;
+   pkg_map = node_map + OPIUM_CPU_MAX;
+   opium_memset(core_map, 0xff, 4 * OPIUM_CPU_MAX * sizeof(opium_s32_t));
+
+   opium_cpu_nodes(node_of);
+
+   for (opium_s32_t cpu = 0; cpu < OPIUM_CPU_MAX; cpu++) {
+      opium_cpu_t *entry;
+
+      if (!CPU_ISSET(cpu, &allowed)) {
+         continue;
+      }
+
+      entry = &info->cpus[info->ncpus++];
+      entry->cpu = cpu;
+
+      /* The first thread of the sibling list names the physical core */
+      core = cpu;
+      entry->smt = 0;
+
+      snprintf(path, sizeof(path), OPIUM_CPU_SYSFS "/cpu%d/topology/thread_siblings_list", cpu);
+      if (opium_cpu_read(path, buf, sizeof(buf)) != -1) {
+         opium_cpu_parse_list(buf, &siblings);
+         if (opium_cpu_first(&siblings) != -1) {
+            core = opium_cpu_first(&siblings);
+         }
+         for (opium_s32_t sibling = 0; sibling < cpu; sibling++) {
+            if (CPU_ISSET(sibling, &siblings)) {
+               entry->smt++;
+            }
+         }
+      }
+
+      snprintf(path, sizeof(path), OPIUM_CPU_SYSFS "/cpu%d/topology/physical_package_id", cpu);
+      package = opium_cpu_read_int(path, 0);
+
+      llc = opium_cpu_llc(cpu, -1);
+
+      entry->core = opium_cpu_dense(core_map, &info->ncores, core);
+      entry->package = opium_cpu_dense(pkg_map, &info->npackages, package);
+      entry->node = opium_cpu_dense(node_map, &info->nnodes, node_of[cpu]);
+
+      /* No cache info: treat each socket as one LLC domain */
+      entry->llc = opium_cpu_dense(llc_map, &info->nllcs,
+            llc != -1 ? llc : OPIUM_CPU_MAX - 1 - entry->package);
+   }
+
+   opium_free(node_of, log);
+
+   if (info->ncpus == 0) {
+      opium_log_err(log, "No usable CPUs found\n");
+      return OPIUM_RET_ERR;
+   }
+
+   return OPIUM_RET_OK;
+}
+
+   static int
+opium_cpu_cmp_physical(const void *a, const void *b)
+{
+   const opium_cpu_t *x = *(const opium_cpu_t **)a, *y = *(const opium_cpu_t **)b;
+
+   if (x->smt != y->smt) return x->smt - y->smt;
+   return x->cpu - y->cpu;
+}
+
+   static int
+opium_cpu_cmp_pack(const void *a, const void *b)
+{
+   const opium_cpu_t *x = *(const opium_cpu_t **)a, *y = *(const opium_cpu_t **)b;
+
+   if (x->node != y->node) return x->node - y->node;
+   if (x->llc != y->llc) return x->llc - y->llc;
+   if (x->core != y->core) return x->core - y->core;
+   return x->smt - y->smt;
+}
+
+/*
+ * Fill 'cpus' with 'count' CPU numbers for the policy. If there are more
+ * threads than CPUs the order simply wraps around.
+ */
+   opium_s32_t
+opium_cpu_place(opium_cpuinfo_t *info, opium_cpu_place_t policy,
+      opium_u32_t count, opium_s32_t *cpus)
+{
+   opium_cpu_t *order[OPIUM_CPU_MAX], *spread[OPIUM_CPU_MAX];
+   opium_u8_t   taken[OPIUM_CPU_MAX];
+   opium_u32_t  n = info->ncpus, placed;
+
+   if (n == 0) {
+      return OPIUM_RET_ERR;
+   }
+
+   for (opium_u32_t index = 0; index < n; index++) {
+      order[index] = &info->cpus[index];
+   }
+
+   switch (policy) {
+      case OPIUM_CPU_PLACE_PACK:
+         qsort(order, n, sizeof(order[0]), opium_cpu_cmp_pack);
+         break;
+
+      case OPIUM_CPU_PLACE_SPREAD_LLC:
+         /*
+          * Physical order first, then deal the CPUs out like cards:
+          * one per LLC per round.
+          */
+         qsort(order, n, sizeof(order[0]), opium_cpu_cmp_physical);
+         opium_memzero(taken, n);
+
+         for (placed = 0; placed < n; ) {
+            for (opium_u32_t llc = 0; llc < info->nllcs && placed < n; llc++) {
+               for (opium_u32_t index = 0; index < n; index++) {
+                  if (!taken[index] && order[index]->llc == (opium_s32_t)llc) {
+                     taken[index] = 1;
+                     spread[placed++] = order[index];
+                     break;
+                  }
+               }
+            }
+         }
+
+         opium_memcpy(order, spread, n * sizeof(order[0]));
+         break;
+
+      case OPIUM_CPU_PLACE_PHYSICAL:
+      default:
+         qsort(order, n, sizeof(order[0]), opium_cpu_cmp_physical);
+         break;
+   }
+
+   for (opium_u32_t index = 0; index < count; index++) {
+      cpus[index] = order[index % n]->cpu;
+   }
+
+   return OPIUM_RET_OK;
+}
+
+   void
+opium_cpuinfo(void)
+{
+   opium_cpuinfo_t *info = malloc(sizeof(opium_cpuinfo_t));
+
+   if (!info || opium_cpuinfo_init(info, NULL) != OPIUM_RET_OK) {
+      printf("CPU topology unavailable\n");
+      free(info);
+      return;
+   }
+
+   printf("CPUs: %u allowed, %u cores, %u LLC domains, %u NUMA nodes, %u packages\n",
+         info->ncpus, info->ncores, info->nllcs, info->nnodes, info->npackages);
+
+   printf("%6s %6s %4s %4s %5s %8s\n", "cpu", "core", "smt", "llc", "node", "package");
+   for (opium_u32_t index = 0; index < info->ncpus; index++) {
+      opium_cpu_t *cpu = &info->cpus[index];
+      printf("%6d %6d %4d %4d %5d %8d\n", cpu->cpu, cpu->core, cpu->smt, cpu->llc, cpu->node, cpu->package);
+   }
+
+   free(info);
+}
@@ -0,0 +1,55 @@
+#ifndef OPIUM_CPU_INCLUDE_H
+#define OPIUM_CPU_INCLUDE_H
+
+#include "core/opium_core.h"
+
+/* Highest logical CPU number we track */
+#define OPIUM_CPU_MAX  CPU_SETSIZE
+
+/*
+ * One logical CPU the process may run on. All ids are dense indexes
+ * (0, 1, 2...), not the raw numbers from sysfs.
+ */
+typedef struct {
+   opium_s32_t   cpu;       /* Logical CPU number, what CPU_SET() wants */
+   opium_s32_t   core;      /* Physical core */
+   opium_s32_t   smt;       /* Rank among the hyperthreads of the core, 0 = first */
+   opium_s32_t   llc;       /* Last level cache domain */
+   opium_s32_t   node;      /* NUMA node */
+   opium_s32_t   package;   /* Socket */
+} opium_cpu_t;
+
+struct opium_cpuinfo_s {
+   opium_cpu_t   cpus[OPIUM_CPU_MAX];   /* Allowed CPUs, sorted by number */
+   opium_u32_t   ncpus;
+
+   opium_u32_t   ncores;
+   opium_u32_t   nllcs;
+   opium_u32_t   nnodes;
+   opium_u32_t   npackages;
+};
+
+/*
+ * Where threads go:
+ *
+ *   PHYSICAL    one thread per physical core first, hyperthread siblings
+ *               only once every core has a thread.
+ *   SPREAD_LLC  round-robin over last level caches (and over physical cores
+ *               inside each), so neighbours do not fight for one L3.
+ *   PACK        fill one LLC (siblings included) before the next one, for
+ *               threads that share a lot of data.
+ */
+typedef enum {
+   OPIUM_CPU_PLACE_PHYSICAL,
+   OPIUM_CPU_PLACE_SPREAD_LLC,
+   OPIUM_CPU_PLACE_PACK,
+} opium_cpu_place_t;
+
+opium_s32_t opium_cpuinfo_init(opium_cpuinfo_t *info, opium_log_t *log);
+opium_s32_t opium_cpu_place(opium_cpuinfo_t *info, opium_cpu_place_t policy,
+      opium_u32_t count, opium_s32_t *cpus);
+
+/* Print the topology of the allowed CPUs */
+void opium_cpuinfo(void);
+
+#endif /* OPIUM_CPU_INCLUDE_H */
@@ -0,0 +1,290 @@
+/* opium_ebr.c
+ *
+ * Epoch-based reclamation (Fraser, "Practical lock-freedom").
+ *
+ * Every registered thread owns one slot. The slot's 'local' word says
+ * whether the thread is inside a read section and which global epoch it
+ * saw when it entered. The global epoch moves forward only when all active
+ * threads have seen the current one, so once it has moved twice past the
+ * epoch an object was retired in, nobody can still hold that object.
+ *
+ * Each thread keeps three limbo lists (one per epoch modulo 3) of chunks,
+ * and frees a list when its own view of the global epoch moves on. No
+ * thread ever frees somebody else's garbage, which keeps the slab/arena
+ * ownership rules the same as for a direct free.
+ *
+ */
+
+#include "core/opium_core.h"
+
+   static void
+opium_ebr_reclaim(opium_ebr_thread_t *thr, opium_u32_t index)
+{
+   opium_ebr_chunk_t *chunk = thr->limbo[index];
+
+   thr->limbo[index] = NULL;
+
+   while (chunk) {
+      opium_ebr_chunk_t *next = chunk->next;
+
+      for (opium_u32_t i = 0; i < chunk->count; i++) {
+         opium_ebr_entry_t *entry = &chunk->entries[i];
+         entry->free(entry->ctx, entry->ptr);
+      }
+
+      thr->pending -= chunk->count;
+      chunk->count = 0;
+      chunk->next = thr->spare;
+      thr->spare = chunk;
+
+      chunk = next;
+   }
+}
+
+/*
+ * Catch up with global epoch 'epoch'. While the thread is active it pins
+ * the global epoch to at most its own + 1, so there are only two cases:
+ *
+ *   +1   limbo of (epoch - 2) is now safe
+ *   +2.. the thread was offline for a while, everything is safe
+ */
+   static void
+opium_ebr_collect(opium_ebr_thread_t *thr, opium_u64_t epoch)
+{
+   if (epoch == thr->epoch) {
+      return;
+   }
+
+   if (epoch - thr->epoch >= 2) {
+      for (opium_u32_t index = 0; index < 3; index++) {
+         opium_ebr_reclaim(thr, index);
+      }
+   } else {
+      opium_ebr_reclaim(thr, (epoch + 1) % 3);
+   }
+
+   thr->epoch = epoch;
+}
+
+   static void
+opium_ebr_advance(opium_ebr_t *ebr)
+{
+   opium_u64_t epoch = atomic_load_explicit(&ebr->epoch, memory_order_acquire);
+
+   for (opium_u32_t index = 0; index < OPIUM_EBR_MAX_THREADS; index++) {
+      opium_ebr_thread_t *thr = &ebr->threads[index];
+
+      if (!atomic_load_explicit(&thr->used, memory_order_acquire)) {
+         continue;
+      }
+
+      opium_u64_t local = atomic_load_explicit(&thr->local, memory_order_acquire);
+      if ((local & OPIUM_EBR_ACTIVE) && (local >> 1) != epoch) {
+         /* Somebody is still reading in an older epoch */
+         return;
+      }
+   }
+
+   /* Losing this race is fine: somebody else advanced it */
+   atomic_compare_exchange_strong_explicit(&ebr->epoch, &epoch, epoch + 1,
+         memory_order_acq_rel, memory_order_relaxed);
+}
+
+   opium_s32_t
+opium_ebr_init(opium_ebr_t *ebr, opium_log_t *log)
+{
+   if (!ebr) {
+      opium_log_err(log, "EBR pointer is NULL\n");
+      return OPIUM_RET_ERR;
+   }
+
+   opium_memzero(ebr, sizeof(*ebr));
+
+   for (opium_u32_t index = 0; index < OPIUM_EBR_MAX_THREADS; index++) {
+      ebr->threads[index].ebr = ebr;
+   }
+
+   ebr->log = log;
+
+   return OPIUM_RET_OK;
+}
+
+/* Only when no thread uses the tables anymore: frees everything left */
+   void
+opium_ebr_exit(opium_ebr_t *ebr)
+{
+   if (!ebr) {
+      return;
+   }
+
+   for (opium_u32_t index = 0; index < OPIUM_EBR_MAX_THREADS; index++) {
+      opium_ebr_thread_t *thr = &ebr->threads[index];
+
+      for (opium_u32_t limbo = 0; limbo < 3; limbo++) {
+         opium_ebr_reclaim(thr, limbo);
+      }
+
+      while (thr->spare) {
+         opium_ebr_chunk_t *next = thr->spare->next;
+         opium_free(thr->spare, ebr->log);
+         thr->spare = next;
+      }
+   }
+}
+
+/*
+ * Claims a slot and goes active. A slot left by an unregistered thread
+ * may still hold its limbo; the new owner frees it once it is safe.
+ */
+   opium_ebr_thread_t *
+opium_ebr_register(opium_ebr_t *ebr)
+{
+   for (opium_u32_t index = 0; index < OPIUM_EBR_MAX_THREADS; index++) {
+      opium_ebr_thread_t *thr = &ebr->threads[index];
+      opium_u32_t expected = 0;
+
+      if (!atomic_compare_exchange_strong_explicit(&thr->used, &expected, 1,
+               memory_order_acq_rel, memory_order_relaxed)) {
+         continue;
+      }
+
+      opium_ebr_enter(thr);
+      return thr;
+   }
+
+   opium_log_err(ebr->log, "EBR: all %d thread slots are taken\n", OPIUM_EBR_MAX_THREADS);
+   return NULL;
+}
+
+   void
+opium_ebr_unregister(opium_ebr_thread_t *thr)
+{
+   if (!thr) {
+      return;
+   }
+
+   opium_ebr_leave(thr);
+   atomic_store_explicit(&thr->used, 0, memory_order_release);
+}
+
+   void
+opium_ebr_enter(opium_ebr_thread_t *thr)
+{
+   opium_u64_t epoch = atomic_load_explicit(&thr->ebr->epoch, memory_order_acquire);
+
+   atomic_store_explicit(&thr->local, (epoch << 1) | OPIUM_EBR_ACTIVE, memory_order_relaxed);
+
+   /* The announcement must be visible before any read of the tables */
+   atomic_thread_fence(memory_order_seq_cst);
+
+   opium_ebr_collect(thr, epoch);
+}
+
+   void
+opium_ebr_leave(opium_ebr_thread_t *thr)
+{
+   atomic_store_explicit(&thr->local, thr->epoch << 1, memory_order_release);
+}
+
+/*
+ * Called at a point where the thread holds no references to shared
+ * objects. Re-announces the current epoch, frees what became safe and,
+ * if it still has garbage, tries to push the epoch forward.
+ */
+   void
+opium_ebr_quiescent(opium_ebr_thread_t *thr)
+{
+   opium_ebr_enter(thr);
+
+   if (thr->pending > 0) {
+      opium_ebr_advance(thr->ebr);
+   }
+}
+
+/*
+ * No references are held until opium_ebr_online(): the slot stops pinning
+ * the epoch, so the thread may block for as long as it likes.
+ */
+   void
+opium_ebr_offline(opium_ebr_thread_t *thr)
+{
+   opium_ebr_leave(thr);
+
+   /* Our own garbage must not wait for our next wakeup */
+   if (thr->pending > 0) {
+      opium_ebr_advance(thr->ebr);
+   }
+}
+
+   void
+opium_ebr_online(opium_ebr_thread_t *thr)
+{
+   opium_ebr_enter(thr);
+}
+
+   opium_s32_t
+opium_ebr_retire(opium_ebr_thread_t *thr, void *ptr, opium_ebr_free_pt free, void *ctx)
+{
+   opium_ebr_chunk_t *chunk;
+   opium_u64_t epoch;
+   opium_u32_t index;
+
+   /* Orders the caller's unlink before the epoch we file the object under */
+   atomic_thread_fence(memory_order_seq_cst);
+
+   epoch = atomic_load_explicit(&thr->ebr->epoch, memory_order_acquire);
+   opium_ebr_collect(thr, epoch);
+
+   index = epoch % 3;
+   chunk = thr->limbo[index];
+
+   if (!chunk || chunk->count == OPIUM_EBR_CHUNK) {
+      if (thr->spare) {
+         chunk = thr->spare;
+         thr->spare = chunk->next;
+      } else {
+         chunk = opium_malloc(sizeof(opium_ebr_chunk_t), thr->ebr->log);
+         if (!chunk) {
+            opium_log_err(thr->ebr->log, "EBR: failed to allocate limbo chunk\n");
+            return OPIUM_RET_ERR;
+         }
+      }
+
+      chunk->count = 0;
+      chunk->next = thr->limbo[index];
+      thr->limbo[index] = chunk;
+   }
+
+   chunk->entries[chunk->count].free = free;
+   chunk->entries[chunk->count].ctx = ctx;
+   chunk->entries[chunk->count].ptr = ptr;
+   chunk->count++;
+
+   thr->pending++;
+
+   return OPIUM_RET_OK;
+}
+
+   static void
+opium_ebr_slab_free(void *ctx, void *ptr)
+{
+   opium_slab_free(ctx, ptr);
+}
+
+   static void
+opium_ebr_arena_free(void *ctx, void *ptr)
+{
+   opium_arena_free(ctx, ptr);
+}
+
+   opium_s32_t
+opium_ebr_retire_slab(opium_ebr_thread_t *thr, opium_slab_t *slab, void *ptr)
+{
+   return opium_ebr_retire(thr, ptr, opium_ebr_slab_free, slab);
+}
+
+   opium_s32_t
+opium_ebr_retire_arena(opium_ebr_thread_t *thr, opium_arena_t *arena, void *ptr)
+{
+   return opium_ebr_retire(thr, ptr, opium_ebr_arena_free, arena);
+}
@@ -0,0 +1,106 @@
+#ifndef OPIUM_EBR_INCLUDE_H
+#define OPIUM_EBR_INCLUDE_H
+
+#include "core/opium_core.h"
+
+/*
+ * Epoch-based reclamation.
+ *
+ * Lock-free readers walk shared tables without taking a lock, so a writer
+ * that unlinks an object cannot free it right away: somebody may still be
+ * looking at it. Instead the writer "retires" it, and it is freed once every
+ * thread has passed through a quiescent state (a point where it holds no
+ * references, e.g. the top of its event loop).
+ *
+ *   global epoch  e
+ *   thread        announces the epoch it saw when it went active
+ *   advance       e -> e + 1 only when every active thread announced e
+ *   free          what was retired in epoch e is safe once global reaches e + 2
+ *
+ * Usage:
+ *
+ *   thr = opium_ebr_register(&ebr);        once per thread
+ *
+ *   loop:
+ *      opium_ebr_quiescent(thr);           once per event loop iteration
+ *      ... read shared tables ...
+ *      opium_ebr_retire_slab(thr, slab, old);
+ *
+ *      opium_ebr_offline(thr);             before a wait that may block
+ *      epoll_wait(...);
+ *      opium_ebr_online(thr);
+ *
+ * quiescent() leaves the thread active: the epoch cannot move past it
+ * until its next call. A loop must go offline before it blocks, or one
+ * idle thread holds back reclamation for all the others.
+ *
+ * Threads that do not run a loop bracket their reads with opium_ebr_enter()
+ * and opium_ebr_leave() instead, and do not hold up the epoch in between.
+ *
+ * Deferred frees run on the thread that retired the object, so it must be
+ * allowed to call the free function (same rule as the slab/arena itself).
+ */
+
+#define OPIUM_EBR_MAX_THREADS  128
+
+/* Retired objects per limbo chunk */
+#define OPIUM_EBR_CHUNK        64
+
+/* Slot local epoch: (epoch << 1) | OPIUM_EBR_ACTIVE */
+#define OPIUM_EBR_ACTIVE       1
+
+typedef void (*opium_ebr_free_pt)(void *ctx, void *ptr);
+
+typedef struct {
+   opium_ebr_free_pt   free;
+   void               *ctx;
+   void               *ptr;
+} opium_ebr_entry_t;
+
+typedef struct opium_ebr_chunk_s opium_ebr_chunk_t;
+
+struct opium_ebr_chunk_s {
+   opium_ebr_chunk_t  *next;
+   opium_u32_t         count;
+   opium_ebr_entry_t   entries[OPIUM_EBR_CHUNK];
+};
+
+struct opium_ebr_thread_s {
+   /* Written by the owner only, read by whoever tries to advance */
+   _Atomic opium_u64_t local __attribute__((aligned(OPIUM_CACHE_LINE)));
+
+   opium_u64_t         epoch;       /* Last global epoch this thread saw */
+   opium_ebr_chunk_t  *limbo[3];    /* Retired in epoch e go to limbo[e % 3] */
+   opium_ebr_chunk_t  *spare;       /* Empty chunks kept for reuse */
+   opium_u32_t         pending;     /* Objects waiting in limbo */
+
+   _Atomic opium_u32_t used;
+   opium_ebr_t        *ebr;
+};
+
+struct opium_ebr_s {
+   _Atomic opium_u64_t epoch __attribute__((aligned(OPIUM_CACHE_LINE)));
+
+   opium_ebr_thread_t  threads[OPIUM_EBR_MAX_THREADS];
+
+   opium_log_t        *log;
+};
+
+opium_s32_t opium_ebr_init(opium_ebr_t *ebr, opium_log_t *log);
+void opium_ebr_exit(opium_ebr_t *ebr);
+
+opium_ebr_thread_t *opium_ebr_register(opium_ebr_t *ebr);
+void opium_ebr_unregister(opium_ebr_thread_t *thr);
+
+void opium_ebr_enter(opium_ebr_thread_t *thr);
+void opium_ebr_leave(opium_ebr_thread_t *thr);
+void opium_ebr_quiescent(opium_ebr_thread_t *thr);
+void opium_ebr_offline(opium_ebr_thread_t *thr);
+void opium_ebr_online(opium_ebr_thread_t *thr);
+
+opium_s32_t opium_ebr_retire(opium_ebr_thread_t *thr, void *ptr,
+      opium_ebr_free_pt free, void *ctx);
+opium_s32_t opium_ebr_retire_slab(opium_ebr_thread_t *thr, opium_slab_t *slab, void *ptr);
+opium_s32_t opium_ebr_retire_arena(opium_ebr_thread_t *thr, opium_arena_t *arena, void *ptr);
+
+#endif /* OPIUM_EBR_INCLUDE_H */
@@ -1,2 +1,1430 @@
+/* opium_event.c
+ *
+ * Reactor on top of epoll or io_uring, picked at init. One opium_event_t is
+ * one loop, meant to run on one pinned thread (opium_event_start) and own
+ * everything registered on it.
+ *
+ * One iteration:
+ *
+ *   1. wait, timeout from the nearest timer (zero if deferred work is
+ *      waiting): epoll_wait() for at most max_events, or one io_uring_enter()
+ *      that also submits everything queued since the last one
+ *   2. dispatch: the handler (data.ptr / user_data), error -> read -> write,
+ *      or the completion of an op
+ *   3. expired timers
+ *   4. deferred tasks, including the ones other threads posted
+ *   5. free handlers deleted during this iteration
+ *
+ * Handlers removed in the middle of a batch stay allocated until step 5,
+ * so a later event of the same batch never touches freed memory. With
+ * io_uring they wait longer, until the kernel confirms the poll is gone.
+ *
+ * io_uring user_data carries the object pointer, its low bits say what it is.
+ *
+ */
+
 #include "core/opium_core.h"
-#include <sys/epoll.h>
+
+/*
+ * io_uring user_data: the pointer with its kind in the top two bits. Arena
+ * blocks sit right after a one byte slab header, their low bits are taken;
+ * user space pointers never reach the top ones.
+ */
+#define OPIUM_EVENT_TAG_POLL    (0x0ULL << 62)   /* opium_event_handler_t */
+#define OPIUM_EVENT_TAG_OP      (0x1ULL << 62)   /* opium_event_op_t */
+#define OPIUM_EVENT_TAG_WAKE    (0x2ULL << 62)   /* wakefd */
+#define OPIUM_EVENT_TAG_IGNORE  (0x3ULL << 62)   /* poll removes, cancels */
+#define OPIUM_EVENT_TAG_MASK    (0x3ULL << 62)
+
+#define opium_event_tag(ptr, tag)  ((opium_u64_t)(uintptr_t)(ptr) | (tag))
+#define opium_event_untag(data)    ((void*)(uintptr_t)((data) & ~OPIUM_EVENT_TAG_MASK))
+
+static opium_s32_t opium_event_uring_op(opium_event_t *event, opium_event_op_t *op);
+
+   opium_u64_t
+opium_event_msec(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (opium_u64_t)ts.tv_sec * 1000 + (opium_u64_t)ts.tv_nsec / 1000000;
+}
+
+/* Timer heap */
+
+   static void
+opium_event_timer_swap(opium_event_t *event, opium_u32_t a, opium_u32_t b)
+{
+   opium_event_timer_t *timer = event->timers[a];
+
+   event->timers[a] = event->timers[b];
+   event->timers[b] = timer;
+
+   event->timers[a]->index = a;
+   event->timers[b]->index = b;
+}
+
+   static void
+opium_event_timer_up(opium_event_t *event, opium_u32_t index)
+{
+   while (index > 0) {
+      opium_u32_t parent = (index - 1) / 2;
+      if (event->timers[parent]->deadline <= event->timers[index]->deadline) {
+         break;
+      }
+      opium_event_timer_swap(event, parent, index);
+      index = parent;
+   }
+}
+
+   static void
+opium_event_timer_down(opium_event_t *event, opium_u32_t index)
+{
+   for ( ;; ) {
+      opium_u32_t left = index * 2 + 1;
+      opium_u32_t right = left + 1;
+      opium_u32_t min = index;
+
+      if (left < event->ntimers
+            && event->timers[left]->deadline < event->timers[min]->deadline) {
+         min = left;
+      }
+      if (right < event->ntimers
+            && event->timers[right]->deadline < event->timers[min]->deadline) {
+         min = right;
+      }
+      if (min == index) {
+         break;
+      }
+
+      opium_event_timer_swap(event, index, min);
+      index = min;
+   }
+}
+
+   void
+opium_event_timer_init(opium_event_timer_t *timer, opium_event_timer_pt handler, void *data)
+{
+   timer->deadline = 0;
+   timer->index = OPIUM_EVENT_TIMER_IDLE;
+   timer->handler = handler;
+   timer->data = data;
+}
+
+/* Re-arming an armed timer just moves it */
+   void
+opium_event_timer_add(opium_event_t *event, opium_event_timer_t *timer, opium_u64_t msec)
+{
+   if (timer->index != OPIUM_EVENT_TIMER_IDLE) {
+      opium_event_timer_del(event, timer);
+   }
+
+   if (event->ntimers == event->timers_cap) {
+      opium_u32_t cap = event->timers_cap * 2;
+      opium_event_timer_t **timers = opium_malloc(cap * sizeof(opium_event_timer_t*), event->log);
+      if (!timers) {
+         opium_log_err(event->log, "Failed to grow the timer heap\n");
+         return;
+      }
+      opium_memcpy(timers, event->timers, event->ntimers * sizeof(opium_event_timer_t*));
+      opium_free(event->timers, event->log);
+      event->timers = timers;
+      event->timers_cap = cap;
+   }
+
+   timer->deadline = opium_event_msec() + msec;
+   timer->index = event->ntimers;
+   event->timers[event->ntimers++] = timer;
+
+   opium_event_timer_up(event, timer->index);
+}
+
+   void
+opium_event_timer_del(opium_event_t *event, opium_event_timer_t *timer)
+{
+   opium_u32_t index = timer->index;
+
+   if (index >= event->ntimers || event->timers[index] != timer) {
+      return;
+   }
+
+   event->ntimers--;
+   if (index != event->ntimers) {
+      opium_event_timer_swap(event, index, event->ntimers);
+      opium_event_timer_down(event, index);
+      opium_event_timer_up(event, index);
+   }
+
+   timer->index = OPIUM_EVENT_TIMER_IDLE;
+}
+
+   static void
+opium_event_timers_expire(opium_event_t *event)
+{
+   while (event->ntimers > 0 && event->timers[0]->deadline <= event->now) {
+      opium_event_timer_t *timer = event->timers[0];
+
+      opium_event_timer_del(event, timer);
+
+      /* The handler may re-arm the timer */
+      timer->handler(timer);
+   }
+}
+
+/* Deferred tasks */
+
+   void
+opium_event_defer(opium_event_t *event, opium_task_t *task)
+{
+   task->next = NULL;
+
+   if (event->deferred_tail) {
+      event->deferred_tail->next = task;
+   } else {
+      event->deferred_head = task;
+   }
+   event->deferred_tail = task;
+}
+
+/*
+ * Any thread. Only the post that finds the list empty rings the eventfd:
+ * the loop takes the whole list at once, so one wakeup covers a burst.
+ */
+   void
+opium_event_post(opium_event_t *event, opium_task_t *task)
+{
+   opium_u64_t one = 1;
+   opium_u32_t ring;
+
+   task->next = NULL;
+
+   opium_amutex_lock(&event->posted_lock);
+
+   ring = (event->posted_head == NULL);
+   if (event->posted_tail) {
+      event->posted_tail->next = task;
+   } else {
+      event->posted_head = task;
+   }
+   event->posted_tail = task;
+
+   opium_amutex_unlock(&event->posted_lock);
+
+   if (ring && write(event->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      opium_log_err(event->log, "Failed to wake event loop: %s\n", strerror(errno));
+   }
+}
+
+   static void
+opium_event_posted_take(opium_event_t *event)
+{
+   opium_u64_t   count;
+   opium_task_t *head, *tail;
+
+   event->nsyscalls++;
+   if (read(event->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      opium_log_err(event->log, "Failed to read event loop wakefd: %s\n", strerror(errno));
+   }
+
+   opium_amutex_lock(&event->posted_lock);
+   head = event->posted_head;
+   tail = event->posted_tail;
+   event->posted_head = event->posted_tail = NULL;
+   opium_amutex_unlock(&event->posted_lock);
+
+   if (!head) {
+      return;
+   }
+
+   if (event->deferred_tail) {
+      event->deferred_tail->next = head;
+   } else {
+      event->deferred_head = head;
+   }
+   event->deferred_tail = tail;
+}
+
+   static void
+opium_event_deferred_run(opium_event_t *event)
+{
+   /* Tasks deferred by these tasks wait for the next iteration */
+   opium_task_t *task = event->deferred_head;
+
+   event->deferred_head = event->deferred_tail = NULL;
+
+   while (task) {
+      opium_task_t *next = task->next;
+      task->handler(task->data);
+      task = next;
+   }
+}
+
+/* io_uring requests behind the readiness API */
+
+/*
+ * A linked send chains whatever sqe comes next. Only sends may join, every
+ * other request goes in ahead of the open chain, or a recv could wait on a
+ * send that needs it to drain the peer first.
+ */
+   static struct io_uring_sqe *
+opium_event_uring_sqe(opium_event_t *event, opium_u32_t send)
+{
+   struct io_uring_sqe *sqe;
+
+   /* The previous batch went in, and its chain with it */
+   if (event->uring.pending == 0) {
+      event->chain = 0;
+   }
+
+   if (!send) {
+      return opium_uring_sqe_ahead(&event->uring, event->chain);
+   }
+
+   sqe = opium_uring_sqe(&event->uring);
+   if (sqe && event->chain >= event->uring.pending) {
+      /* A full ring was pushed to make room */
+      event->chain = 0;
+   }
+
+   return sqe;
+}
+
+   static opium_s32_t
+opium_event_uring_poll(opium_event_t *event, opium_u64_t data, opium_fd_t fd, opium_u32_t events)
+{
+   struct io_uring_sqe *sqe = opium_event_uring_sqe(event, 0);
+
+   if (!sqe) {
+      opium_log_err(event->log, "io_uring SQ full, can't poll fd %d\n", fd);
+      return OPIUM_RET_ERR;
+   }
+
+   /* EPOLLIN/OUT/ERR/HUP/RDHUP have the poll(2) values, multishot keeps it armed */
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = fd;
+   sqe->poll32_events = events;
+   sqe->len = IORING_POLL_ADD_MULTI;
+   sqe->user_data = data;
+
+   return OPIUM_RET_OK;
+}
+
+/* POLL_REMOVE or ASYNC_CANCEL of whatever carries 'target', the answer is ignored */
+   static void
+opium_event_uring_cancel(opium_event_t *event, opium_u8_t opcode, opium_u64_t target)
+{
+   struct io_uring_sqe *sqe = opium_event_uring_sqe(event, 0);
+
+   if (!sqe) {
+      opium_log_err(event->log, "io_uring SQ full, can't cancel request\n");
+      return;
+   }
+
+   sqe->opcode = opcode;
+   sqe->fd = -1;
+   sqe->addr = target;
+   sqe->user_data = OPIUM_EVENT_TAG_IGNORE;
+}
+
+/* Registration */
+
+   opium_event_handler_t *
+opium_event_add(opium_event_t *event, opium_fd_t fd, opium_u32_t events,
+      opium_event_handler_pt read, opium_event_handler_pt write, void *data)
+{
+   struct epoll_event     ee;
+   opium_event_handler_t *handler;
+
+   handler = opium_arena_calloc(event->arena, sizeof(opium_event_handler_t));
+   if (!handler) {
+      opium_log_err(event->log, "Failed to allocate event handler for fd %d\n", fd);
+      return NULL;
+   }
+
+   handler->fd = fd;
+   handler->events = events;
+   handler->read = read;
+   handler->write = write;
+   handler->data = data;
+   handler->event = event;
+
+   if (event->backend == OPIUM_EVENT_URING) {
+      if (opium_event_uring_poll(event, opium_event_tag(handler, OPIUM_EVENT_TAG_POLL),
+               fd, events) != OPIUM_RET_OK) {
+         opium_arena_free(event->arena, handler);
+         return NULL;
+      }
+      handler->armed = 1;
+      return handler;
+   }
+
+   ee.events = events | EPOLLET;
+   ee.data.ptr = handler;
+
+   event->nsyscalls++;
+   if (epoll_ctl(event->fd, EPOLL_CTL_ADD, fd, &ee) < 0) {
+      opium_log_err(event->log, "epoll_ctl(ADD, %d) failed: %s\n", fd, strerror(errno));
+      opium_arena_free(event->arena, handler);
+      return NULL;
+   }
+
+   return handler;
+}
+
+/* Same handler object, only the mask changes */
+   opium_s32_t
+opium_event_mod(opium_event_handler_t *handler, opium_u32_t events)
+{
+   opium_event_t       *event = handler->event;
+   struct epoll_event   ee;
+   struct io_uring_sqe *sqe;
+
+   if (handler->closed) {
+      return OPIUM_RET_ERR;
+   }
+
+   if (event->backend == OPIUM_EVENT_URING) {
+      if (!handler->armed) {
+         /* The poll ended on an error, start a new one */
+         if (opium_event_uring_poll(event, opium_event_tag(handler, OPIUM_EVENT_TAG_POLL),
+                  handler->fd, events) != OPIUM_RET_OK) {
+            return OPIUM_RET_ERR;
+         }
+         handler->armed = 1;
+         handler->events = events;
+         return OPIUM_RET_OK;
+      }
+
+      sqe = opium_event_uring_sqe(event, 0);
+      if (!sqe) {
+         opium_log_err(event->log, "io_uring SQ full, can't modify fd %d\n", handler->fd);
+         return OPIUM_RET_ERR;
+      }
+
+      /* Update in place, the poll keeps its user_data */
+      sqe->opcode = IORING_OP_POLL_REMOVE;
+      sqe->fd = -1;
+      sqe->addr = opium_event_tag(handler, OPIUM_EVENT_TAG_POLL);
+      sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+      sqe->poll32_events = events;
+      sqe->user_data = OPIUM_EVENT_TAG_IGNORE;
+
+      handler->events = events;
+      return OPIUM_RET_OK;
+   }
+
+   ee.events = events | EPOLLET;
+   ee.data.ptr = handler;
+
+   event->nsyscalls++;
+   if (epoll_ctl(event->fd, EPOLL_CTL_MOD, handler->fd, &ee) < 0) {
+      opium_log_err(event->log, "epoll_ctl(MOD, %d) failed: %s\n",
+            handler->fd, strerror(errno));
+      return OPIUM_RET_ERR;
+   }
+
+   handler->events = events;
+
+   return OPIUM_RET_OK;
+}
+
+/* The fd stays open, it belongs to the caller */
+   void
+opium_event_del(opium_event_handler_t *handler)
+{
+   opium_event_t *event = handler->event;
+
+   if (handler->closed) {
+      return;
+   }
+
+   if (event->backend == OPIUM_EVENT_URING) {
+      if (handler->armed) {
+         opium_event_uring_cancel(event, IORING_OP_POLL_REMOVE,
+               opium_event_tag(handler, OPIUM_EVENT_TAG_POLL));
+      }
+   } else {
+      event->nsyscalls++;
+      if (epoll_ctl(event->fd, EPOLL_CTL_DEL, handler->fd, NULL) < 0 && errno != EBADF) {
+         opium_log_err(event->log, "epoll_ctl(DEL, %d) failed: %s\n", handler->fd, strerror(errno));
+      }
+   }
+
+   handler->closed = 1;
+   handler->next = event->closed;
+   event->closed = handler;
+}
+
+/* Handlers io_uring still polls stay on the list until the removal completes */
+   static void
+opium_event_closed_free(opium_event_t *event)
+{
+   opium_event_handler_t **link = &event->closed;
+
+   while (*link) {
+      opium_event_handler_t *handler = *link;
+
+      if (handler->armed) {
+         link = &handler->next;
+         continue;
+      }
+
+      *link = handler->next;
+      opium_arena_free(event->arena, handler);
+   }
+}
+
+/* Completion ops */
+
+   static void
+opium_event_op_final(void *data)
+{
+   opium_event_op_t *op = data;
+
+   opium_log_trace(op->event->log, "Op %d on fd %d done: %d\n", (int)op->type, op->fd, op->res);
+
+   op->active = 0;
+   op->more = 0;
+   op->buf = NULL;
+   op->handler(op);
+}
+
+   static void
+opium_event_op_prepare(opium_event_t *event, opium_event_op_t *op, opium_fd_t fd,
+      opium_event_op_type_t type, opium_event_op_pt handler, void *data)
+{
+   op->fd = fd;
+   op->type = type;
+   op->handler = handler;
+   op->data = data;
+   op->event = event;
+
+   op->res = 0;
+   op->buf = NULL;
+   op->len = 0;
+   op->flags = 0;
+
+   op->more = 0;
+   op->active = 1;
+   op->inflight = 0;
+
+   op->watch = NULL;
+   op->sent = 0;
+   op->next = NULL;
+   op->task.handler = opium_event_op_final;
+   op->task.data = op;
+   op->task.group = NULL;
+   op->task.next = NULL;
+}
+
+/* epoll: drain the listener, one completion per connection */
+   static void
+opium_event_accept_ready(opium_event_handler_t *handler)
+{
+   opium_event_op_t *op = handler->data;
+   opium_event_t    *event = handler->event;
+   opium_fd_t        fd;
+
+   while (op->active) {
+      event->nsyscalls++;
+      fd = accept4(op->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+         if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+         }
+         if (errno == EAGAIN) {
+            break;
+         }
+      }
+
+      /* EMFILE and friends are reported, the listener stays armed */
+      op->res = fd < 0 ? -errno : fd;
+      op->more = 1;
+      op->buf = NULL;
+      op->handler(op);
+
+      if (fd < 0) {
+         break;
+      }
+   }
+}
+
+/* epoll: read until EAGAIN into the scratch buffer, EOF or an error ends the op */
+   static void
+opium_event_recv_ready(opium_event_handler_t *handler)
+{
+   opium_event_op_t *op = handler->data;
+   opium_event_t    *event = handler->event;
+   ssize_t           n;
+
+   while (op->active) {
+      event->nsyscalls++;
+      n = recv(op->fd, event->scratch, OPIUM_EVENT_RECV_BUF_SIZE, 0);
+      if (n > 0) {
+         op->res = (opium_s32_t)n;
+         op->more = 1;
+         op->buf = event->scratch;
+         op->handler(op);
+         continue;
+      }
+
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         if (errno == EAGAIN) {
+            break;
+         }
+      }
+
+      op->res = n < 0 ? -errno : 0;
+      opium_event_del(op->watch);
+      op->watch = NULL;
+      opium_event_op_final(op);
+      break;
+   }
+}
+
+   opium_s32_t
+opium_event_accept(opium_event_t *event, opium_event_op_t *op, opium_fd_t fd,
+      opium_event_op_pt handler, void *data)
+{
+   opium_event_op_prepare(event, op, fd, OPIUM_EVENT_OP_ACCEPT, handler, data);
+
+   if (event->backend == OPIUM_EVENT_URING) {
+      return opium_event_uring_op(event, op);
+   }
+
+   op->watch = opium_event_add(event, fd, OPIUM_EVENT_READ, opium_event_accept_ready, NULL, op);
+   if (!op->watch) {
+      op->active = 0;
+      return OPIUM_RET_ERR;
+   }
+
+   return OPIUM_RET_OK;
+}
+
+   opium_s32_t
+opium_event_recv(opium_event_t *event, opium_event_op_t *op, opium_fd_t fd,
+      opium_event_op_pt handler, void *data)
+{
+   opium_event_op_prepare(event, op, fd, OPIUM_EVENT_OP_RECV, handler, data);
+
+   if (event->backend == OPIUM_EVENT_URING) {
+      return opium_event_uring_op(event, op);
+   }
+
+   op->watch = opium_event_add(event, fd, OPIUM_EVENT_READ | EPOLLRDHUP,
+         opium_event_recv_ready, NULL, op);
+   if (!op->watch) {
+      op->active = 0;
+      return OPIUM_RET_ERR;
+   }
+
+   return OPIUM_RET_OK;
+}
+
+/*
+ * epoll: write what the socket takes. 1 once the op is done and 'res' set,
+ * 0 for a linked send that has to wait for room. An unlinked send that
+ * fills the socket completes with a short count the caller resends.
+ */
+   static opium_u32_t
+opium_event_send_push(opium_event_t *event, opium_event_op_t *op)
+{
+   ssize_t n;
+
+   while (op->sent < op->len) {
+      event->nsyscalls++;
+      n = send(op->fd, (const u_char*)op->buf + op->sent, op->len - op->sent, MSG_NOSIGNAL);
+      if (n >= 0) {
+         op->sent += (size_t)n;
+         continue;
+      }
+
+      if (errno == EINTR) {
+         continue;
+      }
+
+      if (errno == EAGAIN && (op->flags & OPIUM_EVENT_LINK)) {
+         return 0;
+      }
+
+      if (op->sent == 0) {
+         op->res = -errno;
+         return 1;
+      }
+
+      break;
+   }
+
+   op->res = (opium_s32_t)op->sent;
+   return 1;
+}
+
+   static opium_event_op_t *
+opium_event_send_parked(opium_event_t *event, opium_fd_t fd)
+{
+   for (opium_event_op_t *op = event->sends_head; op; op = op->next) {
+      if (op->fd == fd) {
+         return op;
+      }
+   }
+
+   return NULL;
+}
+
+   static void
+opium_event_send_park(opium_event_t *event, opium_event_op_t *op)
+{
+   op->next = NULL;
+
+   if (event->sends_tail) {
+      event->sends_tail->next = op;
+   } else {
+      event->sends_head = op;
+   }
+
+   event->sends_tail = op;
+}
+
+   static void
+opium_event_send_unpark(opium_event_t *event, opium_event_op_t *op)
+{
+   opium_event_op_t *prev = NULL;
+
+   for (opium_event_op_t *cur = event->sends_head; cur; prev = cur, cur = cur->next) {
+      if (cur != op) {
+         continue;
+      }
+
+      if (prev) {
+         prev->next = op->next;
+      } else {
+         event->sends_head = op->next;
+      }
+
+      if (event->sends_tail == op) {
+         event->sends_tail = prev;
+      }
+
+      op->next = NULL;
+      return;
+   }
+}
+
+/* The fd may already be registered (a recv on it), the watch gets a dup */
+   static void
+opium_event_send_unwatch(opium_event_handler_t *watch)
+{
+   opium_fd_t fd = watch->fd;
+
+   opium_event_del(watch);
+   close(fd);
+}
+
+static void opium_event_send_ready(opium_event_handler_t *handler);
+
+/*
+ * epoll: move the parked sends of 'fd' on, in order, until one of them has
+ * to wait again. That one gets 'watch' (a new one if needed); without one
+ * left the watch goes away.
+ */
+   static void
+opium_event_send_flush(opium_event_t *event, opium_fd_t fd, opium_event_handler_t *watch)
+{
+   opium_event_op_t *op, *next, *blocked = NULL;
+   opium_fd_t        wfd;
+
+   for (op = event->sends_head; op; op = next) {
+      next = op->next;
+
+      if (op->fd != fd) {
+         continue;
+      }
+
+      if (!opium_event_send_push(event, op)) {
+         blocked = op;
+         break;
+      }
+
+      if (op->watch) {
+         watch = op->watch;
+         op->watch = NULL;
+      }
+
+      opium_event_send_unpark(event, op);
+      opium_event_defer(event, &op->task);
+   }
+
+   if (!blocked) {
+      if (watch) {
+         opium_event_send_unwatch(watch);
+      }
+      return;
+   }
+
+   if (watch) {
+      watch->data = blocked;
+      blocked->watch = watch;
+      return;
+   }
+
+   wfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+   blocked->watch = wfd < 0 ? NULL
+      : opium_event_add(event, wfd, OPIUM_EVENT_WRITE, NULL, opium_event_send_ready, blocked);
+
+   if (!blocked->watch) {
+      opium_log_err(event->log, "Can't wait for room on fd %d, send fails\n", fd);
+      if (wfd >= 0) {
+         close(wfd);
+      }
+      opium_event_send_unpark(event, blocked);
+      blocked->res = blocked->sent > 0 ? (opium_s32_t)blocked->sent : -EAGAIN;
+      opium_event_defer(event, &blocked->task);
+      /* Whatever queued behind it moves on without the link */
+      opium_event_send_flush(event, fd, NULL);
+   }
+}
+
+   static void
+opium_event_send_ready(opium_event_handler_t *handler)
+{
+   opium_event_op_t *op = handler->data;
+
+   op->watch = NULL;
+   opium_event_send_flush(handler->event, op->fd, handler);
+}
+
+/*
+ * 'buf' must stay valid until the completion. With OPIUM_EVENT_LINK the
+ * next send starts only after this one finished in full: io_uring links
+ * the requests, epoll parks a send that filled the socket and queues every
+ * later send on the same fd behind it.
+ */
+   opium_s32_t
+opium_event_send(opium_event_t *event, opium_event_op_t *op, opium_fd_t fd,
+      const void *buf, size_t len, opium_u32_t flags, opium_event_op_pt handler, void *data)
+{
+   opium_event_op_prepare(event, op, fd, OPIUM_EVENT_OP_SEND, handler, data);
+   op->buf = (void*)buf;
+   op->len = len;
+   op->flags = flags;
+
+   if (event->backend == OPIUM_EVENT_URING) {
+      return opium_event_uring_op(event, op);
+   }
+
+   /* Behind a parked send: its tail goes out first */
+   if (opium_event_send_parked(event, fd)) {
+      opium_event_send_park(event, op);
+      return OPIUM_RET_OK;
+   }
+
+   /* Completions never run inside the call that started the op */
+   if (opium_event_send_push(event, op)) {
+      opium_event_defer(event, &op->task);
+      return OPIUM_RET_OK;
+   }
+
+   opium_event_send_park(event, op);
+   opium_event_send_flush(event, fd, NULL);
+
+   return OPIUM_RET_OK;
+}
+
+/* The handler still gets its final call, with -ECANCELED unless the op finished first */
+   void
+opium_event_cancel(opium_event_op_t *op)
+{
+   opium_event_t *event = op->event;
+
+   if (!op->active) {
+      return;
+   }
+
+   if (event->backend == OPIUM_EVENT_URING) {
+      op->active = 0;
+      if (op->inflight) {
+         opium_event_uring_cancel(event, IORING_OP_ASYNC_CANCEL,
+               opium_event_tag(op, OPIUM_EVENT_TAG_OP));
+      }
+      return;
+   }
+
+   if (op->type == OPIUM_EVENT_OP_SEND) {
+      opium_event_handler_t *watch = op->watch;
+
+      /* Not parked: it already carries its result */
+      for (opium_event_op_t *cur = event->sends_head; cur != op; cur = cur->next) {
+         if (!cur) {
+            return;
+         }
+      }
+
+      op->watch = NULL;
+      opium_event_send_unpark(event, op);
+      op->active = 0;
+      op->res = op->sent > 0 ? (opium_s32_t)op->sent : -ECANCELED;
+      opium_event_defer(event, &op->task);
+
+      /* Only the first one on the fd waits, the next one takes over */
+      if (watch) {
+         opium_event_send_flush(event, op->fd, watch);
+      }
+      return;
+   }
+
+   if (op->watch) {
+      opium_event_del(op->watch);
+      op->watch = NULL;
+   }
+
+   op->active = 0;
+   op->res = -ECANCELED;
+   opium_event_defer(event, &op->task);
+}
+
+/* io_uring side of the ops */
+
+   static opium_s32_t
+opium_event_uring_op(opium_event_t *event, opium_event_op_t *op)
+{
+   struct io_uring_sqe *sqe = opium_event_uring_sqe(event, op->type == OPIUM_EVENT_OP_SEND);
+
+   if (!sqe) {
+      opium_log_err(event->log, "io_uring SQ full, can't queue op on fd %d\n", op->fd);
+      op->active = 0;
+      return OPIUM_RET_ERR;
+   }
+
+   sqe->fd = op->fd;
+   sqe->user_data = opium_event_tag(op, OPIUM_EVENT_TAG_OP);
+
+   switch (op->type) {
+
+      case OPIUM_EVENT_OP_ACCEPT:
+         sqe->opcode = IORING_OP_ACCEPT;
+         sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+         sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+         break;
+
+      case OPIUM_EVENT_OP_RECV:
+         /* No buffer of our own: the kernel takes one from the group per completion */
+         sqe->opcode = IORING_OP_RECV;
+         sqe->ioprio = IORING_RECV_MULTISHOT;
+         sqe->flags = IOSQE_BUFFER_SELECT;
+         sqe->buf_group = event->bufs.group;
+         break;
+
+      case OPIUM_EVENT_OP_SEND:
+         sqe->opcode = IORING_OP_SEND;
+         sqe->addr = (opium_u64_t)(uintptr_t)op->buf;
+         sqe->len = (opium_u32_t)op->len;
+         sqe->msg_flags = MSG_NOSIGNAL;
+         if (op->flags & OPIUM_EVENT_LINK) {
+            /* A short send breaks the chain, make the kernel finish it */
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->msg_flags |= MSG_WAITALL;
+            event->chain++;
+         } else {
+            event->chain = 0;
+         }
+         break;
+   }
+
+   op->inflight = 1;
+
+   return OPIUM_RET_OK;
+}
+
+   static void
+opium_event_uring_complete(opium_event_t *event, opium_event_op_t *op,
+      opium_s32_t res, opium_u32_t flags)
+{
+   opium_u32_t more = (flags & IORING_CQE_F_MORE) != 0;
+   opium_u32_t rearm = 0;
+   opium_u16_t bid = 0;
+   u_char     *buf = NULL;
+
+   opium_log_trace(event->log, "Op %d on fd %d completed: %d, flags %u\n",
+         (int)op->type, op->fd, res, flags);
+
+   if (flags & IORING_CQE_F_BUFFER) {
+      bid = (opium_u16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+      buf = opium_uring_bufs_get(&event->bufs, bid);
+   }
+
+   if (!more) {
+      op->inflight = 0;
+   }
+
+   if (!op->active) {
+      /* Cancelled: drop what was still on the way, report only the end */
+      if (buf) {
+         opium_uring_bufs_recycle(&event->bufs, bid);
+      }
+      if (op->type == OPIUM_EVENT_OP_ACCEPT && res >= 0) {
+         close(res);
+      }
+      if (!more) {
+         /* A send that made it keeps its count */
+         op->res = (op->type == OPIUM_EVENT_OP_SEND && res >= 0) ? res : -ECANCELED;
+         opium_event_op_final(op);
+      }
+      return;
+   }
+
+   /*
+    * A multishot request also ends when the CQ overflowed or, for recv, the
+    * group ran dry. Neither is the caller's business: start it again.
+    */
+   if (!more) {
+      rearm = (op->type == OPIUM_EVENT_OP_ACCEPT && res >= 0)
+         || (op->type == OPIUM_EVENT_OP_RECV && (res > 0 || res == -ENOBUFS));
+   }
+
+   if (res == -ENOBUFS) {
+      if (rearm && opium_event_uring_op(event, op) != OPIUM_RET_OK) {
+         op->res = -ENOBUFS;
+         opium_event_op_final(op);
+      }
+      return;
+   }
+
+   op->res = res;
+   op->buf = buf;
+   op->more = more || rearm;
+   if (!op->more) {
+      op->active = 0;
+   }
+
+   op->handler(op);
+
+   if (buf) {
+      opium_uring_bufs_recycle(&event->bufs, bid);
+   }
+
+   if (!rearm) {
+      return;
+   }
+
+   /* The handler may have cancelled it while nothing was in flight */
+   if (!op->active) {
+      op->res = -ECANCELED;
+      opium_event_op_final(op);
+      return;
+   }
+
+   if (opium_event_uring_op(event, op) != OPIUM_RET_OK) {
+      op->res = -EAGAIN;
+      opium_event_op_final(op);
+   }
+}
+
+/* Loop */
+
+   static void
+opium_event_handler_run(opium_event_handler_t *handler, opium_u32_t revents)
+{
+   handler->revents = revents;
+
+   if ((revents & OPIUM_EVENT_ERR) && handler->error) {
+      handler->error(handler);
+      return;
+   }
+
+   if ((revents & (EPOLLIN | EPOLLRDHUP | OPIUM_EVENT_ERR)) && handler->read) {
+      handler->read(handler);
+   }
+
+   if (!handler->closed && (revents & (EPOLLOUT | OPIUM_EVENT_ERR)) && handler->write) {
+      handler->write(handler);
+   }
+}
+
+   static void
+opium_event_dispatch(opium_event_t *event, opium_s32_t n)
+{
+   for (opium_s32_t index = 0; index < n; index++) {
+      opium_event_handler_t *handler = event->events[index].data.ptr;
+
+      if (!handler) {
+         opium_event_posted_take(event);
+         continue;
+      }
+
+      if (handler->closed) {
+         continue;
+      }
+
+      opium_event_handler_run(handler, event->events[index].events);
+   }
+}
+
+   static void
+opium_event_uring_ready(opium_event_t *event, opium_event_handler_t *handler,
+      opium_s32_t res, opium_u32_t flags)
+{
+   if (!(flags & IORING_CQE_F_MORE)) {
+      handler->armed = 0;
+   }
+
+   if (handler->closed) {
+      return;
+   }
+
+   opium_event_handler_run(handler, res < 0 ? EPOLLERR : (opium_u32_t)res);
+
+   /* Multishot poll dropped (CQ overflow): arm again, unless it failed */
+   if (!handler->armed && !handler->closed && res >= 0) {
+      if (opium_event_uring_poll(event, opium_event_tag(handler, OPIUM_EVENT_TAG_POLL),
+               handler->fd, handler->events) == OPIUM_RET_OK) {
+         handler->armed = 1;
+      }
+   }
+}
+
+/* Everything in the CQ, including what the handlers' own submissions produce */
+   static opium_s32_t
+opium_event_uring_dispatch(opium_event_t *event)
+{
+   struct io_uring_cqe *cqe;
+   opium_s32_t          n = 0;
+
+   while ((cqe = opium_uring_cqe_peek(&event->uring)) != NULL) {
+      opium_u64_t data = cqe->user_data;
+      opium_s32_t res = cqe->res;
+      opium_u32_t flags = cqe->flags;
+
+      /* Free the slot before the handler runs */
+      opium_uring_cqe_seen(&event->uring);
+      n++;
+
+      switch (data & OPIUM_EVENT_TAG_MASK) {
+
+         case OPIUM_EVENT_TAG_POLL:
+            opium_event_uring_ready(event, opium_event_untag(data), res, flags);
+            break;
+
+         case OPIUM_EVENT_TAG_OP:
+            opium_event_uring_complete(event, opium_event_untag(data), res, flags);
+            break;
+
+         case OPIUM_EVENT_TAG_WAKE:
+            opium_event_posted_take(event);
+            if (!(flags & IORING_CQE_F_MORE)) {
+               opium_event_uring_poll(event, OPIUM_EVENT_TAG_WAKE, event->wakefd, EPOLLIN);
+            }
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   return n;
+}
+
+   static void
+opium_event_ebr_online(opium_event_t *event, opium_s32_t timeout)
+{
+   if (event->ebr && timeout != 0) {
+      opium_ebr_online(event->ebr);
+   }
+}
+
+   opium_s32_t
+opium_event_process(opium_event_t *event, opium_s32_t timeout)
+{
+   opium_u64_t enter = event->uring.nenter;
+   opium_s32_t n;
+
+   if (event->deferred_head) {
+      timeout = 0;
+   } else if (event->ntimers > 0) {
+      opium_u64_t now = opium_event_msec();
+      opium_u64_t deadline = event->timers[0]->deadline;
+      opium_s32_t left = deadline > now ? (opium_s32_t)opium_min(deadline - now, (opium_u64_t)INT_MAX) : 0;
+
+      if (timeout < 0 || left < timeout) {
+         timeout = left;
+      }
+   }
+
+   /* Asleep the loop holds nothing, it must not pin the epoch meanwhile */
+   if (event->ebr && timeout != 0) {
+      opium_ebr_offline(event->ebr);
+   }
+
+   if (event->backend == OPIUM_EVENT_URING) {
+      /* Submit the whole iteration's batch and wait, one syscall */
+      if (opium_uring_enter(&event->uring, 1, timeout) != OPIUM_RET_OK) {
+         opium_event_ebr_online(event, timeout);
+         return OPIUM_RET_ERR;
+      }
+
+      opium_event_ebr_online(event, timeout);
+
+      event->now = opium_event_msec();
+      event->nwakeups++;
+
+      n = opium_event_uring_dispatch(event);
+   } else {
+      event->nsyscalls++;
+      n = epoll_wait(event->fd, event->events, (int)event->max_events, timeout);
+      opium_event_ebr_online(event, timeout);
+      if (n < 0) {
+         if (errno != EINTR) {
+            opium_log_err(event->log, "epoll_wait() failed: %s\n", strerror(errno));
+            return OPIUM_RET_ERR;
+         }
+         n = 0;
+      }
+
+      event->now = opium_event_msec();
+      event->nwakeups++;
+
+      opium_event_dispatch(event, n);
+   }
+
+   event->nevents += n;
+
+   opium_log_trace(event->log, "Loop woke with %d events, timeout %d ms\n", n, timeout);
+
+   opium_event_timers_expire(event);
+   opium_event_deferred_run(event);
+   opium_event_closed_free(event);
+
+   /* Submissions made when the SQ filled up mid-iteration count too */
+   event->nsyscalls += event->uring.nenter - enter;
+
+   /* Nothing of the previous iteration is referenced past this point */
+   if (event->ebr) {
+      opium_ebr_quiescent(event->ebr);
+   }
+
+   return n;
+}
+
+   static void *
+opium_event_loop(void *data)
+{
+   opium_event_t *event = data;
+
+   while (!atomic_load_explicit(&event->stop, memory_order_acquire)) {
+      if (opium_event_process(event, OPIUM_EVENT_INFINITE) == OPIUM_RET_ERR) {
+         break;
+      }
+   }
+
+   return NULL;
+}
+
+   opium_s32_t
+opium_event_start(opium_event_t *event, opium_u32_t core)
+{
+   atomic_store_explicit(&event->stop, 0, memory_order_relaxed);
+
+   if (opium_thread_init(&event->thread, opium_event_loop, event, event->log) != OPIUM_RET_OK) {
+      opium_log_err(event->log, "Failed to start event loop thread\n");
+      return OPIUM_RET_ERR;
+   }
+
+   event->thread.core = core;
+   if (opium_thread_affinity(&event->thread, event->log) != OPIUM_RET_OK) {
+      /* Still works, just not pinned */
+      opium_log_err(event->log, "Event loop runs unpinned\n");
+   }
+
+   return OPIUM_RET_OK;
+}
+
+   void
+opium_event_stop(opium_event_t *event)
+{
+   opium_u64_t one = 1;
+
+   atomic_store_explicit(&event->stop, 1, memory_order_release);
+
+   if (write(event->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      opium_log_err(event->log, "Failed to wake event loop: %s\n", strerror(errno));
+   }
+
+   opium_thread_exit(&event->thread, event->log);
+}
+
+/* Lifecycle */
+
+/*
+ * Needs EXT_ARG for timed waits (5.11) and provided buffer rings (5.19);
+ * multishot recv itself arrived in 6.0.
+ */
+   static opium_s32_t
+opium_event_uring_init(opium_event_t *event)
+{
+   if (opium_uring_init(&event->uring, OPIUM_EVENT_URING_ENTRIES, event->log) != OPIUM_RET_OK) {
+      return OPIUM_RET_ERR;
+   }
+
+   if (!(event->uring.features & IORING_FEAT_EXT_ARG)) {
+      opium_log_err(event->log, "io_uring lacks IORING_FEAT_EXT_ARG\n");
+      goto failed;
+   }
+
+   if (opium_uring_bufs_init(&event->uring, &event->bufs, OPIUM_EVENT_RECV_GROUP,
+            OPIUM_EVENT_RECV_BUFS, OPIUM_EVENT_RECV_BUF_SIZE) != OPIUM_RET_OK) {
+      goto failed;
+   }
+
+   if (opium_event_uring_poll(event, OPIUM_EVENT_TAG_WAKE, event->wakefd, EPOLLIN) != OPIUM_RET_OK) {
+      goto failed;
+   }
+
+   return OPIUM_RET_OK;
+
+failed:
+   opium_uring_bufs_exit(&event->uring, &event->bufs);
+   opium_uring_exit(&event->uring);
+   return OPIUM_RET_ERR;
+}
+
+   static opium_s32_t
+opium_event_epoll_init(opium_event_t *event)
+{
+   struct epoll_event ee;
+
+   event->events = opium_calloc(event->max_events * sizeof(struct epoll_event), event->log);
+   if (!event->events) {
+      opium_log_err(event->log, "Failed to allocate epoll events\n");
+      return OPIUM_RET_ERR;
+   }
+
+   event->scratch = opium_malloc(OPIUM_EVENT_RECV_BUF_SIZE, event->log);
+   if (!event->scratch) {
+      opium_log_err(event->log, "Failed to allocate recv buffer\n");
+      return OPIUM_RET_ERR;
+   }
+
+   event->fd = epoll_create1(EPOLL_CLOEXEC);
+   if (event->fd < 0) {
+      opium_log_err(event->log, "epoll_create1() failed: %s\n", strerror(errno));
+      return OPIUM_RET_ERR;
+   }
+
+   /* data.ptr == NULL marks the wakefd in dispatch */
+   ee.events = EPOLLIN;
+   ee.data.ptr = NULL;
+   if (epoll_ctl(event->fd, EPOLL_CTL_ADD, event->wakefd, &ee) < 0) {
+      opium_log_err(event->log, "epoll_ctl(ADD, wakefd) failed: %s\n", strerror(errno));
+      return OPIUM_RET_ERR;
+   }
+
+   return OPIUM_RET_OK;
+}
+
+   opium_s32_t
+opium_event_init(opium_event_t *event, opium_arena_t *arena, size_t mevents,
+      opium_event_backend_t backend, opium_log_t *log)
+{
+   if (!event || !arena || mevents < 1) {
+      opium_log_err(log, "Invalid event loop arguments\n");
+      return OPIUM_RET_ERR;
+   }
+
+   opium_memzero(event, sizeof(*event));
+   event->fd = event->wakefd = event->uring.fd = -1;
+   event->backend = backend;
+   event->arena = arena;
+   event->log = log;
+   event->max_events = mevents;
+   opium_amutex_init(&event->posted_lock);
+
+   event->timers_cap = OPIUM_EVENT_TIMERS;
+   event->timers = opium_malloc(event->timers_cap * sizeof(opium_event_timer_t*), log);
+   if (!event->timers) {
+      opium_log_err(log, "Failed to allocate timer heap\n");
+      goto failed;
+   }
+
+   event->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+   if (event->wakefd < 0) {
+      opium_log_err(log, "eventfd() failed: %s\n", strerror(errno));
+      goto failed;
+   }
+
+   if (event->backend == OPIUM_EVENT_URING && opium_event_uring_init(event) != OPIUM_RET_OK) {
+      opium_log_err(log, "io_uring unavailable, event loop falls back to epoll\n");
+      event->backend = OPIUM_EVENT_EPOLL;
+   }
+
+   if (event->backend == OPIUM_EVENT_EPOLL && opium_event_epoll_init(event) != OPIUM_RET_OK) {
+      goto failed;
+   }
+
+   event->now = opium_event_msec();
+
+   return OPIUM_RET_OK;
+
+failed:
+   opium_event_exit(event);
+   return OPIUM_RET_ERR;
+}
+
+/*
+ * Loop must be stopped. Handlers still registered live in the arena and go
+ * away with it; posted tasks that never ran are dropped, and so are ops
+ * still in the kernel, the ring goes away with them.
+ */
+   void
+opium_event_exit(opium_event_t *event)
+{
+   if (!event) {
+      return;
+   }
+
+   opium_uring_bufs_exit(&event->uring, &event->bufs);
+   opium_uring_exit(&event->uring);
+
+   /* Parked sends are dropped, their watches hold a dup of the fd */
+   for (opium_event_op_t *op = event->sends_head; op; op = op->next) {
+      if (op->watch) {
+         close(op->watch->fd);
+      }
+   }
+   event->sends_head = event->sends_tail = NULL;
+
+   /* No poll can complete anymore */
+   for (opium_event_handler_t *handler = event->closed; handler; handler = handler->next) {
+      handler->armed = 0;
+   }
+   opium_event_closed_free(event);
+
+   if (event->wakefd >= 0) {
+      close(event->wakefd);
+      event->wakefd = -1;
+   }
+
+   if (event->fd >= 0) {
+      close(event->fd);
+      event->fd = -1;
+   }
+
+   if (event->timers) {
+      opium_free(event->timers, event->log);
+      event->timers = NULL;
+   }
+
+   if (event->events) {
+      opium_free(event->events, event->log);
+      event->events = NULL;
+   }
+
+   if (event->scratch) {
+      opium_free(event->scratch, event->log);
+      event->scratch = NULL;
+   }
+
+   event->ntimers = event->timers_cap = 0;
+   event->deferred_head = event->deferred_tail = NULL;
+   event->posted_head = event->posted_tail = NULL;
+}
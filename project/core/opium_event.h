@@ -1,25 +1,208 @@
-#ifndef OPIUM_EVENT_CONNECTION_H 
+#ifndef OPIUM_EVENT_CONNECTION_H
 #define OPIUM_EVENT_CONNECTION_H
 
 #include "core/opium_core.h"
 
 #define OPIUM_EVENT_READ  EPOLLIN
-#define OPIUM_EVENT_WRITE EPOLLOUT 
-#define OPIUM_EVENT_ERR   EPOLLER | EPOLLHUP 
+#define OPIUM_EVENT_WRITE EPOLLOUT
+#define OPIUM_EVENT_ERR   (EPOLLERR | EPOLLHUP)
+
+/* Initial capacity of the timer heap, it grows by doubling */
+#define OPIUM_EVENT_TIMERS       64
+
+/* Not in the timer heap */
+#define OPIUM_EVENT_TIMER_IDLE   ((opium_u32_t)-1)
+
+/* Wait forever when there are no timers and nothing deferred */
+#define OPIUM_EVENT_INFINITE     -1
+
+/* io_uring backend: ring size and the provided buffers multishot recv picks from */
+#define OPIUM_EVENT_URING_ENTRIES   256
+#define OPIUM_EVENT_RECV_BUFS       256
+#define OPIUM_EVENT_RECV_BUF_SIZE   4096
+#define OPIUM_EVENT_RECV_GROUP      0
+
+/*
+ * opium_event_send() flag: the next send on this loop starts after this one
+ * finished in full. epoll keeps a linked send that filled the socket parked
+ * until EPOLLOUT, and later sends on the same fd queue behind it.
+ */
+#define OPIUM_EVENT_LINK            0x01
+
+typedef enum {
+   OPIUM_EVENT_EPOLL = 0,
+   OPIUM_EVENT_URING,               /* Falls back to epoll when the kernel can't */
+} opium_event_backend_t;
+
+typedef enum {
+   OPIUM_EVENT_OP_ACCEPT = 0,
+   OPIUM_EVENT_OP_RECV,
+   OPIUM_EVENT_OP_SEND,
+} opium_event_op_type_t;
+
+typedef struct opium_event_handler_s opium_event_handler_t;
+typedef struct opium_event_timer_s   opium_event_timer_t;
+typedef struct opium_event_op_s      opium_event_op_t;
+
+typedef void (*opium_event_handler_pt)(opium_event_handler_t *handler);
+typedef void (*opium_event_timer_pt)(opium_event_timer_t *timer);
+typedef void (*opium_event_op_pt)(opium_event_op_t *op);
+
+/*
+ * One registered fd. Allocated from the reactor arena by opium_event_add(),
+ * epoll data.ptr points straight at it, so dispatch needs no lookup.
+ * Registration is edge-triggered: a handler has to read/write until EAGAIN.
+ */
+struct opium_event_handler_s {
+   opium_fd_t              fd;
+   opium_u32_t             events;    /* Registered mask, without EPOLLET */
+   opium_u32_t             revents;   /* What epoll reported this time */
+
+   opium_event_handler_pt  read;
+   opium_event_handler_pt  write;
+   opium_event_handler_pt  error;     /* NULL: read/write see the error themselves */
+
+   void                   *data;
+   opium_event_t          *event;
+
+   opium_event_handler_t  *next;      /* Closed list */
+   unsigned                closed:1;
+   unsigned                armed:1;   /* io_uring: a poll still references it */
+};
+
+/* Embedded by the caller, like opium_task_t */
+struct opium_event_timer_s {
+   opium_u64_t             deadline;  /* ms, CLOCK_MONOTONIC */
+   opium_u32_t             index;     /* Position in the heap */
+
+   opium_event_timer_pt    handler;
+   void                   *data;
+};
+
+/*
+ * Completion-style operation, embedded by the caller. Works on both
+ * backends: io_uring runs it in the kernel (multishot accept/recv, sends
+ * optionally linked), epoll emulates it with readiness and plain syscalls.
+ *
+ * The handler sees 'res' (accepted fd, bytes, 0 for EOF, or -errno) and
+ * 'more'. Once it is called with more == 0 the loop forgets the op and the
+ * caller may reuse or free it. A recv 'buf' is only valid inside the handler.
+ */
+struct opium_event_op_s {
+   opium_fd_t              fd;
+   opium_event_op_type_t   type;
+
+   opium_event_op_pt       handler;
+   void                   *data;
+   opium_event_t          *event;
+
+   opium_s32_t             res;
+   void                   *buf;
+   size_t                  len;
+   opium_u32_t             flags;
+
+   unsigned                more:1;
+   unsigned                active:1;  /* Cleared by cancel or the final completion */
+   unsigned                inflight:1;/* io_uring: the kernel holds it */
+
+   opium_event_handler_t  *watch;     /* epoll: readiness behind accept/recv/parked send */
+   opium_task_t            task;      /* epoll: final completion, deferred */
+
+   size_t                  sent;      /* epoll: bytes of a send already out */
+   opium_event_op_t       *next;      /* epoll: parked sends */
+};
 
 struct opium_event_s {
-   opium_fd_t             fd;
+   opium_event_backend_t   backend;
+
+   opium_fd_t              fd;        /* epoll */
+   opium_fd_t              wakefd;    /* eventfd: cross-thread posts and stop */
+
+   struct epoll_event     *events;
+   size_t                  max_events;
+
+   /* io_uring: submissions are batched and pushed once per iteration */
+   opium_uring_t           uring;
+   opium_uring_bufs_t      bufs;
+   opium_u32_t             chain;     /* Linked sends at the end of the batch */
+
+   /* epoll: what recv reads into */
+   u_char                 *scratch;
+
+   /* Binary min-heap on deadline */
+   opium_event_timer_t   **timers;
+   opium_u32_t             ntimers;
+   opium_u32_t             timers_cap;
+
+   /* Run on the loop thread after the current batch (loop thread only) */
+   opium_task_t           *deferred_head;
+   opium_task_t           *deferred_tail;
+
+   /* Handed in by other threads, moved to deferred by the loop */
+   opium_amutex_t          posted_lock;
+   opium_task_t           *posted_head;
+   opium_task_t           *posted_tail;
+
+   /* Deleted during dispatch, freed once the batch is done */
+   opium_event_handler_t  *closed;
+
+   /* epoll: sends waiting for room, in submission order, every fd */
+   opium_event_op_t       *sends_head;
+   opium_event_op_t       *sends_tail;
 
-   struct epoll_event     events;
-   size_t                 max_events;
+   opium_u64_t             now;       /* Cached once per iteration */
 
-   opium_thread_t         thread;
-   
-   opium_arena_t         *arena;
-   opium_log_t           *log;
+   /* Optional: quiescent state announced after every iteration */
+   opium_ebr_thread_t     *ebr;
+
+   _Atomic opium_u32_t     stop;
+
+   /* Statistics */
+   opium_u64_t             nevents;
+   opium_u64_t             nwakeups;
+   opium_u64_t             nsyscalls; /* Made by the loop, either backend */
+
+   opium_thread_t          thread;
+
+   opium_arena_t          *arena;
+   opium_log_t            *log;
 };
 
-opium_s32_t  opium_event_init(opium_event_t *event, opium_arena_t *arena, size_t mevents, opium_log_t *log);
+opium_s32_t  opium_event_init(opium_event_t *event, opium_arena_t *arena, size_t mevents,
+      opium_event_backend_t backend, opium_log_t *log);
 void opium_event_exit(opium_event_t *event);
 
+/* Registration, loop thread (or before the loop starts) */
+opium_event_handler_t *opium_event_add(opium_event_t *event, opium_fd_t fd, opium_u32_t events,
+      opium_event_handler_pt read, opium_event_handler_pt write, void *data);
+opium_s32_t opium_event_mod(opium_event_handler_t *handler, opium_u32_t events);
+void opium_event_del(opium_event_handler_t *handler);
+
+/* Completion ops, loop thread */
+opium_s32_t opium_event_accept(opium_event_t *event, opium_event_op_t *op, opium_fd_t fd,
+      opium_event_op_pt handler, void *data);
+opium_s32_t opium_event_recv(opium_event_t *event, opium_event_op_t *op, opium_fd_t fd,
+      opium_event_op_pt handler, void *data);
+opium_s32_t opium_event_send(opium_event_t *event, opium_event_op_t *op, opium_fd_t fd,
+      const void *buf, size_t len, opium_u32_t flags, opium_event_op_pt handler, void *data);
+void opium_event_cancel(opium_event_op_t *op);
+
+/* Timers, loop thread */
+void opium_event_timer_init(opium_event_timer_t *timer, opium_event_timer_pt handler, void *data);
+void opium_event_timer_add(opium_event_t *event, opium_event_timer_t *timer, opium_u64_t msec);
+void opium_event_timer_del(opium_event_t *event, opium_event_timer_t *timer);
+
+/* Deferred tasks: defer from the loop thread, post from any thread */
+void opium_event_defer(opium_event_t *event, opium_task_t *task);
+void opium_event_post(opium_event_t *event, opium_task_t *task);
+
+/* One iteration: wait (at most 'timeout' ms), dispatch, timers, deferred */
+opium_s32_t opium_event_process(opium_event_t *event, opium_s32_t timeout);
+
+/* Run the loop on its own thread, pinned to 'core' */
+opium_s32_t opium_event_start(opium_event_t *event, opium_u32_t core);
+void opium_event_stop(opium_event_t *event);
+
+opium_u64_t opium_event_msec(void);
+
 #endif /* OPIUM_EVENT_CONNECTION_H */
@@ -0,0 +1,812 @@
+/* opium_file.c
+ *
+ * Open file cache with inotify invalidation and sendfile(2) bodies.
+ *
+ * Entries are one array. A free entry sits on the free list, a cached one
+ * in its hash chain and on the LRU list, an entry dropped while still
+ * referenced on neither until its last close. Watches are per directory:
+ * inotify reports the name of the child that changed, which is exactly
+ * the cache key once the directory path is put in front of it.
+ *
+ */
+
+#include "core/opium_core.h"
+
+#define OPIUM_FILE_WATCH_MASK  (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE \
+      | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO            \
+      | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+#define OPIUM_FILE_EVENTS_SIZE 4096
+
+typedef struct {
+   const char *ext;
+   const char *type;
+} opium_file_mime_t;
+
+static const opium_file_mime_t opium_file_mimes[] = {
+   { "html",  "text/html; charset=utf-8" },
+   { "htm",   "text/html; charset=utf-8" },
+   { "css",   "text/css; charset=utf-8" },
+   { "js",    "application/javascript; charset=utf-8" },
+   { "json",  "application/json" },
+   { "txt",   "text/plain; charset=utf-8" },
+   { "xml",   "application/xml" },
+   { "svg",   "image/svg+xml" },
+   { "png",   "image/png" },
+   { "jpg",   "image/jpeg" },
+   { "jpeg",  "image/jpeg" },
+   { "gif",   "image/gif" },
+   { "webp",  "image/webp" },
+   { "ico",   "image/x-icon" },
+   { "woff",  "font/woff" },
+   { "woff2", "font/woff2" },
+   { "wasm",  "application/wasm" },
+   { "pdf",   "application/pdf" },
+   { NULL,    NULL }
+};
+
+   static const char *
+opium_file_mime(const char *path)
+{
+   const char *dot = strrchr(path, '.');
+   const char *slash = strrchr(path, '/');
+
+   if (dot && (!slash || dot > slash)) {
+      for (const opium_file_mime_t *mime = opium_file_mimes; mime->ext; mime++) {
+         if (strcasecmp(dot + 1, mime->ext) == 0) {
+            return mime->type;
+         }
+      }
+   }
+
+   return "application/octet-stream";
+}
+
+   static opium_u32_t
+opium_file_hash(const char *path)
+{
+   return (opium_u32_t)opium_hash_djb2((void*)path, strlen(path));
+}
+
+/*
+ * Request path to a key relative to the root: query dropped, empty and
+ * "." segments skipped, ".." refused, the index appended to a directory.
+ */
+   static opium_s32_t
+opium_file_key(opium_file_cache_t *cache, const char *uri, char *key, size_t size)
+{
+   size_t       len = 0, seg;
+   const char  *pos = uri, *end;
+
+   if (*uri != '/') {
+      errno = EACCES;
+      return OPIUM_RET_ERR;
+   }
+
+   end = uri + strcspn(uri, "?#");
+
+   while (pos < end) {
+      while (pos < end && *pos == '/') {
+         pos++;
+      }
+
+      seg = 0;
+      while (pos + seg < end && pos[seg] != '/') {
+         seg++;
+      }
+
+      if (seg == 0 || (seg == 1 && pos[0] == '.')) {
+         pos += seg;
+         continue;
+      }
+
+      if (seg == 2 && pos[0] == '.' && pos[1] == '.') {
+         errno = EACCES;
+         return OPIUM_RET_ERR;
+      }
+
+      if (len + seg + 2 > size) {
+         errno = ENAMETOOLONG;
+         return OPIUM_RET_ERR;
+      }
+
+      if (len > 0) {
+         key[len++] = '/';
+      }
+      opium_memcpy(key + len, (void*)pos, seg);
+      len += seg;
+      pos += seg;
+   }
+
+   key[len] = '\0';
+
+   if (len == 0 || end[-1] == '/') {
+      size_t index = strlen(cache->index);
+
+      if (len + index + 2 > size) {
+         errno = ENAMETOOLONG;
+         return OPIUM_RET_ERR;
+      }
+
+      if (len > 0) {
+         key[len++] = '/';
+      }
+      opium_memcpy(key + len, (void*)cache->index, index + 1);
+   }
+
+   return OPIUM_RET_OK;
+}
+
+/*
+ * Open a key under the root without leaving it. The key has no ".." any
+ * more, but a symlink inside the tree still could: openat2() resolves
+ * every component beneath the root and refuses /proc style magic links.
+ * Kernels before 5.6 walk one component at a time with O_NOFOLLOW, which
+ * refuses any symlink, even one that stays inside.
+ *
+ * *linked is set when a symlink was followed: the watch on the key's
+ * directory would not see the target change.
+ */
+   static opium_fd_t
+opium_file_openat(opium_file_cache_t *cache, const char *key, opium_u32_t *linked)
+{
+   struct open_how  how;
+   char             seg[OPIUM_FILE_PATH_MAX];
+   const char      *pos = key;
+   opium_fd_t       dir = cache->root, fd;
+
+   *linked = 0;
+
+   if (cache->resolve) {
+      opium_memzero(&how, sizeof(how));
+      how.flags = O_RDONLY | O_CLOEXEC;
+      how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+
+      fd = (opium_fd_t)syscall(SYS_openat2, cache->root, key, &how, sizeof(how));
+      if (fd < 0 && errno == ELOOP) {
+         how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+         fd = (opium_fd_t)syscall(SYS_openat2, cache->root, key, &how, sizeof(how));
+         *linked = 1;
+      }
+
+      if (fd >= 0 || errno != ENOSYS) {
+         if (fd < 0 && (errno == EXDEV || errno == ELOOP)) {
+            errno = EACCES;
+         }
+         return fd;
+      }
+
+      opium_log_warn(cache->log, "openat2() unavailable, symlinks under %s refused\n", cache->root_path);
+      cache->resolve = 0;
+   }
+
+   for ( ;; ) {
+      size_t len = strcspn(pos, "/");
+
+      if (pos[len] == '\0') {
+         fd = openat(dir, pos, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+      } else {
+         opium_memcpy(seg, (void*)pos, len);
+         seg[len] = '\0';
+         fd = openat(dir, seg, O_PATH | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+      }
+
+      if (fd < 0 && (errno == ELOOP || errno == ENOTDIR)) {
+         errno = EACCES;
+      }
+
+      if (dir != cache->root) {
+         opium_err_t err = errno;
+
+         close(dir);
+         errno = err;
+      }
+
+      if (fd < 0 || pos[len] == '\0') {
+         return fd;
+      }
+
+      dir = fd;
+      pos += len + 1;
+   }
+}
+
+   static opium_file_t *
+opium_file_lookup(opium_file_cache_t *cache, const char *key, opium_u32_t hash)
+{
+   for (opium_file_t *file = cache->buckets[hash & cache->mask]; file; file = file->hnext) {
+      if (file->hash == hash && strcmp(file->path, key) == 0) {
+         return file;
+      }
+   }
+
+   return NULL;
+}
+
+/* Watch the directory holding 'key', the slot it ended up in */
+   static opium_s32_t
+opium_file_watch(opium_file_cache_t *cache, const char *key)
+{
+   char         path[OPIUM_FILE_PATH_MAX * 2];
+   const char  *slash = strrchr(key, '/');
+   size_t       dirlen = slash ? (size_t)(slash - key) : 0;
+   opium_s32_t  wd, slot = OPIUM_FILE_DIR_NONE;
+
+   if (cache->inotify < 0) {
+      return OPIUM_FILE_DIR_NONE;
+   }
+
+   snprintf(path, sizeof(path), "%s/%.*s", cache->root_path, (int)dirlen, key);
+
+   wd = inotify_add_watch(cache->inotify, path, OPIUM_FILE_WATCH_MASK);
+   if (wd < 0) {
+      opium_log_debug(cache->log, "inotify_add_watch(%s) failed: %s\n", path, strerror(errno));
+      return OPIUM_FILE_DIR_NONE;
+   }
+
+   for (opium_s32_t index = 0; index < OPIUM_FILE_DIRS_MAX; index++) {
+      opium_file_dir_t *dir = &cache->dirs[index];
+
+      if (dir->refs > 0 && dir->wd == wd) {
+         dir->refs++;
+         return index;
+      }
+
+      if (dir->refs == 0 && slot == OPIUM_FILE_DIR_NONE) {
+         slot = index;
+      }
+   }
+
+   if (slot == OPIUM_FILE_DIR_NONE) {
+      /* Uncached then: closed and reopened per response, still correct */
+      inotify_rm_watch(cache->inotify, wd);
+      return OPIUM_FILE_DIR_NONE;
+   }
+
+   cache->dirs[slot].wd = wd;
+   cache->dirs[slot].refs = 1;
+   snprintf(cache->dirs[slot].path, sizeof(cache->dirs[slot].path), "%.*s", (int)dirlen, key);
+
+   return slot;
+}
+
+   static void
+opium_file_unwatch(opium_file_cache_t *cache, opium_s32_t slot)
+{
+   opium_file_dir_t *dir;
+
+   if (slot == OPIUM_FILE_DIR_NONE) {
+      return;
+   }
+
+   dir = &cache->dirs[slot];
+   if (--dir->refs > 0) {
+      return;
+   }
+
+   if (dir->wd >= 0) {
+      inotify_rm_watch(cache->inotify, dir->wd);
+   }
+   dir->wd = -1;
+}
+
+   static void
+opium_file_release(opium_file_cache_t *cache, opium_file_t *file)
+{
+   if (file->fd >= 0) {
+      close(file->fd);
+      file->fd = -1;
+   }
+
+   opium_file_unwatch(cache, file->dir);
+   file->dir = OPIUM_FILE_DIR_NONE;
+   file->used = 0;
+
+   opium_list_add(&file->lru, &cache->free);
+}
+
+/* Out of the hash and the LRU list; the fd goes with the last reference */
+   static void
+opium_file_drop(opium_file_cache_t *cache, opium_file_t *file)
+{
+   opium_file_t **link;
+
+   if (!file->cached) {
+      return;
+   }
+
+   for (link = &cache->buckets[file->hash & cache->mask]; *link; link = &(*link)->hnext) {
+      if (*link == file) {
+         *link = file->hnext;
+         break;
+      }
+   }
+
+   file->hnext = NULL;
+   file->cached = 0;
+   opium_list_del(&file->lru);
+   cache->cached--;
+
+   if (file->refs == 0) {
+      opium_file_release(cache, file);
+   }
+}
+
+/* A free entry, the least recently used idle one if there is none */
+   static opium_file_t *
+opium_file_alloc(opium_file_cache_t *cache)
+{
+   opium_list_head_t *pos;
+   opium_file_t      *file;
+
+   if (!opium_list_empty(&cache->free)) {
+      file = opium_list_entry(cache->free.next, opium_file_t, lru);
+      opium_list_del(&file->lru);
+      return file;
+   }
+
+   for (pos = cache->lru.prev; pos != &cache->lru; pos = pos->prev) {
+      file = opium_list_entry(pos, opium_file_t, lru);
+      if (file->refs > 0) {
+         continue;
+      }
+
+      cache->nevicted++;
+      opium_file_drop(cache, file);
+
+      /* Released onto the free list by the drop */
+      opium_list_del(&file->lru);
+      return file;
+   }
+
+   return NULL;
+}
+
+   static void
+opium_file_format(opium_file_t *file, struct stat *st)
+{
+   struct tm tm;
+   int       len;
+
+   file->size = st->st_size;
+   file->mtime = st->st_mtime;
+   file->ino = st->st_ino;
+   file->mime = opium_file_mime(file->path);
+
+   gmtime_r(&file->mtime, &tm);
+   strftime(file->last_modified, sizeof(file->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+   snprintf(file->etag, sizeof(file->etag), "\"%llx-%llx\"",
+         (unsigned long long)file->mtime, (unsigned long long)file->size);
+
+   len = snprintf((char*)file->header, sizeof(file->header),
+         "Content-Type: %s\r\n"
+         "Content-Length: %lld\r\n"
+         "Last-Modified: %s\r\n"
+         "ETag: %s\r\n",
+         file->mime, (long long)file->size, file->last_modified, file->etag);
+
+   file->header_len = opium_min((size_t)len, sizeof(file->header) - 1);
+}
+
+   opium_s32_t
+opium_file_cache_init(opium_file_cache_t *cache, const char *root, const char *index,
+      opium_u32_t capacity, opium_log_t *log)
+{
+   opium_u32_t buckets = 1;
+
+   opium_memzero(cache, sizeof(*cache));
+   cache->root = -1;
+   cache->inotify = -1;
+   cache->log = log;
+   cache->index = index ? index : OPIUM_FILE_INDEX;
+   cache->resolve = 1;
+
+   OPIUM_INIT_LIST_HEAD(&cache->lru);
+   OPIUM_INIT_LIST_HEAD(&cache->free);
+
+   for (opium_s32_t slot = 0; slot < OPIUM_FILE_DIRS_MAX; slot++) {
+      cache->dirs[slot].wd = -1;
+   }
+
+   if (!root || strlen(root) >= sizeof(cache->root_path) || capacity < 1) {
+      opium_log_err(log, "Invalid file cache arguments\n");
+      return OPIUM_RET_ERR;
+   }
+
+   snprintf(cache->root_path, sizeof(cache->root_path), "%s", root);
+
+   cache->root = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+   if (cache->root < 0) {
+      opium_log_err(log, "Failed to open file root %s: %s\n", root, strerror(errno));
+      goto failed;
+   }
+
+   while (buckets < capacity * 2) {
+      buckets <<= 1;
+   }
+
+   cache->buckets = opium_calloc(buckets * sizeof(opium_file_t*), log);
+   cache->files = opium_calloc(capacity * sizeof(opium_file_t), log);
+   if (!cache->buckets || !cache->files) {
+      opium_log_err(log, "Failed to allocate a file cache of %u entries\n", capacity);
+      goto failed;
+   }
+
+   cache->mask = buckets - 1;
+   cache->capacity = capacity;
+
+   for (opium_u32_t slot = capacity; slot-- > 0;) {
+      opium_file_t *file = &cache->files[slot];
+
+      file->fd = -1;
+      file->dir = OPIUM_FILE_DIR_NONE;
+      opium_list_add(&file->lru, &cache->free);
+   }
+
+   /* Without inotify nothing can be trusted across requests, still serves */
+   cache->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+   if (cache->inotify < 0) {
+      opium_log_warn(log, "inotify_init1() failed, file cache disabled: %s\n", strerror(errno));
+   }
+
+   return OPIUM_RET_OK;
+
+failed:
+   opium_file_cache_exit(cache);
+   return OPIUM_RET_ERR;
+}
+
+   void
+opium_file_cache_exit(opium_file_cache_t *cache)
+{
+   if (cache->ev) {
+      opium_event_del(cache->ev);
+      cache->ev = NULL;
+   }
+
+   if (cache->files) {
+      for (opium_u32_t slot = 0; slot < cache->capacity; slot++) {
+         opium_file_t *file = &cache->files[slot];
+
+         if (file->refs > 0) {
+            opium_log_err(cache->log, "File %s released with %u references\n", file->path, file->refs);
+         }
+         if (file->fd >= 0) {
+            close(file->fd);
+            file->fd = -1;
+         }
+      }
+      opium_free(cache->files, cache->log);
+      cache->files = NULL;
+   }
+
+   if (cache->buckets) {
+      opium_free(cache->buckets, cache->log);
+      cache->buckets = NULL;
+   }
+
+   /* Closing the instance removes every watch */
+   if (cache->inotify >= 0) {
+      close(cache->inotify);
+      cache->inotify = -1;
+   }
+
+   if (cache->root >= 0) {
+      close(cache->root);
+      cache->root = -1;
+   }
+
+   cache->capacity = 0;
+   cache->cached = 0;
+}
+
+   static void
+opium_file_read_handler(opium_event_handler_t *handler)
+{
+   opium_file_cache_process(handler->data);
+}
+
+   opium_s32_t
+opium_file_cache_add(opium_file_cache_t *cache, opium_event_t *event)
+{
+   if (cache->inotify < 0) {
+      return OPIUM_RET_OK;
+   }
+
+   cache->ev = opium_event_add(event, cache->inotify, OPIUM_EVENT_READ, opium_file_read_handler, NULL, cache);
+   return cache->ev ? OPIUM_RET_OK : OPIUM_RET_ERR;
+}
+
+   static opium_s32_t
+opium_file_drop_all(opium_file_cache_t *cache, opium_s32_t dir)
+{
+   opium_s32_t dropped = 0;
+
+   for (opium_u32_t slot = 0; slot < cache->capacity; slot++) {
+      opium_file_t *file = &cache->files[slot];
+
+      if (file->cached && (dir == OPIUM_FILE_DIR_NONE || file->dir == dir)) {
+         opium_file_drop(cache, file);
+         dropped++;
+      }
+   }
+
+   return dropped;
+}
+
+   static opium_s32_t
+opium_file_event(opium_file_cache_t *cache, struct inotify_event *ev)
+{
+   char               key[OPIUM_FILE_PATH_MAX * 2];
+   opium_file_t      *file;
+   opium_file_dir_t  *dir = NULL;
+   opium_s32_t        slot;
+
+   /* Events were lost, nothing cached can be trusted */
+   if (ev->mask & IN_Q_OVERFLOW) {
+      opium_log_warn(cache->log, "inotify queue overflow, dropping the file cache\n");
+      return opium_file_drop_all(cache, OPIUM_FILE_DIR_NONE);
+   }
+
+   for (slot = 0; slot < OPIUM_FILE_DIRS_MAX; slot++) {
+      if (cache->dirs[slot].refs > 0 && cache->dirs[slot].wd == ev->wd) {
+         dir = &cache->dirs[slot];
+         break;
+      }
+   }
+
+   if (!dir) {
+      return 0;
+   }
+
+   if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+      if (ev->mask & IN_IGNORED) {
+         dir->wd = -1;
+      }
+      return opium_file_drop_all(cache, slot);
+   }
+
+   if (ev->len == 0) {
+      return 0;
+   }
+
+   if (dir->path[0] != '\0') {
+      snprintf(key, sizeof(key), "%s/%s", dir->path, ev->name);
+   } else {
+      snprintf(key, sizeof(key), "%s", ev->name);
+   }
+
+   file = opium_file_lookup(cache, key, opium_file_hash(key));
+   if (!file) {
+      return 0;
+   }
+
+   opium_file_drop(cache, file);
+   return 1;
+}
+
+   opium_s32_t
+opium_file_cache_process(opium_file_cache_t *cache)
+{
+   union {
+      char                  buf[OPIUM_FILE_EVENTS_SIZE];
+      struct inotify_event  align;
+   } events;
+   opium_s32_t  dropped = 0;
+   ssize_t      len;
+
+   if (cache->inotify < 0) {
+      return 0;
+   }
+
+   for ( ;; ) {
+      len = read(cache->inotify, events.buf, sizeof(events.buf));
+      if (len < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            opium_log_err(cache->log, "inotify read failed: %s\n", strerror(errno));
+         }
+         break;
+      }
+
+      for (char *pos = events.buf; pos < events.buf + len; ) {
+         struct inotify_event *ev = (struct inotify_event*)pos;
+
+         dropped += opium_file_event(cache, ev);
+         pos += sizeof(struct inotify_event) + ev->len;
+      }
+   }
+
+   cache->ninvalidated += dropped;
+   return dropped;
+}
+
+   opium_file_t *
+opium_file_open(opium_file_cache_t *cache, const char *uri)
+{
+   char          key[OPIUM_FILE_PATH_MAX];
+   opium_file_t *file;
+   opium_u32_t   hash, linked;
+   struct stat   st;
+
+   if (opium_file_key(cache, uri, key, sizeof(key)) != OPIUM_RET_OK) {
+      return NULL;
+   }
+
+   hash = opium_file_hash(key);
+
+   file = opium_file_lookup(cache, key, hash);
+   if (file) {
+      opium_log_trace(cache->log, "File cache hit: %s\n", key);
+      cache->nhits++;
+      file->refs++;
+
+      opium_list_del(&file->lru);
+      opium_list_add(&file->lru, &cache->lru);
+      return file;
+   }
+
+   opium_log_trace(cache->log, "File cache miss: %s\n", key);
+   cache->nmisses++;
+
+   file = opium_file_alloc(cache);
+   if (!file) {
+      errno = ENOBUFS;
+      return NULL;
+   }
+
+   snprintf(file->path, sizeof(file->path), "%s", key);
+   file->hash = hash;
+   file->used = 1;
+
+   /* Watch first: a change between fstat() and the watch would be lost */
+   file->dir = opium_file_watch(cache, key);
+
+   file->fd = opium_file_openat(cache, key, &linked);
+   if (file->fd < 0) {
+      goto failed;
+   }
+
+   /* Served, but reopened per response: nothing watches the target */
+   if (linked) {
+      opium_file_unwatch(cache, file->dir);
+      file->dir = OPIUM_FILE_DIR_NONE;
+   }
+
+   if (fstat(file->fd, &st) < 0) {
+      goto failed;
+   }
+
+   if (!S_ISREG(st.st_mode)) {
+      errno = EACCES;
+      goto failed;
+   }
+
+   opium_file_format(file, &st);
+   file->refs = 1;
+
+   if (file->dir != OPIUM_FILE_DIR_NONE) {
+      file->hnext = cache->buckets[hash & cache->mask];
+      cache->buckets[hash & cache->mask] = file;
+      file->cached = 1;
+      opium_list_add(&file->lru, &cache->lru);
+      cache->cached++;
+   }
+
+   return file;
+
+failed:
+   {
+      opium_err_t err = errno;
+
+      opium_file_release(cache, file);
+      errno = err;
+   }
+   return NULL;
+}
+
+   void
+opium_file_close(opium_file_cache_t *cache, opium_file_t *file)
+{
+   if (file->refs == 0) {
+      opium_log_err(cache->log, "File %s closed twice\n", file->path);
+      return;
+   }
+
+   if (--file->refs == 0 && !file->cached) {
+      opium_file_release(cache, file);
+   }
+}
+
+   ssize_t
+opium_file_header(opium_file_t *file, const char *extra, u_char *buf, size_t size)
+{
+   int len;
+
+   len = snprintf((char*)buf, size, "HTTP/1.1 200 OK\r\n%.*s%s\r\n",
+         (int)file->header_len, (char*)file->header, extra ? extra : "");
+
+   if (len < 0 || (size_t)len >= size) {
+      return OPIUM_RET_ERR;
+   }
+
+   return len;
+}
+
+/*
+ * An HTTP-date (RFC 9110, 5.6.7) in seconds since the epoch, -1 when it is
+ * none of the three forms a recipient has to accept.
+ */
+   static opium_time_t
+opium_file_http_date(const char *date)
+{
+   static const char *formats[] = {
+      "%a, %d %b %Y %H:%M:%S GMT",   /* IMF-fixdate */
+      "%A, %d-%b-%y %H:%M:%S GMT",   /* Obsolete RFC 850 */
+      "%a %b %e %H:%M:%S %Y",        /* asctime() */
+   };
+   const char *end;
+   struct tm   tm;
+
+   for (size_t index = 0; index < sizeof(formats) / sizeof(formats[0]); index++) {
+      opium_memzero(&tm, sizeof(tm));
+
+      end = strptime(date, formats[index], &tm);
+      if (end && end[strspn(end, " \t")] == '\0') {
+         return timegm(&tm);
+      }
+   }
+
+   return -1;
+}
+
+   opium_s32_t
+opium_file_not_modified(opium_file_t *file, const char *if_none_match,
+      const char *if_modified_since)
+{
+   /* If-None-Match wins when both are present (RFC 9110, 13.2.2) */
+   if (if_none_match) {
+      return strcmp(if_none_match, "*") == 0 || strstr(if_none_match, file->etag) != NULL;
+   }
+
+   if (if_modified_since) {
+      opium_time_t since = opium_file_http_date(if_modified_since);
+
+      /* A date the server has not reached yet is no validator */
+      return since >= 0 && since <= time(NULL) && file->mtime <= since;
+   }
+
+   return 0;
+}
+
+   ssize_t
+opium_file_send(opium_file_t *file, opium_socket_fd_t sock, opium_off_t *offset)
+{
+   ssize_t n;
+
+   if (*offset >= file->size) {
+      return 0;
+   }
+
+   n = sendfile(sock, file->fd, offset, opium_min((size_t)(file->size - *offset), OPIUM_FILE_SEND_CHUNK));
+   if (n == 0) {
+      /* Truncated under us, the promised Content-Length cannot be kept */
+      errno = EIO;
+      return OPIUM_RET_ERR;
+   }
+
+   return n;
+}
+
+   void
+opium_file_cache_stats(opium_file_cache_t *cache)
+{
+   opium_log_debug(cache->log, "File cache: %u/%u cached, hits %llu, misses %llu, "
+         "evicted %llu, invalidated %llu\n",
+         cache->cached, cache->capacity,
+         (unsigned long long)cache->nhits, (unsigned long long)cache->nmisses,
+         (unsigned long long)cache->nevicted, (unsigned long long)cache->ninvalidated);
+}
@@ -0,0 +1,142 @@
+#ifndef OPIUM_FILE_INCLUDE_H
+#define OPIUM_FILE_INCLUDE_H
+
+#include "core/opium_core.h"
+
+/*
+ * Static files under one root, served straight from the page cache.
+ *
+ * An entry keeps the open fd of a file together with what its response
+ * needs: size, MIME type and the Content-Type / Content-Length /
+ * Last-Modified / ETag lines, formatted once when the file is opened.
+ * A hit costs a hash lookup, no open() and no stat(); the body goes out
+ * with sendfile(2) and never enters user space.
+ *
+ * Freshness comes from inotify: the parent directory of every cached file
+ * is watched, a write, attribute change, rename or delete of a cached name
+ * drops its entry. An entry dropped while a response still sends from it
+ * keeps its fd until the last opium_file_close().
+ *
+ * Loop thread only, like the connection pool.
+ */
+
+#define OPIUM_FILE_PATH_MAX     256
+#define OPIUM_FILE_HEADER_MAX   256
+#define OPIUM_FILE_ETAG_LEN     48
+#define OPIUM_FILE_DATE_LEN     32
+
+/* Watched directories, each shared by the entries inside it */
+#define OPIUM_FILE_DIRS_MAX     64
+
+#define OPIUM_FILE_INDEX        "index.html"
+
+/* Bytes per sendfile() call, the socket buffer takes less anyway */
+#define OPIUM_FILE_SEND_CHUNK   (1024 * 1024)
+
+#define OPIUM_FILE_DIR_NONE     -1
+
+struct opium_file_s {
+   opium_fd_t          fd;
+   opium_u32_t         hash;
+   opium_u32_t         refs;        /* Responses sending from it */
+
+   unsigned            cached:1;    /* In the hash and on the LRU list */
+   unsigned            used:1;
+
+   opium_s32_t         dir;         /* Index in dirs, OPIUM_FILE_DIR_NONE */
+
+   opium_off_t         size;
+   opium_time_t        mtime;
+   ino_t               ino;
+
+   const char         *mime;
+   char                etag[OPIUM_FILE_ETAG_LEN];
+   char                last_modified[OPIUM_FILE_DATE_LEN];
+
+   /* Entity header lines, each ending in CRLF, without the blank line */
+   u_char              header[OPIUM_FILE_HEADER_MAX];
+   size_t              header_len;
+
+   opium_file_t       *hnext;       /* Hash chain */
+   opium_list_head_t   lru;         /* LRU list while cached, free list otherwise */
+
+   char                path[OPIUM_FILE_PATH_MAX];   /* Relative to the root */
+};
+
+typedef struct {
+   opium_s32_t         wd;          /* -1 when the slot is free */
+   opium_u32_t         refs;
+   char                path[OPIUM_FILE_PATH_MAX];   /* "" for the root itself */
+} opium_file_dir_t;
+
+struct opium_file_cache_s {
+   opium_fd_t          root;        /* O_PATH directory, files are opened at it */
+   char                root_path[OPIUM_FILE_PATH_MAX];
+   const char         *index;       /* Served for a path ending in '/' */
+
+   /* openat2() can resolve beneath the root, cleared on ENOSYS */
+   unsigned            resolve:1;
+
+   opium_file_t       *files;
+   opium_u32_t         capacity;
+
+   opium_file_t      **buckets;
+   opium_u32_t         mask;
+
+   opium_list_head_t   lru;         /* Most recently used first */
+   opium_list_head_t   free;
+   opium_u32_t         cached;
+
+   /* -1 without inotify: every entry is dropped as soon as it is closed */
+   opium_fd_t          inotify;
+   opium_file_dir_t    dirs[OPIUM_FILE_DIRS_MAX];
+
+   opium_event_handler_t *ev;
+
+   /* Statistics */
+   opium_u64_t         nhits;
+   opium_u64_t         nmisses;
+   opium_u64_t         nevicted;
+   opium_u64_t         ninvalidated;
+
+   opium_log_t        *log;
+};
+
+opium_s32_t opium_file_cache_init(opium_file_cache_t *cache, const char *root, const char *index,
+      opium_u32_t capacity, opium_log_t *log);
+void opium_file_cache_exit(opium_file_cache_t *cache);
+
+/* Watch for invalidations from an event loop */
+opium_s32_t opium_file_cache_add(opium_file_cache_t *cache, opium_event_t *event);
+
+/* Read the pending inotify events, entries dropped */
+opium_s32_t opium_file_cache_process(opium_file_cache_t *cache);
+
+/*
+ * The file for a request path ("/", "/css/a.css?v=2"), referenced until
+ * opium_file_close(). NULL with errno set: ENOENT, EACCES for a path
+ * leaving the root or not a regular file, ENOBUFS when every entry is
+ * in use.
+ */
+opium_file_t *opium_file_open(opium_file_cache_t *cache, const char *uri);
+void opium_file_close(opium_file_cache_t *cache, opium_file_t *file);
+
+/* Status line, entity headers, 'extra' lines if any and the blank line */
+ssize_t opium_file_header(opium_file_t *file, const char *extra, u_char *buf, size_t size);
+
+/*
+ * If-None-Match / If-Modified-Since of the request still match. The
+ * latter is parsed, the file is unmodified unless its mtime is newer.
+ */
+opium_s32_t opium_file_not_modified(opium_file_t *file, const char *if_none_match,
+      const char *if_modified_since);
+
+/*
+ * Send the body from *offset on, advancing it. Bytes sent, 0 once the
+ * whole file is out, -1 with errno EAGAIN when the socket is full.
+ */
+ssize_t opium_file_send(opium_file_t *file, opium_socket_fd_t sock, opium_off_t *offset);
+
+void opium_file_cache_stats(opium_file_cache_t *cache);
+
+#endif /* OPIUM_FILE_INCLUDE_H */
@@ -0,0 +1,41 @@
+/* opium_lock.c
+ *
+ * Slow path of the adaptive mutex. This is the futex mutex from Ulrich
+ * Drepper's "Futexes Are Tricky":
+ *
+ *   state 0  unlocked
+ *   state 1  locked, nobody waits        -> unlock is one atomic, no syscall
+ *   state 2  locked, somebody may sleep  -> unlock has to wake one waiter
+ *
+ * Most critical sections are shorter than a context switch, so before
+ * sleeping we spin for a while hoping the owner releases the lock.
+ *
+ */
+
+#include "core/opium_core.h"
+
+   void
+opium_amutex_lock_slow(opium_amutex_t *mtx)
+{
+   opium_u32_t state;
+
+   for (opium_u32_t spin = 0; spin < OPIUM_AMUTEX_SPIN; spin++) {
+      state = atomic_load_explicit(&mtx->state, memory_order_relaxed);
+      if (state == 0 && opium_amutex_trylock(mtx)) {
+         return;
+      }
+      if (state == 2) {
+         /* Others already sleep: spinning would only jump the queue */
+         break;
+      }
+      opium_cpu_relax();
+   }
+
+   /*
+    * Mark the lock contended. If it was free at that moment we now own it
+    * (in state 2, which costs one spurious wake at unlock, harmless).
+    */
+   while (atomic_exchange_explicit(&mtx->state, 2, memory_order_acquire) != 0) {
+      opium_futex_wait(&mtx->state, 2);
+   }
+}
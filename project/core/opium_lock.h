@@ -0,0 +1,147 @@
+#ifndef OPIUM_LOCK_INCLUDE_H
+#define OPIUM_LOCK_INCLUDE_H
+
+#include "core/opium_core.h"
+
+/*
+ * Lock family for hot paths. opium_mutex_t (pthread, ERRORCHECK in debug
+ * builds) stays the default for cold code; these are for critical sections
+ * of a few dozen instructions where the pthread call itself is the cost.
+ *
+ *   opium_spinlock_t   test-and-test-and-set. Cheapest, unfair, never
+ *                      sleeps: only for very short sections.
+ *   opium_ticketlock_t FIFO order, waiters back off proportionally to
+ *                      their distance from the head. Fair under contention.
+ *   opium_amutex_t     adaptive mutex: spins a little, then sleeps on a
+ *                      futex. Uncontended lock/unlock is one atomic each.
+ */
+
+/* Spins of opium_amutex_t before it goes to the kernel */
+#define OPIUM_AMUTEX_SPIN      100
+
+/* Pause rounds per ticket between a waiter and the owner */
+#define OPIUM_TICKET_BACKOFF   16
+
+typedef struct {
+   _Atomic opium_u32_t  locked;
+} opium_spinlock_t;
+
+typedef struct {
+   _Atomic opium_u32_t  next;
+   _Atomic opium_u32_t  owner;
+} opium_ticketlock_t;
+
+/* state: 0 unlocked, 1 locked, 2 locked with (possible) sleepers */
+typedef struct {
+   _Atomic opium_u32_t  state;
+} opium_amutex_t;
+
+#define OPIUM_SPINLOCK_INIT    { 0 }
+#define OPIUM_TICKETLOCK_INIT  { 0, 0 }
+#define OPIUM_AMUTEX_INIT      { 0 }
+
+void opium_amutex_lock_slow(opium_amutex_t *mtx);
+
+/* TTAS spinlock */
+
+   static inline void
+opium_spin_init(opium_spinlock_t *lock)
+{
+   atomic_store_explicit(&lock->locked, 0, memory_order_relaxed);
+}
+
+   static inline int
+opium_spin_trylock(opium_spinlock_t *lock)
+{
+   return atomic_load_explicit(&lock->locked, memory_order_relaxed) == 0
+      && atomic_exchange_explicit(&lock->locked, 1, memory_order_acquire) == 0;
+}
+
+   static inline void
+opium_spin_lock(opium_spinlock_t *lock)
+{
+   /*
+    * Spin on a plain load: the line stays shared in every waiter's cache
+    * and only the unlock invalidates it. Spinning on the exchange itself
+    * would bounce the line between all cores on every iteration.
+    */
+   while (atomic_exchange_explicit(&lock->locked, 1, memory_order_acquire) != 0) {
+      while (atomic_load_explicit(&lock->locked, memory_order_relaxed) != 0) {
+         opium_cpu_relax();
+      }
+   }
+}
+
+   static inline void
+opium_spin_unlock(opium_spinlock_t *lock)
+{
+   atomic_store_explicit(&lock->locked, 0, memory_order_release);
+}
+
+/* Ticket lock */
+
+   static inline void
+opium_ticket_init(opium_ticketlock_t *lock)
+{
+   atomic_store_explicit(&lock->next, 0, memory_order_relaxed);
+   atomic_store_explicit(&lock->owner, 0, memory_order_relaxed);
+}
+
+   static inline void
+opium_ticket_lock(opium_ticketlock_t *lock)
+{
+   opium_u32_t ticket = atomic_fetch_add_explicit(&lock->next, 1, memory_order_relaxed);
+   opium_u32_t owner;
+
+   while ((owner = atomic_load_explicit(&lock->owner, memory_order_acquire)) != ticket) {
+      for (opium_u32_t spin = (ticket - owner) * OPIUM_TICKET_BACKOFF; spin > 0; spin--) {
+         opium_cpu_relax();
+      }
+   }
+}
+
+   static inline void
+opium_ticket_unlock(opium_ticketlock_t *lock)
+{
+   /* Only the owner writes 'owner', a plain increment is enough */
+   opium_u32_t owner = atomic_load_explicit(&lock->owner, memory_order_relaxed);
+   atomic_store_explicit(&lock->owner, owner + 1, memory_order_release);
+}
+
+/* Adaptive spin-then-futex mutex */
+
+   static inline void
+opium_amutex_init(opium_amutex_t *mtx)
+{
+   atomic_store_explicit(&mtx->state, 0, memory_order_relaxed);
+}
+
+   static inline int
+opium_amutex_trylock(opium_amutex_t *mtx)
+{
+   opium_u32_t expected = 0;
+   return atomic_compare_exchange_strong_explicit(&mtx->state, &expected, 1,
+         memory_order_acquire, memory_order_relaxed);
+}
+
+   static inline void
+opium_amutex_lock(opium_amutex_t *mtx)
+{
+   if (opium_amutex_trylock(mtx)) {
+      return;
+   }
+
+   opium_amutex_lock_slow(mtx);
+}
+
+   static inline void
+opium_amutex_unlock(opium_amutex_t *mtx)
+{
+   /* 1 -> 0: nobody sleeps, no syscall */
+   if (atomic_fetch_sub_explicit(&mtx->state, 1, memory_order_release) != 1) {
+      atomic_store_explicit(&mtx->state, 0, memory_order_release);
+      opium_futex_wake(&mtx->state, 1);
+   }
+}
+
+#endif /* OPIUM_LOCK_INCLUDE_H */
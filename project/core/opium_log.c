@@ -30,6 +30,13 @@ opium_log_debug_inline(opium_log_t *log, char *format, ...)
 
    va_list args;
    va_start(args, format);
+   opium_log_async_t *async = opium_log_async_enter(log);
+   if (async) {
+      opium_log_async_write(async, OPIUM_LOG_DEST_DEBUG, NULL, NULL, format, args);
+      opium_log_async_leave(log);
+      va_end(args);
+      return;
+   }
    vfprintf(debug, format, args);
    va_end(args);
 
@@ -44,7 +51,13 @@ opium_log_debug(opium_log_t *log, char *format, ...)
 
    va_list args;
    va_start(args, format); 
-   opium_log_msg(debug, OPIUM_COLOR_RESET, "[DEBUG]", format, args);
+   opium_log_async_t *async = opium_log_async_enter(log);
+   if (async) {
+      opium_log_async_write(async, OPIUM_LOG_DEST_DEBUG, OPIUM_COLOR_RESET, "[DEBUG]", format, args);
+      opium_log_async_leave(log);
+   } else {
+      opium_log_msg(debug, OPIUM_COLOR_RESET, "[DEBUG]", format, args);
+   }
    va_end(args);
 }
 
@@ -56,7 +69,13 @@ opium_log_warn(opium_log_t *log, char *format, ...)
 
    va_list args;
    va_start(args, format); 
-   opium_log_msg(warn, OPIUM_COLOR_RESET, "[WARN]", format, args);
+   opium_log_async_t *async = opium_log_async_enter(log);
+   if (async) {
+      opium_log_async_write(async, OPIUM_LOG_DEST_WARN, OPIUM_COLOR_RESET, "[WARN]", format, args);
+      opium_log_async_leave(log);
+   } else {
+      opium_log_msg(warn, OPIUM_COLOR_RESET, "[WARN]", format, args);
+   }
    va_end(args);
 }
 
@@ -68,7 +87,13 @@ opium_log_err(opium_log_t *log, char *format, ...)
 
    va_list args;
    va_start(args, format); 
-   opium_log_msg(err, OPIUM_COLOR_RESET, "[ERROR]", format, args);
+   opium_log_async_t *async = opium_log_async_enter(log);
+   if (async) {
+      opium_log_async_write(async, OPIUM_LOG_DEST_ERR, OPIUM_COLOR_RESET, "[ERROR]", format, args);
+      opium_log_async_leave(log);
+   } else {
+      opium_log_msg(err, OPIUM_COLOR_RESET, "[ERROR]", format, args);
+   }
    va_end(args);
 }
 
@@ -94,11 +119,13 @@ opium_log_stderr(char *format, ...)
 opium_log_init(char *debug, char *warn, char *err)
 {
 
-   opium_log_t *log = calloc(1, sizeof(opium_log_t));
-   if (!log) {
+   /* Aligned for the producer slots */
+   opium_log_t *log = NULL;
+   if (posix_memalign((void**)&log, OPIUM_CACHE_LINE, sizeof(opium_log_t)) != 0) {
       opium_log_err(log, "Failed to allocate hash table.\n");
       return NULL;
    }
+   memset(log, 0, sizeof(opium_log_t));
    log->initialized = 1;
 
    log->debug = fopen(debug, "a");
@@ -124,6 +151,9 @@ opium_log_exit(opium_log_t *log)
 {
    if (!opium_log_isvalid(log)) return;
 
+   /* Drain and stop the flusher before the files go away */
+   opium_log_async_exit(log);
+
    if (log->debug) {
       fclose(log->debug);
       log->debug = NULL;
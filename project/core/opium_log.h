@@ -7,12 +7,29 @@
 #define OPIUM_COLOR_YELLOW "\x1b[33m"
 #define OPIUM_COLOR_RED    "\x1b[31m"
 
+/* Producer slots of the async backend, see opium_log_async_enter() */
+#define OPIUM_LOG_SLOTS    64
+
+typedef struct {
+   _Atomic opium_u32_t busy __attribute__((aligned(OPIUM_CACHE_LINE)));
+} opium_log_slot_t;
+
 struct opium_log_s {
    int initialized;
 
    FILE *debug;
    FILE *warn;
    FILE *err;
+
+   /* Set by opium_log_async_init(), NULL while logging synchronously */
+   opium_log_async_t *_Atomic async;
+
+   /*
+    * Threads inside the async backend, counted per slot so that producers
+    * on different cores do not share a cache line. Kept here because the
+    * log outlives the backend.
+    */
+   opium_log_slot_t slots[OPIUM_LOG_SLOTS];
 };
 
 int opium_log_isvalid(opium_log_t *log);
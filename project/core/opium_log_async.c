@@ -0,0 +1,532 @@
+/* opium_log_async.c
+ *
+ * Asynchronous logging backend.
+ *
+ * The synchronous path (opium_log_msg) takes the FILE lock several times
+ * per line and usually ends in a write() syscall because of fflush().
+ * That is fine for a tool, but an event thread that logs pays a lock and
+ * a syscall for every line.
+ *
+ * Here every thread owns a private byte ring:
+ *
+ *   thread A -> [ring A] --\
+ *   thread B -> [ring B] ---+--> flusher thread --> write(fd, batch)
+ *   thread C -> [ring C] --/
+ *
+ * - A producer formats the line on its own stack and copies it into its
+ *   ring. No lock, no syscall: one acquire load and one release store.
+ * - The flusher walks all rings, sorts records into per-destination batch
+ *   buffers and issues one large write() per destination.
+ * - When a ring is full the configured policy decides: drop the record and
+ *   count it, or yield until the flusher makes room.
+ * - Producers are counted in per-thread slots of the log
+ *   (opium_log_async_enter/leave), and opium_log_async_exit() waits for
+ *   every slot to drain before it frees anything.
+ *
+ * src/utils/src/log.c carries a single-destination copy of this for
+ * libonion, which is built without the opium core. Keep the two in step.
+ */
+
+#include "core/opium_core.h"
+
+/* Record header stored in front of every line in a ring */
+typedef struct opium_log_record_s opium_log_record_t;
+
+struct opium_log_record_s {
+   opium_u32_t len;
+   opium_u32_t dest;
+};
+
+/* A skip record pads the ring up to its end when a record would wrap */
+#define OPIUM_LOG_RECORD_SKIP  0xFFFFFFFF
+
+#define OPIUM_LOG_RING_MASK    (OPIUM_LOG_ASYNC_RING_SIZE - 1)
+
+#define opium_log_record_align(n) (((n) + 7) & ~((size_t)7))
+
+/*
+ * Every initialized backend gets a generation number, so that a thread
+ * which cached a ring of an already destroyed backend (possibly at the
+ * same address) never reuses that stale pointer.
+ */
+static _Atomic opium_u64_t opium_log_async_generation;
+
+static __thread opium_log_async_t *opium_log_async_owner;
+static __thread opium_log_ring_t  *opium_log_async_ring;
+static __thread opium_u64_t        opium_log_async_owner_gen;
+static __thread opium_log_t       *opium_log_async_owner_log;
+
+/* Producer slot of this thread, the same index in every log */
+static _Atomic opium_u32_t opium_log_async_next_slot;
+static __thread opium_s32_t opium_log_async_slot = -1;
+
+   opium_log_async_t *
+opium_log_async_pin(opium_log_t *log)
+{
+   opium_log_async_t *async;
+
+   if (opium_unlikely(opium_log_async_slot < 0)) {
+      opium_log_async_slot = atomic_fetch_add_explicit(&opium_log_async_next_slot, 1,
+            memory_order_relaxed) % OPIUM_LOG_SLOTS;
+   }
+
+   /*
+    * Both sequentially consistent, like the exchange and the slot loads in
+    * opium_log_async_exit(): either exit sees this slot busy, or this load
+    * already sees NULL.
+    */
+   atomic_fetch_add(&log->slots[opium_log_async_slot].busy, 1);
+   async = atomic_load(&log->async);
+
+   if (!async) {
+      opium_log_async_leave(log);
+   }
+
+   return async;
+}
+
+   void
+opium_log_async_leave(opium_log_t *log)
+{
+   atomic_fetch_sub_explicit(&log->slots[opium_log_async_slot].busy, 1, memory_order_release);
+}
+
+   static void
+opium_log_async_ring_release(void *data)
+{
+   /*
+    * Called by pthread when the owning thread exits. The ring is handed
+    * back; the flusher still drains whatever is left in it, and a new
+    * thread may claim it once it is empty. The thread may exit while
+    * opium_log_async_exit() runs, so it counts as a producer, and a ring
+    * of a backend that is already gone is left alone.
+    */
+   opium_log_ring_t  *ring = data;
+   opium_log_t       *log = opium_log_async_owner_log;
+   opium_log_async_t *async = opium_log_async_enter(log);
+
+   if (!async) {
+      return;
+   }
+
+   if (async == opium_log_async_owner && async->gen == opium_log_async_owner_gen) {
+      atomic_store_explicit(&ring->orphan, 1, memory_order_release);
+   }
+
+   opium_log_async_leave(log);
+}
+
+   static opium_log_ring_t *
+opium_log_async_ring_get(opium_log_async_t *async)
+{
+   opium_log_ring_t *ring;
+   size_t            count, index;
+
+   if (opium_likely(opium_log_async_owner == async && opium_log_async_owner_gen == async->gen)) {
+      return opium_log_async_ring;
+   }
+
+   /* First try to reuse a ring whose owner is gone and which is drained */
+   count = atomic_load_explicit(&async->nrings, memory_order_acquire);
+   ring = NULL;
+
+   for (index = 0; index < count && index < OPIUM_LOG_ASYNC_MAX_THREADS; index++) {
+      opium_log_ring_t *current = &async->rings[index];
+      int expected = 1;
+
+      if (atomic_load_explicit(&current->head, memory_order_relaxed)
+            != atomic_load_explicit(&current->tail, memory_order_acquire)) {
+         continue;
+      }
+
+      if (atomic_compare_exchange_strong(&current->orphan, &expected, 0)) {
+         ring = current;
+         break;
+      }
+   }
+
+   if (!ring) {
+      index = atomic_fetch_add(&async->nrings, 1);
+      if (index >= OPIUM_LOG_ASYNC_MAX_THREADS) {
+         atomic_fetch_sub(&async->nrings, 1);
+         return NULL;
+      }
+
+      ring = &async->rings[index];
+   }
+
+   /*
+    * The ring's buffer is allocated by its first owner, so a backend costs
+    * one ring per thread that logs, not OPIUM_LOG_ASYNC_MAX_THREADS of them.
+    * The flusher only reads 'data' after it saw 'head' move, which the
+    * first record publishes. No log for the allocation: it would land here
+    * again.
+    */
+   if (opium_unlikely(!ring->data)) {
+      ring->data = opium_memalign(OPIUM_CACHE_LINE, OPIUM_LOG_ASYNC_RING_SIZE, NULL);
+      if (!ring->data) {
+         atomic_store_explicit(&ring->orphan, 1, memory_order_release);
+         return NULL;
+      }
+   }
+
+   pthread_setspecific(async->key, ring);
+
+   opium_log_async_owner = async;
+   opium_log_async_owner_gen = async->gen;
+   opium_log_async_owner_log = async->log;
+   opium_log_async_ring = ring;
+
+   return ring;
+}
+
+   static u_char *
+opium_log_async_reserve(opium_log_ring_t *ring, size_t need, size_t *head_out)
+{
+   size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+   size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+   size_t free = OPIUM_LOG_ASYNC_RING_SIZE - (head - tail);
+   size_t offset = head & OPIUM_LOG_RING_MASK;
+   size_t room = OPIUM_LOG_ASYNC_RING_SIZE - offset;
+
+   if (need > room) {
+      /*
+       * The record does not fit before the end of the ring. Burn the rest
+       * of the ring with a skip record and start again at offset 0, so
+       * the consumer always sees a record as one contiguous piece.
+       */
+      if (free < room + need) {
+         return NULL;
+      }
+
+      opium_log_record_t *skip = (opium_log_record_t*)(ring->data + offset);
+      skip->len = room - sizeof(opium_log_record_t);
+      skip->dest = OPIUM_LOG_RECORD_SKIP;
+
+      head = head + room;
+      offset = 0;
+
+   } else if (free < need) {
+      return NULL;
+   }
+
+   *head_out = head + need;
+
+   return ring->data + offset;
+}
+
+   static void
+opium_log_async_write_fd(opium_fd_t fd, u_char *data, size_t len)
+{
+   while (len > 0) {
+      ssize_t n = write(fd, data, len);
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return;
+      }
+
+      data = data + n;
+      len = len - n;
+   }
+}
+
+   static void
+opium_log_async_batch_flush(opium_log_async_t *async, opium_u32_t dest)
+{
+   if (async->batch_len[dest] == 0) {
+      return;
+   }
+
+   opium_log_async_write_fd(async->fds[dest], async->batch[dest], async->batch_len[dest]);
+   async->batch_len[dest] = 0;
+}
+
+   static void
+opium_log_async_batch_add(opium_log_async_t *async, opium_u32_t dest, u_char *data, size_t len)
+{
+   if (async->batch_len[dest] + len > OPIUM_LOG_ASYNC_BATCH_SIZE) {
+      opium_log_async_batch_flush(async, dest);
+   }
+
+   opium_memcpy(async->batch[dest] + async->batch_len[dest], data, len);
+   async->batch_len[dest] = async->batch_len[dest] + len;
+}
+
+   static size_t
+opium_log_async_drain(opium_log_async_t *async)
+{
+   size_t count = atomic_load_explicit(&async->nrings, memory_order_acquire);
+   size_t records = 0, dropped = 0;
+
+   if (count > OPIUM_LOG_ASYNC_MAX_THREADS) {
+      count = OPIUM_LOG_ASYNC_MAX_THREADS;
+   }
+
+   for (size_t index = 0; index < count; index++) {
+      opium_log_ring_t *ring = &async->rings[index];
+
+      size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+      while (tail != head) {
+         opium_log_record_t *record = (opium_log_record_t*)(ring->data + (tail & OPIUM_LOG_RING_MASK));
+         u_char *payload = (u_char*)(record + 1);
+
+         if (record->dest != OPIUM_LOG_RECORD_SKIP) {
+            opium_log_async_batch_add(async, record->dest, payload, record->len);
+            records = records + 1;
+         }
+
+         tail = tail + opium_log_record_align(sizeof(opium_log_record_t) + record->len);
+      }
+
+      /* Hand the space back to the producer only after the copy is done */
+      atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+      dropped = dropped + atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+   }
+
+   if (opium_unlikely(dropped != async->reported)) {
+      char   line[128];
+      int    len;
+
+      len = snprintf(line, sizeof(line), "[WARN]: async log dropped %zu records\n",
+            dropped - async->reported);
+      if (len > 0) {
+         opium_log_async_batch_add(async, OPIUM_LOG_DEST_WARN, (u_char*)line, len);
+      }
+
+      async->reported = dropped;
+   }
+
+   for (opium_u32_t dest = 0; dest < OPIUM_LOG_DEST_MAX; dest++) {
+      opium_log_async_batch_flush(async, dest);
+   }
+
+   return records;
+}
+
+   static void *
+opium_log_async_flusher(void *data)
+{
+   opium_log_async_t *async = data;
+
+   struct timespec ts = {
+      .tv_sec = async->flush_ms / 1000,
+      .tv_nsec = (async->flush_ms % 1000) * 1000000
+   };
+
+   while (!atomic_load_explicit(&async->stop, memory_order_acquire)) {
+      if (opium_log_async_drain(async) == 0) {
+         nanosleep(&ts, NULL);
+      }
+   }
+
+   /* Producers may still have published lines right before stop */
+   opium_log_async_drain(async);
+
+   return NULL;
+}
+
+   void
+opium_log_async_write(opium_log_async_t *async, opium_log_dest_t dest,
+      const char *cc, const char *pref, const char *format, va_list args)
+{
+   char   line[OPIUM_LOG_ASYNC_LINE_MAX];
+   size_t len = 0, reset = sizeof(OPIUM_COLOR_RESET) - 1;
+   int    colored = cc && async->colored[dest];
+   int    n;
+
+   if (colored) {
+      n = snprintf(line, sizeof(line), "%s", cc);
+      len = n > 0 ? (size_t)n : 0;
+   }
+
+   if (pref) {
+      n = snprintf(line + len, sizeof(line) - len, "%s: ", pref);
+      len = n > 0 ? len + n : len;
+   }
+
+   /* Always keep room for the color reset sequence */
+   n = vsnprintf(line + len, sizeof(line) - len - reset, format, args);
+   if (n > 0) {
+      len = opium_min(len + n, sizeof(line) - reset - 1);
+   }
+
+   if (colored) {
+      opium_memcpy(line + len, OPIUM_COLOR_RESET, reset);
+      len = len + reset;
+   }
+
+   opium_log_async_push(async, dest, line, len);
+}
+
+   void
+opium_log_async_push(opium_log_async_t *async, opium_log_dest_t dest, void *data, size_t len)
+{
+   opium_log_ring_t *ring = opium_log_async_ring_get(async);
+   if (opium_unlikely(!ring)) {
+      /* Out of rings: fall back to a direct write rather than losing the record */
+      opium_log_async_write_fd(async->fds[dest], data, len);
+      return;
+   }
+
+   size_t need = opium_log_record_align(sizeof(opium_log_record_t) + len);
+   size_t head;
+   u_char *pos;
+
+   while ((pos = opium_log_async_reserve(ring, need, &head)) == NULL) {
+      if (async->policy == OPIUM_LOG_OVERFLOW_DROP
+            || atomic_load_explicit(&async->stop, memory_order_relaxed)) {
+         atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+         return;
+      }
+
+      sched_yield();
+   }
+
+   opium_log_record_t *record = (opium_log_record_t*)pos;
+   record->len = len;
+   record->dest = dest;
+   opium_memcpy(record + 1, data, len);
+
+   atomic_store_explicit(&ring->head, head, memory_order_release);
+}
+
+   size_t
+opium_log_async_dropped(opium_log_async_t *async)
+{
+   size_t count = atomic_load_explicit(&async->nrings, memory_order_acquire);
+   size_t dropped = 0;
+
+   for (size_t index = 0; index < count && index < OPIUM_LOG_ASYNC_MAX_THREADS; index++) {
+      dropped = dropped + atomic_load_explicit(&async->rings[index].dropped, memory_order_relaxed);
+   }
+
+   return dropped;
+}
+
+   opium_s32_t
+opium_log_async_init(opium_log_t *log, opium_log_overflow_t policy, size_t flush_ms)
+{
+   opium_log_async_t *async;
+   opium_err_t        err;
+
+   if (!opium_log_isvalid(log) || log->async) {
+      return OPIUM_RET_ERR;
+   }
+
+   async = opium_memalign(OPIUM_CACHE_LINE, sizeof(opium_log_async_t), log);
+   if (!async) {
+      opium_log_err(log, "Failed to allocate async log.\n");
+      return OPIUM_RET_ERR;
+   }
+
+   opium_memzero(async, sizeof(opium_log_async_t));
+
+   async->policy = policy;
+   async->flush_ms = flush_ms > 0 ? flush_ms : OPIUM_LOG_ASYNC_FLUSH_MS;
+   async->log = log;
+
+   /* Resolve destinations exactly the way the synchronous path does */
+   FILE *files[OPIUM_LOG_DEST_BIN] = {
+      log->debug ? log->debug : stdout,
+      log->warn ? log->warn : stderr,
+      log->err ? log->err : stderr,
+   };
+
+   for (opium_u32_t dest = 0; dest < OPIUM_LOG_DEST_BIN; dest++) {
+      fflush(files[dest]);
+      async->fds[dest] = fileno(files[dest]);
+      async->colored[dest] = files[dest] == stdout || files[dest] == stderr;
+   }
+
+   /* The binary destination stays closed until opium_log_bin_init() */
+   async->fds[OPIUM_LOG_DEST_BIN] = -1;
+
+   for (opium_u32_t dest = 0; dest < OPIUM_LOG_DEST_MAX; dest++) {
+      async->batch[dest] = opium_memalign(OPIUM_CACHE_LINE, OPIUM_LOG_ASYNC_BATCH_SIZE, log);
+      if (!async->batch[dest]) {
+         opium_log_err(log, "Failed to allocate async log batch.\n");
+         goto failed;
+      }
+   }
+
+   err = pthread_key_create(&async->key, opium_log_async_ring_release);
+   if (err != 0) {
+      opium_log_err(log, "pthread_key_create() failed\n");
+      goto failed;
+   }
+
+   async->gen = atomic_fetch_add(&opium_log_async_generation, 1) + 1;
+
+   if (opium_thread_init(&async->flusher, opium_log_async_flusher, async, log) != OPIUM_RET_OK) {
+      pthread_key_delete(async->key);
+      goto failed;
+   }
+
+   atomic_store(&log->async, async);
+
+   return OPIUM_RET_OK;
+
+failed:
+   for (opium_u32_t dest = 0; dest < OPIUM_LOG_DEST_MAX; dest++) {
+      opium_free(async->batch[dest], log);
+   }
+   for (size_t index = 0; index < OPIUM_LOG_ASYNC_MAX_THREADS; index++) {
+      opium_free(async->rings[index].data, log);
+   }
+   opium_free(async, log);
+
+   return OPIUM_RET_ERR;
+}
+
+   void
+opium_log_async_exit(opium_log_t *log)
+{
+   opium_log_async_t *async;
+
+   if (!opium_log_isvalid(log) || !log->async) {
+      return;
+   }
+
+   /* From here on every line goes through the synchronous path again */
+   async = atomic_exchange(&log->async, NULL);
+
+   /*
+    * Quiesce: producers that picked the backend up before the exchange
+    * may still be copying into their ring. 'stop' makes a blocked one
+    * give up, and the rings are not freed before the last one has left.
+    */
+   atomic_store(&async->stop, 1);
+
+   for (size_t index = 0; index < OPIUM_LOG_SLOTS; index++) {
+      while (atomic_load(&log->slots[index].busy) > 0) {
+         sched_yield();
+      }
+   }
+
+   opium_thread_exit(&async->flusher, log);
+
+   /* The flusher may have made its last pass before the last producer left */
+   opium_log_async_drain(async);
+
+   pthread_key_delete(async->key);
+
+   if (async->fds[OPIUM_LOG_DEST_BIN] != -1) {
+      close(async->fds[OPIUM_LOG_DEST_BIN]);
+      opium_log_bin_exit();
+   }
+
+   for (opium_u32_t dest = 0; dest < OPIUM_LOG_DEST_MAX; dest++) {
+      opium_free(async->batch[dest], log);
+   }
+   for (size_t index = 0; index < OPIUM_LOG_ASYNC_MAX_THREADS; index++) {
+      opium_free(async->rings[index].data, log);
+   }
+
+   opium_free(async, log);
+}
@@ -0,0 +1,110 @@
+#ifndef OPIUM_LOG_ASYNC_INCLUDE_H
+#define OPIUM_LOG_ASYNC_INCLUDE_H
+
+#include "core/opium_core.h"
+
+/* Per-thread ring size in bytes, must be a power of two */
+#define OPIUM_LOG_ASYNC_RING_SIZE    (64 * 1024)
+
+/* Bytes collected per destination before the flusher issues a write() */
+#define OPIUM_LOG_ASYNC_BATCH_SIZE   (64 * 1024)
+
+/* Maximum number of threads that can own a ring at the same time */
+#define OPIUM_LOG_ASYNC_MAX_THREADS  64
+
+/* Longest formatted line, longer lines are truncated */
+#define OPIUM_LOG_ASYNC_LINE_MAX     1024
+
+/* How long the flusher sleeps when every ring is empty */
+#define OPIUM_LOG_ASYNC_FLUSH_MS     10
+
+/* What a producer does when its ring has no room for a record */
+typedef enum {
+   OPIUM_LOG_OVERFLOW_DROP,   /* Drop the record and count it */
+   OPIUM_LOG_OVERFLOW_BLOCK,  /* Yield until the flusher makes room */
+} opium_log_overflow_t;
+
+typedef enum {
+   OPIUM_LOG_DEST_DEBUG,
+   OPIUM_LOG_DEST_WARN,
+   OPIUM_LOG_DEST_ERR,
+   OPIUM_LOG_DEST_BIN,   /* Binary records, see opium_log_bin.h */
+   OPIUM_LOG_DEST_MAX,
+} opium_log_dest_t;
+
+/*
+ * opium_log_ring_t - single producer / single consumer byte ring.
+ *
+ * The owning thread only moves 'head', the flusher only moves 'tail'.
+ * Both live on their own cache line so the producer and the consumer
+ * never write to the same line.
+ */
+typedef struct opium_log_ring_s opium_log_ring_t;
+
+struct opium_log_ring_s {
+   _Atomic size_t   head __attribute__((aligned(OPIUM_CACHE_LINE)));
+   _Atomic size_t   dropped;
+
+   _Atomic size_t   tail __attribute__((aligned(OPIUM_CACHE_LINE)));
+
+   _Atomic int      orphan __attribute__((aligned(OPIUM_CACHE_LINE)));
+   u_char          *data;
+};
+
+struct opium_log_async_s {
+   opium_log_ring_t      rings[OPIUM_LOG_ASYNC_MAX_THREADS];
+   _Atomic size_t        nrings;
+
+   opium_log_overflow_t  policy;
+   size_t                flush_ms;
+
+   opium_fd_t            fds[OPIUM_LOG_DEST_MAX];
+   opium_u8_t            colored[OPIUM_LOG_DEST_MAX];
+
+   u_char               *batch[OPIUM_LOG_DEST_MAX];
+   size_t                batch_len[OPIUM_LOG_DEST_MAX];
+
+   size_t                reported;
+   opium_u64_t           gen;
+
+   /* Binary mode: set by opium_log_bin_init() */
+   _Atomic int           binary;
+
+   pthread_key_t         key;
+   opium_thread_t        flusher;
+   _Atomic int           stop;
+
+   opium_log_t          *log;
+};
+
+opium_s32_t opium_log_async_init(opium_log_t *log, opium_log_overflow_t policy, size_t flush_ms);
+void opium_log_async_exit(opium_log_t *log);
+
+opium_log_async_t *opium_log_async_pin(opium_log_t *log);
+void opium_log_async_leave(opium_log_t *log);
+
+/*
+ * Every use of log->async goes through enter(), and leave() follows once
+ * the backend is no longer touched, so that opium_log_async_exit() can
+ * wait for the last producer before it frees the rings. A thread counts
+ * itself in its own slot of the log (one cache line each, shared only
+ * past OPIUM_LOG_SLOTS threads). With logging synchronous enter() is a
+ * single load and returns NULL; leave() is only called after a non-NULL
+ * enter().
+ */
+   static inline opium_log_async_t *
+opium_log_async_enter(opium_log_t *log)
+{
+   if (atomic_load_explicit(&log->async, memory_order_relaxed) == NULL) {
+      return NULL;
+   }
+   return opium_log_async_pin(log);
+}
+
+void opium_log_async_write(opium_log_async_t *async, opium_log_dest_t dest,
+      const char *cc, const char *pref, const char *format, va_list args);
+void opium_log_async_push(opium_log_async_t *async, opium_log_dest_t dest, void *data, size_t len);
+
+size_t opium_log_async_dropped(opium_log_async_t *async);
+
+#endif /* OPIUM_LOG_ASYNC_INCLUDE_H */
@@ -0,0 +1,396 @@
+/* opium_log_bin.c
+ *
+ * Binary, deferred-formatting log records.
+ *
+ * Even when a line goes into a lock-free ring, vsnprintf() still runs on
+ * the hot path and costs hundreds of nanoseconds. Most of that work is
+ * wasted: the format string never changes for a given call site.
+ *
+ * So the hot path stores only what changes:
+ *
+ *   [record header: size, kind, nargs, site id][ticks][arg0][arg1]...
+ *
+ * - The site id names a static opium_log_site_t. On first use the format
+ *   is parsed once into argument classes and a dictionary record
+ *   (id -> format, file, line) is written.
+ * - 'ticks' comes from the TSC on x86, which is a handful of cycles
+ *   instead of a clock_gettime() call.
+ * - Arguments are copied raw: 4 or 8 bytes for numbers, a length-prefixed
+ *   copy for strings.
+ *
+ * Records travel through the same per-thread rings as text lines
+ * (destination OPIUM_LOG_DEST_BIN) and tools/opium_log_decode renders them
+ * to text offline.
+ *
+ */
+
+#include "core/opium_core.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define OPIUM_LOG_BIN_TSC 1
+#endif
+
+/*
+ * Site ids are process-wide, so one binary log is open at a time. Every
+ * site that got an id is on the registered list: when the log closes they
+ * all go back to 0 and the next binary file gets its dictionary again.
+ */
+static _Atomic opium_u32_t          opium_log_bin_sites;
+static _Atomic int                  opium_log_bin_enabled;
+static _Atomic(opium_log_site_t *)  opium_log_bin_registered;
+
+   opium_u64_t
+opium_log_bin_ticks(void)
+{
+#if (OPIUM_LOG_BIN_TSC)
+   return __rdtsc();
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (opium_u64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+   static opium_u64_t
+opium_log_bin_clock_ns(clockid_t clock)
+{
+   struct timespec ts;
+   clock_gettime(clock, &ts);
+   return (opium_u64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+   opium_s32_t
+opium_log_bin_parse(const char *format, opium_u8_t *types, opium_u8_t *nargs)
+{
+   const char *p = format;
+   opium_u8_t  count = 0;
+
+   /*
+    * Walk the printf format once and remember the storage class of every
+    * argument, in the order va_arg() will fetch them:
+    *
+    *   "%s took %5.*f ms (%zu bytes)"
+    *     |          | |       |
+    *     STR      I32 F64    I64     ('*' consumes an int of its own)
+    */
+
+   while (*p) {
+      int longs = 0;
+
+      if (*p++ != '%') {
+         continue;
+      }
+
+      if (*p == '%') {
+         p++;
+         continue;
+      }
+
+      while (*p && strchr("-+ #0'", *p)) {
+         p++;
+      }
+
+      if (*p == '*') {
+         if (count >= OPIUM_LOG_BIN_MAX_ARGS) return OPIUM_RET_ERR;
+         types[count++] = OPIUM_LOG_ARG_I32;
+         p++;
+      } else {
+         while (isdigit((u_char)*p)) p++;
+      }
+
+      if (*p == '.') {
+         p++;
+         if (*p == '*') {
+            if (count >= OPIUM_LOG_BIN_MAX_ARGS) return OPIUM_RET_ERR;
+            types[count++] = OPIUM_LOG_ARG_I32;
+            p++;
+         } else {
+            while (isdigit((u_char)*p)) p++;
+         }
+      }
+
+      for ( ;; ) {
+         if (*p == 'h') {
+            p++;
+         } else if (*p == 'l' || *p == 'j' || *p == 'z' || *p == 't' || *p == 'q') {
+            longs++;
+            p++;
+         } else if (*p == 'L') {
+            /* long double is not supported in binary mode */
+            return OPIUM_RET_ERR;
+         } else {
+            break;
+         }
+      }
+
+      if (*p == '\0') {
+         return OPIUM_RET_ERR;
+      }
+
+      if (*p == 'm') {
+         /* glibc %m takes no argument but reads errno at format time */
+         return OPIUM_RET_ERR;
+      }
+
+      if (count >= OPIUM_LOG_BIN_MAX_ARGS) {
+         return OPIUM_RET_ERR;
+      }
+
+      switch (*p++) {
+         case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+            types[count++] = longs ? OPIUM_LOG_ARG_I64 : OPIUM_LOG_ARG_I32;
+            break;
+         case 'c':
+            types[count++] = OPIUM_LOG_ARG_I32;
+            break;
+         case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            types[count++] = OPIUM_LOG_ARG_F64;
+            break;
+         case 's':
+            types[count++] = OPIUM_LOG_ARG_STR;
+            break;
+         case 'p':
+            types[count++] = OPIUM_LOG_ARG_PTR;
+            break;
+         default:
+            return OPIUM_RET_ERR;
+      }
+   }
+
+   *nargs = count;
+
+   return OPIUM_RET_OK;
+}
+
+   static opium_u32_t
+opium_log_bin_register(opium_log_async_t *async, opium_log_site_t *site)
+{
+   opium_u32_t expected = 0, id;
+
+   if (!atomic_compare_exchange_strong(&site->id, &expected, OPIUM_LOG_BIN_SITE_BUSY)) {
+      /* Another thread registers this site right now, or already did */
+      while ((id = atomic_load_explicit(&site->id, memory_order_acquire)) == OPIUM_LOG_BIN_SITE_BUSY) {
+         sched_yield();
+      }
+      return id;
+   }
+
+   if (opium_log_bin_parse(site->format, site->types, &site->nargs) != OPIUM_RET_OK) {
+      atomic_store_explicit(&site->id, OPIUM_LOG_BIN_SITE_TEXT, memory_order_release);
+      return OPIUM_LOG_BIN_SITE_TEXT;
+   }
+
+   id = atomic_fetch_add(&opium_log_bin_sites, 1) + 1;
+
+   /* Dictionary record, written once per site on the cold path */
+   u_char      buf[sizeof(opium_log_bin_record_t) + 8 + OPIUM_LOG_BIN_MAX_ARGS
+                  + OPIUM_LOG_BIN_FMT_MAX + PATH_MAX];
+   u_char     *pos = buf + sizeof(opium_log_bin_record_t);
+   opium_u16_t fmt_len = opium_min(strlen(site->format), OPIUM_LOG_BIN_FMT_MAX);
+   opium_u16_t file_len = opium_min(strlen(site->file), PATH_MAX);
+   opium_u32_t line = site->line;
+
+   opium_memcpy(pos, &line, sizeof(line));
+   pos = pos + sizeof(line);
+   opium_memcpy(pos, &fmt_len, sizeof(fmt_len));
+   pos = pos + sizeof(fmt_len);
+   opium_memcpy(pos, &file_len, sizeof(file_len));
+   pos = pos + sizeof(file_len);
+   opium_memcpy(pos, site->types, site->nargs);
+   pos = pos + site->nargs;
+   opium_memcpy(pos, (void*)site->format, fmt_len);
+   pos = pos + fmt_len;
+   opium_memcpy(pos, (void*)site->file, file_len);
+   pos = pos + file_len;
+
+   opium_log_bin_record_t record = {
+      .size = pos - buf,
+      .kind = OPIUM_LOG_BIN_SITE,
+      .nargs = site->nargs,
+      .id = id,
+   };
+   opium_memcpy(buf, &record, sizeof(record));
+
+   opium_log_async_push(async, OPIUM_LOG_DEST_BIN, buf, record.size);
+
+   site->next = atomic_load_explicit(&opium_log_bin_registered, memory_order_relaxed);
+   while (!atomic_compare_exchange_weak_explicit(&opium_log_bin_registered, &site->next, site,
+            memory_order_release, memory_order_relaxed)) {
+      /* 'next' was reloaded, try again */
+   }
+
+   atomic_store_explicit(&site->id, id, memory_order_release);
+
+   return id;
+}
+
+   void
+opium_log_bin_write(opium_log_async_t *async, opium_log_site_t *site, ...)
+{
+   u_char      buf[OPIUM_LOG_ASYNC_LINE_MAX];
+   u_char     *pos, *end = buf + sizeof(buf);
+   opium_u32_t id;
+   opium_u64_t ticks;
+   va_list     args;
+
+   /* Read the clock first: it is the moment of the call that matters */
+   ticks = opium_log_bin_ticks();
+
+   id = atomic_load_explicit(&site->id, memory_order_acquire);
+   if (opium_unlikely(id == 0 || id == OPIUM_LOG_BIN_SITE_BUSY)) {
+      id = opium_log_bin_register(async, site);
+   }
+
+   va_start(args, site);
+
+   if (opium_unlikely(id == OPIUM_LOG_BIN_SITE_TEXT)) {
+      opium_log_async_write(async, OPIUM_LOG_DEST_DEBUG, OPIUM_COLOR_RESET, "[DEBUG]", site->format, args);
+      va_end(args);
+      return;
+   }
+
+   pos = buf + sizeof(opium_log_bin_record_t);
+   opium_memcpy(pos, &ticks, sizeof(ticks));
+   pos = pos + sizeof(ticks);
+
+   for (opium_u8_t index = 0; index < site->nargs; index++) {
+      switch (site->types[index]) {
+         case OPIUM_LOG_ARG_I32: {
+            opium_s32_t value = va_arg(args, int);
+            opium_memcpy(pos, &value, sizeof(value));
+            pos = pos + sizeof(value);
+            break;
+         }
+         case OPIUM_LOG_ARG_I64: {
+            opium_s64_t value = va_arg(args, long long);
+            opium_memcpy(pos, &value, sizeof(value));
+            pos = pos + sizeof(value);
+            break;
+         }
+         case OPIUM_LOG_ARG_F64: {
+            double value = va_arg(args, double);
+            opium_memcpy(pos, &value, sizeof(value));
+            pos = pos + sizeof(value);
+            break;
+         }
+         case OPIUM_LOG_ARG_PTR: {
+            opium_u64_t value = (uintptr_t)va_arg(args, void *);
+            opium_memcpy(pos, &value, sizeof(value));
+            pos = pos + sizeof(value);
+            break;
+         }
+         case OPIUM_LOG_ARG_STR: {
+            const char *str = va_arg(args, const char *);
+            size_t      room;
+            opium_u16_t len;
+
+            if (!str) {
+               str = "(null)";
+            }
+
+            /* Keep 8 bytes for every argument that still follows */
+            room = (size_t)(end - pos) - sizeof(len) - 8 * (site->nargs - index - 1);
+            len = opium_min(strnlen(str, OPIUM_LOG_BIN_STR_MAX), room);
+
+            opium_memcpy(pos, &len, sizeof(len));
+            pos = pos + sizeof(len);
+            opium_memcpy(pos, (void*)str, len);
+            pos = pos + len;
+            break;
+         }
+      }
+   }
+
+   va_end(args);
+
+   opium_log_bin_record_t record = {
+      .size = pos - buf,
+      .kind = OPIUM_LOG_BIN_ENTRY,
+      .nargs = site->nargs,
+      .id = id,
+   };
+   opium_memcpy(buf, &record, sizeof(record));
+
+   opium_log_async_push(async, OPIUM_LOG_DEST_BIN, buf, record.size);
+}
+
+   opium_s32_t
+opium_log_bin_init(opium_log_t *log, char *path)
+{
+   opium_log_bin_header_t header;
+   opium_fd_t             fd;
+
+   if (!opium_log_isvalid(log) || !log->async) {
+      opium_log_err(log, "Binary log requires the async log backend.\n");
+      return OPIUM_RET_ERR;
+   }
+
+   if (atomic_exchange(&opium_log_bin_enabled, 1)) {
+      opium_log_err(log, "Binary log is already enabled.\n");
+      return OPIUM_RET_ERR;
+   }
+
+   fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+   if (fd == -1) {
+      opium_log_err(log, "open(%s) failed: %s\n", path, strerror(errno));
+      atomic_store(&opium_log_bin_enabled, 0);
+      return OPIUM_RET_ERR;
+   }
+
+   opium_memzero(&header, sizeof(header));
+   opium_memcpy(header.magic, OPIUM_LOG_BIN_MAGIC, sizeof(header.magic));
+   header.version = OPIUM_LOG_BIN_VERSION;
+
+#if (OPIUM_LOG_BIN_TSC)
+   /*
+    * Calibrate the TSC against CLOCK_MONOTONIC once, so the decoder can
+    * turn ticks into wall clock time. 20ms is plenty for a few ppm.
+    */
+   struct timespec nap = { 0, 20 * 1000000 };
+   opium_u64_t     t0, t1, m0, m1;
+
+   t0 = opium_log_bin_ticks();
+   m0 = opium_log_bin_clock_ns(CLOCK_MONOTONIC);
+   nanosleep(&nap, NULL);
+   t1 = opium_log_bin_ticks();
+   m1 = opium_log_bin_clock_ns(CLOCK_MONOTONIC);
+
+   header.ticks_hz = (opium_u64_t)((long double)(t1 - t0) * 1000000000.0L / (m1 - m0));
+#else
+   header.ticks_hz = 1000000000ULL;
+#endif
+
+   header.ticks_ref = opium_log_bin_ticks();
+   header.realtime_ref = opium_log_bin_clock_ns(CLOCK_REALTIME);
+
+   if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+      opium_log_err(log, "write(%s) failed: %s\n", path, strerror(errno));
+      close(fd);
+      atomic_store(&opium_log_bin_enabled, 0);
+      return OPIUM_RET_ERR;
+   }
+
+   log->async->fds[OPIUM_LOG_DEST_BIN] = fd;
+   atomic_store_explicit(&log->async->binary, 1, memory_order_release);
+
+   return OPIUM_RET_OK;
+}
+
+/* The last producer has left: nobody reads or registers a site anymore */
+   void
+opium_log_bin_exit(void)
+{
+   opium_log_site_t *site = atomic_exchange(&opium_log_bin_registered, NULL);
+
+   while (site) {
+      opium_log_site_t *next = site->next;
+
+      site->next = NULL;
+      atomic_store_explicit(&site->id, 0, memory_order_relaxed);
+      site = next;
+   }
+
+   atomic_store(&opium_log_bin_sites, 0);
+   atomic_store(&opium_log_bin_enabled, 0);
+}
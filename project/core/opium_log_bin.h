@@ -0,0 +1,144 @@
+#ifndef OPIUM_LOG_BIN_INCLUDE_H
+#define OPIUM_LOG_BIN_INCLUDE_H
+
+#include "core/opium_core.h"
+
+#define OPIUM_LOG_BIN_MAGIC     "OPIUMLOG"
+#define OPIUM_LOG_BIN_VERSION   1
+
+/* Limits of a single call site */
+#define OPIUM_LOG_BIN_MAX_ARGS  16
+#define OPIUM_LOG_BIN_STR_MAX   256
+#define OPIUM_LOG_BIN_FMT_MAX   4096
+
+/* Site id while the first caller is still registering it */
+#define OPIUM_LOG_BIN_SITE_BUSY 0xFFFFFFFF
+
+/* Site id of a format the binary encoder cannot handle (e.g. %Lf, %n) */
+#define OPIUM_LOG_BIN_SITE_TEXT 0xFFFFFFFE
+
+/* Storage class of one argument inside an entry record */
+typedef enum {
+   OPIUM_LOG_ARG_I32 = 1,   /* int, char, short: 4 bytes */
+   OPIUM_LOG_ARG_I64,       /* long, long long, size_t: 8 bytes */
+   OPIUM_LOG_ARG_F64,       /* double: 8 bytes */
+   OPIUM_LOG_ARG_STR,       /* u16 length + bytes */
+   OPIUM_LOG_ARG_PTR,       /* void *: 8 bytes */
+} opium_log_arg_t;
+
+typedef enum {
+   OPIUM_LOG_BIN_SITE = 1,  /* Dictionary: id -> format, file, line, arg classes */
+   OPIUM_LOG_BIN_ENTRY,     /* One log call: id, timestamp, raw arguments */
+} opium_log_bin_kind_t;
+
+/*
+ * File layout:
+ *
+ *   [header][record][record]...
+ *
+ * Every record starts with opium_log_bin_record_t, 'size' covers the whole
+ * record. Site records of a format may appear after the first entries
+ * that use it (they come from different thread rings), so a decoder
+ * reads the dictionary first and renders afterwards.
+ */
+typedef struct opium_log_bin_header_s opium_log_bin_header_t;
+
+struct opium_log_bin_header_s {
+   char          magic[8];
+   opium_u32_t   version;
+   opium_u32_t   reserved;
+
+   opium_u64_t   ticks_hz;       /* Ticks per second of the entry clock */
+   opium_u64_t   ticks_ref;      /* Clock value at ... */
+   opium_u64_t   realtime_ref;   /* ... this wall clock time, in ns */
+} __attribute__((packed));
+
+typedef struct opium_log_bin_record_s opium_log_bin_record_t;
+
+struct opium_log_bin_record_s {
+   opium_u16_t   size;
+   opium_u8_t    kind;
+   opium_u8_t    nargs;
+   opium_u32_t   id;
+} __attribute__((packed));
+
+/* Site record body: line, u16 fmt_len, u16 file_len, types[nargs], fmt, file */
+/* Entry record body: u64 ticks, then every argument by its class */
+
+/*
+ * opium_log_site_t - one static instance per opium_log_bin() call site.
+ * The format is parsed once, on first use; afterwards the hot path only
+ * reads 'types'.
+ */
+
+struct opium_log_site_s {
+   const char           *format;
+   const char           *file;
+   opium_u32_t           line;
+
+   _Atomic opium_u32_t   id;
+   opium_u8_t            nargs;
+   opium_u8_t            types[OPIUM_LOG_BIN_MAX_ARGS];
+
+   opium_log_site_t     *next;       /* Registered sites, for opium_log_bin_exit() */
+};
+
+opium_s32_t opium_log_bin_init(opium_log_t *log, char *path);
+
+/* Binary log closed: sites register again into the next one */
+void opium_log_bin_exit(void);
+
+void opium_log_bin_write(opium_log_async_t *async, opium_log_site_t *site, ...);
+
+opium_s32_t opium_log_bin_parse(const char *format, opium_u8_t *types, opium_u8_t *nargs);
+
+opium_u64_t opium_log_bin_ticks(void);
+
+/*
+ * Debug level logging that costs a few ns per record in binary mode.
+ * Without binary mode it behaves exactly like opium_log_debug().
+ * The format must be a string literal.
+ */
+#define opium_log_bin(log, fmt, ...) do {                                         \
+   static opium_log_site_t opium_log_site__ =                                    \
+         { .format = (fmt), .file = __FILE__, .line = __LINE__ };                 \
+   opium_log_t *opium_log_bin_log__ = (log);                                      \
+   opium_log_async_t *opium_log_bin_async__ = opium_log_bin_log__                 \
+         ? opium_log_async_enter(opium_log_bin_log__) : NULL;                     \
+   if (opium_log_bin_async__ && !atomic_load_explicit(                            \
+            &opium_log_bin_async__->binary, memory_order_relaxed)) {              \
+      opium_log_async_leave(opium_log_bin_log__);                                 \
+      opium_log_bin_async__ = NULL;                                               \
+   }                                                                              \
+   if (opium_log_bin_async__) {                                                   \
+      opium_log_bin_write(opium_log_bin_async__, &opium_log_site__,               \
+            ##__VA_ARGS__);                                                       \
+      opium_log_async_leave(opium_log_bin_log__);                                 \
+   } else {                                                                       \
+      opium_log_debug(opium_log_bin_log__, (fmt), ##__VA_ARGS__);                 \
+   }                                                                              \
+} while (0)
+
+/*
+ * Same record for per-request and event loop paths, but only in binary
+ * mode: otherwise it is dropped, at the price of one load with logging
+ * synchronous. A text line per accept or per completion would cost more
+ * than the work it describes.
+ */
+#define opium_log_trace(log, fmt, ...) do {                                       \
+   static opium_log_site_t opium_log_site__ =                                    \
+         { .format = (fmt), .file = __FILE__, .line = __LINE__ };                 \
+   opium_log_t *opium_log_trace_log__ = (log);                                    \
+   opium_log_async_t *opium_log_trace_async__ = opium_log_trace_log__             \
+         ? opium_log_async_enter(opium_log_trace_log__) : NULL;                   \
+   if (opium_log_trace_async__) {                                                 \
+      if (atomic_load_explicit(&opium_log_trace_async__->binary,                  \
+               memory_order_relaxed)) {                                           \
+         opium_log_bin_write(opium_log_trace_async__, &opium_log_site__,          \
+               ##__VA_ARGS__);                                                    \
+      }                                                                           \
+      opium_log_async_leave(opium_log_trace_log__);                               \
+   }                                                                              \
+} while (0)
+
+#endif /* OPIUM_LOG_BIN_INCLUDE_H */
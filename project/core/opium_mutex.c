@@ -3,6 +3,9 @@
  * ERRORCHECK type is used in debug builds to detect:
  *  - Double locks by the same thread (deadlocks)
  *  - Unlocks by threads that do not own the mutex
+ *
+ * Release builds use the default (NORMAL) type: no owner bookkeeping on
+ * every lock and unlock. Hot paths should use opium_lock.h instead.
  */
 
 #include "core/opium_core.h"
@@ -20,14 +23,18 @@ opium_thread_mutex_init(opium_mutex_t *mtx, opium_log_t *log)
    }
 
    /*
-    * ERRORCHECK mutex:
+    * ERRORCHECK mutex (debug builds only):
     *   - Detects attempts by the same thread to re-lock (returns EDEADLK)
     *   - Detects unlocking by a thread that does not own the mutex (returns EPERM)
     *   - Safer for debugging and library-level locks
     */
 
    /* ATTR cleanup: Always destroy the attribute object after init attempt */
+#if defined(DEBUG)
    err = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+#else
+   err = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
+#endif
    if (err != 0) {
       opium_log_err(log, "pthread_mutexattr_settype() failed\n");
       pthread_mutexattr_destroy(&attr);
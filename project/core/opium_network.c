@@ -1,13 +1,739 @@
+/* opium_network.c
+ *
+ * Transports for opium_network_t.
+ *
+ * Kernel: every call is the syscall, accepted sockets come out
+ * non-blocking and close-on-exec in one accept4().
+ *
+ * Memory: sockets are slots of one table, a connection is two slots
+ * pointing at each other, each with the ring buffer its peer writes into.
+ * connect() completes at once by queueing the server side on the
+ * listener's backlog. One lock per instance: it exists to separate
+ * protocol cost from syscall cost, not to scale.
+ *
+ */
+
 #include "core/opium_core.h"
 
    static opium_socket_fd_t
-sys_socket(int domain, int type, int proto)
+sys_socket(void *obj, int domain, int type, int proto)
 {
+   (void)obj;
    return socket(domain, type, proto);
 }
 
+   static int
+sys_bind(void *obj, opium_socket_fd_t fd, const struct sockaddr *addr, socklen_t len)
+{
+   (void)obj;
+   return bind(fd, addr, len);
+}
+
+   static int
+sys_listen(void *obj, opium_socket_fd_t fd, int backlog)
+{
+   (void)obj;
+   return listen(fd, backlog);
+}
+
+   static opium_socket_fd_t
+sys_accept(void *obj, opium_socket_fd_t fd, struct sockaddr *addr, socklen_t *len, int flags)
+{
+   (void)obj;
+   return accept4(fd, addr, len, flags);
+}
 
+   static int
+sys_connect(void *obj, opium_socket_fd_t fd, const struct sockaddr *addr, socklen_t len)
+{
+   (void)obj;
+   return connect(fd, addr, len);
+}
+
+   static ssize_t
+sys_recv(void *obj, opium_socket_fd_t fd, void *buf, size_t len, int flags)
+{
+   (void)obj;
+   return recv(fd, buf, len, flags);
+}
+
+   static ssize_t
+sys_send(void *obj, opium_socket_fd_t fd, const void *buf, size_t len, int flags)
+{
+   (void)obj;
+   return send(fd, buf, len, flags | MSG_NOSIGNAL);
+}
+
+   static ssize_t
+sys_readv(void *obj, opium_socket_fd_t fd, const struct iovec *iov, int iovcnt)
+{
+   (void)obj;
+   return readv(fd, iov, iovcnt);
+}
+
+   static ssize_t
+sys_writev(void *obj, opium_socket_fd_t fd, const struct iovec *iov, int iovcnt)
+{
+   (void)obj;
+   return writev(fd, iov, iovcnt);
+}
+
+   static int
+sys_close(void *obj, opium_socket_fd_t fd)
+{
+   (void)obj;
+   return close(fd);
+}
 
 static const opium_network_funcs_t network_funcs = {
+   .socket  = sys_socket,
+   .bind    = sys_bind,
+   .listen  = sys_listen,
+   .accept  = sys_accept,
+   .connect = sys_connect,
+   .recv    = sys_recv,
+   .send    = sys_send,
+   .readv   = sys_readv,
+   .writev  = sys_writev,
+   .close   = sys_close,
+};
+
+/* Memory transport */
+
+typedef enum {
+   OPIUM_MEMSOCK_FREE = 0,
+   OPIUM_MEMSOCK_OPEN,
+   OPIUM_MEMSOCK_LISTEN,
+   OPIUM_MEMSOCK_CONNECTED,
+} opium_memsock_state_t;
+
+typedef struct {
+   opium_memsock_state_t    state;
+   opium_socket_fd_t        peer;       /* -1 once the peer closed */
+
+   /* What the peer sent, not read yet. head/tail only grow */
+   u_char                  *buf;
+   size_t                   head;
+   size_t                   tail;
+
+   /* Bound address, compared byte for byte by connect() */
+   struct sockaddr_storage  addr;
+   socklen_t                addrlen;
+
+   /* Listener: accepted-but-not-taken server sides */
+   opium_socket_fd_t       *backlog;
+   opium_u32_t              backlog_cap;
+   opium_u32_t              backlog_head;
+   opium_u32_t              backlog_count;
+} opium_memsock_t;
+
+typedef struct {
+   opium_amutex_t           lock;
+
+   opium_memsock_t         *socks;
+   opium_u32_t              nsocks;
+   opium_u32_t              next;       /* Where the search for a free fd starts */
+   size_t                   bufsize;
+
+   opium_log_t             *log;
+} opium_memnet_t;
+
+   static opium_memsock_t *
+mem_get(opium_memnet_t *mem, opium_socket_fd_t fd)
+{
+   if (fd < 0 || (opium_u32_t)fd >= mem->nsocks || mem->socks[fd].state == OPIUM_MEMSOCK_FREE) {
+      errno = EBADF;
+      return NULL;
+   }
+   return &mem->socks[fd];
+}
+
+/* Lock held */
+   static opium_socket_fd_t
+mem_alloc(opium_memnet_t *mem)
+{
+   /* Round robin from the last fd handed out: filling a large table stays linear */
+   for (opium_u32_t count = 0; count < mem->nsocks; count++) {
+      opium_u32_t      fd = (mem->next + count) % mem->nsocks;
+      opium_memsock_t *sock = &mem->socks[fd];
+
+      if (sock->state == OPIUM_MEMSOCK_FREE) {
+         opium_memzero(sock, sizeof(*sock));
+         sock->state = OPIUM_MEMSOCK_OPEN;
+         sock->peer = -1;
+         mem->next = (fd + 1) % mem->nsocks;
+         return (opium_socket_fd_t)fd;
+      }
+   }
+
+   errno = EMFILE;
+   return -1;
+}
+
+/* Lock held */
+   static void
+mem_release(opium_memnet_t *mem, opium_memsock_t *sock)
+{
+   if (sock->buf) {
+      opium_free(sock->buf, mem->log);
+   }
+   if (sock->backlog) {
+      opium_free(sock->backlog, mem->log);
+   }
+   opium_memzero(sock, sizeof(*sock));
+}
+
+   static opium_socket_fd_t
+mem_socket(void *obj, int domain, int type, int proto)
+{
+   opium_memnet_t   *mem = obj;
+   opium_socket_fd_t fd;
+
+   (void)domain;
+   (void)proto;
+
+   if ((type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) != SOCK_STREAM) {
+      errno = EPROTONOSUPPORT;
+      return -1;
+   }
+
+   opium_amutex_lock(&mem->lock);
+   fd = mem_alloc(mem);
+   opium_amutex_unlock(&mem->lock);
+
+   return fd;
+}
+
+   static int
+mem_bind(void *obj, opium_socket_fd_t fd, const struct sockaddr *addr, socklen_t len)
+{
+   opium_memnet_t  *mem = obj;
+   opium_memsock_t *sock;
+   int              ret = -1;
+
+   if (len > sizeof(struct sockaddr_storage)) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   opium_amutex_lock(&mem->lock);
+
+   sock = mem_get(mem, fd);
+   if (sock) {
+      for (opium_u32_t index = 0; index < mem->nsocks; index++) {
+         opium_memsock_t *other = &mem->socks[index];
+         if (other != sock && other->state != OPIUM_MEMSOCK_FREE && other->addrlen == len
+               && memcmp(&other->addr, addr, len) == 0) {
+            errno = EADDRINUSE;
+            goto done;
+         }
+      }
+
+      opium_memcpy(&sock->addr, (void*)addr, len);
+      sock->addrlen = len;
+      ret = 0;
+   }
+
+done:
+   opium_amutex_unlock(&mem->lock);
+   return ret;
+}
+
+   static int
+mem_listen(void *obj, opium_socket_fd_t fd, int backlog)
+{
+   opium_memnet_t  *mem = obj;
+   opium_memsock_t *sock;
+   int              ret = -1;
+
+   opium_amutex_lock(&mem->lock);
+
+   sock = mem_get(mem, fd);
+   if (!sock) {
+      goto done;
+   }
+
+   if (sock->state != OPIUM_MEMSOCK_OPEN || sock->addrlen == 0) {
+      errno = EINVAL;
+      goto done;
+   }
+
+   sock->backlog_cap = backlog > 0 ? (opium_u32_t)backlog : 1;
+   sock->backlog = opium_malloc(sock->backlog_cap * sizeof(opium_socket_fd_t), mem->log);
+   if (!sock->backlog) {
+      errno = ENOMEM;
+      goto done;
+   }
+
+   sock->state = OPIUM_MEMSOCK_LISTEN;
+   ret = 0;
+
+done:
+   opium_amutex_unlock(&mem->lock);
+   return ret;
+}
+
+   static int
+mem_connect(void *obj, opium_socket_fd_t fd, const struct sockaddr *addr, socklen_t len)
+{
+   opium_memnet_t   *mem = obj;
+   opium_memsock_t  *client, *server, *listener = NULL;
+   opium_socket_fd_t sfd;
+   int               ret = -1;
+
+   opium_amutex_lock(&mem->lock);
+
+   client = mem_get(mem, fd);
+   if (!client) {
+      goto done;
+   }
+
+   if (client->state != OPIUM_MEMSOCK_OPEN) {
+      errno = EISCONN;
+      goto done;
+   }
+
+   for (opium_u32_t index = 0; index < mem->nsocks; index++) {
+      opium_memsock_t *sock = &mem->socks[index];
+      if (sock->state == OPIUM_MEMSOCK_LISTEN && sock->addrlen == len
+            && memcmp(&sock->addr, addr, len) == 0) {
+         listener = sock;
+         break;
+      }
+   }
+
+   if (!listener || listener->backlog_count == listener->backlog_cap) {
+      errno = ECONNREFUSED;
+      goto done;
+   }
+
+   sfd = mem_alloc(mem);
+   if (sfd < 0) {
+      goto done;
+   }
+   server = &mem->socks[sfd];
+
+   client->buf = opium_malloc(mem->bufsize, mem->log);
+   server->buf = opium_malloc(mem->bufsize, mem->log);
+   if (!client->buf || !server->buf) {
+      if (client->buf) {
+         opium_free(client->buf, mem->log);
+         client->buf = NULL;
+      }
+      mem_release(mem, server);
+      errno = ENOMEM;
+      goto done;
+   }
+
+   client->state = server->state = OPIUM_MEMSOCK_CONNECTED;
+   client->peer = sfd;
+   server->peer = fd;
+   opium_memcpy(&server->addr, &listener->addr, listener->addrlen);
+   server->addrlen = listener->addrlen;
+
+   listener->backlog[(listener->backlog_head + listener->backlog_count) % listener->backlog_cap] = sfd;
+   listener->backlog_count++;
+   ret = 0;
+
+done:
+   opium_amutex_unlock(&mem->lock);
+   return ret;
+}
+
+   static opium_socket_fd_t
+mem_accept(void *obj, opium_socket_fd_t fd, struct sockaddr *addr, socklen_t *len, int flags)
+{
+   opium_memnet_t   *mem = obj;
+   opium_memsock_t  *listener;
+   opium_socket_fd_t sfd = -1;
+
+   (void)flags;
+
+   opium_amutex_lock(&mem->lock);
+
+   listener = mem_get(mem, fd);
+   if (!listener) {
+      goto done;
+   }
+
+   if (listener->state != OPIUM_MEMSOCK_LISTEN) {
+      errno = EINVAL;
+      goto done;
+   }
+
+   if (listener->backlog_count == 0) {
+      errno = EAGAIN;
+      goto done;
+   }
+
+   sfd = listener->backlog[listener->backlog_head];
+   listener->backlog_head = (listener->backlog_head + 1) % listener->backlog_cap;
+   listener->backlog_count--;
+
+   /* The client has no address of its own: report the listener's */
+   if (addr && len) {
+      socklen_t copy = opium_min(*len, listener->addrlen);
+      opium_memcpy(addr, &listener->addr, copy);
+      *len = listener->addrlen;
+   }
+
+done:
+   opium_amutex_unlock(&mem->lock);
+   return sfd;
+}
+
+/* Lock held. Copies out of 'sock' ring, wrapping */
+   static size_t
+mem_ring_read(opium_memnet_t *mem, opium_memsock_t *sock, u_char *dst, size_t len)
+{
+   size_t avail = sock->tail - sock->head;
+   size_t count = opium_min(len, avail);
+   size_t off = sock->head % mem->bufsize;
+   size_t first = opium_min(count, mem->bufsize - off);
+
+   opium_memcpy(dst, sock->buf + off, first);
+   opium_memcpy(dst + first, sock->buf, count - first);
+   sock->head += count;
+
+   return count;
+}
+
+/* Lock held */
+   static size_t
+mem_ring_write(opium_memnet_t *mem, opium_memsock_t *sock, const u_char *src, size_t len)
+{
+   size_t space = mem->bufsize - (sock->tail - sock->head);
+   size_t count = opium_min(len, space);
+   size_t off = sock->tail % mem->bufsize;
+   size_t first = opium_min(count, mem->bufsize - off);
 
+   opium_memcpy(sock->buf + off, (u_char*)src, first);
+   opium_memcpy(sock->buf, (u_char*)src + first, count - first);
+   sock->tail += count;
+
+   return count;
+}
+
+   static ssize_t
+mem_readv(void *obj, opium_socket_fd_t fd, const struct iovec *iov, int iovcnt)
+{
+   opium_memnet_t  *mem = obj;
+   opium_memsock_t *sock;
+   ssize_t          total = -1;
+
+   opium_amutex_lock(&mem->lock);
+
+   sock = mem_get(mem, fd);
+   if (!sock) {
+      goto done;
+   }
+
+   if (sock->state != OPIUM_MEMSOCK_CONNECTED) {
+      errno = ENOTCONN;
+      goto done;
+   }
+
+   if (sock->tail == sock->head) {
+      /* Drained and the peer is gone: EOF */
+      if (sock->peer < 0) {
+         total = 0;
+      } else {
+         errno = EAGAIN;
+      }
+      goto done;
+   }
+
+   total = 0;
+   for (int index = 0; index < iovcnt && sock->tail != sock->head; index++) {
+      total += (ssize_t)mem_ring_read(mem, sock, iov[index].iov_base, iov[index].iov_len);
+   }
+
+done:
+   opium_amutex_unlock(&mem->lock);
+   return total;
+}
+
+   static ssize_t
+mem_writev(void *obj, opium_socket_fd_t fd, const struct iovec *iov, int iovcnt)
+{
+   opium_memnet_t  *mem = obj;
+   opium_memsock_t *sock, *peer;
+   ssize_t          total = -1;
+
+   opium_amutex_lock(&mem->lock);
+
+   sock = mem_get(mem, fd);
+   if (!sock) {
+      goto done;
+   }
+
+   if (sock->state != OPIUM_MEMSOCK_CONNECTED) {
+      errno = ENOTCONN;
+      goto done;
+   }
+
+   if (sock->peer < 0) {
+      errno = EPIPE;
+      goto done;
+   }
+
+   peer = &mem->socks[sock->peer];
+   if (peer->tail - peer->head == mem->bufsize) {
+      errno = EAGAIN;
+      goto done;
+   }
+
+   total = 0;
+   for (int index = 0; index < iovcnt; index++) {
+      size_t count = mem_ring_write(mem, peer, iov[index].iov_base, iov[index].iov_len);
+      total += (ssize_t)count;
+      if (count < iov[index].iov_len) {
+         break;
+      }
+   }
+
+done:
+   opium_amutex_unlock(&mem->lock);
+   return total;
+}
+
+   static ssize_t
+mem_recv(void *obj, opium_socket_fd_t fd, void *buf, size_t len, int flags)
+{
+   struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+   (void)flags;
+   return mem_readv(obj, fd, &iov, 1);
+}
+
+   static ssize_t
+mem_send(void *obj, opium_socket_fd_t fd, const void *buf, size_t len, int flags)
+{
+   struct iovec iov = { .iov_base = (void*)buf, .iov_len = len };
+
+   (void)flags;
+   return mem_writev(obj, fd, &iov, 1);
+}
+
+   static int
+mem_close(void *obj, opium_socket_fd_t fd)
+{
+   opium_memnet_t  *mem = obj;
+   opium_memsock_t *sock;
+
+   opium_amutex_lock(&mem->lock);
+
+   sock = mem_get(mem, fd);
+   if (!sock) {
+      opium_amutex_unlock(&mem->lock);
+      return -1;
+   }
+
+   /* Connections nobody accepted are reset */
+   if (sock->state == OPIUM_MEMSOCK_LISTEN) {
+      while (sock->backlog_count > 0) {
+         opium_socket_fd_t sfd = sock->backlog[sock->backlog_head];
+         opium_memsock_t  *server = &mem->socks[sfd];
+
+         if (server->peer >= 0) {
+            mem->socks[server->peer].peer = -1;
+         }
+         mem_release(mem, server);
+
+         sock->backlog_head = (sock->backlog_head + 1) % sock->backlog_cap;
+         sock->backlog_count--;
+      }
+   }
+
+   /* The peer keeps what it has not read yet and then sees EOF */
+   if (sock->state == OPIUM_MEMSOCK_CONNECTED && sock->peer >= 0) {
+      mem->socks[sock->peer].peer = -1;
+   }
+
+   mem_release(mem, sock);
+
+   opium_amutex_unlock(&mem->lock);
+   return 0;
+}
+
+static const opium_network_funcs_t network_memory_funcs = {
+   .socket  = mem_socket,
+   .bind    = mem_bind,
+   .listen  = mem_listen,
+   .accept  = mem_accept,
+   .connect = mem_connect,
+   .recv    = mem_recv,
+   .send    = mem_send,
+   .readv   = mem_readv,
+   .writev  = mem_writev,
+   .close   = mem_close,
 };
+
+/* Transports */
+
+   void
+opium_network_kernel(opium_network_t *net)
+{
+   net->funcs = network_funcs;
+   net->obj = NULL;
+}
+
+   opium_s32_t
+opium_network_memory_init(opium_network_t *net, opium_u32_t nsockets, size_t bufsize, opium_log_t *log)
+{
+   opium_memnet_t *mem;
+
+   if (nsockets < 2 || bufsize < 1) {
+      opium_log_err(log, "Invalid memory transport arguments\n");
+      return OPIUM_RET_ERR;
+   }
+
+   mem = opium_calloc(sizeof(opium_memnet_t), log);
+   if (!mem) {
+      opium_log_err(log, "Failed to allocate memory transport\n");
+      return OPIUM_RET_ERR;
+   }
+
+   mem->socks = opium_calloc(nsockets * sizeof(opium_memsock_t), log);
+   if (!mem->socks) {
+      opium_log_err(log, "Failed to allocate memory transport sockets\n");
+      opium_free(mem, log);
+      return OPIUM_RET_ERR;
+   }
+
+   opium_amutex_init(&mem->lock);
+   mem->nsocks = nsockets;
+   mem->bufsize = bufsize;
+   mem->log = log;
+
+   net->funcs = network_memory_funcs;
+   net->obj = mem;
+
+   return OPIUM_RET_OK;
+}
+
+/* Every socket still open goes away with it */
+   void
+opium_network_memory_exit(opium_network_t *net)
+{
+   opium_memnet_t *mem = net->obj;
+
+   if (!mem) {
+      return;
+   }
+
+   for (opium_u32_t fd = 0; fd < mem->nsocks; fd++) {
+      if (mem->socks[fd].state != OPIUM_MEMSOCK_FREE) {
+         mem_release(mem, &mem->socks[fd]);
+      }
+   }
+
+   opium_free(mem->socks, mem->log);
+   opium_free(mem, mem->log);
+   net->obj = NULL;
+}
+
+/* Calls */
+
+   opium_socket_t
+opium_net_socket(opium_network_t *net, opium_family family, opium_s32_t type, opium_s32_t proto)
+{
+   opium_socket_t sock;
+
+   sock.fd = net->funcs.socket(net->obj, (int)family.family, type, proto);
+   return sock;
+}
+
+   opium_s32_t
+opium_net_bind(opium_network_t *net, opium_socket_t sock, const struct sockaddr *addr, socklen_t len)
+{
+   return net->funcs.bind(net->obj, sock.fd, addr, len) == 0 ? OPIUM_RET_OK : OPIUM_RET_ERR;
+}
+
+   opium_s32_t
+opium_net_listen(opium_network_t *net, opium_socket_t sock, opium_s32_t backlog)
+{
+   return net->funcs.listen(net->obj, sock.fd, backlog) == 0 ? OPIUM_RET_OK : OPIUM_RET_ERR;
+}
+
+   opium_socket_t
+opium_net_accept(opium_network_t *net, opium_socket_t sock, struct sockaddr *addr, socklen_t *len)
+{
+   opium_socket_t client;
+
+   client.fd = net->funcs.accept(net->obj, sock.fd, addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+   return client;
+}
+
+   opium_s32_t
+opium_net_connect(opium_network_t *net, opium_socket_t sock, const struct sockaddr *addr, socklen_t len)
+{
+   return net->funcs.connect(net->obj, sock.fd, addr, len) == 0 ? OPIUM_RET_OK : OPIUM_RET_ERR;
+}
+
+   ssize_t
+opium_net_recv(opium_network_t *net, opium_socket_t sock, void *buf, size_t len)
+{
+   return net->funcs.recv(net->obj, sock.fd, buf, len, 0);
+}
+
+   ssize_t
+opium_net_send(opium_network_t *net, opium_socket_t sock, const void *buf, size_t len)
+{
+   return net->funcs.send(net->obj, sock.fd, buf, len, 0);
+}
+
+   ssize_t
+opium_net_readv(opium_network_t *net, opium_socket_t sock, const struct iovec *iov, opium_s32_t iovcnt)
+{
+   return net->funcs.readv(net->obj, sock.fd, iov, iovcnt);
+}
+
+   ssize_t
+opium_net_writev(opium_network_t *net, opium_socket_t sock, const struct iovec *iov, opium_s32_t iovcnt)
+{
+   return net->funcs.writev(net->obj, sock.fd, iov, iovcnt);
+}
+
+   void
+opium_net_close(opium_network_t *net, opium_socket_t sock)
+{
+   if (sock.fd >= 0) {
+      net->funcs.close(net->obj, sock.fd);
+   }
+}
+
+   socklen_t
+opium_net_unix_addr(struct sockaddr_un *addr, const char *path)
+{
+   size_t len = strlen(path);
+
+   opium_memzero(addr, sizeof(*addr));
+   addr->sun_family = AF_UNIX;
+
+   if (len == 0 || len >= sizeof(addr->sun_path)) {
+      return 0;
+   }
+
+   opium_memcpy(addr->sun_path, (void*)path, len);
+
+   /* Abstract: leading NUL, the name is exactly 'len' bytes, no terminator */
+   if (path[0] == '@') {
+      addr->sun_path[0] = '\0';
+      return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+   }
+
+   return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len + 1);
+}
+
+   opium_s32_t
+opium_net_peer_cred(opium_socket_t sock, struct ucred *cred)
+{
+   socklen_t len = sizeof(*cred);
+
+   if (getsockopt(sock.fd, SOL_SOCKET, SO_PEERCRED, cred, &len) < 0) {
+      return OPIUM_RET_ERR;
+   }
+
+   return OPIUM_RET_OK;
+}
@@ -3,15 +3,38 @@
 
 #include "core/opium_core.h"
 
+/*
+ * Transport behind every socket call. The kernel table is a thin shim over
+ * the syscalls; the memory table keeps connections as in-process ring
+ * buffers, so the protocol stack can be driven with no kernel networking
+ * at all. Either way the calls behave like their syscalls on non-blocking
+ * sockets: -1 and errno on failure, EAGAIN when nothing is ready.
+ */
+
+/* Memory transport: sockets per instance and bytes each direction may buffer */
+#define OPIUM_NET_MEMORY_SOCKETS   1024
+#define OPIUM_NET_MEMORY_BUFSIZE   (64 * 1024)
+
 typedef struct opium_network_funcs_s opium_network_funcs_t; 
 struct opium_network_funcs_s {
+   opium_socket_fd_t (*socket)(void *obj, int domain, int type, int proto);
+   int               (*bind)(void *obj, opium_socket_fd_t fd, const struct sockaddr *addr, socklen_t len);
+   int               (*listen)(void *obj, opium_socket_fd_t fd, int backlog);
+   opium_socket_fd_t (*accept)(void *obj, opium_socket_fd_t fd, struct sockaddr *addr, socklen_t *len, int flags);
+   int               (*connect)(void *obj, opium_socket_fd_t fd, const struct sockaddr *addr, socklen_t len);
 
+   ssize_t           (*recv)(void *obj, opium_socket_fd_t fd, void *buf, size_t len, int flags);
+   ssize_t           (*send)(void *obj, opium_socket_fd_t fd, const void *buf, size_t len, int flags);
+   ssize_t           (*readv)(void *obj, opium_socket_fd_t fd, const struct iovec *iov, int iovcnt);
+   ssize_t           (*writev)(void *obj, opium_socket_fd_t fd, const struct iovec *iov, int iovcnt);
+
+   int               (*close)(void *obj, opium_socket_fd_t fd);
 };
 
 typedef struct opium_network_s opium_network_t;
 struct opium_network_s {
    opium_network_funcs_t  funcs;
-   void                  *obj;
+   void                  *obj;      /* Transport state, NULL for the kernel */
 };
 
 typedef enum {
@@ -56,6 +79,33 @@ struct opium_socket_s {
    opium_socket_fd_t fd;
 };
 
-opium_socket_t opium_net_socket(opium_network_t ns, opium_family family, opium_s32_t type, opium_s32_t proto);
+/* Transports */
+void opium_network_kernel(opium_network_t *net);
+opium_s32_t opium_network_memory_init(opium_network_t *net, opium_u32_t nsockets, size_t bufsize, opium_log_t *log);
+void opium_network_memory_exit(opium_network_t *net);
+
+/* Calls through the table. fd is -1 in the returned socket on failure */
+opium_socket_t opium_net_socket(opium_network_t *net, opium_family family, opium_s32_t type, opium_s32_t proto);
+opium_s32_t opium_net_bind(opium_network_t *net, opium_socket_t sock, const struct sockaddr *addr, socklen_t len);
+opium_s32_t opium_net_listen(opium_network_t *net, opium_socket_t sock, opium_s32_t backlog);
+opium_socket_t opium_net_accept(opium_network_t *net, opium_socket_t sock, struct sockaddr *addr, socklen_t *len);
+opium_s32_t opium_net_connect(opium_network_t *net, opium_socket_t sock, const struct sockaddr *addr, socklen_t len);
+
+ssize_t opium_net_recv(opium_network_t *net, opium_socket_t sock, void *buf, size_t len);
+ssize_t opium_net_send(opium_network_t *net, opium_socket_t sock, const void *buf, size_t len);
+ssize_t opium_net_readv(opium_network_t *net, opium_socket_t sock, const struct iovec *iov, opium_s32_t iovcnt);
+ssize_t opium_net_writev(opium_network_t *net, opium_socket_t sock, const struct iovec *iov, opium_s32_t iovcnt);
+
+void opium_net_close(opium_network_t *net, opium_socket_t sock);
+
+/*
+ * AF_UNIX listeners go through the same calls with this address. A
+ * leading '@' selects the abstract namespace. Returns the length to
+ * bind/connect with, 0 when the path does not fit.
+ */
+socklen_t opium_net_unix_addr(struct sockaddr_un *addr, const char *path);
+
+/* Who connected to an AF_UNIX socket (kernel transport only) */
+opium_s32_t opium_net_peer_cred(opium_socket_t sock, struct ucred *cred);
 
 #endif /* OPIUM_NETWORK_INCLUDE_H */
@@ -0,0 +1,125 @@
+/* opium_server.c
+ *
+ * A listener feeding the connection pool.
+ *
+ */
+
+#include "core/opium_core.h"
+
+   void
+opium_server_conf_default(opium_server_conf_t *conf)
+{
+   conf->connections = OPIUM_SERVER_CONNECTIONS;
+   conf->backlog = OPIUM_SERVER_BACKLOG;
+}
+
+   opium_s32_t
+opium_server_init(opium_server_t *server, opium_server_conf_t *conf, opium_network_t *net,
+      const struct sockaddr *addr, socklen_t len, opium_log_t *log)
+{
+   opium_family family = { .family = addr->sa_family };
+
+   opium_memzero(server, sizeof(*server));
+   server->net = net;
+   server->log = log;
+
+   /* Everything the configuration allows, allocated before the first client */
+   if (opium_conn_pool_init(&server->conns, conf->connections, log) != OPIUM_RET_OK) {
+      return OPIUM_RET_ERR;
+   }
+
+   server->listening = opium_net_socket(net, family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (server->listening.fd < 0) {
+      opium_log_err(log, "Failed to create listener: %s\n", strerror(errno));
+      goto failed;
+   }
+
+   if (opium_net_bind(net, server->listening, addr, len) != OPIUM_RET_OK) {
+      opium_log_err(log, "Failed to bind listener: %s\n", strerror(errno));
+      goto failed;
+   }
+
+   if (opium_net_listen(net, server->listening, conf->backlog) != OPIUM_RET_OK) {
+      opium_log_err(log, "Failed to listen: %s\n", strerror(errno));
+      goto failed;
+   }
+
+   return OPIUM_RET_OK;
+
+failed:
+   opium_net_close(net, server->listening);
+   opium_conn_pool_exit(&server->conns);
+   return OPIUM_RET_ERR;
+}
+
+   void
+opium_server_exit(opium_server_t *server)
+{
+   opium_conn_pool_t *pool = &server->conns;
+
+   for (opium_u32_t index = 0; index < pool->capacity; index++) {
+      opium_connection_t *conn = &pool->conns[index];
+      if (conn->used) {
+         opium_server_close(server, conn);
+      }
+   }
+
+   opium_net_close(server->net, server->listening);
+   server->listening.fd = -1;
+
+   opium_conn_pool_exit(pool);
+}
+
+   opium_s32_t
+opium_server_accept(opium_server_t *server, opium_s32_t budget)
+{
+   struct sockaddr_storage addr;
+   socklen_t               len;
+   opium_socket_t          client;
+   opium_connection_t     *conn;
+   opium_s32_t             accepted = 0;
+
+   while (accepted < budget) {
+      len = sizeof(addr);
+      client = opium_net_accept(server->net, server->listening, (struct sockaddr*)&addr, &len);
+      if (client.fd < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+         }
+         /* The client gave up before we got to it */
+         if (errno == ECONNABORTED || errno == EPROTO || errno == EINTR) {
+            continue;
+         }
+         opium_log_err(server->log, "Accept failed: %s\n", strerror(errno));
+         return accepted > 0 ? accepted : -1;
+      }
+
+      conn = opium_conn_get(&server->conns, client.fd, (struct sockaddr*)&addr, len);
+      if (!conn) {
+         opium_log_trace(server->log, "Refused fd %d, %u connections in use\n",
+               client.fd, server->conns.used);
+         /* Closing beats leaving it in the backlog to retry forever */
+         opium_net_close(server->net, client);
+         server->nrefused++;
+         continue;
+      }
+
+      opium_log_trace(server->log, "Accepted fd %d as connection %u\n",
+            client.fd, opium_conn_handle_index(conn->handle));
+      server->naccepted++;
+      accepted++;
+   }
+
+   return accepted;
+}
+
+   void
+opium_server_close(opium_server_t *server, opium_connection_t *conn)
+{
+   opium_socket_t sock = { .fd = conn->fd };
+
+   opium_log_trace(server->log, "Closed connection %u, fd %d\n",
+         opium_conn_handle_index(conn->handle), conn->fd);
+   opium_net_close(server->net, sock);
+   opium_conn_free(&server->conns, conn);
+}
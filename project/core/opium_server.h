@@ -1,13 +1,50 @@
 #ifndef OPIUM_SERVER_INCLUDE_H
 #define OPIUM_SERVER_INCLUDE_H
 
+#include "core/opium_core.h"
+
 typedef enum {
    OPIUM_SERVER_STATUS_NO,
    OPIUM_SERVER_STATUS_OK,
 } OPIUM_SERVER_STATUS;
 
+/* Defaults of opium_server_conf_t */
+#define OPIUM_SERVER_CONNECTIONS   1024
+#define OPIUM_SERVER_BACKLOG       511
+
+typedef struct {
+   /* Connection pool capacity: the most clients served at once */
+   opium_u32_t       connections;
+   opium_s32_t       backlog;
+} opium_server_conf_t;
+
+/*
+ * One listening socket and the connections accepted from it. Every
+ * connection comes from the pool sized by the configuration, a client
+ * arriving while the pool is full is accepted and closed at once.
+ * Loop thread only.
+ */
 struct opium_server_s {
+   opium_network_t   *net;
+   opium_socket_t     listening;
+   opium_conn_pool_t  conns;
+
+   /* Statistics */
+   opium_u64_t        naccepted;
+   opium_u64_t        nrefused;   /* Pool was full */
 
+   opium_log_t       *log;
 };
 
+void opium_server_conf_default(opium_server_conf_t *conf);
+
+opium_s32_t opium_server_init(opium_server_t *server, opium_server_conf_t *conf, opium_network_t *net,
+      const struct sockaddr *addr, socklen_t len, opium_log_t *log);
+/* Closes every connection still open */
+void opium_server_exit(opium_server_t *server);
+
+/* Accepts up to 'budget' clients. How many were taken, -1 on a listener error */
+opium_s32_t opium_server_accept(opium_server_t *server, opium_s32_t budget);
+void opium_server_close(opium_server_t *server, opium_connection_t *conn);
+
 #endif /* OPIUM_SERVER_INCLUDE_H */
@@ -195,7 +195,7 @@ opium_slab_init(opium_slab_t *slab, size_t item_size, opium_log_t *log)
 
    slab->log = log;
 
-   opium_log_debug(log, 
+   opium_log_bin(log,
          "Slab initialization: item_size: %zu, item_count: %zu data_offset: %zu, page_size: %zu\n", 
          slab->item_size, slab->item_count, data_offset, slab->page_size);
 
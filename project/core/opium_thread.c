@@ -67,3 +67,31 @@ opium_thread_exit(opium_thread_t *thread, opium_log_t *log)
 
    return OPIUM_RET_OK;
 }
+
+/*
+ * Pin the thread to the CPU stored in thread->core. A worker that stays on
+ * one core keeps its caches warm and never competes with its siblings for
+ * the same run queue.
+ */
+   opium_s32_t
+opium_thread_affinity(opium_thread_t *thread, opium_log_t *log)
+{
+   cpu_set_t   set;
+   opium_err_t err;
+
+   if (thread->core >= CPU_SETSIZE) {
+      opium_log_err(log, "Core %u is out of the cpu set range\n", thread->core);
+      return OPIUM_RET_ERR;
+   }
+
+   CPU_ZERO(&set);
+   CPU_SET(thread->core, &set);
+
+   err = pthread_setaffinity_np(thread->tid, sizeof(set), &set);
+   if (err != 0) {
+      opium_log_err(log, "pthread_setaffinity_np(core %u) failed: %s\n", thread->core, strerror(err));
+      return OPIUM_RET_ERR;
+   }
+
+   return OPIUM_RET_OK;
+}
@@ -30,5 +30,6 @@ struct opium_thread_s {
 
 opium_s32_t opium_thread_init(opium_thread_t *thread, opium_thread_cb cb, void *ctx, opium_log_t *log);
 opium_s32_t opium_thread_exit(opium_thread_t *thread, opium_log_t *log);
+opium_s32_t opium_thread_affinity(opium_thread_t *thread, opium_log_t *log);
 
 #endif /* OPIUM_THREAD_INCLUDE_H */
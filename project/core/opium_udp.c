@@ -0,0 +1,480 @@
+/* opium_udp.c
+ *
+ * Batched datagram service on recvmmsg(2) and sendmmsg(2).
+ *
+ * Slot i owns slots[i], rx[i] and its buffer for the lifetime of the
+ * listener. A batch fills slots 0..n-1, replies are packed to the front
+ * of tx so the single sendmmsg() covers exactly the answered ones. Under
+ * GSO a tx entry carries a run of replies, one iovec each.
+ *
+ */
+
+#include "core/opium_core.h"
+
+   opium_s32_t
+opium_udp_init(opium_udp_t *udp, const struct sockaddr *addr, socklen_t addrlen,
+      opium_u32_t batch, opium_u32_t flags, opium_udp_handler_pt handler, void *data,
+      opium_log_t *log)
+{
+   int on = 1, off = 0;
+
+   opium_memzero(udp, sizeof(*udp));
+   udp->fd = -1;
+   udp->log = log;
+
+   if (batch < 1 || batch > OPIUM_UDP_BATCH_MAX || !handler) {
+      opium_log_err(log, "Invalid UDP listener arguments (batch %u)\n", batch);
+      return OPIUM_RET_ERR;
+   }
+
+   udp->batch = batch;
+   udp->handler = handler;
+   udp->data = data;
+
+   udp->fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (udp->fd < 0) {
+      opium_log_err(log, "UDP socket() failed: %s\n", strerror(errno));
+      goto failed;
+   }
+
+   /* Offloads the kernel refuses are dropped, the plain path still works */
+   if ((flags & OPIUM_UDP_GRO) && setsockopt(udp->fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+      opium_log_err(log, "UDP_GRO not available: %s\n", strerror(errno));
+      flags &= ~OPIUM_UDP_GRO;
+   }
+   if ((flags & OPIUM_UDP_GSO) && setsockopt(udp->fd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) < 0) {
+      opium_log_err(log, "UDP_SEGMENT not available: %s\n", strerror(errno));
+      flags &= ~OPIUM_UDP_GSO;
+   }
+   udp->flags = flags;
+
+   udp->bufsize = (flags & OPIUM_UDP_GRO) ? OPIUM_UDP_GRO_BUFSIZE : OPIUM_UDP_BUFSIZE;
+   udp->tx_max = (flags & OPIUM_UDP_GRO) ? batch * OPIUM_UDP_GSO_SEGS : batch;
+
+   if (opium_slab_init(&udp->slab, udp->bufsize, log) != OPIUM_RET_OK) {
+      opium_log_err(log, "Failed to init UDP buffer slab\n");
+      goto failed;
+   }
+
+   udp->slots = opium_calloc(batch * sizeof(opium_udp_slot_t), log);
+   udp->rx = opium_calloc(batch * sizeof(struct mmsghdr), log);
+   udp->rx_iov = opium_calloc(batch * sizeof(struct iovec), log);
+   udp->tx = opium_calloc(udp->tx_max * sizeof(struct mmsghdr), log);
+   udp->tx_iov = opium_calloc(udp->tx_max * sizeof(struct iovec), log);
+   udp->tx_control = opium_calloc(udp->tx_max * sizeof(opium_udp_control_t), log);
+   if (!udp->slots || !udp->rx || !udp->rx_iov || !udp->tx || !udp->tx_iov || !udp->tx_control) {
+      opium_log_err(log, "Failed to allocate UDP message vectors\n");
+      goto failed;
+   }
+
+   for (opium_u32_t index = 0; index < batch; index++) {
+      opium_udp_slot_t *slot = &udp->slots[index];
+      struct msghdr    *hdr = &udp->rx[index].msg_hdr;
+
+      slot->buf = opium_slab_alloc(&udp->slab);
+      if (!slot->buf) {
+         opium_log_err(log, "Failed to allocate UDP buffer\n");
+         goto failed;
+      }
+
+      udp->rx_iov[index].iov_base = slot->buf;
+      udp->rx_iov[index].iov_len = udp->bufsize;
+
+      hdr->msg_iov = &udp->rx_iov[index];
+      hdr->msg_iovlen = 1;
+      hdr->msg_name = &slot->addr;
+   }
+
+   if (bind(udp->fd, addr, addrlen) < 0) {
+      opium_log_err(log, "UDP bind() failed: %s\n", strerror(errno));
+      goto failed;
+   }
+
+   return OPIUM_RET_OK;
+
+failed:
+   opium_udp_exit(udp);
+   return OPIUM_RET_ERR;
+}
+
+   void
+opium_udp_exit(opium_udp_t *udp)
+{
+   if (udp->ev) {
+      opium_event_del(udp->ev);
+      udp->ev = NULL;
+   }
+
+   if (udp->fd >= 0) {
+      close(udp->fd);
+      udp->fd = -1;
+   }
+
+   if (udp->slots) {
+      for (opium_u32_t index = 0; index < udp->batch; index++) {
+         if (udp->slots[index].buf) {
+            opium_slab_free(&udp->slab, udp->slots[index].buf);
+         }
+      }
+      opium_free(udp->slots, udp->log);
+      udp->slots = NULL;
+   }
+
+   if (udp->rx) {
+      opium_free(udp->rx, udp->log);
+      udp->rx = NULL;
+   }
+   if (udp->rx_iov) {
+      opium_free(udp->rx_iov, udp->log);
+      udp->rx_iov = NULL;
+   }
+   if (udp->tx) {
+      opium_free(udp->tx, udp->log);
+      udp->tx = NULL;
+   }
+   if (udp->tx_iov) {
+      opium_free(udp->tx_iov, udp->log);
+      udp->tx_iov = NULL;
+   }
+   if (udp->tx_control) {
+      opium_free(udp->tx_control, udp->log);
+      udp->tx_control = NULL;
+   }
+
+   if (udp->bufsize > 0) {
+      opium_slab_exit(&udp->slab);
+      udp->bufsize = 0;
+   }
+   udp->batch = 0;
+}
+
+/* Segment size of a GRO super-packet, 0 for a plain datagram */
+   static size_t
+opium_udp_gro_size(struct msghdr *hdr)
+{
+   struct cmsghdr *cmsg;
+   int             size;
+
+   for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+         opium_memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+         return size > 0 ? (size_t)size : 0;
+      }
+   }
+
+   return 0;
+}
+
+   static void
+opium_udp_segment(opium_udp_t *udp, struct msghdr *hdr, opium_u32_t index, size_t segment)
+{
+   opium_udp_control_t *control = &udp->tx_control[index];
+   struct cmsghdr      *cmsg;
+   opium_u16_t          size = (opium_u16_t)segment;
+
+   hdr->msg_control = control->buf;
+   hdr->msg_controllen = sizeof(control->buf);
+
+   cmsg = CMSG_FIRSTHDR(hdr);
+   cmsg->cmsg_level = SOL_UDP;
+   cmsg->cmsg_type = UDP_SEGMENT;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(size));
+   opium_memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+}
+
+   static int
+opium_udp_same_peer(struct msghdr *hdr, struct sockaddr_storage *addr, socklen_t addrlen)
+{
+   return hdr->msg_name == (void*)addr
+      || (hdr->msg_namelen == addrlen && memcmp(hdr->msg_name, addr, addrlen) == 0);
+}
+
+/*
+ * A full send buffer drops the rest, as UDP would anyway. Any other error
+ * belongs to the entry sendmmsg() stopped at (an unreachable peer, a
+ * refused address): only that one is dropped, the batch goes on after it.
+ */
+   static void
+opium_udp_flush(opium_udp_t *udp, opium_u32_t count)
+{
+   int sent;
+
+   for (opium_u32_t done = 0; done < count; done += (opium_u32_t)sent) {
+      sent = sendmmsg(udp->fd, udp->tx + done, count - done, MSG_DONTWAIT);
+      if (sent < 0 && errno == EINTR) {
+         sent = 0;
+         continue;
+      }
+
+      if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+         udp->ndropped += udp->tx[done].msg_hdr.msg_iovlen;
+         sent = 1;
+         continue;
+      }
+
+      if (sent <= 0) {
+         for (opium_u32_t index = done; index < count; index++) {
+            udp->ndropped += udp->tx[index].msg_hdr.msg_iovlen;
+         }
+         return;
+      }
+
+      for (int index = 0; index < sent; index++) {
+         struct msghdr *hdr = &udp->tx[done + index].msg_hdr;
+         udp->nsent += hdr->msg_iovlen;
+         if (hdr->msg_iovlen > 1) {
+            udp->ngso++;
+         }
+      }
+   }
+}
+
+   opium_s32_t
+opium_udp_process(opium_udp_t *udp)
+{
+   opium_udp_msg_t  msg;
+   struct msghdr   *group = NULL;
+   opium_u32_t      group_index = 0;
+   size_t           group_seg = 0, group_bytes = 0;
+   opium_u32_t      ntx = 0, niov = 0;
+   opium_u32_t      handled = 0;
+   int              gro = (udp->flags & OPIUM_UDP_GRO) != 0;
+   int              gso = (udp->flags & OPIUM_UDP_GSO) != 0;
+   int              nrx;
+
+   /* msg_namelen and msg_controllen are in/out: reset before every call */
+   for (opium_u32_t index = 0; index < udp->batch; index++) {
+      struct msghdr *hdr = &udp->rx[index].msg_hdr;
+
+      hdr->msg_namelen = sizeof(struct sockaddr_storage);
+      if (gro) {
+         hdr->msg_control = udp->slots[index].control.buf;
+         hdr->msg_controllen = sizeof(udp->slots[index].control.buf);
+      }
+   }
+
+   nrx = recvmmsg(udp->fd, udp->rx, udp->batch, MSG_DONTWAIT, NULL);
+   if (nrx < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+         return 0;
+      }
+      opium_log_err(udp->log, "recvmmsg() failed: %s\n", strerror(errno));
+      return OPIUM_RET_ERR;
+   }
+
+   udp->nbatches++;
+
+   for (int index = 0; index < nrx; index++) {
+      opium_udp_slot_t *slot = &udp->slots[index];
+      struct msghdr    *rxhdr = &udp->rx[index].msg_hdr;
+      size_t            len = udp->rx[index].msg_len;
+      size_t            seg = gro ? opium_udp_gro_size(rxhdr) : 0;
+
+      if (seg == 0 || seg >= len) {
+         seg = len;
+      } else {
+         udp->nsuper++;
+      }
+
+      msg.flags = (opium_u32_t)rxhdr->msg_flags;
+      msg.addr = &slot->addr;
+      msg.addrlen = rxhdr->msg_namelen;
+      opium_net_ip_port((struct sockaddr*)&slot->addr, &msg.peer);
+
+      /* An empty datagram is still one message */
+      size_t off = 0;
+      do {
+         ssize_t reply;
+
+         msg.buf = slot->buf + off;
+         msg.len = opium_min(seg, len - off);
+         /* Inside a super-packet a reply may not spill into the next segment */
+         msg.cap = off + msg.len < len ? msg.len : udp->bufsize - off;
+
+         handled++;
+         reply = udp->handler(udp, &msg);
+         if (reply <= 0) {
+            continue;
+         }
+         reply = (ssize_t)opium_min((size_t)reply, msg.cap);
+
+         if (niov == udp->tx_max) {
+            opium_udp_flush(udp, ntx);
+            ntx = niov = 0;
+            group = NULL;
+         }
+
+         udp->tx_iov[niov].iov_base = msg.buf;
+         udp->tx_iov[niov].iov_len = (size_t)reply;
+
+         /*
+          * Same peer, same size (the last one may be shorter), within the
+          * segment and byte limits: ride along in the open GSO send.
+          */
+         if (gso && group && opium_udp_same_peer(group, &slot->addr, msg.addrlen)
+               && group->msg_iovlen < OPIUM_UDP_GSO_SEGS
+               && (size_t)reply <= group_seg
+               && group_bytes + (size_t)reply <= OPIUM_UDP_GSO_MAX) {
+            if (group->msg_iovlen == 1) {
+               opium_udp_segment(udp, group, group_index, group_seg);
+            }
+            group->msg_iovlen++;
+            group_bytes += (size_t)reply;
+            if ((size_t)reply < group_seg) {
+               group = NULL;
+            }
+         } else {
+            opium_memzero(&udp->tx[ntx], sizeof(struct mmsghdr));
+            group = &udp->tx[ntx].msg_hdr;
+            group_index = ntx;
+            group->msg_iov = &udp->tx_iov[niov];
+            group->msg_iovlen = 1;
+            group->msg_name = &slot->addr;
+            group->msg_namelen = msg.addrlen;
+            group_seg = group_bytes = (size_t)reply;
+            ntx++;
+         }
+         niov++;
+      } while ((off += seg) < len);
+   }
+
+   udp->nrecv += handled;
+
+   opium_log_trace(udp->log, "UDP batch: %d datagrams, %u messages\n", nrx, handled);
+
+   if (ntx > 0) {
+      opium_udp_flush(udp, ntx);
+   }
+
+   return nrx;
+}
+
+   ssize_t
+opium_udp_send(opium_udp_t *udp, const struct sockaddr *addr, socklen_t addrlen,
+      const void *buf, size_t len, size_t segment)
+{
+   const u_char *pos = buf;
+   size_t        done = 0;
+
+   if (segment == 0 || segment > OPIUM_UDP_GSO_MAX) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   while (done < len) {
+      opium_u32_t count = 0;
+      size_t      chunk = 0;
+
+      if (udp->flags & OPIUM_UDP_GSO) {
+         /* One send carries as many whole segments as the limits allow */
+         size_t         max = opium_min(OPIUM_UDP_GSO_MAX / segment, OPIUM_UDP_GSO_SEGS) * segment;
+         struct msghdr *hdr = &udp->tx[0].msg_hdr;
+         ssize_t        sent;
+
+         chunk = opium_min(len - done, max);
+
+         opium_memzero(&udp->tx[0], sizeof(struct mmsghdr));
+         udp->tx_iov[0].iov_base = (void*)(pos + done);
+         udp->tx_iov[0].iov_len = chunk;
+         hdr->msg_iov = &udp->tx_iov[0];
+         hdr->msg_iovlen = 1;
+         hdr->msg_name = (void*)addr;
+         hdr->msg_namelen = addrlen;
+         if (chunk > segment) {
+            opium_udp_segment(udp, hdr, 0, segment);
+         }
+
+         sent = sendmsg(udp->fd, hdr, MSG_DONTWAIT);
+         if (sent < 0) {
+            return done > 0 ? (ssize_t)done : -1;
+         }
+         if (chunk > segment) {
+            udp->ngso++;
+         }
+         udp->nsent += (chunk + segment - 1) / segment;
+         done += chunk;
+         continue;
+      }
+
+      while (count < udp->tx_max && done + chunk < len) {
+         size_t piece = opium_min(segment, len - done - chunk);
+
+         opium_memzero(&udp->tx[count], sizeof(struct mmsghdr));
+         udp->tx_iov[count].iov_base = (void*)(pos + done + chunk);
+         udp->tx_iov[count].iov_len = piece;
+         udp->tx[count].msg_hdr.msg_iov = &udp->tx_iov[count];
+         udp->tx[count].msg_hdr.msg_iovlen = 1;
+         udp->tx[count].msg_hdr.msg_name = (void*)addr;
+         udp->tx[count].msg_hdr.msg_namelen = addrlen;
+
+         chunk += piece;
+         count++;
+      }
+
+      int sent = sendmmsg(udp->fd, udp->tx, count, MSG_DONTWAIT);
+      if (sent <= 0) {
+         return done > 0 ? (ssize_t)done : -1;
+      }
+      udp->nsent += (opium_u64_t)sent;
+
+      if ((opium_u32_t)sent < count) {
+         return (ssize_t)(done + (size_t)sent * segment);
+      }
+      done += chunk;
+   }
+
+   return (ssize_t)done;
+}
+
+   static void
+opium_udp_read_handler(opium_event_handler_t *handler)
+{
+   opium_udp_t *udp = handler->data;
+   opium_s32_t  ret;
+
+   /* Edge-triggered: a short batch means the queue is empty */
+   do {
+      ret = opium_udp_process(udp);
+   } while (ret == (opium_s32_t)udp->batch);
+}
+
+   opium_s32_t
+opium_udp_add(opium_udp_t *udp, opium_event_t *event)
+{
+   udp->ev = opium_event_add(event, udp->fd, OPIUM_EVENT_READ, opium_udp_read_handler, NULL, udp);
+   return udp->ev ? OPIUM_RET_OK : OPIUM_RET_ERR;
+}
+
+   ssize_t
+opium_udp_ping(opium_udp_t *udp, opium_udp_msg_t *msg)
+{
+   opium_net_ping_t *ping = (opium_net_ping_t*)msg->buf;
+
+   (void)udp;
+
+   if (msg->len < sizeof(opium_net_ping_t) || (msg->flags & MSG_TRUNC)
+         || ping->type != NET_PACKET_PING_REQUEST) {
+      return 0;
+   }
+
+   /* seq and stamp go back untouched, the sender matches them */
+   ping->type = NET_PACKET_PING_RESPONSE;
+
+   return sizeof(opium_net_ping_t);
+}
+
+   void
+opium_net_ip_port(const struct sockaddr *addr, OPIUM_IP_PORT *out)
+{
+   opium_memzero(out, sizeof(*out));
+
+   if (addr->sa_family == AF_INET) {
+      const struct sockaddr_in *in = (const struct sockaddr_in*)addr;
+      out->port = ntohs(in->sin_port);
+      out->IP.v4.uint32 = in->sin_addr.s_addr;
+   } else if (addr->sa_family == AF_INET6) {
+      const struct sockaddr_in6 *in6 = (const struct sockaddr_in6*)addr;
+      out->port = ntohs(in6->sin6_port);
+      opium_memcpy(out->IP.v6.uint8, (void*)in6->sin6_addr.s6_addr, 16);
+   }
+}
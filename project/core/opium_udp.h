@@ -0,0 +1,135 @@
+#ifndef OPIUM_UDP_INCLUDE_H
+#define OPIUM_UDP_INCLUDE_H
+
+#include "core/opium_core.h"
+
+/*
+ * Datagram listener: one recvmmsg() takes up to 'batch' datagrams, the
+ * handler answers each in place, one sendmmsg() sends every answer back.
+ * Message buffers come from a slab and stay attached to their slot, the
+ * vectors are built once and only their lengths change per batch.
+ *
+ * Offloads, both optional:
+ *   GRO: the kernel hands over up to 64K of same-sized datagrams from one
+ *        flow as a single super-packet, split here by its gso_size
+ *   GSO: consecutive equal-sized replies to one peer leave as a single
+ *        UDP_SEGMENT send, segmented by the kernel or the NIC
+ */
+
+#define OPIUM_UDP_BATCH       32
+#define OPIUM_UDP_BATCH_MAX   64
+#define OPIUM_UDP_BUFSIZE     2048
+
+/* Receive buffer for a GRO super-packet, and segments per GSO send */
+#define OPIUM_UDP_GRO_BUFSIZE 65536
+#define OPIUM_UDP_GSO_SEGS    64
+#define OPIUM_UDP_GSO_MAX     65507
+
+/* opium_udp_init() flags */
+#define OPIUM_UDP_GRO         0x01
+#define OPIUM_UDP_GSO         0x02
+
+typedef struct opium_udp_s     opium_udp_t;
+typedef struct opium_udp_msg_s opium_udp_msg_t;
+
+/*
+ * Return the length of the reply written into msg->buf (up to msg->cap),
+ * 0 for no reply.
+ */
+typedef ssize_t (*opium_udp_handler_pt)(opium_udp_t *udp, opium_udp_msg_t *msg);
+
+/* One datagram, a segment of a super-packet under GRO */
+struct opium_udp_msg_s {
+   u_char                  *buf;
+   size_t                   len;       /* Received bytes */
+   size_t                   cap;
+   opium_u32_t              flags;     /* msg_flags, MSG_TRUNC when it did not fit */
+
+   OPIUM_IP_PORT            peer;
+   struct sockaddr_storage *addr;
+   socklen_t                addrlen;
+};
+
+/* Per recvmmsg() slot */
+typedef struct {
+   u_char                  *buf;
+   struct sockaddr_storage  addr;
+   union {
+      char                  buf[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr        align;
+   } control;
+} opium_udp_slot_t;
+
+/* Per sendmmsg() entry */
+typedef union {
+   char                     buf[CMSG_SPACE(sizeof(opium_u16_t))];
+   struct cmsghdr           align;
+} opium_udp_control_t;
+
+struct opium_udp_s {
+   opium_socket_fd_t        fd;
+
+   opium_u32_t              batch;
+   opium_u32_t              flags;     /* What the kernel accepted */
+   size_t                   bufsize;
+
+   opium_udp_slot_t        *slots;
+   struct mmsghdr          *rx;
+   struct iovec            *rx_iov;
+
+   /* Up to batch * OPIUM_UDP_GSO_SEGS replies under GRO */
+   struct mmsghdr          *tx;
+   struct iovec            *tx_iov;
+   opium_udp_control_t     *tx_control;
+   opium_u32_t              tx_max;
+
+   opium_slab_t             slab;
+
+   opium_udp_handler_pt     handler;
+   void                    *data;
+
+   opium_event_handler_t   *ev;
+
+   /* Statistics */
+   opium_u64_t              nrecv;     /* Datagrams, after GRO splitting */
+   opium_u64_t              nsent;
+   opium_u64_t              nbatches;  /* recvmmsg() calls that returned data */
+   opium_u64_t              nsuper;    /* Coalesced super-packets received */
+   opium_u64_t              ngso;      /* UDP_SEGMENT sends */
+   opium_u64_t              ndropped;  /* Replies sendmmsg() did not take */
+
+   opium_log_t             *log;
+};
+
+/* Ping protocol, the reference handler. All fields network order */
+typedef struct {
+   opium_u8_t               type;      /* OPIUM_NETPACKET_TYPE */
+   opium_u8_t               reserved[3];
+   opium_u32_t              seq;
+   opium_u64_t              stamp;     /* Echoed as is */
+} opium_net_ping_t;
+
+opium_s32_t opium_udp_init(opium_udp_t *udp, const struct sockaddr *addr, socklen_t addrlen,
+      opium_u32_t batch, opium_u32_t flags, opium_udp_handler_pt handler, void *data,
+      opium_log_t *log);
+void opium_udp_exit(opium_udp_t *udp);
+
+/* One batch: receive, handle, reply. Datagrams handled, 0 when none were waiting */
+opium_s32_t opium_udp_process(opium_udp_t *udp);
+
+/* Serve from an event loop, draining the socket on every wakeup */
+opium_s32_t opium_udp_add(opium_udp_t *udp, opium_event_t *event);
+
+/*
+ * Send 'len' bytes to 'addr' as datagrams of 'segment' bytes (the last one
+ * may be shorter): one syscall with UDP_SEGMENT, or one sendmmsg() of
+ * plain datagrams when GSO is off.
+ */
+ssize_t opium_udp_send(opium_udp_t *udp, const struct sockaddr *addr, socklen_t addrlen,
+      const void *buf, size_t len, size_t segment);
+
+ssize_t opium_udp_ping(opium_udp_t *udp, opium_udp_msg_t *msg);
+
+void opium_net_ip_port(const struct sockaddr *addr, OPIUM_IP_PORT *out);
+
+#endif /* OPIUM_UDP_INCLUDE_H */
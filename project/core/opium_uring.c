@@ -0,0 +1,345 @@
+/* opium_uring.c
+ *
+ * io_uring setup, submission and provided buffer rings, straight on top
+ * of io_uring_setup(2), io_uring_enter(2) and io_uring_register(2).
+ *
+ * Everything here is single-threaded: one ring belongs to one event loop.
+ *
+ */
+
+#include "core/opium_core.h"
+
+   static int
+opium_uring_setup(opium_u32_t entries, struct io_uring_params *params)
+{
+   return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+   static int
+opium_uring_register(int fd, opium_u32_t opcode, void *arg, opium_u32_t nr)
+{
+   return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+   opium_s32_t
+opium_uring_init(opium_uring_t *ring, opium_u32_t entries, opium_log_t *log)
+{
+   struct io_uring_params params;
+   u_char                *sq, *cq;
+
+   opium_memzero(ring, sizeof(*ring));
+   ring->fd = -1;
+   ring->log = log;
+
+   /*
+    * COOP_TASKRUN: completions are only processed when we enter the
+    * kernel anyway, no IPI interrupting the loop. Older kernels reject
+    * the flag, then go without it.
+    */
+   opium_memzero(&params, sizeof(params));
+   params.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+
+   ring->fd = opium_uring_setup(entries, &params);
+   if (ring->fd < 0 && errno == EINVAL) {
+      opium_memzero(&params, sizeof(params));
+      ring->fd = opium_uring_setup(entries, &params);
+   }
+
+   if (ring->fd < 0) {
+      opium_log_err(log, "io_uring_setup() failed: %s\n", strerror(errno));
+      return OPIUM_RET_ERR;
+   }
+
+   ring->features = params.features;
+
+   /* One mmap for both rings when the kernel allows it (5.4+) */
+   ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(opium_u32_t);
+   ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+   if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+      ring->sq_ring_size = opium_max(ring->sq_ring_size, ring->cq_ring_size);
+      ring->cq_ring_size = ring->sq_ring_size;
+   }
+
+   ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+   if (ring->sq_ring == MAP_FAILED) {
+      ring->sq_ring = NULL;
+      opium_log_err(log, "io_uring SQ ring mmap failed: %s\n", strerror(errno));
+      goto failed;
+   }
+
+   if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+      ring->cq_ring = ring->sq_ring;
+   } else {
+      ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED) {
+         ring->cq_ring = NULL;
+         opium_log_err(log, "io_uring CQ ring mmap failed: %s\n", strerror(errno));
+         goto failed;
+      }
+   }
+
+   ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+   ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+   if (ring->sqes == MAP_FAILED) {
+      ring->sqes = NULL;
+      opium_log_err(log, "io_uring SQE mmap failed: %s\n", strerror(errno));
+      goto failed;
+   }
+
+   sq = ring->sq_ring;
+   ring->sq_head = (_Atomic opium_u32_t*)(sq + params.sq_off.head);
+   ring->sq_tail = (_Atomic opium_u32_t*)(sq + params.sq_off.tail);
+   ring->sq_mask = *(opium_u32_t*)(sq + params.sq_off.ring_mask);
+   ring->sq_array = (opium_u32_t*)(sq + params.sq_off.array);
+   ring->sq_entries = params.sq_entries;
+
+   cq = ring->cq_ring;
+   ring->cq_head = (_Atomic opium_u32_t*)(cq + params.cq_off.head);
+   ring->cq_tail = (_Atomic opium_u32_t*)(cq + params.cq_off.tail);
+   ring->cq_mask = *(opium_u32_t*)(cq + params.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+   /* Slot i points at sqe i unless opium_uring_sqe_ahead() moved it */
+   for (opium_u32_t index = 0; index < ring->sq_entries; index++) {
+      ring->sq_array[index] = index;
+   }
+
+   return OPIUM_RET_OK;
+
+failed:
+   opium_uring_exit(ring);
+   return OPIUM_RET_ERR;
+}
+
+   void
+opium_uring_exit(opium_uring_t *ring)
+{
+   if (ring->sqes) {
+      munmap(ring->sqes, ring->sqes_size);
+      ring->sqes = NULL;
+   }
+
+   if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+      munmap(ring->cq_ring, ring->cq_ring_size);
+   }
+   ring->cq_ring = NULL;
+
+   if (ring->sq_ring) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      ring->sq_ring = NULL;
+   }
+
+   if (ring->fd >= 0) {
+      close(ring->fd);
+      ring->fd = -1;
+   }
+}
+
+   struct io_uring_sqe *
+opium_uring_sqe(opium_uring_t *ring)
+{
+   struct io_uring_sqe *sqe;
+   opium_u32_t          tail, head;
+
+   tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed) + ring->pending;
+   head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+
+   if (tail - head >= ring->sq_entries) {
+      /* Full: push what we have, without waiting for anything */
+      if (opium_uring_enter(ring, 0, 0) == OPIUM_RET_ERR) {
+         return NULL;
+      }
+      tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+      head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+      if (tail - head >= ring->sq_entries) {
+         return NULL;
+      }
+   }
+
+   sqe = &ring->sqes[tail & ring->sq_mask];
+   opium_memzero(sqe, sizeof(*sqe));
+   ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+   ring->pending++;
+
+   return sqe;
+}
+
+/*
+ * The kernel takes sqes in index array order, not in sqe order: moving the
+ * new slot's entry in front of the last 'count' prepared ones is enough.
+ */
+   struct io_uring_sqe *
+opium_uring_sqe_ahead(opium_uring_t *ring, opium_u32_t count)
+{
+   struct io_uring_sqe *sqe;
+   opium_u32_t          pos, index;
+
+   sqe = opium_uring_sqe(ring);
+   if (!sqe) {
+      return NULL;
+   }
+
+   /* A full ring was pushed meanwhile, those are gone already */
+   count = opium_min(count, ring->pending - 1);
+
+   pos = atomic_load_explicit(ring->sq_tail, memory_order_relaxed) + ring->pending - 1;
+   index = ring->sq_array[pos & ring->sq_mask];
+
+   for (opium_u32_t shift = 0; shift < count; shift++, pos--) {
+      ring->sq_array[pos & ring->sq_mask] = ring->sq_array[(pos - 1) & ring->sq_mask];
+   }
+   ring->sq_array[pos & ring->sq_mask] = index;
+
+   return sqe;
+}
+
+   opium_s32_t
+opium_uring_enter(opium_uring_t *ring, opium_u32_t wait, opium_s32_t msec)
+{
+   struct io_uring_getevents_arg  arg;
+   struct __kernel_timespec       ts;
+   opium_u32_t                    submit, flags = 0;
+   opium_u32_t                    tail;
+   int                            ret;
+
+   /* Publish the batch: the kernel reads sqes up to the new tail */
+   submit = ring->pending;
+   if (submit > 0) {
+      tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+      atomic_store_explicit(ring->sq_tail, tail + submit, memory_order_release);
+      ring->pending = 0;
+   }
+
+   if (wait > 0) {
+      flags |= IORING_ENTER_GETEVENTS;
+   }
+
+   if (submit == 0 && wait == 0) {
+      return OPIUM_RET_OK;
+   }
+
+   if (wait > 0 && msec >= 0 && (ring->features & IORING_FEAT_EXT_ARG)) {
+      ts.tv_sec = msec / 1000;
+      ts.tv_nsec = (long long)(msec % 1000) * 1000000;
+
+      opium_memzero(&arg, sizeof(arg));
+      arg.ts = (opium_u64_t)(uintptr_t)&ts;
+
+      flags |= IORING_ENTER_EXT_ARG;
+      ring->nenter++;
+      ret = (int)syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags, &arg, sizeof(arg));
+   } else {
+      ring->nenter++;
+      ret = (int)syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags, NULL, 0);
+   }
+
+   if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+      opium_log_err(ring->log, "io_uring_enter() failed: %s\n", strerror(errno));
+      return OPIUM_RET_ERR;
+   }
+
+   return OPIUM_RET_OK;
+}
+
+   opium_s32_t
+opium_uring_bufs_init(opium_uring_t *ring, opium_uring_bufs_t *bufs,
+      opium_u16_t group, opium_u32_t count, opium_u32_t size)
+{
+   struct io_uring_buf_reg reg;
+   size_t                  page = (size_t)sysconf(_SC_PAGESIZE);
+
+   opium_memzero(bufs, sizeof(*bufs));
+
+   if (count == 0 || count > 32768 || (count & (count - 1)) != 0) {
+      opium_log_err(ring->log, "Provided buffer count %u must be a power of two\n", count);
+      return OPIUM_RET_ERR;
+   }
+
+   bufs->count = count;
+   bufs->size = size;
+   bufs->group = group;
+
+   /* The ring itself has to be page aligned */
+   bufs->ring_size = count * sizeof(struct io_uring_buf);
+   bufs->ring = mmap(NULL, bufs->ring_size, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (bufs->ring == MAP_FAILED) {
+      bufs->ring = NULL;
+      opium_log_err(ring->log, "Provided buffer ring mmap failed: %s\n", strerror(errno));
+      return OPIUM_RET_ERR;
+   }
+
+   bufs->base = opium_memalign(page, (size_t)count * size, ring->log);
+   if (!bufs->base) {
+      opium_log_err(ring->log, "Failed to allocate provided buffers\n");
+      goto failed;
+   }
+
+   opium_memzero(&reg, sizeof(reg));
+   reg.ring_addr = (opium_u64_t)(uintptr_t)bufs->ring;
+   reg.ring_entries = count;
+   reg.bgid = group;
+
+   if (opium_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+      opium_log_err(ring->log, "IORING_REGISTER_PBUF_RING failed: %s\n", strerror(errno));
+      goto failed;
+   }
+
+   for (opium_u32_t bid = 0; bid < count; bid++) {
+      opium_uring_bufs_recycle(bufs, (opium_u16_t)bid);
+   }
+
+   return OPIUM_RET_OK;
+
+failed:
+   if (bufs->base) {
+      opium_free(bufs->base, ring->log);
+      bufs->base = NULL;
+   }
+   munmap(bufs->ring, bufs->ring_size);
+   bufs->ring = NULL;
+   return OPIUM_RET_ERR;
+}
+
+   void
+opium_uring_bufs_exit(opium_uring_t *ring, opium_uring_bufs_t *bufs)
+{
+   struct io_uring_buf_reg reg;
+
+   if (!bufs->ring) {
+      return;
+   }
+
+   if (ring->fd >= 0) {
+      opium_memzero(&reg, sizeof(reg));
+      reg.bgid = bufs->group;
+      opium_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+   }
+
+   munmap(bufs->ring, bufs->ring_size);
+   bufs->ring = NULL;
+
+   if (bufs->base) {
+      opium_free(bufs->base, ring->log);
+      bufs->base = NULL;
+   }
+}
+
+   void
+opium_uring_bufs_recycle(opium_uring_bufs_t *bufs, opium_u16_t bid)
+{
+   struct io_uring_buf *buf = &bufs->ring->bufs[bufs->tail & (bufs->count - 1)];
+
+   buf->addr = (opium_u64_t)(uintptr_t)opium_uring_bufs_get(bufs, bid);
+   buf->len = bufs->size;
+   buf->bid = bid;
+
+   bufs->tail++;
+
+   /* The tail lives in the first entry's 'resv' field, see io_uring_buf_ring */
+   __atomic_store_n(&bufs->ring->tail, bufs->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,104 @@
+#ifndef OPIUM_URING_INCLUDE_H
+#define OPIUM_URING_INCLUDE_H
+
+#include "core/opium_core.h"
+
+/*
+ * Minimal io_uring on the raw syscalls (no liburing): the two rings are
+ * mmap'ed once, submissions are batched and pushed by one io_uring_enter()
+ * that also waits for completions.
+ *
+ *   SQ: we write sqes and move 'tail', the kernel consumes up to 'tail'
+ *   CQ: the kernel writes cqes and moves 'tail', we consume up to it
+ */
+
+struct opium_uring_s {
+   opium_fd_t              fd;
+   opium_u32_t             features;
+
+   /* Submission ring */
+   _Atomic opium_u32_t    *sq_head;
+   _Atomic opium_u32_t    *sq_tail;
+   opium_u32_t             sq_mask;
+   opium_u32_t            *sq_array;
+   struct io_uring_sqe    *sqes;
+   opium_u32_t             sq_entries;
+   opium_u32_t             pending;      /* Prepared, not yet submitted */
+
+   /* Completion ring */
+   _Atomic opium_u32_t    *cq_head;
+   _Atomic opium_u32_t    *cq_tail;
+   opium_u32_t             cq_mask;
+   struct io_uring_cqe    *cqes;
+
+   void                   *sq_ring;
+   size_t                  sq_ring_size;
+   void                   *cq_ring;
+   size_t                  cq_ring_size;
+   size_t                  sqes_size;
+
+   opium_u64_t             nenter;       /* io_uring_enter() calls */
+
+   opium_log_t            *log;
+};
+
+/*
+ * Provided buffer ring: a pool of equal buffers the kernel picks from for
+ * IOSQE_BUFFER_SELECT reads, the completion says which one it used.
+ */
+struct opium_uring_bufs_s {
+   struct io_uring_buf_ring *ring;
+   size_t                  ring_size;
+
+   u_char                 *base;
+   opium_u32_t             count;        /* Power of two */
+   opium_u32_t             size;
+   opium_u16_t             group;
+   opium_u16_t             tail;         /* Local copy, published with a release store */
+};
+
+opium_s32_t opium_uring_init(opium_uring_t *ring, opium_u32_t entries, opium_log_t *log);
+void opium_uring_exit(opium_uring_t *ring);
+
+/* Next free sqe, zeroed. Submits the batch first if the ring is full */
+struct io_uring_sqe *opium_uring_sqe(opium_uring_t *ring);
+
+/* Same, but the kernel sees it before the last 'count' prepared sqes */
+struct io_uring_sqe *opium_uring_sqe_ahead(opium_uring_t *ring, opium_u32_t count);
+
+/* Submit the batch and wait for 'wait' completions, at most 'msec' (-1 forever) */
+opium_s32_t opium_uring_enter(opium_uring_t *ring, opium_u32_t wait, opium_s32_t msec);
+
+static inline struct io_uring_cqe *
+opium_uring_cqe_peek(opium_uring_t *ring)
+{
+   opium_u32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+
+   if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+      return NULL;
+   }
+
+   return &ring->cqes[head & ring->cq_mask];
+}
+
+static inline void
+opium_uring_cqe_seen(opium_uring_t *ring)
+{
+   opium_u32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+   atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+}
+
+opium_s32_t opium_uring_bufs_init(opium_uring_t *ring, opium_uring_bufs_t *bufs,
+      opium_u16_t group, opium_u32_t count, opium_u32_t size);
+void opium_uring_bufs_exit(opium_uring_t *ring, opium_uring_bufs_t *bufs);
+
+/* Give buffer 'bid' back to the kernel */
+void opium_uring_bufs_recycle(opium_uring_bufs_t *bufs, opium_u16_t bid);
+
+static inline u_char *
+opium_uring_bufs_get(opium_uring_bufs_t *bufs, opium_u16_t bid)
+{
+   return bufs->base + (size_t)bid * bufs->size;
+}
+
+#endif /* OPIUM_URING_INCLUDE_H */
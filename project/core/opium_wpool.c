@@ -0,0 +1,457 @@
+/* opium_wpool.c
+ *
+ * Work-stealing thread pool.
+ *
+ * Event loops must never run CPU-heavy code (compression, hashing, TLS
+ * handshakes...). They hand it to this pool instead:
+ *
+ *   - Every worker owns a Chase-Lev deque. Tasks submitted from inside a
+ *     worker go to its own deque, so recursive fork-join work stays on the
+ *     core that produced it.
+ *   - Threads outside the pool (event loops) submit into one injection
+ *     queue, which every worker checks.
+ *   - A worker with nothing to do steals from random victims, spins a bit,
+ *     and then parks on a futex. Submitters only pay for a wake-up syscall
+ *     when somebody actually sleeps.
+ *
+ * Workers are pinned through the thread 'core' field.
+ *
+ */
+
+#include "core/opium_core.h"
+
+#define OPIUM_WPOOL_DEQUE_MASK  (OPIUM_WPOOL_DEQUE_SIZE - 1)
+
+/* The worker running on this thread, NULL outside of any pool */
+static __thread opium_wpool_worker_t *opium_wpool_current;
+
+   static opium_s32_t
+opium_wsdeque_push(opium_wsdeque_t *deque, opium_task_t *task)
+{
+   opium_s64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+   opium_s64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+   if (bottom - top >= OPIUM_WPOOL_DEQUE_SIZE) {
+      return OPIUM_RET_FULL;
+   }
+
+   atomic_store_explicit(&deque->buffer[bottom & OPIUM_WPOOL_DEQUE_MASK], task, memory_order_relaxed);
+   atomic_thread_fence(memory_order_release);
+   atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+
+   return OPIUM_RET_OK;
+}
+
+/* Owner side: LIFO end */
+   static opium_task_t *
+opium_wsdeque_take(opium_wsdeque_t *deque)
+{
+   opium_s64_t   bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+   opium_s64_t   top;
+   opium_task_t *task;
+
+   atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+   atomic_thread_fence(memory_order_seq_cst);
+   top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+   if (top > bottom) {
+      /* Empty */
+      atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+      return NULL;
+   }
+
+   task = atomic_load_explicit(&deque->buffer[bottom & OPIUM_WPOOL_DEQUE_MASK], memory_order_relaxed);
+
+   if (top == bottom) {
+      /* Last element: race the thieves for it */
+      if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+               memory_order_seq_cst, memory_order_relaxed)) {
+         task = NULL;
+      }
+      atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+   }
+
+   return task;
+}
+
+/* Thief side: FIFO end */
+   static opium_task_t *
+opium_wsdeque_steal(opium_wsdeque_t *deque)
+{
+   opium_s64_t   top = atomic_load_explicit(&deque->top, memory_order_acquire);
+   opium_s64_t   bottom;
+   opium_task_t *task;
+
+   atomic_thread_fence(memory_order_seq_cst);
+   bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+   if (top >= bottom) {
+      return NULL;
+   }
+
+   task = atomic_load_explicit(&deque->buffer[top & OPIUM_WPOOL_DEQUE_MASK], memory_order_relaxed);
+
+   if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+      /* Lost against the owner or another thief */
+      return NULL;
+   }
+
+   return task;
+}
+
+   static void
+opium_wpool_inject(opium_wpool_t *pool, opium_task_t *task)
+{
+   task->next = NULL;
+
+   opium_amutex_lock(&pool->inject_mtx);
+
+   if (pool->inject_tail) {
+      pool->inject_tail->next = task;
+   } else {
+      pool->inject_head = task;
+   }
+   pool->inject_tail = task;
+   atomic_fetch_add_explicit(&pool->inject_len, 1, memory_order_seq_cst);
+
+   opium_amutex_unlock(&pool->inject_mtx);
+}
+
+   static opium_task_t *
+opium_wpool_uninject(opium_wpool_t *pool)
+{
+   opium_task_t *task;
+
+   /* Cheap check first: the queue is empty most of the time */
+   if (atomic_load_explicit(&pool->inject_len, memory_order_relaxed) == 0) {
+      return NULL;
+   }
+
+   opium_amutex_lock(&pool->inject_mtx);
+
+   task = pool->inject_head;
+   if (task) {
+      pool->inject_head = task->next;
+      if (!pool->inject_head) {
+         pool->inject_tail = NULL;
+      }
+      atomic_fetch_sub_explicit(&pool->inject_len, 1, memory_order_relaxed);
+   }
+
+   opium_amutex_unlock(&pool->inject_mtx);
+
+   return task;
+}
+
+   static opium_task_t *
+opium_wpool_find(opium_wpool_worker_t *worker)
+{
+   opium_wpool_t *pool = worker->pool;
+   opium_task_t  *task;
+
+   task = opium_wsdeque_take(&worker->deque);
+   if (task) {
+      return task;
+   }
+
+   task = opium_wpool_uninject(pool);
+   if (task) {
+      return task;
+   }
+
+   /* Start at a random victim so thieves do not all hit worker 0 */
+   worker->seed ^= worker->seed << 13;
+   worker->seed ^= worker->seed >> 17;
+   worker->seed ^= worker->seed << 5;
+
+   for (opium_u32_t index = 0; index < pool->nworkers; index++) {
+      opium_wpool_worker_t *victim = &pool->workers[(worker->seed + index) % pool->nworkers];
+      if (victim == worker) {
+         continue;
+      }
+
+      task = opium_wsdeque_steal(&victim->deque);
+      if (task) {
+         return task;
+      }
+   }
+
+   return NULL;
+}
+
+   static void
+opium_wpool_run(opium_wpool_t *pool, opium_task_t *task)
+{
+   /* The handler may release the task, read the group first */
+   opium_task_group_t *group = task->group;
+
+   task->handler(task->data);
+
+   if (!group || atomic_fetch_sub(&group->pending, 1) != 1) {
+      return;
+   }
+
+   /*
+    * The waiter may have freed the group by now, only the pool is touched.
+    * Same handshake as parking: either the waiter sees 0 after counting
+    * itself in, or we see it and move 'joins' under its futex_wait().
+    */
+   atomic_thread_fence(memory_order_seq_cst);
+
+   if (atomic_load_explicit(&pool->join_sleepers, memory_order_relaxed) > 0) {
+      atomic_fetch_add_explicit(&pool->joins, 1, memory_order_release);
+      opium_futex_wake(&pool->joins, INT_MAX);
+   }
+}
+
+   static int
+opium_wpool_has_work(opium_wpool_t *pool)
+{
+   if (atomic_load(&pool->inject_len) > 0) {
+      return 1;
+   }
+
+   for (opium_u32_t index = 0; index < pool->nworkers; index++) {
+      opium_wsdeque_t *deque = &pool->workers[index].deque;
+      if (atomic_load(&deque->bottom) > atomic_load(&deque->top)) {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+/*
+ * Parking protocol:
+ *
+ *   worker                          submitter
+ *   ------                          ---------
+ *   e = epoch                       publish task
+ *   sleepers++        (seq_cst)     fence             (seq_cst)
+ *   recheck queues                  if (sleepers)
+ *   futex_wait(epoch, e)               epoch++, futex_wake(epoch)
+ *
+ * Either the worker sees the task on its recheck, or the submitter sees the
+ * sleeper. If the epoch moves between the recheck and the wait, the kernel
+ * refuses to sleep.
+ */
+   static void
+opium_wpool_park(opium_wpool_t *pool)
+{
+   opium_u32_t epoch = atomic_load_explicit(&pool->epoch, memory_order_acquire);
+
+   atomic_fetch_add(&pool->sleepers, 1);
+
+   if (!opium_wpool_has_work(pool) && !atomic_load(&pool->stop)) {
+      opium_futex_wait(&pool->epoch, epoch);
+   }
+
+   atomic_fetch_sub(&pool->sleepers, 1);
+}
+
+   static void
+opium_wpool_signal(opium_wpool_t *pool)
+{
+   atomic_thread_fence(memory_order_seq_cst);
+
+   if (atomic_load_explicit(&pool->sleepers, memory_order_relaxed) > 0) {
+      atomic_fetch_add_explicit(&pool->epoch, 1, memory_order_release);
+      opium_futex_wake(&pool->epoch, 1);
+   }
+}
+
+   static void *
+opium_wpool_worker(void *data)
+{
+   opium_wpool_worker_t *worker = data;
+   opium_wpool_t        *pool = worker->pool;
+   opium_task_t         *task;
+   opium_u32_t           idle = 0;
+
+   opium_wpool_current = worker;
+
+   while (!atomic_load_explicit(&pool->stop, memory_order_acquire)) {
+      task = opium_wpool_find(worker);
+      if (task) {
+         opium_wpool_run(pool, task);
+         idle = 0;
+         continue;
+      }
+
+      if (++idle < OPIUM_WPOOL_SPIN) {
+         opium_cpu_relax();
+         continue;
+      }
+
+      opium_wpool_park(pool);
+      idle = 0;
+   }
+
+   opium_wpool_current = NULL;
+
+   return NULL;
+}
+
+   void
+opium_wpool_submit(opium_wpool_t *pool, opium_task_t *task)
+{
+   opium_wpool_worker_t *worker = opium_wpool_current;
+
+   if (task->group) {
+      atomic_fetch_add_explicit(&task->group->pending, 1, memory_order_relaxed);
+   }
+
+   if (!worker || worker->pool != pool
+         || opium_wsdeque_push(&worker->deque, task) != OPIUM_RET_OK) {
+      opium_wpool_inject(pool, task);
+   }
+
+   opium_wpool_signal(pool);
+}
+
+/*
+ * Wait until every task of the group has finished. A worker keeps running
+ * tasks while it waits (so nested fork-join cannot deadlock the pool), any
+ * other thread sleeps on the pool's join word.
+ */
+   void
+opium_wpool_wait(opium_wpool_t *pool, opium_task_group_t *group)
+{
+   opium_wpool_worker_t *worker = opium_wpool_current;
+   opium_task_t         *task;
+   opium_u32_t           joins;
+
+   if (worker && worker->pool != pool) {
+      worker = NULL;
+   }
+
+   while (atomic_load_explicit(&group->pending, memory_order_acquire) != 0) {
+      if (worker) {
+         task = opium_wpool_find(worker);
+         if (task) {
+            opium_wpool_run(pool, task);
+         } else {
+            opium_cpu_relax();
+         }
+         continue;
+      }
+
+      joins = atomic_load_explicit(&pool->joins, memory_order_acquire);
+      atomic_fetch_add(&pool->join_sleepers, 1);
+
+      if (atomic_load(&group->pending) != 0) {
+         opium_futex_wait(&pool->joins, joins);
+      }
+
+      atomic_fetch_sub(&pool->join_sleepers, 1);
+   }
+}
+
+   opium_s32_t
+opium_wpool_init(opium_wpool_t *pool, opium_u32_t nworkers, opium_u32_t first_core, opium_log_t *log)
+{
+   opium_cpuinfo_t *info;
+   opium_s32_t     *cpus;
+   opium_u32_t      index;
+
+   if (nworkers < 1 || nworkers > OPIUM_WPOOL_MAX_WORKERS) {
+      opium_log_err(log, "Work pool size must be in 1..%d\n", OPIUM_WPOOL_MAX_WORKERS);
+      return OPIUM_RET_ERR;
+   }
+
+   opium_memzero(pool, sizeof(opium_wpool_t));
+   pool->log = log;
+
+   opium_amutex_init(&pool->inject_mtx);
+
+   pool->workers = opium_memalign(OPIUM_CACHE_LINE, nworkers * sizeof(opium_wpool_worker_t), log);
+   if (!pool->workers) {
+      opium_log_err(log, "Failed to allocate work pool workers\n");
+      return OPIUM_RET_ERR;
+   }
+   opium_memzero(pool->workers, nworkers * sizeof(opium_wpool_worker_t));
+
+   /* Every deque exists before the first thread starts: thieves walk all of them */
+   pool->nworkers = nworkers;
+
+   for (index = 0; index < nworkers; index++) {
+      opium_wpool_worker_t *worker = &pool->workers[index];
+
+      worker->deque.buffer = opium_calloc(OPIUM_WPOOL_DEQUE_SIZE * sizeof(opium_task_t *), log);
+      if (!worker->deque.buffer) {
+         opium_log_err(log, "Failed to allocate work pool deque\n");
+         goto fail;
+      }
+
+      worker->pool = pool;
+      worker->index = index;
+      worker->seed = 2463534242u + index * 2654435761u;
+   }
+
+   /* One worker per physical core first, only allowed CPUs */
+   cpus = opium_malloc((first_core + nworkers) * sizeof(opium_s32_t), log);
+   info = opium_malloc(sizeof(opium_cpuinfo_t), log);
+   if (!cpus || !info || opium_cpuinfo_init(info, log) != OPIUM_RET_OK
+         || opium_cpu_place(info, OPIUM_CPU_PLACE_PHYSICAL, first_core + nworkers, cpus) != OPIUM_RET_OK) {
+      opium_free(cpus, log);
+      opium_free(info, log);
+      goto fail;
+   }
+   opium_free(info, log);
+
+   for (index = 0; index < nworkers; index++) {
+      opium_wpool_worker_t *worker = &pool->workers[index];
+
+      worker->thread.core = cpus[first_core + index];
+
+      if (opium_thread_init(&worker->thread, opium_wpool_worker, worker, log) != OPIUM_RET_OK) {
+         opium_log_err(log, "Failed to start work pool worker %u\n", index);
+         opium_free(cpus, log);
+         goto fail;
+      }
+      pool->nthreads = index + 1;
+
+      /* Not fatal: the worker just runs unpinned */
+      opium_thread_affinity(&worker->thread, log);
+   }
+
+   opium_free(cpus, log);
+
+   return OPIUM_RET_OK;
+
+fail:
+   opium_wpool_exit(pool);
+   return OPIUM_RET_ERR;
+}
+
+/*
+ * Stop and join every worker. Tasks still queued are not run: callers wait
+ * on their groups before tearing the pool down.
+ */
+   void
+opium_wpool_exit(opium_wpool_t *pool)
+{
+   if (!pool->workers) {
+      return;
+   }
+
+   atomic_store_explicit(&pool->stop, 1, memory_order_release);
+   atomic_fetch_add(&pool->epoch, 1);
+   opium_futex_wake(&pool->epoch, INT_MAX);
+
+   for (opium_u32_t index = 0; index < pool->nthreads; index++) {
+      opium_thread_exit(&pool->workers[index].thread, pool->log);
+   }
+
+   for (opium_u32_t index = 0; index < pool->nworkers; index++) {
+      if (pool->workers[index].deque.buffer) {
+         opium_free(pool->workers[index].deque.buffer, pool->log);
+      }
+   }
+
+   opium_free(pool->workers, pool->log);
+
+   pool->workers = NULL;
+   pool->nworkers = pool->nthreads = 0;
+}
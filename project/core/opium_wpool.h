@@ -0,0 +1,103 @@
+#ifndef OPIUM_WPOOL_INCLUDE_H
+#define OPIUM_WPOOL_INCLUDE_H
+
+#include "core/opium_core.h"
+
+/* Per-worker deque capacity in tasks, must be a power of two */
+#define OPIUM_WPOOL_DEQUE_SIZE   4096
+
+/* Maximum number of worker threads in one pool */
+#define OPIUM_WPOOL_MAX_WORKERS  256
+
+/* Rounds of stealing before a worker parks itself */
+#define OPIUM_WPOOL_SPIN         64
+
+typedef void (*opium_task_cb)(void *data);
+
+/*
+ * opium_task_t - a unit of work. The memory belongs to the submitter and
+ * must stay valid until the task has run, so tasks are usually embedded
+ * into the structure they work on (or into an array the caller waits on
+ * with a group).
+ */
+struct opium_task_s {
+   opium_task_cb        handler;
+   void                *data;
+
+   opium_task_group_t  *group;   /* Optional: counted for opium_wpool_wait() */
+   opium_task_t        *next;    /* Injection queue link */
+};
+
+/*
+ * opium_task_group_t - fork-join counter. Every submitted task that points
+ * to the group increments 'pending', every finished one decrements it.
+ * The waiter may free the group as soon as it reads 0, so the last task
+ * never touches it again: sleepers wait on the pool's 'joins' word.
+ */
+struct opium_task_group_s {
+   _Atomic opium_u32_t  pending;
+};
+
+/*
+ * opium_wsdeque_t - Chase-Lev work-stealing deque.
+ *
+ * The owner pushes and takes at the bottom (LIFO, hot in its cache),
+ * thieves steal from the top (FIFO, the oldest and usually biggest piece
+ * of work). Only the last element is contended, and then the owner and
+ * the thief race with one CAS on 'top'.
+ *
+ *    top                         bottom
+ *     |                             |
+ *     v                             v
+ *   [ t0 ][ t1 ][ t2 ][ t3 ][    ][    ]
+ *     ^ steal()                ^ push() / take()
+ */
+typedef struct {
+   _Atomic opium_s64_t     top __attribute__((aligned(OPIUM_CACHE_LINE)));
+   _Atomic opium_s64_t     bottom __attribute__((aligned(OPIUM_CACHE_LINE)));
+   _Atomic(opium_task_t *) *buffer;
+} opium_wsdeque_t;
+
+typedef struct opium_wpool_worker_s opium_wpool_worker_t;
+
+struct opium_wpool_worker_s {
+   opium_wsdeque_t    deque;
+
+   opium_thread_t     thread;
+   opium_wpool_t     *pool;
+   opium_u32_t        index;
+   opium_u32_t        seed;      /* xorshift state for victim selection */
+};
+
+struct opium_wpool_s {
+   opium_wpool_worker_t  *workers;
+   opium_u32_t            nworkers;
+   opium_u32_t            nthreads;   /* Workers whose thread is running */
+
+   /* Tasks from threads outside the pool */
+   opium_amutex_t         inject_mtx;
+   opium_task_t          *inject_head;
+   opium_task_t          *inject_tail;
+   _Atomic size_t         inject_len;
+
+   /* Parking: sleepers wait on 'epoch', submitters bump it and wake */
+   _Atomic opium_u32_t    epoch __attribute__((aligned(OPIUM_CACHE_LINE)));
+   _Atomic opium_u32_t    sleepers;
+
+   /* Outside threads in opium_wpool_wait(): bumped when any group ends */
+   _Atomic opium_u32_t    joins __attribute__((aligned(OPIUM_CACHE_LINE)));
+   _Atomic opium_u32_t    join_sleepers;
+
+   _Atomic int            stop;
+
+   opium_log_t           *log;
+};
+
+/* 'first_core' skips that many CPUs of the physical placement order */
+opium_s32_t opium_wpool_init(opium_wpool_t *pool, opium_u32_t nworkers, opium_u32_t first_core, opium_log_t *log);
+void opium_wpool_exit(opium_wpool_t *pool);
+
+void opium_wpool_submit(opium_wpool_t *pool, opium_task_t *task);
+void opium_wpool_wait(opium_wpool_t *pool, opium_task_group_t *group);
+
+#endif /* OPIUM_WPOOL_INCLUDE_H */
@@ -1,6 +1,11 @@
 #ifndef OPIUM_LINUX_CONF_H
 #define OPIUM_LINUX_CONF_H
 
+/* CPU_SET(), pthread_setaffinity_np(), accept4() and friends */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 /* -------------------- Standard C headers -------------------- */
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,20 +40,28 @@
 #include <sys/mman.h>
 #include <sys/vfs.h>       /* statfs() */
 #include <sys/utsname.h>   /* uname() */
+#include <sys/syscall.h>   /* syscall(SYS_futex) */
+#include <linux/futex.h>   /* FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE */
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <linux/openat2.h>  /* struct open_how, RESOLVE_BENEATH */
 
 /* -------------------- Networking headers -------------------- */
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>   /* TCP_NODELAY, TCP_CORK */
+#include <netinet/udp.h>   /* UDP_SEGMENT, UDP_GRO */
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/un.h>
 #include <sys/eventfd.h>
 #include <sys/epoll.h>
+#include <linux/io_uring.h> /* Raw io_uring ABI, no liburing */
 /* -------------------- Memory / misc -------------------- */
 #include <malloc.h>         /* memalign() */
 
 #include <pthread.h>
+#include <stdatomic.h>
 
 #endif /* OPIUM_LINUX_CONF_H */
 
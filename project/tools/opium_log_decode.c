@@ -0,0 +1,398 @@
+/* opium_log_decode.c
+ *
+ * Offline decoder for binary logs written by opium_log_bin_init().
+ *
+ *   opium_log_decode <file>
+ *
+ * The file is read twice: the first pass collects every site record
+ * (id -> format, file, line, argument classes), the second one renders
+ * the entries in file order with the stored format, e.g.
+ *
+ *   2025-01-01 12:00:00.000123456 [DEBUG]: Allocate pointer. Size: 4096
+ *
+ * Each conversion of the original format is replayed through printf()
+ * with a length modifier matching the stored class, so "%5zu", "%-8s" or
+ * "%.*f" render exactly as the text logger would.
+ *
+ * Only the headers of the core are used, the tool links nothing from it.
+ *
+ */
+
+#include "core/opium_core.h"
+
+typedef struct {
+   const char    *format;
+   const char    *file;
+   opium_u32_t    line;
+   opium_u16_t    fmt_len;
+   opium_u8_t     nargs;
+   opium_u8_t     types[OPIUM_LOG_BIN_MAX_ARGS];
+} opium_log_decode_site_t;
+
+typedef struct {
+   opium_log_decode_site_t  *sites;
+   size_t                    nsites;
+
+   opium_log_bin_header_t    header;
+} opium_log_decode_t;
+
+   static int
+opium_log_decode_site(opium_log_decode_t *decode, opium_log_bin_record_t *record,
+      u_char *body, u_char *end)
+{
+   opium_log_decode_site_t *site;
+   opium_u32_t line;
+   opium_u16_t fmt_len, file_len;
+
+   if (record->nargs > OPIUM_LOG_BIN_MAX_ARGS
+         || (size_t)(end - body) < sizeof(line) + sizeof(fmt_len) + sizeof(file_len) + record->nargs) {
+      return -1;
+   }
+
+   memcpy(&line, body, sizeof(line));
+   body = body + sizeof(line);
+   memcpy(&fmt_len, body, sizeof(fmt_len));
+   body = body + sizeof(fmt_len);
+   memcpy(&file_len, body, sizeof(file_len));
+   body = body + sizeof(file_len);
+
+   if ((size_t)(end - body) < (size_t)record->nargs + fmt_len + file_len) {
+      return -1;
+   }
+
+   if (record->id >= decode->nsites) {
+      size_t nsites = opium_max(record->id + 1, decode->nsites * 2);
+      void  *sites = realloc(decode->sites, nsites * sizeof(opium_log_decode_site_t));
+      if (!sites) {
+         return -1;
+      }
+
+      decode->sites = sites;
+      memset(decode->sites + decode->nsites, 0,
+            (nsites - decode->nsites) * sizeof(opium_log_decode_site_t));
+      decode->nsites = nsites;
+   }
+
+   site = &decode->sites[record->id];
+   site->line = line;
+   site->nargs = record->nargs;
+   memcpy(site->types, body, record->nargs);
+   body = body + record->nargs;
+
+   site->format = strndup((char*)body, fmt_len);
+   site->fmt_len = fmt_len;
+   site->file = strndup((char*)body + fmt_len, file_len);
+
+   return site->format && site->file ? 0 : -1;
+}
+
+   static void
+opium_log_decode_time(opium_log_decode_t *decode, opium_u64_t ticks)
+{
+   opium_log_bin_header_t *header = &decode->header;
+   long double  delta;
+   opium_s64_t  ns;
+   time_t       sec;
+   struct tm    tm;
+   char         buf[32];
+
+   delta = (long double)((opium_s64_t)(ticks - header->ticks_ref)) * 1000000000.0L
+      / (header->ticks_hz ? header->ticks_hz : 1);
+   ns = (opium_s64_t)header->realtime_ref + (opium_s64_t)delta;
+
+   sec = ns / 1000000000;
+   localtime_r(&sec, &tm);
+   strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+
+   printf("%s.%09lld ", buf, (long long)(ns % 1000000000));
+}
+
+/*
+ * Pull the next argument of a class out of an entry body.
+ * Returns 0 and advances *pos, or -1 if the record is truncated.
+ */
+   static int
+opium_log_decode_arg(u_char **pos, u_char *end, opium_u8_t type, void *value, opium_u16_t *len)
+{
+   size_t size = type == OPIUM_LOG_ARG_I32 ? 4 : 8;
+
+   if (type == OPIUM_LOG_ARG_STR) {
+      if ((size_t)(end - *pos) < sizeof(*len)) {
+         return -1;
+      }
+
+      memcpy(len, *pos, sizeof(*len));
+      *pos = *pos + sizeof(*len);
+
+      if ((size_t)(end - *pos) < *len) {
+         return -1;
+      }
+
+      *(u_char**)value = *pos;
+      *pos = *pos + *len;
+      return 0;
+   }
+
+   if ((size_t)(end - *pos) < size) {
+      return -1;
+   }
+
+   memcpy(value, *pos, size);
+   *pos = *pos + size;
+
+   return 0;
+}
+
+/*
+ * Render a pointer like "%p" does: the "0x" prefix counts towards the
+ * width of the conversion, '-' pads on the right.
+ */
+   static void
+opium_log_decode_ptr(const char *spec, opium_u64_t value)
+{
+   char  buf[32];
+   int   left = 0, width;
+
+   for (spec = spec + 1; *spec && strchr("-+ #0'", *spec); spec++) {
+      if (*spec == '-') {
+         left = 1;
+      }
+   }
+
+   width = atoi(spec);
+
+   snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)value);
+   printf("%*s", left ? -width : width, buf);
+}
+
+   static void
+opium_log_decode_entry(opium_log_decode_t *decode, opium_log_bin_record_t *record,
+      u_char *body, u_char *end)
+{
+   opium_log_decode_site_t *site;
+   const char  *fmt, *fmt_end;
+   opium_u64_t  ticks;
+   opium_u8_t   arg = 0;
+
+   if ((size_t)(end - body) < sizeof(ticks)) {
+      return;
+   }
+
+   memcpy(&ticks, body, sizeof(ticks));
+   body = body + sizeof(ticks);
+
+   opium_log_decode_time(decode, ticks);
+
+   if (record->id >= decode->nsites || !decode->sites[record->id].format) {
+      printf("[DEBUG]: <unknown site %u>\n", record->id);
+      return;
+   }
+
+   site = &decode->sites[record->id];
+   fmt = site->format;
+   fmt_end = fmt + site->fmt_len;
+
+   printf("[DEBUG]: ");
+
+   while (fmt < fmt_end) {
+      char         spec[64];
+      size_t       n = 0;
+      opium_s32_t  i32;
+      opium_s64_t  i64;
+      double       f64;
+      u_char      *str;
+      opium_u16_t  len;
+
+      if (*fmt != '%') {
+         putchar(*fmt++);
+         continue;
+      }
+
+      if (fmt + 1 < fmt_end && fmt[1] == '%') {
+         putchar('%');
+         fmt = fmt + 2;
+         continue;
+      }
+
+      /* Rebuild the conversion with '*' replaced by the stored values */
+      spec[n++] = *fmt++;
+
+      while (fmt < fmt_end && strchr("-+ #0'*.0123456789", *fmt) && n < sizeof(spec) - 16) {
+         if (*fmt == '*') {
+            if (arg >= site->nargs
+                  || opium_log_decode_arg(&body, end, OPIUM_LOG_ARG_I32, &i32, &len) != 0) {
+               goto truncated;
+            }
+            arg = arg + 1;
+            n = n + snprintf(spec + n, sizeof(spec) - n, "%d", i32);
+            fmt = fmt + 1;
+            continue;
+         }
+         spec[n++] = *fmt++;
+      }
+
+      /* Drop the original length modifier, the class decides it */
+      while (fmt < fmt_end && strchr("hljztqL", *fmt)) {
+         fmt = fmt + 1;
+      }
+
+      if (fmt >= fmt_end || arg >= site->nargs) {
+         goto truncated;
+      }
+
+      switch (site->types[arg]) {
+         case OPIUM_LOG_ARG_I64:
+            spec[n++] = 'l';
+            spec[n++] = 'l';
+            break;
+         case OPIUM_LOG_ARG_PTR:
+            spec[n] = '\0';
+            fmt = fmt + 1;
+            break;
+         default:
+            break;
+      }
+
+      if (site->types[arg] != OPIUM_LOG_ARG_PTR) {
+         spec[n++] = *fmt++;
+         spec[n] = '\0';
+      }
+
+      switch (site->types[arg]) {
+         case OPIUM_LOG_ARG_I32:
+            if (opium_log_decode_arg(&body, end, OPIUM_LOG_ARG_I32, &i32, &len) != 0) {
+               goto truncated;
+            }
+            printf(spec, i32);
+            break;
+         case OPIUM_LOG_ARG_I64:
+            if (opium_log_decode_arg(&body, end, OPIUM_LOG_ARG_I64, &i64, &len) != 0) {
+               goto truncated;
+            }
+            printf(spec, (long long)i64);
+            break;
+         case OPIUM_LOG_ARG_PTR:
+            if (opium_log_decode_arg(&body, end, OPIUM_LOG_ARG_PTR, &i64, &len) != 0) {
+               goto truncated;
+            }
+            opium_log_decode_ptr(spec, (opium_u64_t)i64);
+            break;
+         case OPIUM_LOG_ARG_F64:
+            if (opium_log_decode_arg(&body, end, OPIUM_LOG_ARG_F64, &f64, &len) != 0) {
+               goto truncated;
+            }
+            printf(spec, f64);
+            break;
+         case OPIUM_LOG_ARG_STR: {
+            char *copy;
+
+            if (opium_log_decode_arg(&body, end, OPIUM_LOG_ARG_STR, &str, &len) != 0) {
+               goto truncated;
+            }
+
+            copy = strndup((char*)str, len);
+            printf(spec, copy ? copy : "");
+            free(copy);
+            break;
+         }
+         default:
+            goto truncated;
+      }
+
+      arg = arg + 1;
+   }
+
+   return;
+
+truncated:
+   printf(" <truncated record>\n");
+}
+
+   static int
+opium_log_decode_pass(opium_log_decode_t *decode, u_char *data, size_t size, int render)
+{
+   u_char *pos = data + sizeof(opium_log_bin_header_t);
+   u_char *end = data + size;
+
+   while ((size_t)(end - pos) >= sizeof(opium_log_bin_record_t)) {
+      opium_log_bin_record_t record;
+
+      memcpy(&record, pos, sizeof(record));
+
+      if (record.size < sizeof(record) || record.size > (size_t)(end - pos)) {
+         fprintf(stderr, "opium_log_decode: corrupted record at offset %zu\n", (size_t)(pos - data));
+         return -1;
+      }
+
+      if (!render && record.kind == OPIUM_LOG_BIN_SITE) {
+         if (opium_log_decode_site(decode, &record, pos + sizeof(record), pos + record.size) != 0) {
+            fprintf(stderr, "opium_log_decode: bad site record %u\n", record.id);
+         }
+      }
+
+      if (render && record.kind == OPIUM_LOG_BIN_ENTRY) {
+         opium_log_decode_entry(decode, &record, pos + sizeof(record), pos + record.size);
+      }
+
+      pos = pos + record.size;
+   }
+
+   return 0;
+}
+
+   int
+main(int argc, char **argv)
+{
+   opium_log_decode_t  decode;
+   struct stat         st;
+   u_char             *data;
+   int                 fd, ret = 1;
+
+   if (argc != 2) {
+      fprintf(stderr, "usage: %s <binary log>\n", argv[0]);
+      return 1;
+   }
+
+   fd = open(argv[1], O_RDONLY);
+   if (fd == -1 || fstat(fd, &st) == -1) {
+      fprintf(stderr, "opium_log_decode: %s: %s\n", argv[1], strerror(errno));
+      return 1;
+   }
+
+   if ((size_t)st.st_size < sizeof(opium_log_bin_header_t)) {
+      fprintf(stderr, "opium_log_decode: %s: file too short\n", argv[1]);
+      close(fd);
+      return 1;
+   }
+
+   data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) {
+      fprintf(stderr, "opium_log_decode: mmap failed: %s\n", strerror(errno));
+      return 1;
+   }
+
+   memset(&decode, 0, sizeof(decode));
+   memcpy(&decode.header, data, sizeof(decode.header));
+
+   if (memcmp(decode.header.magic, OPIUM_LOG_BIN_MAGIC, sizeof(decode.header.magic)) != 0
+         || decode.header.version != OPIUM_LOG_BIN_VERSION) {
+      fprintf(stderr, "opium_log_decode: %s: not an opium binary log\n", argv[1]);
+      goto done;
+   }
+
+   if (opium_log_decode_pass(&decode, data, st.st_size, 0) == 0
+         && opium_log_decode_pass(&decode, data, st.st_size, 1) == 0) {
+      ret = 0;
+   }
+
+done:
+   for (size_t index = 0; index < decode.nsites; index++) {
+      free((void*)decode.sites[index].format);
+      free((void*)decode.sites[index].file);
+   }
+   free(decode.sites);
+   munmap(data, st.st_size);
+
+   return ret;
+}
@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+
+#include "access.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Access log: one line per request, formatted by hand straight into the
+// worker's current chunk (no stdio, no locks). Full chunks are handed to a
+// single writer thread which writev()s every full chunk of every worker in
+// one call. A worker never waits: if its ring has no free chunk the line is
+// dropped and counted.
+//
+// Line format:
+//   <unix time>.<msec> <method> <url> <status> <bytes> <latency>us
+
+#define ONION_ACCESS_IOV_MAX 64
+#define ONION_ACCESS_IDLE_MS 10
+
+static onion_access_log_t *_Atomic onion_access;
+static __thread onion_access_buf_t *onion_access_self;
+
+static uint64_t onion_access_now_ms(clockid_t clock) {
+   struct timespec ts;
+   clock_gettime(clock, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static char *onion_access_put_u64(char *pos, uint64_t value) {
+   char tmp[20];
+   int len = 0;
+
+   do {
+      tmp[len++] = '0' + value % 10;
+      value /= 10;
+   } while (value);
+
+   while (len > 0) {
+      *pos++ = tmp[--len];
+   }
+   return pos;
+}
+
+static char *onion_access_put_str(char *pos, const char *str, size_t len) {
+   memcpy(pos, str, len);
+   return pos + len;
+}
+
+static const char *onion_access_method_name(onion_http_method_t method) {
+   if (method < ONION_HTTP_METHOD_GET || method >= ONION_HTTP_METHOD_INVALID) {
+      return "-";
+   }
+   return ONION_HTTP_METHOD_LIST[method].name;
+}
+
+// Hand a chunk over to the writer and move on to the next one.
+static void onion_access_publish(onion_access_buf_t *buf) {
+   onion_access_chunk_t *chunk = &buf->chunks[buf->head % ONION_ACCESS_CHUNKS];
+   if (chunk->len == 0) {
+      return;
+   }
+
+   atomic_store_explicit(&chunk->state, ONION_ACCESS_CHUNK_FULL, memory_order_release);
+   buf->head++;
+}
+
+static onion_access_chunk_t *onion_access_chunk_get(onion_access_buf_t *buf) {
+   onion_access_chunk_t *chunk = &buf->chunks[buf->head % ONION_ACCESS_CHUNKS];
+   if (atomic_load_explicit(&chunk->state, memory_order_acquire) != ONION_ACCESS_CHUNK_FREE) {
+      // The writer is behind by a whole ring
+      return NULL;
+   }
+
+   if (chunk->len + ONION_ACCESS_LINE_MAX > ONION_ACCESS_CHUNK_SIZE) {
+      onion_access_publish(buf);
+      return onion_access_chunk_get(buf);
+   }
+   return chunk;
+}
+
+void onion_access_log(onion_access_buf_t *buf, onion_http_method_t method, const char *url, size_t url_len,
+                      int status, size_t bytes, uint64_t latency_us) {
+   if (!buf) {
+      return;
+   }
+
+   onion_access_chunk_t *chunk = onion_access_chunk_get(buf);
+   if (!chunk) {
+      atomic_fetch_add_explicit(&buf->dropped, 1, memory_order_relaxed);
+      return;
+   }
+
+   uint64_t now = onion_access_now_ms(CLOCK_REALTIME_COARSE);
+   if (chunk->len == 0) {
+      buf->first_ms = onion_access_now_ms(CLOCK_MONOTONIC_COARSE);
+   }
+
+   const char *name = onion_access_method_name(method);
+   char *pos = chunk->data + chunk->len;
+
+   pos = onion_access_put_u64(pos, now / 1000);
+   *pos++ = '.';
+   *pos++ = '0' + (now % 1000) / 100;
+   *pos++ = '0' + (now % 100) / 10;
+   *pos++ = '0' + now % 10;
+   *pos++ = ' ';
+
+   pos = onion_access_put_str(pos, name, strlen(name));
+   *pos++ = ' ';
+
+   if (!url || url_len == 0) {
+      *pos++ = '-';
+   } else {
+      if (url_len > ONION_ACCESS_URL_MAX) {
+         url_len = ONION_ACCESS_URL_MAX;
+      }
+      // Never let a request split the line or inject control bytes
+      for (size_t index = 0; index < url_len; index++) {
+         unsigned char ch = url[index];
+         *pos++ = (ch <= ' ' || ch == 0x7f) ? '?' : ch;
+      }
+   }
+   *pos++ = ' ';
+
+   pos = onion_access_put_u64(pos, status < 0 ? 0 : (uint64_t)status);
+   *pos++ = ' ';
+   pos = onion_access_put_u64(pos, bytes);
+   *pos++ = ' ';
+   pos = onion_access_put_u64(pos, latency_us);
+   *pos++ = 'u';
+   *pos++ = 's';
+   *pos++ = '\n';
+
+   chunk->len = pos - chunk->data;
+}
+
+// Called from the worker's timer: publish a partial chunk once it is old
+// enough, so quiet servers still get their lines on disk.
+void onion_access_tick(onion_access_buf_t *buf) {
+   onion_access_log_t *access = atomic_load_explicit(&onion_access, memory_order_acquire);
+   if (!buf || !access) {
+      return;
+   }
+
+   onion_access_chunk_t *chunk = &buf->chunks[buf->head % ONION_ACCESS_CHUNKS];
+   if (chunk->len == 0 || atomic_load_explicit(&chunk->state, memory_order_acquire) != ONION_ACCESS_CHUNK_FREE) {
+      return;
+   }
+
+   if (onion_access_now_ms(CLOCK_MONOTONIC_COARSE) - buf->first_ms >= access->flush_ms) {
+      onion_access_publish(buf);
+   }
+}
+
+static int onion_access_open(const char *path) {
+   int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+   if (fd < 0) {
+      DEBUG_ERR("Access log open failed: %s\n", path);
+   }
+   return fd;
+}
+
+static void onion_access_writev(int fd, struct iovec *iov, int iovcnt) {
+   while (iovcnt > 0) {
+      ssize_t ret = writev(fd, iov, iovcnt);
+      if (ret < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         DEBUG_ERR("Access log writev failed\n");
+         return;
+      }
+
+      while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+         ret -= iov->iov_len;
+         iov++;
+         iovcnt--;
+      }
+
+      if (iovcnt > 0) {
+         iov->iov_base = (char*)iov->iov_base + ret;
+         iov->iov_len -= ret;
+      }
+   }
+}
+
+// Collect every full chunk of every worker into one writev().
+static size_t onion_access_drain(onion_access_log_t *access) {
+   struct iovec iov[ONION_ACCESS_IOV_MAX];
+   onion_access_chunk_t *taken[ONION_ACCESS_IOV_MAX];
+   int iovcnt = 0;
+
+   for (int index = 0; index < access->count; index++) {
+      onion_access_buf_t *buf = &access->bufs[index];
+      size_t tail = buf->tail;
+
+      // At most one lap: chunks taken in this pass are still FULL
+      while (iovcnt < ONION_ACCESS_IOV_MAX && tail - buf->tail < ONION_ACCESS_CHUNKS) {
+         onion_access_chunk_t *chunk = &buf->chunks[tail % ONION_ACCESS_CHUNKS];
+         if (atomic_load_explicit(&chunk->state, memory_order_acquire) != ONION_ACCESS_CHUNK_FULL) {
+            break;
+         }
+         iov[iovcnt].iov_base = chunk->data;
+         iov[iovcnt].iov_len = chunk->len;
+         taken[iovcnt] = chunk;
+         iovcnt++;
+         tail++;
+      }
+      buf->tail = tail;
+   }
+
+   if (iovcnt == 0) {
+      return 0;
+   }
+
+   if (access->fd >= 0) {
+      onion_access_writev(access->fd, iov, iovcnt);
+   }
+
+   for (int index = 0; index < iovcnt; index++) {
+      taken[index]->len = 0;
+      atomic_store_explicit(&taken[index]->state, ONION_ACCESS_CHUNK_FREE, memory_order_release);
+   }
+
+   return iovcnt;
+}
+
+static void *onion_access_writer(void *arg) {
+   onion_access_log_t *access = arg;
+   struct timespec ts = {.tv_sec = 0, .tv_nsec = ONION_ACCESS_IDLE_MS * 1000000};
+
+   while (!atomic_load_explicit(&access->stop, memory_order_acquire)) {
+      if (atomic_exchange(&access->reopen, false)) {
+         // Rotation: the old file was renamed away, start a fresh one
+         int fd = onion_access_open(access->path);
+         if (fd >= 0) {
+            if (access->fd >= 0) {
+               close(access->fd);
+            }
+            access->fd = fd;
+         }
+      }
+
+      if (onion_access_drain(access) == 0) {
+         nanosleep(&ts, NULL);
+      }
+   }
+
+   while (onion_access_drain(access) > 0);
+   return NULL;
+}
+
+static void onion_access_free(onion_access_log_t *access) {
+   if (access->bufs) {
+      for (int index = 0; index < access->count; index++) {
+         for (int chunk = 0; chunk < ONION_ACCESS_CHUNKS; chunk++) {
+            free(access->bufs[index].chunks[chunk].data);
+         }
+      }
+      free(access->bufs);
+   }
+
+   if (access->fd >= 0) {
+      close(access->fd);
+   }
+
+   free(access->path);
+   free(access);
+}
+
+int onion_access_init(const char *path, int workers, size_t flush_ms) {
+   if (!path || workers < 1) {
+      DEBUG_ERR("Access log needs a path and at least one worker.\n");
+      return -1;
+   }
+
+   if (atomic_load(&onion_access)) {
+      DEBUG_ERR("Access log already initialized.\n");
+      return -1;
+   }
+
+   onion_access_log_t *access = calloc(1, sizeof(*access));
+   if (!access) {
+      DEBUG_ERR("Access log allocation failed.\n");
+      return -1;
+   }
+
+   access->fd = -1;
+   access->count = workers;
+   access->flush_ms = flush_ms > 0 ? flush_ms : ONION_ACCESS_FLUSH_MS;
+
+   access->path = strdup(path);
+   if (!access->path) {
+      goto unsuccessfull;
+   }
+
+   access->bufs = calloc(workers, sizeof(onion_access_buf_t));
+   if (!access->bufs) {
+      goto unsuccessfull;
+   }
+
+   for (int index = 0; index < workers; index++) {
+      for (int chunk = 0; chunk < ONION_ACCESS_CHUNKS; chunk++) {
+         access->bufs[index].chunks[chunk].data = malloc(ONION_ACCESS_CHUNK_SIZE);
+         if (!access->bufs[index].chunks[chunk].data) {
+            goto unsuccessfull;
+         }
+      }
+   }
+
+   access->fd = onion_access_open(access->path);
+   if (access->fd < 0) {
+      goto unsuccessfull;
+   }
+
+   if (pthread_create(&access->flow, NULL, onion_access_writer, access) != 0) {
+      DEBUG_ERR("Access log writer thread failed.\n");
+      goto unsuccessfull;
+   }
+
+   atomic_store_explicit(&onion_access, access, memory_order_release);
+   DEBUG_FUNC("Access log initialized: %s (%d workers)\n", path, workers);
+   return 0;
+unsuccessfull:
+   onion_access_free(access);
+   return -1;
+}
+
+// Workers must be stopped before: their current chunks are published here.
+void onion_access_exit(void) {
+   onion_access_log_t *access = atomic_exchange(&onion_access, NULL);
+   if (!access) {
+      return;
+   }
+
+   for (int index = 0; index < access->count; index++) {
+      onion_access_buf_t *buf = &access->bufs[index];
+      onion_access_chunk_t *chunk = &buf->chunks[buf->head % ONION_ACCESS_CHUNKS];
+      if (atomic_load_explicit(&chunk->state, memory_order_acquire) == ONION_ACCESS_CHUNK_FREE) {
+         onion_access_publish(buf);
+      }
+   }
+
+   atomic_store_explicit(&access->stop, true, memory_order_release);
+   pthread_join(access->flow, NULL);
+
+   onion_access_free(access);
+}
+
+onion_access_buf_t *onion_access_buf_get(int worker) {
+   onion_access_log_t *access = atomic_load_explicit(&onion_access, memory_order_acquire);
+   if (!access || worker < 0 || worker >= access->count) {
+      return NULL;
+   }
+   return &access->bufs[worker];
+}
+
+void onion_access_bind(onion_access_buf_t *buf) {
+   onion_access_self = buf;
+}
+
+onion_access_buf_t *onion_access_current(void) {
+   return onion_access_self;
+}
+
+// Safe to call from a SIGHUP handler: it only sets a flag for the writer.
+void onion_access_reopen(void) {
+   onion_access_log_t *access = atomic_load_explicit(&onion_access, memory_order_acquire);
+   if (access) {
+      atomic_store_explicit(&access->reopen, true, memory_order_release);
+   }
+}
+
+size_t onion_access_dropped(void) {
+   onion_access_log_t *access = atomic_load_explicit(&onion_access, memory_order_acquire);
+   size_t dropped = 0;
+   if (!access) {
+      return 0;
+   }
+   for (int index = 0; index < access->count; index++) {
+      dropped += atomic_load_explicit(&access->bufs[index].dropped, memory_order_relaxed);
+   }
+   return dropped;
+}
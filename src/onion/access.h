@@ -0,0 +1,72 @@
+#ifndef ONION_ACCESS_H
+#define ONION_ACCESS_H
+
+#include "http.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ONION_ACCESS_CHUNK_SIZE (64 * 1024)
+#define ONION_ACCESS_CHUNKS 4
+#define ONION_ACCESS_URL_MAX 1024
+#define ONION_ACCESS_LINE_MAX (ONION_ACCESS_URL_MAX + 128)
+#define ONION_ACCESS_FLUSH_MS 1000
+
+typedef enum {
+   ONION_ACCESS_CHUNK_FREE = 0,
+   ONION_ACCESS_CHUNK_FULL
+} onion_access_chunk_state_t;
+
+// Chunk of preformatted lines. The worker fills it while it is FREE,
+// publishes it as FULL, the writer thread writes it out and frees it.
+typedef struct {
+   _Atomic int state;
+   size_t len;
+   char *data;
+} onion_access_chunk_t;
+
+// One per epoll worker: a small ring of chunks, the worker only moves
+// head, the writer only moves tail.
+typedef struct onion_access_buf {
+   onion_access_chunk_t chunks[ONION_ACCESS_CHUNKS];
+   size_t head;
+   size_t tail;
+
+   uint64_t first_ms;
+   _Atomic size_t dropped;
+} onion_access_buf_t;
+
+typedef struct {
+   onion_access_buf_t *bufs;
+   int count;
+
+   int fd;
+   char *path;
+   size_t flush_ms;
+
+   _Atomic bool reopen;
+   _Atomic bool stop;
+   pthread_t flow;
+} onion_access_log_t;
+
+int onion_access_init(const char *path, int workers, size_t flush_ms);
+void onion_access_exit(void);
+
+onion_access_buf_t *onion_access_buf_get(int worker);
+
+// Buffer of the calling worker thread, bound once when its loop starts, so
+// code deep in a request (the parser) logs without carrying it around
+void onion_access_bind(onion_access_buf_t *buf);
+onion_access_buf_t *onion_access_current(void);
+
+void onion_access_log(onion_access_buf_t *buf, onion_http_method_t method, const char *url, size_t url_len,
+                      int status, size_t bytes, uint64_t latency_us);
+void onion_access_tick(onion_access_buf_t *buf);
+
+void onion_access_reopen(void);
+size_t onion_access_dropped(void);
+
+#endif
@@ -0,0 +1,59 @@
+#define _GNU_SOURCE
+
+#include "core/opium_core.h"
+
+#include "cpu.h"
+#include "utils.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Topology discovery and placement live in the opium core
+// (project/core/opium_cpu.c), which the library is built with; this only
+// maps the onion policy names onto it.
+
+static opium_cpu_place_t onion_cpu_policy(onion_cpu_place_t policy) {
+   switch (policy) {
+      case ONION_CPU_PLACE_SPREAD_LLC:
+         return OPIUM_CPU_PLACE_SPREAD_LLC;
+      case ONION_CPU_PLACE_PACK:
+         return OPIUM_CPU_PLACE_PACK;
+      case ONION_CPU_PLACE_PHYSICAL:
+      default:
+         return OPIUM_CPU_PLACE_PHYSICAL;
+   }
+}
+
+int onion_cpu_allowed_count(void) {
+   cpu_set_t allowed;
+   if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+      return sysconf(_SC_NPROCESSORS_ONLN);
+   }
+   return CPU_COUNT(&allowed);
+}
+
+// Writes 'count' CPU numbers into 'cpus', wrapping around when there are
+// more threads than allowed CPUs.
+int onion_cpu_place(onion_cpu_place_t policy, int count, int *cpus) {
+   if (count < 1 || !cpus) {
+      return -1;
+   }
+
+   // One slot per possible CPU, too large for a worker stack
+   opium_cpuinfo_t *info = malloc(sizeof(opium_cpuinfo_t));
+   if (!info) {
+      DEBUG_ERR("CPU topology allocation failed\n");
+      return -1;
+   }
+
+   int ret = 0;
+   if (opium_cpuinfo_init(info, NULL) != OPIUM_RET_OK
+         || opium_cpu_place(info, onion_cpu_policy(policy), count, cpus) != OPIUM_RET_OK) {
+      DEBUG_ERR("CPU placement failed\n");
+      ret = -1;
+   }
+
+   free(info);
+   return ret;
+}
@@ -0,0 +1,17 @@
+#ifndef ONION_CPU_H
+#define ONION_CPU_H
+
+// Placement of epoll threads on the CPUs the process is allowed to use:
+//   PHYSICAL   - one thread per physical core, hyperthread siblings last
+//   SPREAD_LLC - round-robin over last level cache domains
+//   PACK       - fill one LLC domain (siblings included) before the next
+typedef enum {
+   ONION_CPU_PLACE_PHYSICAL = 0,
+   ONION_CPU_PLACE_SPREAD_LLC,
+   ONION_CPU_PLACE_PACK
+} onion_cpu_place_t;
+
+int onion_cpu_allowed_count(void);
+int onion_cpu_place(onion_cpu_place_t policy, int count, int *cpus);
+
+#endif
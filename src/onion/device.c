@@ -4,10 +4,12 @@
 #include "epoll.h"
 #include "socket.h"
 #include "device.h"
+#include "access.h"
 #include "pool.h"
 #include "utils.h"
 
 #include <arpa/inet.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <sched.h>
@@ -158,22 +160,66 @@ free_this_trash:
    return ret;
 }*/
 
-struct onion_worker_head *big_smoke;
+// Registry of the running device. Every listener event looks its worker
+// up here, so readers are the loop threads and the only writers are
+// onion_device_init() and onion_device_exit(). A lock would not keep the
+// head alive past the lookup anyway: what does is that onion_device_exit()
+// joins every loop thread before it frees anything, so a plain publish
+// and acquire load is all the readers need.
+static struct onion_worker_head *_Atomic big_smoke;
 
 struct onion_worker_head *get_worker_head_by_worker(struct onion_worker *worker) {
-   return big_smoke;
+   return atomic_load_explicit(&big_smoke, memory_order_acquire);
 }
 
+// NULL once the device is going away. The worker itself stays valid for
+// the caller: its loop thread is joined before the worker is released.
 struct onion_worker *onion_get_worker_by_epoll(onion_epoll_t *target) {
-   for (long index = 0; index < big_smoke->capable; index++) {
-      struct onion_worker *worker = (struct onion_worker*)onion_block_get(big_smoke->workers, index); 
+   struct onion_worker_head *head = atomic_load_explicit(&big_smoke, memory_order_acquire);
+
+   for (long index = 0; head && index < head->capable; index++) {
+      struct onion_worker *worker = (struct onion_worker*)onion_block_get(head->workers, index); 
       if (worker->epoll == target) {
          return worker;
       }
    }
+
    return NULL;
 }
 
+static void onion_dev_accept_deferred(void *arg);
+
+// Drains the listener up to the configured budget. With the budget spent
+// the rest of the backlog is picked up after this batch of events, so a
+// connect storm cannot starve the peers the worker already serves.
+static int onion_dev_accept(struct onion_worker *worker) {
+   int budget = worker->accept_budget;
+
+   int ret = onion_accept_net(worker->server_sock, budget);
+   bool more = ret >= budget;
+
+   if (worker->local_sock) {
+      int local = onion_accept_net(worker->local_sock, budget);
+      more = more || local >= budget;
+      if (local > 0) {
+         ret = ret > 0 ? ret + local : local;
+      }
+   }
+
+   if (more && !worker->accept_pending) {
+      if (onion_epoll_defer(worker->epoll, onion_dev_accept_deferred, worker) == 0) {
+         worker->accept_pending = true;
+      }
+   }
+   return ret;
+}
+
+static void onion_dev_accept_deferred(void *arg) {
+   struct onion_worker *worker = arg;
+   worker->accept_pending = false;
+   onion_dev_accept(worker);
+}
+
 void *onion_dev_handler(struct onion_thread_my_args *args) {
    int ret;
    onion_epoll_static_t *epoll_static = args->ep_st;
@@ -192,9 +238,8 @@ void *onion_dev_handler(struct onion_thread_my_args *args) {
       return NULL;
    }
 
-   onion_server_net *net = worker->server_sock;
-   ret = onion_accept_net(net);
-   if (ret < 0) {
+   ret = onion_dev_accept(worker);
+   if (ret <= 0) {
       //DEBUG_FUNC("No client!\n");
       return NULL;      
    } 
@@ -243,6 +288,11 @@ int onion_dev_worker_init(struct onion_worker_head *head, struct onion_tcp_port_
 
    worker->epoll = epoll;
    worker->server_sock = net_server;
+   worker->local_sock = NULL;
+   // 0 once the config turned the budget off: no limit
+   int budget = onion_config_accept_budget();
+   worker->accept_budget = budget > 0 ? budget : INT_MAX;
+   worker->accept_pending = false;
    head->count = head->count + 1;
 
    DEBUG_FUNC("Worked allocated! Peer max: %d\n", peers_capable);
@@ -253,6 +303,35 @@ unsuccessfull:
    return -1;
 }
 
+// The first worker binds 'path', the others accept from a dup of it
+int onion_dev_local_init(struct onion_worker_head *head, const char *path, int peers_capable, int queue_capable) {
+   onion_server_net_conf conf = {
+      .peers_capable = peers_capable,
+      .queue_capable = queue_capable,
+      .port_conf = {
+         .domain = AF_UNIX,
+         .type = SOCK_STREAM,
+         .path = path
+      }
+   };
+
+   for (long index = 0; index < head->count; index++) {
+      struct onion_worker *worker = onion_block_get(head->workers, index);
+      if (!worker) {
+         continue;
+      }
+
+      worker->local_sock = onion_server_net_init(head->net_static, &conf);
+      if (!worker->local_sock) {
+         DEBUG_ERR("Worker %ld unix listener failed.\n", index);
+         return -1;
+      }
+      conf.port_conf.share = worker->local_sock->sock;
+   }
+
+   return 0;
+}
+
 void onion_dev_worker_exit(struct onion_worker_head *head, struct onion_worker *worker) {
    onion_epoll_t *epoll = worker->epoll;
    if (epoll && epoll->initialized) {
@@ -266,13 +345,20 @@ void onion_dev_worker_exit(struct onion_worker_head *head, struct onion_worker *
       onion_server_net_exit(net_static, net);
    }
 
+   net = worker->local_sock;
+   if (net && net->initialized) {
+      onion_net_static_t *net_static = onion_get_static_by_net(net);
+      onion_server_net_exit(net_static, net);
+   }
+   worker->local_sock = NULL;
+
    onion_block_free(head->workers, worker);
 }
 
 int onion_device_init(struct onion_worker_head **ptr, uint16_t port, long core_count, int peers_capable, int queue_capable) {
    int ret;
 
-   if (big_smoke) {
+   if (atomic_load(&big_smoke)) {
       DEBUG_ERR("Big smoke already existing!\n");
       return -1;
    }
@@ -306,6 +392,17 @@ int onion_device_init(struct onion_worker_head **ptr, uint16_t port, long core_c
 
    head->count = 0;
    head->capable = core_count;
+   head->epoll_static = NULL;
+   head->net_static = NULL;
+
+   onion_config_t config;
+   onion_config_get(&config);
+
+   // Before the workers: each one picks up its buffer in onion_epoll1_init()
+   if (config.access_log[0] && onion_access_init(config.access_log, head->capable, 0) < 0) {
+      DEBUG_ERR("Access log %s initialization failed.\n", config.access_log);
+      goto unsuccessfull;
+   }
 
    ret = onion_epoll_static_init(&head->epoll_static, head->capable);
    if (ret < 0) {
@@ -313,7 +410,8 @@ int onion_device_init(struct onion_worker_head **ptr, uint16_t port, long core_c
       goto unsuccessfull;
    }
 
-   ret = onion_net_static_init(&head->net_static, head->capable);
+   // One TCP listener per worker, plus its share of the unix listener
+   ret = onion_net_static_init(&head->net_static, config.unix_path[0] ? head->capable * 2 : head->capable);
    if (ret < 0) {
       DEBUG_ERR("onion_net_static_t initialization failed.\n");
       goto unsuccessfull;
@@ -324,7 +422,8 @@ int onion_device_init(struct onion_worker_head **ptr, uint16_t port, long core_c
       .domain = AF_INET,
       .type = SOCK_STREAM,
       .port = htons(port),
-      .addr.s_addr = htonl(INADDR_ANY)
+      .addr.s_addr = htonl(INADDR_ANY),
+      .tuning = config.sock_tuning
    };
 
    int peers_per_core = peers_capable / head->capable;
@@ -339,7 +438,24 @@ int onion_device_init(struct onion_worker_head **ptr, uint16_t port, long core_c
       }
    }
 
-   big_smoke = head;
+   if (config.unix_path[0] && onion_dev_local_init(head, config.unix_path, peers_per_core + (peers_remain ? 1 : 0), queue_capable) < 0) {
+      DEBUG_ERR("Unix listener %s initialization failed.\n", config.unix_path);
+      goto unsuccessfull;
+   }
+
+   // Workers were created in order, so listener i belongs to the worker on
+   // cpus[i]. One attach is enough: the kernel keeps the program on the
+   // SO_REUSEPORT group all TCP listeners joined at bind(), not on the
+   // socket it was set through, and it indexes the group in listen() order
+   // (tests/steer checks both). The unix listener is not in the group.
+   if (config.reuseport_steering) {
+      struct onion_worker *first = onion_block_get(head->workers, 0);
+      if (onion_net_sock_reuseport_steer(first->server_sock->sock->fd, head->epoll_static->cpus, head->capable) < 0) {
+         DEBUG_ERR("Reuseport steering not applied, the kernel hash spreads connections.\n");
+      }
+   }
+
+   atomic_store_explicit(&big_smoke, head, memory_order_release);
    *ptr = head;
    return 0;
 unsuccessfull:
@@ -348,7 +464,8 @@ unsuccessfull:
 }
 
 void onion_device_exit(struct onion_worker_head *head) {
-   big_smoke = NULL;
+   struct onion_worker_head *expected = head;
+   atomic_compare_exchange_strong(&big_smoke, &expected, NULL);
 
    for (int index = 0; index < head->capable; index++) {
       struct onion_worker *worker = onion_block_get(head->workers, index);
@@ -368,5 +485,8 @@ void onion_device_exit(struct onion_worker_head *head) {
       head->epoll_static = NULL;
    }
 
+   // Workers are gone, their last lines are published here
+   onion_access_exit();
+
    free(head);
 }
@@ -24,12 +24,20 @@ struct onion_worker_head {
 
 struct onion_worker {
    onion_server_net *server_sock;
+   // AF_UNIX listener, shared by all workers; NULL when not configured
+   onion_server_net *local_sock;
    onion_epoll_t *epoll;
+
+   // Connections accepted per wakeup, from the config at init
+   int accept_budget;
+   // Accept budget ran out, a deferred drain is queued on the worker
+   bool accept_pending;
 };
 
 typedef void (*onion_accept_callback_sk)(int peer_fd, onion_peer_net *);
 
 int onion_dev_worker_init(struct onion_worker_head *onion_workers, struct onion_tcp_port_conf port_conf, int peers_capable, int queue_capable);
+int onion_dev_local_init(struct onion_worker_head *head, const char *path, int peers_capable, int queue_capable);
 void onion_dev_worker_exit(struct onion_worker_head *onion_workers, struct onion_worker *worker);
 
 int onion_device_init(struct onion_worker_head **head, uint16_t port, long core_count, int peers_capable, int queue_capable);
@@ -1,6 +1,10 @@
 #define _GNU_SOURCE
 
 #include "epoll.h"
+#include "access.h"
+#include "cpu.h"
+#include "fiber.h"
+#include "onion.h"
 #include "utils.h"
 #include "pool.h"
 #include "sup.h"
@@ -23,7 +27,8 @@
 #include <sys/eventfd.h>
 #include <sys/timerfd.h>
 
-onion_epoll_static_t *big_smoke;
+// Registry of the epoll static, see net.c
+static onion_epoll_static_t *_Atomic big_smoke;
 
 int onion_set_worker_core(pthread_t thread, int core_id) {
    cpu_set_t *set_t = CPU_ALLOC(core_id + 1);
@@ -54,7 +59,7 @@ int onion_fd_is_valid(int fd) {
 
 // THIS FUNCTION WILL BE UPDATED MAYBE BABY
 onion_epoll_static_t *onion_get_static_by_epoll(onion_epoll_t *ep) {
-   return big_smoke;
+   return atomic_load_explicit(&big_smoke, memory_order_acquire);
 }
 
 void onion_epoll_tag_set(onion_epoll_tag_t *tag, int fd, onion_handler_ret_t type, void *data) {
@@ -155,9 +160,145 @@ onion_handler_ret_t onion_handle_timer(onion_epoll_t *ep) {
          onion_epoll_slot_del(ep, slot);
       }
    }
+
+   onion_access_tick(ep->access);
    return ONION_EPOLL_HANDLER_TIMERFD;
 }
 
+static int64_t onion_epoll_now_ns() {
+   struct timespec time;
+   clock_gettime(CLOCK_MONOTONIC, &time);
+   return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// End of a loop turn: charge it to work or to spinning, and open a new
+// spin window after activity. 'blocked' is time asleep in epoll_wait.
+static void onion_epoll_busy_account(onion_epoll_t *ep, int64_t turn_start, int64_t blocked, bool worked, bool spinning) {
+   int64_t now = onion_epoll_now_ns();
+   uint64_t spent = (uint64_t)(now - turn_start - blocked);
+
+   // Single writer: a plain add is enough, readers only need no tearing
+   if (worked) {
+      uint64_t work = atomic_load_explicit(&ep->work_ns, memory_order_relaxed);
+      atomic_store_explicit(&ep->work_ns, work + spent, memory_order_relaxed);
+      ep->spin_until = now + (int64_t)ep->busy_poll_usec * 1000;
+   } else if (spinning) {
+      uint64_t spin = atomic_load_explicit(&ep->spin_ns, memory_order_relaxed);
+      atomic_store_explicit(&ep->spin_ns, spin + spent, memory_order_relaxed);
+   }
+}
+
+void onion_epoll_busy_stats(onion_epoll_t *ep, uint64_t *spin_ns, uint64_t *work_ns) {
+   *spin_ns = atomic_load_explicit(&ep->spin_ns, memory_order_relaxed);
+   *work_ns = atomic_load_explicit(&ep->work_ns, memory_order_relaxed);
+}
+
+// Runs up to ONION_EPOLL_INBOX_BUDGET messages, returns how many ran
+static int onion_epoll_inbox_drain(onion_epoll_t *ep) {
+   queue_msg_t msg;
+   int count = 0;
+   while (count < ONION_EPOLL_INBOX_BUDGET && mpsc_queue_pop(ep->inbox, &msg)) {
+      msg.func(msg.arg);
+      count++;
+   }
+   return count;
+}
+
+// Any thread. Returns -1 when the inbox is full, the caller decides
+// whether to retry, run the work itself or drop it.
+int onion_epoll_post(onion_epoll_t *ep, void (*func) (void*), void *arg) {
+   if (!ep || !ep->inbox || !func) {
+      return -1;
+   }
+
+   queue_msg_t msg = {.func = func, .arg = arg};
+   if (!mpsc_queue_push(ep->inbox, &msg)) {
+      return -1;
+   }
+
+   // Only the first producer after the worker parked pays for the syscall
+   if (mpsc_queue_ring(ep->inbox)) {
+      uint64_t one = 1;
+      if (write(ep->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+         DEBUG_ERR("Failed to ring worker %d doorbell\n", ep->core);
+      }
+   }
+   return 0;
+}
+
+int onion_epoll_defer(onion_epoll_t *ep, void (*func) (void*), void *arg) {
+   if (!ep || !func) {
+      return -1;
+   }
+
+   if (ep->deferred_count == ep->deferred_capable) {
+      int capable = ep->deferred_capable ? ep->deferred_capable * 2 : ONION_EPOLL_DEFERRED_CAPABLE;
+      queue_msg_t *deferred = realloc(ep->deferred, sizeof(queue_msg_t) * capable);
+      if (!deferred) {
+         DEBUG_ERR("Failed to grow deferred queue of worker %d\n", ep->core);
+         return -1;
+      }
+      ep->deferred = deferred;
+      ep->deferred_capable = capable;
+   }
+
+   ep->deferred[ep->deferred_count].func = func;
+   ep->deferred[ep->deferred_count].arg = arg;
+   ep->deferred_count++;
+   return 0;
+}
+
+int onion_epoll_hook_add(onion_epoll_t *ep, void (*func) (void*), void *arg) {
+   if (!ep || !func) {
+      return -1;
+   }
+
+   if (ep->hook_count >= ONION_EPOLL_HOOKS_MAX) {
+      DEBUG_ERR("Worker %d has no free hook slot\n", ep->core);
+      return -1;
+   }
+
+   ep->hooks[ep->hook_count].func = func;
+   ep->hooks[ep->hook_count].arg = arg;
+   ep->hook_count++;
+   return 0;
+}
+
+void onion_epoll_hook_del(onion_epoll_t *ep, void (*func) (void*), void *arg) {
+   for (int index = 0; index < ep->hook_count; index++) {
+      if (ep->hooks[index].func == func && ep->hooks[index].arg == arg) {
+         memmove(&ep->hooks[index], &ep->hooks[index + 1], sizeof(queue_msg_t) * (ep->hook_count - index - 1));
+         ep->hook_count--;
+         return;
+      }
+   }
+}
+
+// What was queued before this point runs now, what these tasks defer
+// waits for the next batch so a task re-deferring itself can't spin here
+static void onion_epoll_deferred_run(onion_epoll_t *ep) {
+   int count = ep->deferred_count;
+   for (int index = 0; index < count; index++) {
+      ep->deferred[index].func(ep->deferred[index].arg);
+   }
+
+   ep->deferred_count -= count;
+   if (ep->deferred_count > 0) {
+      memmove(ep->deferred, ep->deferred + count, sizeof(queue_msg_t) * ep->deferred_count);
+   }
+}
+
+static void onion_epoll_hooks_run(onion_epoll_t *ep) {
+   // A hook may remove itself, walk a copy
+   queue_msg_t hooks[ONION_EPOLL_HOOKS_MAX];
+   int count = ep->hook_count;
+   memcpy(hooks, ep->hooks, sizeof(queue_msg_t) * count);
+
+   for (int index = 0; index < count; index++) {
+      hooks[index].func(hooks[index].arg);
+   }
+}
+
 onion_handler_ret_t onion_epoll_tag_handler(onion_epoll_t *ep, onion_epoll_tag_t *tag, struct epoll_event *event) {
    onion_handler_ret_t ret = ONION_EPOLL_HANDLER_UNKNOWN;
 
@@ -186,6 +327,8 @@ onion_handler_ret_t onion_epoll_tag_handler(onion_epoll_t *ep, onion_epoll_tag_t
       case ONION_EPOLL_HANDLER_EPFD:
          break;
       case ONION_EPOLL_HANDLER_EVENTFD:
+         // Counter was reset by the read above, the loop drains the inbox
+         ret = ONION_EPOLL_HANDLER_EVENTFD;
          break;
       case ONION_EPOLL_HANDLER_TIMERFD:
          ret = onion_handle_timer(ep);
@@ -230,6 +373,8 @@ void *onion_epoll_handler(void *arg) {
       return NULL;
    }
 
+   onion_access_bind(ep->access);
+
    int ret = onion_set_worker_core(pthread_self(), ep->core);
    if (ret < 0) {
       DEBUG_ERR("Failed to set thread affinity inside handler, core = %d\n", ep->core);
@@ -241,7 +386,29 @@ void *onion_epoll_handler(void *arg) {
    struct epoll_event events[ONION_EPOLL_PER_MAX_EVENTS];
 
    while (ep && ep->initialized) {
-      int event_count = epoll_wait(ep->fd, events, ONION_EPOLL_PER_MAX_EVENTS, 1000);
+      int64_t turn_start = ep->busy_poll_usec > 0 ? onion_epoll_now_ns() : 0;
+
+      // Leftover messages or one that raced with parking: just poll
+      int ran = onion_epoll_inbox_drain(ep);
+      bool busy = ran == ONION_EPOLL_INBOX_BUDGET && !mpsc_queue_empty(ep->inbox);
+      int resumed = onion_fiber_sched_run(ep->fibers);
+
+      int timeout = onion_fiber_sched_timeout(ep->fibers, 1000);
+
+      // Inside the spin window: never sleep, so never park either
+      bool spinning = ep->busy_poll_usec > 0 && turn_start < ep->spin_until;
+      if (spinning || ep->deferred_count > 0) {
+         timeout = 0;
+      }
+
+      if (timeout != 0 && (busy || !mpsc_queue_park(ep->inbox))) {
+         timeout = 0;
+      }
+
+      int64_t wait_start = (ep->busy_poll_usec > 0 && timeout != 0) ? onion_epoll_now_ns() : 0;
+      int event_count = epoll_wait(ep->fd, events, ONION_EPOLL_PER_MAX_EVENTS, timeout);
+      int64_t blocked = wait_start ? onion_epoll_now_ns() - wait_start : 0;
+      mpsc_queue_unpark(ep->inbox);
       if (event_count < 0) {
          continue;
       }
@@ -253,6 +420,12 @@ void *onion_epoll_handler(void *arg) {
             continue;
          }
 
+         // The fd belongs to the fiber, do not touch its data here
+         if (tag->type == ONION_EPOLL_HANDLER_FIBER) {
+            onion_fiber_sched_event(ep->fibers, tag, event->events);
+            continue;
+         }
+
          onion_handler_ret_t tag_ret = onion_epoll_tag_handler(ep, tag, event);
 
          if (tag_ret == ONION_EPOLL_HANDLER_UNKNOWN || tag_ret < 0) {
@@ -269,6 +442,22 @@ void *onion_epoll_handler(void *arg) {
             ep->handler(&args);
          }
       }
+
+      // The batch is done: deferred work first, then the hooks see its result
+      bool deferred = ep->deferred_count > 0;
+      if (deferred) {
+         onion_epoll_deferred_run(ep);
+      }
+      if (event_count > 0 && ep->hook_count > 0) {
+         onion_epoll_hooks_run(ep);
+      }
+
+      if (ep->busy_poll_usec > 0) {
+         // Cross-core posts never ring the doorbell while spinning, so
+         // everything the turn ran counts, not only epoll events
+         bool worked = event_count > 0 || ran > 0 || resumed > 0 || deferred;
+         onion_epoll_busy_account(ep, turn_start, blocked, worked, spinning);
+      }
    }
 
 unsuccessfull:
@@ -277,7 +466,8 @@ unsuccessfull:
 }
 
 int onion_epoll_slot_add(onion_epoll_t *ep, int fd, void *data, int (*func) (void*), void (*shutdown) (void*), void *shutdown_data) {
-   if (ep->conn_count + 1 >= ep->conn_max) {
+   // Soft limit, the slots block pool is the hard one
+   if (counter_read_approx(ep->conn_count) + 1 >= ep->conn_max) {
       DEBUG_ERR("Epoll slot limit reached!\n");
       return -1;
    }
@@ -306,7 +496,7 @@ int onion_epoll_slot_add(onion_epoll_t *ep, int fd, void *data, int (*func) (voi
    ep_slot->time_alive = onion_tick();
    ep_slot->time_limit = ONION_ANONYMOUS_TIME_ALIVE;
 
-   ep->conn_count += 1;
+   counter_inc(ep->conn_count);
 
    DEBUG_FUNC("Epoll slot added (fd=%d, pos=%d)\n", fd, start_pos);
    return 0;
@@ -327,7 +517,7 @@ void onion_epoll_slot_del(onion_epoll_t *ep, onion_epoll_slot_t *ep_slot) {
    }
 
    if (ep_slot->start_pos >= 0) {
-      ep->conn_count -= 1;
+      counter_dec(ep->conn_count);
    }
 
    onion_block_free(ep->slots, ep_slot);
@@ -361,12 +551,24 @@ onion_epoll_t *onion_epoll1_init(onion_epoll_static_t *ep_st, onion_handler_t ha
    }
 
    ep->initialized = false;
-   ep->conn_count = 0;
+   ep->conn_count = NULL;
    ep->conn_max = conn_max;
    ep->handler = handler;
-   ep->core = current_core;
+   ep->core = ep_st->cpus[current_core];
    ep->fd = -1;
    ep->eventfd = -1;
+   ep->access = onion_access_buf_get(current_core);
+   ep->inbox = NULL;
+   ep->fibers = NULL;
+   ep->deferred = NULL;
+   ep->deferred_count = 0;
+   ep->deferred_capable = 0;
+   ep->hook_count = 0;
+
+   ep->busy_poll_usec = onion_config_busy_poll_usec();
+   ep->spin_until = 0;
+   atomic_store_explicit(&ep->spin_ns, 0, memory_order_relaxed);
+   atomic_store_explicit(&ep->work_ns, 0, memory_order_relaxed);
 
    ep->fd = epoll_create1(EPOLL_CLOEXEC);
    if (onion_fd_is_valid(ep->fd) == -1) {
@@ -380,6 +582,24 @@ onion_epoll_t *onion_epoll1_init(onion_epoll_static_t *ep_st, onion_handler_t ha
       goto please_free;
    }
 
+   ret = counter_init(&ep->conn_count);
+   if (ret < 0) {
+      DEBUG_ERR("Failed to init connection counter.\n");
+      goto please_free;
+   }
+
+   ret = onion_fiber_sched_init(&ep->fibers, ep->fd);
+   if (ret < 0) {
+      DEBUG_ERR("Failed to init fiber scheduler.\n");
+      goto please_free;
+   }
+
+   ret = mpsc_queue_init(&ep->inbox, ONION_EPOLL_INBOX_CAPABLE);
+   if (ret < 0) {
+      DEBUG_ERR("Failed to init epoll inbox.\n");
+      goto please_free;
+   }
+
    ep->args = (struct onion_thread_args*)onion_block_alloc(ep_st->epolls_args, NULL);
    if (!ep->args) {
       DEBUG_ERR("args initialization failed.\n");
@@ -407,12 +627,6 @@ onion_epoll_t *onion_epoll1_init(onion_epoll_static_t *ep_st, onion_handler_t ha
       goto please_free;
    }
 
-   ret = pthread_create(&ep->flow, NULL, onion_epoll_handler, ep->args); 
-   if (ret < 0) {
-      DEBUG_ERR("pthread_create failed.\n");
-      goto please_free;
-   }
-
    ep->event.events = EPOLLIN | EPOLLOUT | EPOLLET;
 
    ret = onion_integrate_timer(ep);
@@ -424,6 +638,13 @@ onion_epoll_t *onion_epoll1_init(onion_epoll_static_t *ep_st, onion_handler_t ha
    ep_st->count = ep_st->count + 1;
    ep->initialized = true;
 
+   // Last: the loop runs only while 'initialized' is set
+   ret = pthread_create(&ep->flow, NULL, onion_epoll_handler, ep->args); 
+   if (ret != 0) {
+      DEBUG_ERR("pthread_create failed.\n");
+      goto please_free;
+   }
+
    DEBUG_FUNC("Epoll initialized: fd=%d, core=%d, struct size=%zu.\n", ep->fd, ep->core, sizeof(*ep));
    return ep;
 
@@ -443,6 +664,13 @@ void onion_epoll1_exit(onion_epoll_static_t *ep_st, onion_epoll_t *ep) {
 
    onion_liquidate_timer(ep);
 
+   if (ep->busy_poll_usec > 0) {
+      uint64_t spin_ns, work_ns;
+      onion_epoll_busy_stats(ep, &spin_ns, &work_ns);
+      DEBUG_FUNC("Worker %d busy poll: %llu ms spinning, %llu ms working\n", ep->core,
+            (unsigned long long)(spin_ns / 1000000), (unsigned long long)(work_ns / 1000000));
+   }
+
    if (ep->slots) {
       onion_bitmask *bitmask = ep->slots->bitmask;
       onion_epoll_slot_t *slots = (onion_epoll_slot_t *)ep->slots->data;
@@ -465,6 +693,11 @@ void onion_epoll1_exit(onion_epoll_static_t *ep_st, onion_epoll_t *ep) {
       ep->tags = NULL;
    }
 
+   if (ep->conn_count) {
+      counter_exit(ep->conn_count);
+      ep->conn_count = NULL;
+   }
+
    if (onion_fd_is_valid(ep->eventfd)) {
       if (onion_fd_is_valid(ep->fd)) {
          epoll_ctl(ep->fd, EPOLL_CTL_DEL, ep->eventfd, NULL);
@@ -473,11 +706,40 @@ void onion_epoll1_exit(onion_epoll_static_t *ep_st, onion_epoll_t *ep) {
       ep->eventfd = -1;
    }
 
+   if (ep->fibers) {
+      onion_fiber_sched_exit(ep->fibers);
+      ep->fibers = NULL;
+   }
+
    if (onion_fd_is_valid(ep->fd)) {
       close(ep->fd);
       ep->fd = -1;
    }
 
+   if (ep->inbox) {
+      // Worker is gone, whatever is still queued will never run
+      queue_msg_t msg;
+      long dropped = 0;
+      while (mpsc_queue_pop(ep->inbox, &msg)) {
+         dropped++;
+      }
+      if (dropped > 0) {
+         DEBUG_ERR("Dropped %ld inbox messages of worker %d\n", dropped, ep->core);
+      }
+      mpsc_queue_exit(ep->inbox);
+      ep->inbox = NULL;
+   }
+
+   if (ep->deferred) {
+      if (ep->deferred_count > 0) {
+         DEBUG_ERR("Dropped %d deferred tasks of worker %d\n", ep->deferred_count, ep->core);
+      }
+      free(ep->deferred);
+      ep->deferred = NULL;
+      ep->deferred_count = ep->deferred_capable = 0;
+   }
+   ep->hook_count = 0;
+
    onion_block_free(ep_st->epolls_args, ep->args);
    onion_block_free(ep_st->epolls, ep);
 
@@ -493,7 +755,7 @@ void onion_epoll1_exit(onion_epoll_static_t *ep_st, onion_epoll_t *ep) {
 int onion_epoll_static_init(onion_epoll_static_t **ptr, long core_count) {
    int ret;
    
-   if (big_smoke) {
+   if (atomic_load(&big_smoke)) {
       DEBUG_ERR("Big smoke already existing!\n");
       return -1;
    }
@@ -511,6 +773,22 @@ int onion_epoll_static_init(onion_epoll_static_t **ptr, long core_count) {
 
    ep_st->count = 0;
    ep_st->capable = core_count;
+   ep_st->epolls = NULL;
+   ep_st->epolls_args = NULL;
+
+   ep_st->cpus = malloc(sizeof(int) * core_count);
+   if (!ep_st->cpus) {
+      DEBUG_ERR("Failed to allocate worker cpu table.\n");
+      goto unsuccessfull;
+   }
+
+   ret = onion_cpu_place(onion_config_cpu_placement(), core_count, ep_st->cpus);
+   if (ret < 0) {
+      // No topology: fall back to the old 0..N-1 order
+      for (long index = 0; index < core_count; index++) {
+         ep_st->cpus[index] = index;
+      }
+   }
 
    size_t epolls_size = sizeof(onion_epoll_t) * ep_st->capable;
    size_t epolls_args_size = sizeof(struct onion_thread_args) * ep_st->capable;
@@ -527,7 +805,7 @@ int onion_epoll_static_init(onion_epoll_static_t **ptr, long core_count) {
       goto unsuccessfull;
    }
 
-   big_smoke = ep_st;
+   atomic_store_explicit(&big_smoke, ep_st, memory_order_release);
    *ptr = ep_st;
    DEBUG_FUNC("onion_epoll_static initialized (%ld cores).\n", ep_st->capable);
    return 0;
@@ -539,7 +817,8 @@ unsuccessfull:
 void onion_epoll_static_exit(onion_epoll_static_t *ep_st) {
    if (!ep_st) return;
    
-   big_smoke = NULL;
+   onion_epoll_static_t *expected = ep_st;
+   atomic_compare_exchange_strong(&big_smoke, &expected, NULL);
 
    if (ep_st->epolls) {
       for (size_t index = 0; index < (size_t)ep_st->capable; ++index) {
@@ -561,6 +840,7 @@ void onion_epoll_static_exit(onion_epoll_static_t *ep_st) {
    ep_st->count = 0;
    ep_st->capable = 0;
 
+   free(ep_st->cpus);
    free(ep_st);
    DEBUG_FUNC("onion_epoll_static exited.\n");
 }
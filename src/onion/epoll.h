@@ -2,6 +2,7 @@
 #define ONION_EPOLL_H
 
 #include "pool.h"
+#include "queue.h"
 
 #include <bits/pthreadtypes.h>
 #include <stdatomic.h>
@@ -19,14 +20,26 @@
 #define ONION_EPOLL_TAG_QUEUE_CAPABLE 5
 #define ONION_TAG_QUEUE_CAPABLE 10
 
+// Cross-core messages: inbox size and how many are run per loop turn
+#define ONION_EPOLL_INBOX_CAPABLE 1024
+#define ONION_EPOLL_INBOX_BUDGET 256
+
+// Work a worker puts off until its current batch of events is dispatched:
+// initial room of the deferred queue (it grows) and hook slots
+#define ONION_EPOLL_DEFERRED_CAPABLE 64
+#define ONION_EPOLL_HOOKS_MAX 8
+
 struct onion_thread_args;
 struct onion_thread_my_args;
+struct onion_access_buf;
+struct onion_fiber_sched;
 
 typedef enum {
    ONION_EPOLL_HANDLER_EPFD = 4308,
    ONION_EPOLL_HANDLER_EVENTFD,
    ONION_EPOLL_HANDLER_TIMERFD,
    ONION_EPOLL_HANDLER_PUPPYFD,
+   ONION_EPOLL_HANDLER_FIBER,
    ONION_EPOLL_HANDLER_UNKNOWN
 } onion_handler_ret_t;
 
@@ -58,7 +71,7 @@ typedef struct {
    int timerfd;
 
    pthread_t flow;
-   int conn_count;
+   counter_t *conn_count; // Slots are added from the accepting thread too
    int conn_max;
 
    struct epoll_event event;
@@ -67,6 +80,34 @@ typedef struct {
 
    struct onion_thread_args *args;
 
+   // Access log buffer of this worker, NULL without onion_access_init()
+   struct onion_access_buf *access;
+
+   // Messages from other threads, run on this worker. The eventfd is the
+   // doorbell and is only written when the worker is parked in epoll_wait.
+   mpsc_queue_t *inbox;
+
+   // Fibers of this worker, see fiber.h
+   struct onion_fiber_sched *fibers;
+
+   // Worker thread only. Deferred tasks run once after the batch they were
+   // queued in, hooks after every batch that had events: a handler marks
+   // its peer dirty and one flush covers all the responses of the batch.
+   queue_msg_t *deferred;
+   int deferred_count;
+   int deferred_capable;
+
+   queue_msg_t hooks[ONION_EPOLL_HOOKS_MAX];
+   int hook_count;
+
+   // Hybrid busy polling, 0 when off. Until spin_until (ns, monotonic) the
+   // loop polls with a zero timeout; the time split is written by the
+   // worker only and can be read from anywhere.
+   int busy_poll_usec;
+   int64_t spin_until;
+   _Atomic uint64_t spin_ns;
+   _Atomic uint64_t work_ns;
+
    onion_handler_t handler;
 
    bool initialized;
@@ -77,6 +118,9 @@ typedef struct {
    struct onion_block *epolls_args;
    long count;
    long capable;
+
+   // CPU of every worker, from onion_cpu_place()
+   int *cpus;
 } onion_epoll_static_t;
 
 struct onion_thread_args {
@@ -103,4 +147,15 @@ void onion_epoll1_exit(onion_epoll_static_t *ep_st, onion_epoll_t *);
 int onion_epoll_slot_add(onion_epoll_t *ep, int fd, void *data, int (*func) (void*), void (*shutdown) (void*), void *shutdown_data);
 void onion_epoll_slot_del(onion_epoll_t *ep, onion_epoll_slot_t *ep_slot);
 
+int onion_epoll_post(onion_epoll_t *ep, void (*func) (void*), void *arg);
+
+// Worker thread only (or before it starts)
+int onion_epoll_defer(onion_epoll_t *ep, void (*func) (void*), void *arg);
+int onion_epoll_hook_add(onion_epoll_t *ep, void (*func) (void*), void *arg);
+void onion_epoll_hook_del(onion_epoll_t *ep, void (*func) (void*), void *arg);
+
+// CPU time of a busy polling worker: spent spinning on empty polls vs
+// spent on turns that had something to do
+void onion_epoll_busy_stats(onion_epoll_t *ep, uint64_t *spin_ns, uint64_t *work_ns);
+
 #endif
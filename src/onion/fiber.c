@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+
+#include "fiber.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__)
+#error "onion fibers need the x86-64 context switch"
+#endif
+
+// Scheduler of the worker running on this thread, set while it runs fibers
+static __thread struct onion_fiber_sched *onion_fiber_self;
+
+// onion_fiber_switch(&from->sp, to->sp)
+//
+// Pushes the callee-saved registers on the current stack, stores the stack
+// pointer, loads the other one and pops its registers. Everything else is
+// caller-saved by the ABI, so the compiler already spilled it around the
+// call. 'ret' continues wherever the other side was switched out, or in
+// onion_fiber_entry() for a fresh fiber.
+void onion_fiber_switch(void **from_sp, void *to_sp);
+
+__asm__(
+   ".text\n"
+   ".globl onion_fiber_switch\n"
+   ".hidden onion_fiber_switch\n"
+   ".type onion_fiber_switch, @function\n"
+   "onion_fiber_switch:\n"
+   "   pushq %rbp\n"
+   "   pushq %rbx\n"
+   "   pushq %r12\n"
+   "   pushq %r13\n"
+   "   pushq %r14\n"
+   "   pushq %r15\n"
+   "   movq %rsp, (%rdi)\n"
+   "   movq %rsi, %rsp\n"
+   "   popq %r15\n"
+   "   popq %r14\n"
+   "   popq %r13\n"
+   "   popq %r12\n"
+   "   popq %rbx\n"
+   "   popq %rbp\n"
+   "   ret\n"
+   ".size onion_fiber_switch, .-onion_fiber_switch\n"
+);
+
+static int64_t onion_fiber_now(void) {
+   struct timespec time;
+   clock_gettime(CLOCK_MONOTONIC, &time);
+   return (int64_t)time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
+
+static void onion_fiber_ready(struct onion_fiber_sched *sched, onion_fiber_t *fiber) {
+   fiber->state = ONION_FIBER_READY;
+   fiber->next = NULL;
+   if (sched->ready_tail) {
+      sched->ready_tail->next = fiber;
+   } else {
+      sched->ready_head = fiber;
+   }
+   sched->ready_tail = fiber;
+}
+
+static onion_fiber_t *onion_fiber_ready_pop(struct onion_fiber_sched *sched) {
+   onion_fiber_t *fiber = sched->ready_head;
+   if (fiber) {
+      sched->ready_head = fiber->next;
+      if (!sched->ready_head) {
+         sched->ready_tail = NULL;
+      }
+      fiber->next = NULL;
+   }
+   return fiber;
+}
+
+static void onion_fiber_suspend(onion_fiber_t *fiber) {
+   onion_fiber_switch(&fiber->sp, fiber->sched->loop_sp);
+}
+
+static void onion_fiber_entry(void) {
+   struct onion_fiber_sched *sched = onion_fiber_self;
+   onion_fiber_t *fiber = sched->current;
+
+   fiber->func(fiber->arg);
+
+   // The loop frees the stack, we are still standing on it
+   fiber->state = ONION_FIBER_DEAD;
+   onion_fiber_suspend(fiber);
+   __builtin_unreachable();
+}
+
+static void *onion_fiber_stack_alloc(struct onion_fiber_sched *sched, size_t size) {
+   if (sched->stack_cached > 0) {
+      return sched->stack_cache[--sched->stack_cached];
+   }
+
+   size_t page = (size_t)sysconf(_SC_PAGESIZE);
+   void *stack = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+   if (stack == MAP_FAILED) {
+      DEBUG_ERR("Failed to map fiber stack.\n");
+      return NULL;
+   }
+
+   // Guard page at the bottom: an overflow faults instead of corrupting
+   if (mprotect(stack, page, PROT_NONE) < 0) {
+      DEBUG_ERR("Failed to protect fiber guard page.\n");
+      munmap(stack, size);
+      return NULL;
+   }
+   return stack;
+}
+
+static void onion_fiber_stack_free(struct onion_fiber_sched *sched, void *stack, size_t size) {
+   if (sched->stack_cached < ONION_FIBER_STACK_CACHE) {
+      sched->stack_cache[sched->stack_cached++] = stack;
+      return;
+   }
+   munmap(stack, size);
+}
+
+static void onion_fiber_free(struct onion_fiber_sched *sched, onion_fiber_t *fiber) {
+   if (fiber->all_prev) {
+      fiber->all_prev->all_next = fiber->all_next;
+   } else {
+      sched->all = fiber->all_next;
+   }
+   if (fiber->all_next) {
+      fiber->all_next->all_prev = fiber->all_prev;
+   }
+   sched->count -= 1;
+   onion_fiber_stack_free(sched, fiber->stack, fiber->stack_size);
+}
+
+int onion_fiber_sched_init(struct onion_fiber_sched **ptr, int epfd) {
+   struct onion_fiber_sched *sched = calloc(1, sizeof(*sched));
+   if (!sched) {
+      DEBUG_ERR("Failed to allocate fiber scheduler.\n");
+      return -1;
+   }
+   sched->epfd = epfd;
+   *ptr = sched;
+   return 0;
+}
+
+void onion_fiber_sched_exit(struct onion_fiber_sched *sched) {
+   if (!sched) {
+      return;
+   }
+
+   // Fibers still waiting never get to finish, their stacks just go away
+   while (sched->all) {
+      onion_fiber_t *fiber = sched->all;
+      if (fiber->state == ONION_FIBER_WAITING && fiber->tag.fd >= 0) {
+         epoll_ctl(sched->epfd, EPOLL_CTL_DEL, fiber->tag.fd, NULL);
+      }
+      onion_fiber_free(sched, fiber);
+   }
+
+   while (sched->stack_cached > 0) {
+      munmap(sched->stack_cache[--sched->stack_cached], ONION_FIBER_STACK_SIZE);
+   }
+
+   if (sched->count != 0) {
+      DEBUG_ERR("Fiber count is %ld after exit\n", sched->count);
+   }
+   free(sched);
+}
+
+onion_fiber_t *onion_fiber_spawn(struct onion_fiber_sched *sched, onion_fiber_func_t func, void *arg) {
+   if (!sched || !func) {
+      return NULL;
+   }
+
+   size_t size = ONION_FIBER_STACK_SIZE;
+   void *stack = onion_fiber_stack_alloc(sched, size);
+   if (!stack) {
+      return NULL;
+   }
+
+   // Fiber lives at the top of its own mapping, the stack grows down from it
+   uintptr_t top = (uintptr_t)stack + size - sizeof(onion_fiber_t);
+   top &= ~(uintptr_t)63;
+   onion_fiber_t *fiber = (onion_fiber_t*)top;
+   memset(fiber, 0, sizeof(*fiber));
+
+   fiber->func = func;
+   fiber->arg = arg;
+   fiber->sched = sched;
+   fiber->stack = stack;
+   fiber->stack_size = size;
+   fiber->tag.fd = -1;
+
+   // Frame that onion_fiber_switch() pops: six registers and a return
+   // address. After 'ret' rsp is 8 mod 16, as if onion_fiber_entry was called.
+   uint64_t *sp = (uint64_t*)(top & ~(uintptr_t)15) - 8;
+   memset(sp, 0, 8 * sizeof(uint64_t));
+   sp[6] = (uint64_t)(uintptr_t)onion_fiber_entry;
+   fiber->sp = sp;
+
+   fiber->all_next = sched->all;
+   if (sched->all) {
+      sched->all->all_prev = fiber;
+   }
+   sched->all = fiber;
+   sched->count += 1;
+
+   onion_fiber_ready(sched, fiber);
+   return fiber;
+}
+
+static void onion_fiber_resume(struct onion_fiber_sched *sched, onion_fiber_t *fiber) {
+   sched->current = fiber;
+   fiber->state = ONION_FIBER_RUNNING;
+   onion_fiber_switch(&sched->loop_sp, fiber->sp);
+   sched->current = NULL;
+
+   if (fiber->state == ONION_FIBER_DEAD) {
+      onion_fiber_free(sched, fiber);
+   }
+}
+
+int onion_fiber_sched_run(struct onion_fiber_sched *sched) {
+   int resumed = 0;
+   if (!sched) {
+      return 0;
+   }
+   onion_fiber_self = sched;
+
+   if (sched->sleepers) {
+      int64_t now = onion_fiber_now();
+      while (sched->sleepers && sched->sleepers->deadline <= now) {
+         onion_fiber_t *fiber = sched->sleepers;
+         sched->sleepers = fiber->next;
+         onion_fiber_ready(sched, fiber);
+      }
+   }
+
+   // Only what is ready now: a fiber that yields runs again next turn,
+   // after epoll had a chance to deliver events
+   onion_fiber_t *last = sched->ready_tail;
+   onion_fiber_t *fiber;
+   while ((fiber = onion_fiber_ready_pop(sched)) != NULL) {
+      onion_fiber_resume(sched, fiber);
+      resumed++;
+      if (fiber == last) {
+         break;
+      }
+   }
+   return resumed;
+}
+
+void onion_fiber_sched_event(struct onion_fiber_sched *sched, onion_epoll_tag_t *tag, uint32_t events) {
+   onion_fiber_t *fiber = tag->user_data;
+   if (!sched || !fiber || fiber->state != ONION_FIBER_WAITING) {
+      return;
+   }
+   fiber->revents = events;
+   onion_fiber_ready(sched, fiber);
+}
+
+int onion_fiber_sched_timeout(struct onion_fiber_sched *sched, int timeout) {
+   if (!sched) {
+      return timeout;
+   }
+   if (sched->ready_head) {
+      return 0;
+   }
+   if (sched->sleepers) {
+      int64_t left = sched->sleepers->deadline - onion_fiber_now();
+      if (left < 0) {
+         left = 0;
+      }
+      if (timeout < 0 || left < timeout) {
+         timeout = (int)left;
+      }
+   }
+   return timeout;
+}
+
+onion_fiber_t *onion_fiber_current(void) {
+   return onion_fiber_self ? onion_fiber_self->current : NULL;
+}
+
+// The registration stays in epoll (disarmed by EPOLLONESHOT) after the
+// wake-up, so a loop of awaits on one fd costs one epoll_ctl each.
+static int onion_fiber_await(int fd, uint32_t events) {
+   onion_fiber_t *fiber = onion_fiber_current();
+   if (!fiber) {
+      DEBUG_ERR("await outside of a fiber\n");
+      return -1;
+   }
+
+   onion_epoll_tag_t *tag = &fiber->tag;
+   tag->type = ONION_EPOLL_HANDLER_FIBER;
+   tag->fd = fd;
+   tag->user_data = fiber;
+   fiber->revents = 0;
+
+   struct epoll_event event = {.events = events | EPOLLONESHOT, .data.ptr = tag};
+   int epfd = fiber->sched->epfd;
+   if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &event) < 0) {
+      if (errno != ENOENT || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+         DEBUG_ERR("Failed to register fd %d for fiber\n", fd);
+         return -1;
+      }
+   }
+
+   fiber->state = ONION_FIBER_WAITING;
+   onion_fiber_suspend(fiber);
+   tag->fd = -1;
+
+   if (!(fiber->revents & events) && (fiber->revents & (EPOLLERR | EPOLLHUP))) {
+      return -1;
+   }
+   return 0;
+}
+
+int onion_fiber_await_readable(int fd) {
+   return onion_fiber_await(fd, EPOLLIN | EPOLLRDHUP);
+}
+
+int onion_fiber_await_writable(int fd) {
+   return onion_fiber_await(fd, EPOLLOUT);
+}
+
+void onion_fiber_sleep(long ms) {
+   onion_fiber_t *fiber = onion_fiber_current();
+   if (!fiber) {
+      return;
+   }
+   struct onion_fiber_sched *sched = fiber->sched;
+
+   fiber->deadline = onion_fiber_now() + (ms > 0 ? ms : 0);
+   fiber->state = ONION_FIBER_WAITING;
+
+   onion_fiber_t **pos = &sched->sleepers;
+   while (*pos && (*pos)->deadline <= fiber->deadline) {
+      pos = &(*pos)->next;
+   }
+   fiber->next = *pos;
+   *pos = fiber;
+
+   onion_fiber_suspend(fiber);
+}
+
+void onion_fiber_yield(void) {
+   onion_fiber_t *fiber = onion_fiber_current();
+   if (!fiber) {
+      return;
+   }
+   onion_fiber_ready(fiber->sched, fiber);
+   onion_fiber_suspend(fiber);
+}
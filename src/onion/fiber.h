@@ -0,0 +1,98 @@
+#ifndef ONION_FIBER_H
+#define ONION_FIBER_H
+
+#include "epoll.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Stackful coroutines on top of the worker event loop.
+//
+// A fiber runs on the thread of the epoll worker that spawned it. When it
+// has to wait (fd readiness, a timer) it switches back to the loop, which
+// resumes it once epoll or the sleeper list says so. Handler code reads
+// top to bottom instead of being a state machine:
+//
+//    static void client(void *arg) {
+//       int fd = (intptr_t)arg;
+//       while (onion_fiber_await_readable(fd) == 0) {
+//          ssize_t len = read(fd, buf, sizeof(buf));
+//          ...
+//       }
+//    }
+//
+//    onion_fiber_spawn(ep->fibers, client, (void*)(intptr_t)fd);
+//
+// Other threads hand work to a worker with onion_epoll_post() and spawn
+// from there. The context switch saves only callee-saved registers.
+
+#define ONION_FIBER_STACK_SIZE (64 * 1024)
+#define ONION_FIBER_STACK_CACHE 64
+
+struct onion_fiber_sched;
+
+typedef void (*onion_fiber_func_t)(void *arg);
+
+typedef enum {
+   ONION_FIBER_READY,
+   ONION_FIBER_RUNNING,
+   ONION_FIBER_WAITING,
+   ONION_FIBER_DEAD
+} onion_fiber_state_t;
+
+typedef struct onion_fiber {
+   void *sp;
+
+   onion_fiber_func_t func;
+   void *arg;
+   onion_fiber_state_t state;
+
+   // Registered in epoll while waiting for an fd, data.ptr points here
+   onion_epoll_tag_t tag;
+   uint32_t revents;
+
+   int64_t deadline; // ms, CLOCK_MONOTONIC, while sleeping
+
+   struct onion_fiber *next; // ready queue / sleeper list
+   struct onion_fiber *all_prev, *all_next; // every live fiber of the sched
+   struct onion_fiber_sched *sched;
+
+   // The mapping: guard page, then the stack, this struct sits on top
+   void *stack;
+   size_t stack_size;
+} onion_fiber_t;
+
+struct onion_fiber_sched {
+   void *loop_sp; // Loop context while a fiber runs
+   onion_fiber_t *current;
+
+   onion_fiber_t *ready_head, *ready_tail;
+   onion_fiber_t *sleepers; // Sorted by deadline
+   onion_fiber_t *all;
+
+   void *stack_cache[ONION_FIBER_STACK_CACHE];
+   int stack_cached;
+
+   int epfd;
+   long count;
+};
+
+int onion_fiber_sched_init(struct onion_fiber_sched **sched, int epfd);
+void onion_fiber_sched_exit(struct onion_fiber_sched *sched);
+
+// Loop side: run every ready fiber once, wake fibers on fd events and
+// tell epoll_wait how long it may sleep. sched_run returns how many ran
+int onion_fiber_sched_run(struct onion_fiber_sched *sched);
+void onion_fiber_sched_event(struct onion_fiber_sched *sched, onion_epoll_tag_t *tag, uint32_t events);
+int onion_fiber_sched_timeout(struct onion_fiber_sched *sched, int timeout);
+
+onion_fiber_t *onion_fiber_spawn(struct onion_fiber_sched *sched, onion_fiber_func_t func, void *arg);
+
+// Fiber side, only from inside a fiber
+onion_fiber_t *onion_fiber_current(void);
+int onion_fiber_await_readable(int fd);
+int onion_fiber_await_writable(int fd);
+void onion_fiber_sleep(long ms);
+void onion_fiber_yield(void);
+
+#endif
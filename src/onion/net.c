@@ -3,35 +3,57 @@
 #include "socket.h"
 #include "utils.h"
 
-onion_net_static_t *big_smoke;
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
 
-onion_net_static_t *onion_get_static_by_epoll(onion_server_net *net) {
-   return big_smoke;
+// Registry of the net static, read from the worker threads while the main
+// thread may be tearing it down. The loop threads are joined before
+// onion_net_static_exit() runs, see device.c, so an acquire load is enough.
+static onion_net_static_t *_Atomic big_smoke;
+
+onion_net_static_t *onion_get_static_by_net(onion_server_net *net) {
+   return atomic_load_explicit(&big_smoke, memory_order_acquire);
 }
 
-int onion_accept_net(onion_server_net *net_server) {
+// Accepts until the backlog is empty or 'budget' connections were taken.
+// Listeners are edge-triggered, so a caller that used up the budget has
+// to come back on its own. Returns the number accepted, -1 when the first
+// accept already failed for a reason other than an empty backlog.
+int onion_accept_net(onion_server_net *net_server, int budget) {
    int ret;
-   
-   struct onion_net_sock temp_sock;
-   ret = onion_net_sock_accept(net_server->sock, &temp_sock);
-   if (ret < 0) {
-      DEBUG_ERR("Peer finding failed.\n");
-      goto unsuccessfull;
-   }
+   int accepted = 0;
+
+   while (accepted < budget) {
+      struct onion_net_sock temp_sock;
+      ret = onion_net_sock_accept(net_server->sock, &temp_sock);
+      if (ret < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+         }
+         // The client gave up between SYN and accept: next one
+         if (errno == ECONNABORTED || errno == EPROTO || errno == EINTR) {
+            continue;
+         }
+         DEBUG_ERR("Peer finding failed.\n");
+         goto unsuccessfull;
+      }
 
-   onion_peer_net *peer = onion_peer_net_init(net_server, &temp_sock);
-   if (!peer) {
-     DEBUG_ERR("Peer init failed!\n");
-     goto free_sock;
-   }
+      onion_peer_net *peer = onion_peer_net_init(net_server, &temp_sock);
+      if (!peer) {
+        DEBUG_ERR("Peer init failed!\n");
+        // Stack copy: close the fd, there is nothing to free
+        close(temp_sock.fd);
+        break;
+      }
 
-   DEBUG_FUNC("Peer inited!: %d", peer->initialized);
+      DEBUG_FUNC("Peer inited!: %d", peer->initialized);
+      accepted++;
+   }
 
-   return 0;
-free_sock:
-   onion_net_sock_exit(&temp_sock);
+   return accepted;
 unsuccessfull:
-   return -1;
+   return accepted > 0 ? accepted : -1;
 }
 
 onion_peer_net *onion_peer_net_init(onion_server_net *net_server, struct onion_net_sock *sock) {
@@ -42,7 +64,8 @@ onion_peer_net *onion_peer_net_init(onion_server_net *net_server, struct onion_n
       goto unsuccessfull;
    }
 
-   if (net_server->peer_current + 1 >= net_server->peer_capable) {
+   // Soft limit, peer_barracks holds exactly peer_capable peers
+   if (counter_read_approx(net_server->peer_current) + 1 >= net_server->peer_capable) {
       DEBUG_ERR("Onion peer net full baby.\n");
       goto unsuccessfull; 
    }
@@ -53,8 +76,9 @@ onion_peer_net *onion_peer_net_init(onion_server_net *net_server, struct onion_n
       goto unsuccessfull;
    }
 
-   peer->sock = sock;
+   peer->sock = *sock;
    peer->initialized = true;
+   counter_inc(net_server->peer_current);
    return peer;
 free_please:
    onion_peer_net_exit(net_server, peer);
@@ -63,7 +87,12 @@ unsuccessfull:
 }
 
 void onion_peer_net_exit(onion_server_net *net_server, onion_peer_net *peer) {
-   free(peer);
+   if (peer->initialized) {
+      counter_dec(net_server->peer_current);
+      close(peer->sock.fd);
+   }
+   peer->initialized = false;
+   onion_block_free(net_server->peer_barracks, peer);
 }
 
 onion_server_net *onion_server_net_init(onion_net_static_t *net_static, onion_server_net_conf *conf) {
@@ -95,6 +124,13 @@ onion_server_net *onion_server_net_init(onion_net_static_t *net_static, onion_se
    }
 
    net_server->initialized = false;
+   net_server->peer_current = NULL;
+
+   ret = counter_init(&net_server->peer_current);
+   if (ret < 0) {
+      DEBUG_ERR("Net peer counter initialization failed.\n");
+      goto please_free;
+   }
 
    ret = onion_block_init(&net_server->peer_barracks, conf->peers_capable * sizeof(onion_peer_net), sizeof(onion_peer_net));
    if (ret < 0) {
@@ -108,7 +144,6 @@ onion_server_net *onion_server_net_init(onion_net_static_t *net_static, onion_se
       goto please_free;
    }
 
-   net_server->peer_current = 0;
    net_server->peer_capable = conf->peers_capable;
    net_server->initialized = true;
    net_static->count = net_static->count + 1;
@@ -134,6 +169,11 @@ void onion_server_net_exit(onion_net_static_t *net_static, onion_server_net *net
       net_server->peer_barracks = NULL;
    }
 
+   if (net_server->peer_current) {
+      counter_exit(net_server->peer_current);
+      net_server->peer_current = NULL;
+   }
+
    free(net_server);
    net_static->count = net_static->count - 1;
 }
@@ -141,7 +181,7 @@ void onion_server_net_exit(onion_net_static_t *net_static, onion_server_net *net
 int onion_net_static_init(onion_net_static_t **ptr, long capable) {
    int ret;
  
-   if (big_smoke) {
+   if (atomic_load(&big_smoke)) {
       DEBUG_ERR("Big smoke already existing!\n");
       return -1;
    }
@@ -163,7 +203,7 @@ int onion_net_static_init(onion_net_static_t **ptr, long capable) {
       goto unsuccessfull;
    }
 
-   big_smoke = net_static;
+   atomic_store_explicit(&big_smoke, net_static, memory_order_release);
    *ptr = net_static;
    DEBUG_FUNC("onion_net_static_t initialized (%ld cores).\n", net_static->capable);
    return 0;
@@ -175,7 +215,8 @@ unsuccessfull:
 void onion_net_static_exit(onion_net_static_t *net_static) {
    if (!net_static) return;
 
-   big_smoke = NULL;
+   onion_net_static_t *expected = net_static;
+   atomic_compare_exchange_strong(&big_smoke, &expected, NULL);
 
    if (net_static->nets) {
       for (size_t index = 0; index < (size_t)net_static->nets->block_max; ++index) {
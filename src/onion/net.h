@@ -1,6 +1,7 @@
 #ifndef ONION_NET_H
 #define ONION_NET_H
 
+#include "counter.h"
 #include "parser.h"
 #include "slab.h"
 #include "socket.h"
@@ -18,7 +19,9 @@ typedef struct {
 } onion_server_net_conf;
 
 typedef struct {
-   struct onion_net_sock *sock;
+   // Owned copy: the accept loop fills one on its stack for every peer,
+   // the fd and SO_PEERCRED have to outlive it
+   struct onion_net_sock sock;
    struct onion_server_net *server_sock;
 
    bool initialized;
@@ -28,7 +31,7 @@ typedef struct {
    struct onion_net_sock *sock;
 
    struct onion_block *peer_barracks;
-   int peer_current;
+   counter_t *peer_current; // Peers come and go on every worker
    int peer_capable;
 
    struct onion_slab *request_allocator;
@@ -45,7 +48,7 @@ typedef struct {
 
 onion_net_static_t *onion_get_static_by_net(onion_server_net *net);
 
-int onion_accept_net(onion_server_net *net_server);
+int onion_accept_net(onion_server_net *net_server, int budget);
 
 onion_peer_net *onion_peer_net_init(onion_server_net *net_server, struct onion_net_sock *sock);
 void onion_peer_net_exit(onion_server_net *net_server, onion_peer_net *ptr);
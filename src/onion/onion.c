@@ -1,61 +1,167 @@
 #include "onion.h"
+#include "cpu.h"
 #include "utils.h"
+#include "lock.h"
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 onion_config_t onion_config = {0};
 
+// Writers are init (and later reloads), readers are every worker. Nobody
+// reads fields straight from onion_config in the middle of an update:
+// init paths take a whole snapshot with onion_config_get(), hot paths read
+// the one scalar they need, which does not drag the path buffers along.
+static seqlock_t onion_config_lock = SEQLOCK_INIT;
+
+void onion_config_get(onion_config_t *out) {
+    unsigned seq;
+    do {
+        seq = seqlock_read_begin(&onion_config_lock);
+        *out = onion_config;
+    } while (seqlock_read_retry(&onion_config_lock, seq));
+}
+
+static int onion_config_int(const int *field) {
+    unsigned seq;
+    int value;
+    do {
+        seq = seqlock_read_begin(&onion_config_lock);
+        value = *(const volatile int *)field;
+    } while (seqlock_read_retry(&onion_config_lock, seq));
+    return value;
+}
+
+int onion_config_cpu_placement(void) {
+    return onion_config_int(&onion_config.cpu_placement);
+}
+
+int onion_config_busy_poll_usec(void) {
+    return onion_config_int(&onion_config.busy_poll_usec);
+}
+
+int onion_config_accept_budget(void) {
+    return onion_config_int(&onion_config.accept_budget);
+}
+
+int onion_config_accept_defer_sec(void) {
+    return onion_config_int(&onion_config.accept_defer_sec);
+}
+
+// 0 takes the default, a negative value turns the option off
+static int onion_config_pick(int user, int fallback) {
+    if (user == 0) {
+        return fallback;
+    }
+    return user > 0 ? user : 0;
+}
+
+static void onion_config_sock_tuning(struct onion_sock_tuning *out, const onion_config_t *user_cfg) {
+    struct onion_sock_tuning none = {0};
+    const struct onion_sock_tuning *user = user_cfg ? &user_cfg->sock_tuning : &none;
+
+    out->nodelay = onion_config_pick(user->nodelay, ONION_TCP_NODELAY);
+    out->quickack = onion_config_pick(user->quickack, ONION_TCP_QUICKACK);
+    out->fastopen = onion_config_pick(user->fastopen, ONION_TCP_FASTOPEN);
+    out->rcvbuf = onion_config_pick(user->rcvbuf, ONION_SO_RCVBUF);
+    out->sndbuf = onion_config_pick(user->sndbuf, ONION_SO_SNDBUF);
+    out->notsent_lowat = onion_config_pick(user->notsent_lowat, ONION_TCP_NOTSENT_LOWAT);
+    out->keepalive = onion_config_pick(user->keepalive, ONION_TCP_KEEPALIVE);
+    out->keepidle = onion_config_pick(user->keepidle, ONION_TCP_KEEPIDLE);
+    out->keepintvl = onion_config_pick(user->keepintvl, ONION_TCP_KEEPINTVL);
+    out->keepcnt = onion_config_pick(user->keepcnt, ONION_TCP_KEEPCNT);
+}
+
+// A path field of the caller's struct, never read past its end even when
+// the caller left it unterminated
+static void onion_config_path(char *dst, size_t size, const char *src) {
+    size_t len = strnlen(src, size - 1);
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
 int onion_config_init(onion_config_t *user_cfg) {
-    int core_count = sysconf(_SC_NPROCESSORS_CONF);
+    // Only the CPUs this process may run on, not every CPU of the machine
+    int core_count = onion_cpu_allowed_count();
     if (core_count < 1) {
         DEBUG_FUNC("onion_config_init: no CPU cores found (core_count = %d)\n", core_count);
         return -1;
     }
-    
-    onion_config.core_count = core_count;
 
-    onion_config.max_peer_per_core = (user_cfg && user_cfg->max_peer_per_core >= 1)
+    onion_config_t cfg = {0};
+    cfg.core_count = core_count;
+
+    cfg.cpu_placement = user_cfg ? user_cfg->cpu_placement : ONION_CPU_PLACE_PHYSICAL;
+
+    cfg.max_peer_per_core = (user_cfg && user_cfg->max_peer_per_core >= 1)
         ? user_cfg->max_peer_per_core
         : ONION_MAX_PEER_PER_COUNT;
 
-    onion_config.max_peer_queue_capable = (user_cfg && user_cfg->max_peer_queue_capable > 0)
+    cfg.max_peer_queue_capable = (user_cfg && user_cfg->max_peer_queue_capable > 0)
         ? user_cfg->max_peer_queue_capable
         : ONION_MAX_PEER_QUEUE_CAPABLE;
 
-    onion_config.http_max_requests = (user_cfg && user_cfg->http_max_requests > 0)
+    cfg.http_max_requests = (user_cfg && user_cfg->http_max_requests > 0)
         ? user_cfg->http_max_requests
         : ONION_HTTP_MAX_REQUESTS;
 
-    onion_config.http_line_method_max_size = (user_cfg && user_cfg->http_line_method_max_size > 0)
+    cfg.busy_poll_usec = onion_config_pick(user_cfg ? user_cfg->busy_poll_usec : 0, ONION_BUSY_POLL_USEC);
+
+    cfg.reuseport_steering = onion_config_pick(user_cfg ? user_cfg->reuseport_steering : 0, ONION_REUSEPORT_STEERING) > 0;
+
+    cfg.accept_budget = onion_config_pick(user_cfg ? user_cfg->accept_budget : 0, ONION_ACCEPT_BUDGET);
+
+    cfg.accept_defer_sec = onion_config_pick(user_cfg ? user_cfg->accept_defer_sec : 0, ONION_ACCEPT_DEFER_SEC);
+
+    onion_config_sock_tuning(&cfg.sock_tuning, user_cfg);
+    cfg.sock_tuning.busy_poll_usec = cfg.busy_poll_usec;
+
+    cfg.zerocopy = onion_config_pick(user_cfg ? user_cfg->zerocopy : 0, ONION_ZEROCOPY) > 0;
+
+    cfg.zerocopy_threshold = (user_cfg && user_cfg->zerocopy_threshold > 0)
+        ? user_cfg->zerocopy_threshold
+        : ONION_ZEROCOPY_THRESHOLD;
+
+    cfg.http_line_method_max_size = (user_cfg && user_cfg->http_line_method_max_size > 0)
         ? user_cfg->http_line_method_max_size
         : ONION_HTTP_LINE_METHOD_MAX_SIZE;
 
-    onion_config.http_line_url_max_size = (user_cfg && user_cfg->http_line_url_max_size > 0)
+    cfg.http_line_url_max_size = (user_cfg && user_cfg->http_line_url_max_size > 0)
         ? user_cfg->http_line_url_max_size
         : ONION_HTTP_LINE_URL_MAX_SIZE;
 
-    onion_config.http_line_version_max_size = (user_cfg && user_cfg->http_line_version_max_size > 0)
+    cfg.http_line_version_max_size = (user_cfg && user_cfg->http_line_version_max_size > 0)
         ? user_cfg->http_line_version_max_size
         : ONION_HTTP_LINE_VERSION_MAX_SIZE;
 
-    onion_config.http_header_name_size = (user_cfg && user_cfg->http_header_name_size > 0)
+    cfg.http_header_name_size = (user_cfg && user_cfg->http_header_name_size > 0)
         ? user_cfg->http_header_name_size
         : ONION_HTTP_HEADER_NAME_SIZE;
 
-    onion_config.http_header_value_size = (user_cfg && user_cfg->http_header_value_size > 0)
+    cfg.http_header_value_size = (user_cfg && user_cfg->http_header_value_size > 0)
         ? user_cfg->http_header_value_size
         : ONION_HTTP_HEADER_VALUE_SIZE;
 
-    onion_config.http_header_max_headers = (user_cfg && user_cfg->http_header_max_headers > 0)
+    cfg.http_header_max_headers = (user_cfg && user_cfg->http_header_max_headers > 0)
         ? user_cfg->http_header_max_headers
         : ONION_HTTP_MAX_HEADERS;
 
-    onion_config.http_init_body_size = (user_cfg && user_cfg->http_init_body_size > 0)
+    cfg.http_init_body_size = (user_cfg && user_cfg->http_init_body_size > 0)
         ? user_cfg->http_init_body_size
         : ONION_HTTP_INIT_BODY_SIZE;
 
-    onion_config.http_max_body_size = (user_cfg && user_cfg->http_max_body_size > 0)
+    cfg.http_max_body_size = (user_cfg && user_cfg->http_max_body_size > 0)
         ? user_cfg->http_max_body_size
         : ONION_HTTP_MAX_BODY_SIZE;
 
+    if (user_cfg) {
+        onion_config_path(cfg.unix_path, sizeof(cfg.unix_path), user_cfg->unix_path);
+        onion_config_path(cfg.access_log, sizeof(cfg.access_log), user_cfg->access_log);
+    }
+
+    seqlock_write_lock(&onion_config_lock);
+    onion_config = cfg;
+    seqlock_write_unlock(&onion_config_lock);
+
     return 0;
 }
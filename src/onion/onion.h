@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 
+#include "socket.h"
+
 #define ONION_HTTP_LINE_METHOD_MAX_SIZE     32
 #define ONION_HTTP_LINE_URL_MAX_SIZE       464
 #define ONION_HTTP_LINE_VERSION_MAX_SIZE    16
@@ -28,14 +30,85 @@
 #define ONION_MAX_PEER_PER_COUNT 16
 #define ONION_MAX_PEER_QUEUE_CAPABLE 16
 
+// Busy polling is opt-in, 0 keeps the workers blocking in epoll_wait
+#define ONION_BUSY_POLL_USEC 0
+
+// CPU-affine SO_REUSEPORT steering is opt-in as well
+#define ONION_REUSEPORT_STEERING 0
+
+// Connections a worker accepts per wakeup before it serves its peers again
+#define ONION_ACCEPT_BUDGET 64
+// TCP_DEFER_ACCEPT seconds. In the config 0 takes this default and a
+// negative value disables it: connections are handed over right after
+// the handshake.
+#define ONION_ACCEPT_DEFER_SEC 1
+
+// Socket tuning profile, 0 keeps the kernel default
+#define ONION_TCP_NODELAY 1
+#define ONION_TCP_QUICKACK 0
+#define ONION_TCP_FASTOPEN 0
+#define ONION_SO_RCVBUF 0
+#define ONION_SO_SNDBUF 0
+#define ONION_TCP_NOTSENT_LOWAT 0
+#define ONION_TCP_KEEPALIVE 0
+#define ONION_TCP_KEEPIDLE 0
+#define ONION_TCP_KEEPINTVL 0
+#define ONION_TCP_KEEPCNT 0
+
+// MSG_ZEROCOPY sends are opt-in; smaller buffers are always copied
+#define ONION_ZEROCOPY 0
+#define ONION_ZEROCOPY_THRESHOLD (16 * 1024)
+
+// Access log file, off while the path is empty
+#define ONION_ACCESS_PATH_MAX 256
+
+// AF_UNIX listener next to the TCP port, off while the path is empty
+#define ONION_UNIX_PATH_MAX 108
+
+// One convention for every on/off or tunable int below: 0 takes the
+// default defined above, a negative value turns the option off (for
+// flags any positive value turns it on). Sizes and counts that cannot be
+// off take any value > 0 and fall back to their default otherwise.
 typedef struct {
    int core_count;
+   int cpu_placement; // onion_cpu_place_t, ONION_CPU_PLACE_PHYSICAL by default
 
    int max_peer_per_core;
    int max_peer_queue_capable;
 
    int http_max_requests;
 
+   // After activity a worker keeps polling with a zero timeout for this
+   // long before it blocks again; also handed to SO_BUSY_POLL. Off: the
+   // worker always blocks in epoll_wait
+   int busy_poll_usec;
+
+   // Hand each connection to the worker on the CPU that received it
+   int reuseport_steering;
+
+   // Accept path: per-wakeup budget (off: drain the whole backlog) and
+   // TCP_DEFER_ACCEPT timeout in seconds
+   int accept_budget;
+   int accept_defer_sec;
+
+   // Applied to every listener and its peers; per field 0 takes the
+   // default above, a negative value keeps the kernel default. Its
+   // busy_poll_usec always follows busy_poll_usec.
+   struct onion_sock_tuning sock_tuning;
+
+   // Responses of at least zerocopy_threshold bytes are sent with
+   // MSG_ZEROCOPY, see zerocopy.h
+   int zerocopy;
+   size_t zerocopy_threshold;
+
+   // One line per request, written by a background thread
+   char access_log[ONION_ACCESS_PATH_MAX];
+
+   // Local listener for a co-located proxy; "@name" binds in the abstract
+   // namespace. Its peers are accepted by the same workers into the same
+   // peer pool as TCP ones and, like those, are not read from yet.
+   char unix_path[ONION_UNIX_PATH_MAX];
+
    size_t http_line_method_max_size;
    size_t http_line_url_max_size;
    size_t http_line_version_max_size;
@@ -51,6 +124,15 @@ typedef struct {
 extern onion_config_t onion_config;
 
 int onion_config_init(onion_config_t *onion_config);
+
+// Whole snapshot (about 550 bytes), for init paths
+void onion_config_get(onion_config_t *out);
+
+// Single fields for everything else
+int onion_config_cpu_placement(void);
+int onion_config_busy_poll_usec(void);
+int onion_config_accept_budget(void);
+int onion_config_accept_defer_sec(void);
 void onion_config_exit();
 
 #endif
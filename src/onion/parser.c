@@ -1,3 +1,4 @@
+#include "access.h"
 #include "http.h"
 #include "parser.h"
 #include "request.h"
@@ -5,6 +6,26 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+static uint64_t onion_http_parser_now_us(void) {
+   struct timespec time;
+   clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
+   return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+// No response writer yet: a request is logged once it is fully parsed,
+// status 0, with the bytes received and the time since its first byte
+static void onion_http_parser_log(onion_http_request_t *request) {
+   onion_access_buf_t *access = onion_access_current();
+   if (!access) {
+      return;
+   }
+
+   const char *url = request->start_line.url;
+   onion_access_log(access, request->start_line.method, url, url ? strlen(url) : 0,
+                    0, request->bytes_received, onion_http_parser_now_us() - request->started_us);
+}
 
 int onion_http_find_free_request(onion_http_parser_t *parser) {
    int ret = -1;
@@ -51,6 +72,7 @@ int onion_http_parser_request(onion_http_parser_t *parser, char *data, size_t si
       if (ret < 0) {
          goto parser_error;
       }
+      request->started_us = onion_http_parser_now_us();
    }
 
    ret = onion_http_parser_request_append(parser, request, data, size);
@@ -67,6 +89,7 @@ int onion_http_parser_request(onion_http_parser_t *parser, char *data, size_t si
 
    if (ret > 0) {
       printf("INDEX request confirmed: %d\n", index);
+      onion_http_parser_log(request);
       ret = onion_http_buff_reinit(parser->req_allocator, &parser->req_buff, ONION_HTTP_LINE_MAX_SIZE, ONION_HTTP_MAX_MESSAGE_SIZE);
       if (ret < 0) {
          goto parser_error_exit;
@@ -11,7 +11,7 @@
 
 struct list_head onion_block_list = LIST_HEAD_INIT(onion_block_list);
 
-size_t onion_bs_malloc_current_size = 0;
+counter_t onion_bs_malloc_current_size;
 
 int onion_block_init(struct onion_block **poolPtr, size_t max_size, size_t block_size) {
    int ret = -1;
@@ -103,7 +103,7 @@ void *onion_block_alloc(struct onion_block *pool, int *write) {
    pool->block_free--;
    pool->block_count++;
    pool->current_size += pool->block_size;
-   onion_bs_malloc_current_size = onion_bs_malloc_current_size + pool->block_size;
+   counter_add(&onion_bs_malloc_current_size, pool->block_size);
    //if (write) {
    //   write = &index;
   // }
@@ -125,7 +125,7 @@ void onion_block_free(struct onion_block *pool, void *ptr) {
    pool->block_count--;
    pool->current_size -= pool->block_size;
 
-   onion_bs_malloc_current_size = onion_bs_malloc_current_size - pool->block_size;
+   counter_add(&onion_bs_malloc_current_size, -(long)pool->block_size);
 }
 
 int onion_block_isFull(struct onion_block *pool) {
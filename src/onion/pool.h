@@ -1,6 +1,7 @@
 #ifndef MEMORY_POOL_H
 #define MEMORY_POOL_H
 
+#include "counter.h"
 #include "listhead.h"
 #include "sup.h"
 #include <stddef.h>
@@ -8,6 +9,9 @@
 
 extern struct list_head onion_block_list;
 
+// Bytes handed out by all onion_block pools, from every thread
+extern counter_t onion_bs_malloc_current_size;
+
 struct onion_block {
    void *data;
    size_t max_size;
@@ -42,6 +42,7 @@ typedef struct {
    size_t header_end;
 
    size_t bytes_received;
+   uint64_t started_us; // First byte, for the access log
 
    bool isContentLength;
    bool isChunked;
@@ -1,21 +1,33 @@
+#define _GNU_SOURCE
+
 #include "socket.h"
+#include "onion.h"
 #include "utils.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
 
 void onion_net_sock_zero(struct onion_net_sock *sock_struct) {
    sock_struct->fd = -1;
+   sock_struct->domain = AF_UNSPEC;
    sock_struct->type = -1;
-   sock_struct->packets_sent = 0;
-   sock_struct->packets_received = 0;
+   sock_struct->unix_path = NULL;
+   memset(&sock_struct->peer_cred, 0, sizeof(sock_struct->peer_cred));
+   memset(&sock_struct->tuning, 0, sizeof(sock_struct->tuning));
+   atomic_store_explicit(&sock_struct->packets_sent, 0, memory_order_relaxed);
+   atomic_store_explicit(&sock_struct->packets_received, 0, memory_order_relaxed);
 }
 
 int onion_tcp_port_conf_check(struct onion_tcp_port_conf *conf) {
@@ -25,6 +37,9 @@ int onion_tcp_port_conf_check(struct onion_tcp_port_conf *conf) {
    //DEBUG_FUNC("domain: %d, type: %d, port: %d, s_addr: %d", conf->domain, conf->type, conf->port, conf->addr.s_addr);
    if (conf->domain == 0) return -1;
    if (conf->type == 0) return -1;
+   if (conf->domain == AF_UNIX) {
+      return (conf->path && conf->path[0]) || conf->share ? 1 : -1;
+   }
    if (conf->port == 0) return -1;
    return 1;
 }
@@ -50,6 +65,152 @@ int onion_net_port_check(uint16_t port) {
    return (ret == 0);
 }
 
+// Let the kernel poll the device queue for 'usec' on a blocking read or
+// epoll_wait instead of waiting for the interrupt. Needs a NIC driver with
+// NAPI and CAP_NET_ADMIN above net.core.busy_read, so failing is not fatal:
+// the loop still spins on its own.
+int onion_net_sock_busy_poll(int fd, int usec) {
+   int ret = 0;
+
+   if (usec <= 0) {
+      return 0;
+   }
+
+   if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0) {
+      DEBUG_FUNC("SO_BUSY_POLL on fd %d not applied: %s\n", fd, strerror(errno));
+      ret = -1;
+   }
+
+#ifdef SO_PREFER_BUSY_POLL
+   int prefer = 1;
+   if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) < 0) {
+      DEBUG_FUNC("SO_PREFER_BUSY_POLL on fd %d not applied: %s\n", fd, strerror(errno));
+      ret = -1;
+   }
+#endif
+
+   return ret;
+}
+
+static int onion_net_sock_set(int fd, int level, int name, int value, const char *what) {
+   if (value <= 0) {
+      return 0;
+   }
+   if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+      DEBUG_FUNC("%s = %d on fd %d not applied: %s\n", what, value, fd, strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+// Accepted sockets are cloned from the listener, so buffers, NODELAY,
+// NOTSENT_LOWAT, busy polling and keepalive are set once on the listener
+// and inherited. Only QUICKACK does not stick and is set per peer. A
+// failing option is logged and skipped, the count of failures returned.
+int onion_net_sock_tune(int fd, const struct onion_sock_tuning *tuning, int listener) {
+   int failed = 0;
+
+   if (!tuning) {
+      return 0;
+   }
+
+   if (!listener) {
+      failed += onion_net_sock_set(fd, IPPROTO_TCP, TCP_QUICKACK, tuning->quickack, "TCP_QUICKACK") < 0;
+      return -failed;
+   }
+
+   failed += onion_net_sock_set(fd, SOL_SOCKET, SO_RCVBUF, tuning->rcvbuf, "SO_RCVBUF") < 0;
+   failed += onion_net_sock_set(fd, SOL_SOCKET, SO_SNDBUF, tuning->sndbuf, "SO_SNDBUF") < 0;
+   failed += onion_net_sock_set(fd, IPPROTO_TCP, TCP_NODELAY, tuning->nodelay, "TCP_NODELAY") < 0;
+   failed += onion_net_sock_set(fd, IPPROTO_TCP, TCP_FASTOPEN, tuning->fastopen, "TCP_FASTOPEN") < 0;
+   failed += onion_net_sock_set(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, tuning->notsent_lowat, "TCP_NOTSENT_LOWAT") < 0;
+   failed += onion_net_sock_set(fd, SOL_SOCKET, SO_KEEPALIVE, tuning->keepalive, "SO_KEEPALIVE") < 0;
+   failed += onion_net_sock_set(fd, IPPROTO_TCP, TCP_KEEPIDLE, tuning->keepidle, "TCP_KEEPIDLE") < 0;
+   failed += onion_net_sock_set(fd, IPPROTO_TCP, TCP_KEEPINTVL, tuning->keepintvl, "TCP_KEEPINTVL") < 0;
+   failed += onion_net_sock_set(fd, IPPROTO_TCP, TCP_KEEPCNT, tuning->keepcnt, "TCP_KEEPCNT") < 0;
+   failed += onion_net_sock_busy_poll(fd, tuning->busy_poll_usec) < 0;
+
+   return -failed;
+}
+
+static int onion_net_sock_get(int fd, int level, int name) {
+   int value = 0;
+   socklen_t len = sizeof(value);
+   if (getsockopt(fd, level, name, &value, &len) < 0) {
+      return -1;
+   }
+   return value;
+}
+
+// What the kernel actually uses, -1 for options it does not report.
+// SO_RCVBUF/SO_SNDBUF come back doubled for bookkeeping overhead.
+int onion_net_sock_tuning_read(int fd, struct onion_sock_tuning *out) {
+   if (!out || fd < 0) {
+      return -1;
+   }
+
+   out->nodelay = onion_net_sock_get(fd, IPPROTO_TCP, TCP_NODELAY);
+   out->quickack = onion_net_sock_get(fd, IPPROTO_TCP, TCP_QUICKACK);
+   out->fastopen = onion_net_sock_get(fd, IPPROTO_TCP, TCP_FASTOPEN);
+   out->rcvbuf = onion_net_sock_get(fd, SOL_SOCKET, SO_RCVBUF);
+   out->sndbuf = onion_net_sock_get(fd, SOL_SOCKET, SO_SNDBUF);
+   out->notsent_lowat = onion_net_sock_get(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT);
+   out->busy_poll_usec = onion_net_sock_get(fd, SOL_SOCKET, SO_BUSY_POLL);
+   out->keepalive = onion_net_sock_get(fd, SOL_SOCKET, SO_KEEPALIVE);
+   out->keepidle = onion_net_sock_get(fd, IPPROTO_TCP, TCP_KEEPIDLE);
+   out->keepintvl = onion_net_sock_get(fd, IPPROTO_TCP, TCP_KEEPINTVL);
+   out->keepcnt = onion_net_sock_get(fd, IPPROTO_TCP, TCP_KEEPCNT);
+   return 0;
+}
+
+// Steer every new connection of a SO_REUSEPORT group to the listener whose
+// worker runs on the CPU that received the SYN, so accept and the rest of
+// the connection stay on the core that already has its packets in cache.
+// cpus[i] is the CPU serving the i-th socket of the group, in listen()
+// order. Attaching to one member applies to the whole group. SYNs landing
+// on a CPU without a worker are spread with cpu % count.
+int onion_net_sock_reuseport_steer(int fd, const int *cpus, int count) {
+   if (count < 1 || count > (BPF_MAXINSNS - 3) / 2) {
+      DEBUG_ERR("Cannot steer %d listeners.\n", count);
+      return -1;
+   }
+
+   int len = 0;
+   struct sock_filter *code = malloc(sizeof(struct sock_filter) * (2 * count + 3));
+   if (!code) {
+      DEBUG_ERR("Failed to allocate steering program.\n");
+      return -1;
+   }
+
+   // A = CPU the packet was processed on
+   code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+   // if (A == cpus[i]) return i
+   for (int index = 0; index < count; index++) {
+      code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)cpus[index], 0, 1);
+      code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (uint32_t)index);
+   }
+
+   // return A % count
+   code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)count);
+   code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+   struct sock_fprog prog = {
+      .len = (unsigned short)len,
+      .filter = code
+   };
+
+   int ret = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+   free(code);
+
+   if (ret < 0) {
+      DEBUG_ERR("SO_ATTACH_REUSEPORT_CBPF on fd %d failed: %s\n", fd, strerror(errno));
+      return -1;
+   }
+
+   return 0;
+}
+
 int onion_net_sock_tcp_create(struct onion_net_sock **sock_struct, struct onion_tcp_port_conf *port_conf, size_t queue_capable) {
    struct sockaddr_in sock_addr;
    socklen_t addr_len = sizeof(sock_addr);
@@ -94,6 +255,16 @@ int onion_net_sock_tcp_create(struct onion_net_sock **sock_struct, struct onion_
       goto close_sock;
    }
 
+   // Before listen(): the buffer sizes decide the window scale of the handshake
+   onion_net_sock_tune(sock_fd, &port_conf->tuning, 1);
+
+   // Keep the connection in the kernel until the client sends its request:
+   // no wakeup, accept and empty read for a handshake that is all we get
+   int defer_sec = onion_config_accept_defer_sec();
+   if (defer_sec > 0 && setsockopt(sock_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_sec, sizeof(defer_sec)) < 0) {
+      fprintf(stderr, "Failed to set socket options[TCP_DEFER_ACCEPT]: %s\n", strerror(errno));
+   }
+
    if (bind(sock_fd, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) < 0) {
       fprintf(stderr, "Failed to bind socket: %s\n", strerror(errno));
       goto close_sock;
@@ -106,9 +277,11 @@ int onion_net_sock_tcp_create(struct onion_net_sock **sock_struct, struct onion_
 
    onion_net_sock_zero(new_struct);
    new_struct->fd = sock_fd;
+   new_struct->domain = port_conf->domain;
    new_struct->type = port_conf->type;
    new_struct->queue_capable = queue_capable;
    new_struct->sock_addr = sock_addr;
+   new_struct->tuning = port_conf->tuning;
 
    *sock_struct = new_struct;
    return 0;
@@ -120,33 +293,155 @@ unsuccessfull:
    return -1;
 }
 
-int onion_net_sock_tcp_accept(struct onion_net_sock *onion_server_sock, struct onion_net_sock *client_sock) {
-   struct sockaddr_in client_addr;
-   socklen_t client_len = sizeof(client_addr);
-   
-   int client_fd = accept(onion_server_sock->fd, (struct sockaddr *)&client_addr, &client_len);
-   if (client_fd < 0) {
-      fprintf(stderr, "Failed to accept connection: %s\n", strerror(errno));
-      return -1;
+// Fills 'addr' for 'path', a leading '@' selects the abstract namespace
+// (no file, gone with the last socket). Returns the length to bind or
+// connect with, 0 when the name does not fit.
+socklen_t onion_net_sock_unix_addr(struct sockaddr_un *addr, const char *path) {
+   size_t len = strlen(path);
+
+   memset(addr, 0, sizeof(*addr));
+   addr->sun_family = AF_UNIX;
+
+   if (len == 0 || len >= sizeof(addr->sun_path)) {
+      return 0;
    }
 
-   int fcntl_result = fcntl(client_fd, F_GETFL, 0);
-   if (fcntl_result == -1) {
-      fprintf(stderr, "Failed to get peer socket flags%s\n", strerror(errno));
+   memcpy(addr->sun_path, path, len);
+   if (path[0] == '@') {
+      addr->sun_path[0] = '\0';
+      return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+   }
+   return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len + 1);
+}
+
+// Removes a socket file left behind by a previous run so the bind can
+// take its name. Anything else at 'path' is not ours to delete: -1.
+static int onion_net_sock_unix_unlink(const char *path) {
+   struct stat st;
+
+   if (lstat(path, &st) < 0) {
+      return errno == ENOENT ? 0 : -1;
+   }
+
+   if (!S_ISSOCK(st.st_mode)) {
+      errno = EEXIST;
+      DEBUG_ERR("'%s' exists and is not a socket, not removing it.\n", path);
       return -1;
    }
 
-   fcntl_result = fcntl(client_fd, F_SETFL, fcntl_result | O_NONBLOCK);
-   if (fcntl_result == -1) {
-      fprintf(stderr, "Failed to set peer socket flags%s\n", strerror(errno));
+   return unlink(path);
+}
+
+// Local stream listener for a co-located proxy. Same accept path, peers
+// and parser as TCP, minus the TCP stack. With port_conf->share set the
+// listener is a dup of an existing one, every worker accepts from it.
+int onion_net_sock_unix_create(struct onion_net_sock **sock_struct, struct onion_tcp_port_conf *port_conf, size_t queue_capable) {
+   struct sockaddr_un addr;
+   socklen_t addr_len = 0;
+   bool bound = false;
+
+   struct onion_net_sock *new_struct = malloc(sizeof(struct onion_net_sock));
+   if (!new_struct) {
+      DEBUG_ERR("Failed to initialize new struct");
+      goto unsuccessfull;
+   }
+   onion_net_sock_zero(new_struct);
+
+   int sock_fd;
+   if (port_conf->share) {
+      sock_fd = fcntl(port_conf->share->fd, F_DUPFD_CLOEXEC, 0);
+      if (sock_fd < 0) {
+         fprintf(stderr, "Failed to share unix listener: %s\n", strerror(errno));
+         goto free_struct;
+      }
+      goto done;
+   }
+
+   addr_len = onion_net_sock_unix_addr(&addr, port_conf->path);
+   if (addr_len == 0) {
+      DEBUG_ERR("Unix socket path '%s' is empty or too long.\n", port_conf->path);
+      goto free_struct;
+   }
+
+   sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (sock_fd < 0) {
+      fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+      goto free_struct;
+   }
+
+   // A file left behind by a previous run would fail the bind
+   if (port_conf->path[0] != '@' && onion_net_sock_unix_unlink(port_conf->path) < 0) {
+      fprintf(stderr, "Failed to clear '%s': %s\n", port_conf->path, strerror(errno));
+      goto close_sock;
+   }
+
+   if (bind(sock_fd, (struct sockaddr *)&addr, addr_len) < 0) {
+      fprintf(stderr, "Failed to bind socket: %s\n", strerror(errno));
+      goto close_sock;
+   }
+   bound = true;
+
+   if (listen(sock_fd, queue_capable) < 0) {
+      fprintf(stderr, "Failed to listen socket: %s\n", strerror(errno));
+      goto close_sock;
+   }
+
+   if (port_conf->path[0] != '@') {
+      new_struct->unix_path = strdup(port_conf->path);
+   }
+
+done:
+   new_struct->fd = sock_fd;
+   new_struct->domain = AF_UNIX;
+   new_struct->type = SOCK_STREAM;
+   new_struct->queue_capable = queue_capable;
+
+   *sock_struct = new_struct;
+   return 0;
+close_sock:
+   close(sock_fd);
+   // Only the file our own bind created
+   if (bound && port_conf->path[0] != '@') {
+      unlink(port_conf->path);
+   }
+free_struct:
+   free(new_struct);
+unsuccessfull:
+   return -1;
+}
+
+// Returns -1 with errno set when there is nothing to accept (EAGAIN) or
+// the accept failed; the caller tells them apart.
+int onion_net_sock_tcp_accept(struct onion_net_sock *onion_server_sock, struct onion_net_sock *client_sock) {
+   struct sockaddr_storage client_addr;
+   socklen_t client_len = sizeof(client_addr);
+   
+   // Non-blocking and close-on-exec in the same syscall, no fcntl round trips
+   int client_fd = accept4(onion_server_sock->fd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+   if (client_fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+         fprintf(stderr, "Failed to accept connection: %s\n", strerror(errno));
+      }
       return -1;
    }
 
    onion_net_sock_zero(client_sock);
    client_sock->fd = client_fd;
+   client_sock->domain = onion_server_sock->domain;
    client_sock->type = SOCK_STREAM;
    client_sock->queue_capable = -1;
-   client_sock->sock_addr = client_addr;
+
+   if (onion_server_sock->domain == AF_UNIX) {
+      // Credentials as of connect(), the local proxy can be told apart by uid
+      socklen_t cred_len = sizeof(client_sock->peer_cred);
+      if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &client_sock->peer_cred, &cred_len) < 0) {
+         DEBUG_FUNC("SO_PEERCRED on fd %d failed: %s\n", client_fd, strerror(errno));
+      }
+      memset(&client_sock->sock_addr, 0, sizeof(client_sock->sock_addr));
+   } else {
+      onion_net_sock_tune(client_fd, &onion_server_sock->tuning, 0);
+      memcpy(&client_sock->sock_addr, &client_addr, sizeof(client_sock->sock_addr));
+   }
 
    return 0;
 }
@@ -166,6 +461,9 @@ int onion_net_sock_accept(struct onion_net_sock *onion_server_sock, struct onion
 }
 
 int onion_net_sock_init(struct onion_net_sock **sock_struct, struct onion_tcp_port_conf *port_conf, size_t queue_capable) {
+   if (port_conf->domain == AF_UNIX && port_conf->type == SOCK_STREAM) {
+      return onion_net_sock_unix_create(sock_struct, port_conf, queue_capable);
+   }
    if (port_conf->type == SOCK_STREAM) {
       return onion_net_sock_tcp_create(sock_struct, port_conf, queue_capable);
    }
@@ -173,6 +471,11 @@ int onion_net_sock_init(struct onion_net_sock **sock_struct, struct onion_tcp_po
 }
 
 void onion_net_sock_exit(struct onion_net_sock *sock_struct) {
+   if (sock_struct->unix_path) {
+      unlink(sock_struct->unix_path);
+      free(sock_struct->unix_path);
+      sock_struct->unix_path = NULL;
+   }
    if (sock_struct->type == SOCK_STREAM) {
       onion_net_sock_tcp_close(sock_struct);
    }
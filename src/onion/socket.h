@@ -3,7 +3,35 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+// Socket options for a listener and the peers it accepts. A value > 0 is
+// applied, anything else keeps the kernel default, so a zeroed struct
+// changes nothing. Booleans are 1.
+struct onion_sock_tuning {
+   int nodelay;
+   int quickack;
+   int fastopen;        // TFO queue length, listener only
+   int rcvbuf;
+   int sndbuf;
+   int notsent_lowat;
+   int busy_poll_usec;
+   int keepalive;
+   int keepidle;        // Seconds
+   int keepintvl;       // Seconds
+   int keepcnt;
+};
+
+// Same layout as struct ucred, which needs _GNU_SOURCE in every includer
+struct onion_peer_cred {
+   pid_t pid;
+   uid_t uid;
+   gid_t gid;
+};
 
 struct onion_tcp_port_conf {
    int domain;
@@ -11,22 +39,48 @@ struct onion_tcp_port_conf {
    int protocol;
    uint16_t port;
    struct in_addr addr;
+   struct onion_sock_tuning tuning;
+
+   // AF_UNIX: filesystem path, or "@name" for the abstract namespace
+   const char *path;
+   // AF_UNIX: listen on this socket's fd instead of binding again, unix
+   // sockets have no SO_REUSEPORT so the workers share one listener
+   struct onion_net_sock *share;
 };
 
 struct onion_net_sock {
    int fd;
+   int domain;
    int type;
    int queue_capable;
    struct sockaddr_in sock_addr;
 
-   uint32_t packets_sent;
-   uint32_t packets_received;
+   // AF_UNIX peer: who is on the other end, from SO_PEERCRED
+   struct onion_peer_cred peer_cred;
+   // AF_UNIX listener that bound a filesystem path: unlinked on exit
+   char *unix_path;
+
+   // Listener: what its accepted peers get on top of what they inherit
+   struct onion_sock_tuning tuning;
+
+   // One socket is served by one worker at a time; relaxed atomics keep
+   // the odd cross-thread read (stats) race free without sharding per socket
+   _Atomic uint32_t packets_sent;
+   _Atomic uint32_t packets_received;
 };
 
 int onion_tcp_port_conf_check(struct onion_tcp_port_conf *conf);
 
 int onion_net_port_check(uint16_t port);
 int onion_net_sock_accept(struct onion_net_sock *onion_server_sock, struct onion_net_sock *client_sock);
+int onion_net_sock_busy_poll(int fd, int usec);
+
+int onion_net_sock_tune(int fd, const struct onion_sock_tuning *tuning, int listener);
+int onion_net_sock_tuning_read(int fd, struct onion_sock_tuning *out);
+int onion_net_sock_reuseport_steer(int fd, const int *cpus, int count);
+
+socklen_t onion_net_sock_unix_addr(struct sockaddr_un *addr, const char *path);
+int onion_net_sock_unix_create(struct onion_net_sock **sock_struct, struct onion_tcp_port_conf *port_conf, size_t queue_capable);
 
 int onion_net_sock_init(struct onion_net_sock **sock_struct, struct onion_tcp_port_conf *port_conf, size_t queue_capable);
 void onion_net_sock_exit(struct onion_net_sock *sock_struct);
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+
+#include "zerocopy.h"
+#include "fiber.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+static onion_zc_entry_t *onion_zc_entry(onion_zc_t *zc, int index) {
+   return &zc->entries[(zc->head + index) % ONION_ZC_QUEUE_CAPABLE];
+}
+
+// Hand back, in queue order, every buffer the kernel no longer needs
+static void onion_zc_release_done(onion_zc_t *zc) {
+   while (zc->count > 0) {
+      onion_zc_entry_t *entry = onion_zc_entry(zc, 0);
+      if (entry->sent < entry->len) {
+         break;
+      }
+      if (entry->zerocopy && entry->ncompleted < entry->nsends) {
+         break;
+      }
+
+      if (entry->release) {
+         entry->release(entry->allocator, (void*)entry->buf);
+      }
+      memset(entry, 0, sizeof(*entry));
+
+      zc->head = (zc->head + 1) % ONION_ZC_QUEUE_CAPABLE;
+      zc->count--;
+      zc->nreleased++;
+   }
+}
+
+int onion_zc_init(onion_zc_t *zc, int fd, size_t threshold) {
+   if (!zc || fd < 0) {
+      DEBUG_ERR("Invalid zero-copy arguments\n");
+      return -1;
+   }
+
+   memset(zc, 0, sizeof(*zc));
+   zc->fd = fd;
+
+   if (threshold > 0) {
+      int one = 1;
+      // AF_UNIX and kernels before 4.14 refuse it, copies still work
+      if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+         DEBUG_FUNC("SO_ZEROCOPY unavailable on fd %d: %s\n", fd, strerror(errno));
+         threshold = 0;
+      }
+   }
+   zc->threshold = threshold;
+
+   return 0;
+}
+
+void onion_zc_exit(onion_zc_t *zc) {
+   if (!zc) {
+      return;
+   }
+
+   // Whatever is still pinned belongs to a closed socket by now
+   while (zc->count > 0) {
+      onion_zc_entry_t *entry = onion_zc_entry(zc, 0);
+      entry->sent = entry->len;
+      entry->ncompleted = entry->nsends;
+      onion_zc_release_done(zc);
+   }
+   zc->fd = -1;
+}
+
+int onion_zc_queue(onion_zc_t *zc, const void *buf, size_t len, onion_zc_release_t release, void *allocator) {
+   if (zc->count >= ONION_ZC_QUEUE_CAPABLE) {
+      return -1;
+   }
+
+   onion_zc_entry_t *entry = onion_zc_entry(zc, zc->count);
+   memset(entry, 0, sizeof(*entry));
+   entry->buf = buf;
+   entry->len = len;
+   entry->release = release;
+   entry->allocator = allocator;
+   entry->zerocopy = zc->threshold > 0 && len >= zc->threshold;
+
+   zc->count++;
+
+   // Nothing to send, nothing to wait for
+   onion_zc_release_done(zc);
+   return 0;
+}
+
+ssize_t onion_zc_flush(onion_zc_t *zc) {
+   ssize_t total = 0;
+
+   for (int index = 0; index < zc->count; index++) {
+      onion_zc_entry_t *entry = onion_zc_entry(zc, index);
+      bool zerocopy = entry->zerocopy;
+
+      while (entry->sent < entry->len) {
+         int flags = MSG_NOSIGNAL | MSG_DONTWAIT | (zerocopy ? MSG_ZEROCOPY : 0);
+         ssize_t ret = send(zc->fd, entry->buf + entry->sent, entry->len - entry->sent, flags);
+         if (ret < 0) {
+            if (errno == EINTR) {
+               continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+               goto full;
+            }
+            // Out of optmem for the pinned pages: copy this part
+            if (errno == ENOBUFS && zerocopy) {
+               zerocopy = false;
+               continue;
+            }
+            DEBUG_ERR("Send on fd %d failed: %s\n", zc->fd, strerror(errno));
+            onion_zc_release_done(zc);
+            return -1;
+         }
+
+         if (zerocopy) {
+            if (entry->nsends == 0) {
+               entry->seq = zc->next_seq;
+            }
+            entry->nsends++;
+            zc->next_seq++;
+            zc->nzerocopy++;
+         } else {
+            zc->ncopied++;
+         }
+
+         entry->sent += ret;
+         total += ret;
+      }
+   }
+
+full:
+   onion_zc_release_done(zc);
+   return total;
+}
+
+static void onion_zc_completed(onion_zc_t *zc, uint32_t lo, uint32_t hi) {
+   for (int index = 0; index < zc->count; index++) {
+      onion_zc_entry_t *entry = onion_zc_entry(zc, index);
+      if (entry->nsends == 0) {
+         continue;
+      }
+      entry->ncompleted += onion_zc_overlap(entry->seq, entry->nsends, lo, hi);
+   }
+}
+
+int onion_zc_complete(onion_zc_t *zc) {
+   int completions = 0;
+
+   while (completions < ONION_ZC_COMPLETE_BUDGET) {
+      union {
+         char buf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+         struct cmsghdr align;
+      } control;
+      struct msghdr msg = {
+         .msg_control = control.buf,
+         .msg_controllen = sizeof(control.buf)
+      };
+
+      if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+         }
+         DEBUG_ERR("Error queue read on fd %d failed: %s\n", zc->fd, strerror(errno));
+         return -1;
+      }
+
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+         bool recverr = (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR)
+            || (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+         if (!recverr) {
+            continue;
+         }
+
+         struct sock_extended_err serr;
+         memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+         if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr.ee_errno != 0) {
+            continue;
+         }
+
+         // The kernel fell back to copying, e.g. a loopback peer or a
+         // device without scatter-gather
+         if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+            zc->nfallback++;
+         }
+
+         onion_zc_completed(zc, serr.ee_info, serr.ee_data);
+         completions++;
+      }
+   }
+
+   onion_zc_release_done(zc);
+   return completions;
+}
+
+size_t onion_zc_unsent(onion_zc_t *zc) {
+   size_t unsent = 0;
+   for (int index = 0; index < zc->count; index++) {
+      onion_zc_entry_t *entry = onion_zc_entry(zc, index);
+      unsent += entry->len - entry->sent;
+   }
+   return unsent;
+}
+
+// Completions make epoll report EPOLLERR; with nothing on the error queue
+// it was a real socket error. 1 when the wake-up only carried completions.
+static int onion_zc_fiber_wait(onion_zc_t *zc, bool writable) {
+   int ret = writable ? onion_fiber_await_writable(zc->fd) : onion_fiber_await_readable(zc->fd);
+   onion_fiber_t *fiber = onion_fiber_current();
+
+   if (!fiber || !(fiber->revents & EPOLLERR)) {
+      return ret;
+   }
+
+   int completions = onion_zc_complete(zc);
+   if (ret == 0) {
+      return 0;
+   }
+   return completions > 0 ? 1 : -1;
+}
+
+int onion_zc_fiber_flush(onion_zc_t *zc) {
+   for (;;) {
+      if (onion_zc_flush(zc) < 0) {
+         return -1;
+      }
+      if (onion_zc_unsent(zc) == 0) {
+         return 0;
+      }
+      if (onion_zc_fiber_wait(zc, true) < 0) {
+         return -1;
+      }
+   }
+}
+
+int onion_zc_fiber_await_readable(onion_zc_t *zc) {
+   return onion_zc_fiber_wait(zc, false);
+}
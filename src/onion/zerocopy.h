@@ -0,0 +1,120 @@
+#ifndef ONION_ZEROCOPY_H
+#define ONION_ZEROCOPY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Zero-copy transmission with MSG_ZEROCOPY.
+//
+// A send with MSG_ZEROCOPY pins the user pages instead of copying them into
+// the socket buffer, so the buffer must stay untouched until the kernel says
+// it is done with it. Each successful zero-copy send() gets the next number
+// of a per-socket counter; completions arrive on the socket error queue as
+// ranges of those numbers and make epoll report EPOLLERR.
+//
+// The queue below owns the buffers handed to it: they are sent in order,
+// and each one goes back to its allocator through its release callback
+// once it is fully sent and every zero-copy send that covered it has
+// completed. Buffers under the threshold are sent with a plain copy and
+// released as soon as the socket took them, pinning pages costs more than
+// copying a few KB.
+//
+//    onion_zc_init(&zc, fd, config.zerocopy ? config.zerocopy_threshold : 0);
+//    onion_zc_queue(&zc, body, len, release_body, slab);
+//    onion_zc_fiber_flush(&zc);   // from the peer fiber
+//    ...
+//    onion_zc_exit(&zc);
+
+#define ONION_ZC_QUEUE_CAPABLE 64
+
+// Completions read from the error queue per recvmsg() call are ranges, one
+// message can cover any number of sends
+#define ONION_ZC_COMPLETE_BUDGET 64
+
+typedef void (*onion_zc_release_t)(void *allocator, void *buf);
+
+typedef struct {
+   const uint8_t *buf;
+   size_t len;
+   size_t sent;
+
+   onion_zc_release_t release;
+   void *allocator;
+
+   // Zero-copy sends that carried part of this buffer: the first one's
+   // number, how many there were and how many have completed
+   uint32_t seq;
+   uint32_t nsends;
+   uint32_t ncompleted;
+
+   bool zerocopy;
+} onion_zc_entry_t;
+
+typedef struct {
+   int fd;
+
+   // 0 when the socket refused SO_ZEROCOPY or the mode is off: every
+   // buffer is then copied
+   size_t threshold;
+
+   onion_zc_entry_t entries[ONION_ZC_QUEUE_CAPABLE];
+   int head;
+   int count;
+
+   uint32_t next_seq; // Number the kernel gives the next zero-copy send
+
+   // Statistics
+   uint64_t nzerocopy;   // Zero-copy send() calls
+   uint64_t ncopied;     // Plain send() calls
+   uint64_t nfallback;   // Completions where the kernel copied anyway
+   uint64_t nreleased;
+} onion_zc_t;
+
+// threshold 0 turns zero-copy off for this socket
+int onion_zc_init(onion_zc_t *zc, int fd, size_t threshold);
+// Releases every buffer still queued, the socket should be closed first
+void onion_zc_exit(onion_zc_t *zc);
+
+// Takes ownership of buf, -1 when the queue is full
+int onion_zc_queue(onion_zc_t *zc, const void *buf, size_t len, onion_zc_release_t release, void *allocator);
+
+// Sends queued bytes until the queue is drained or the socket is full.
+// Bytes sent, -1 on a socket error
+ssize_t onion_zc_flush(onion_zc_t *zc);
+
+// Reads the error queue and releases what completed, call on EPOLLERR.
+// Completions read, -1 on a socket error
+int onion_zc_complete(onion_zc_t *zc);
+
+// Unsent bytes left in the queue
+size_t onion_zc_unsent(onion_zc_t *zc);
+
+// Buffers not yet released, sent or not
+static inline int onion_zc_pending(onion_zc_t *zc) {
+   return zc->count;
+}
+
+// Sends of [first, first + count) that fall into the completed [lo, hi].
+// The numbers wrap after 2^32 sends, so they compare as serial numbers
+static inline uint32_t onion_zc_overlap(uint32_t first, uint32_t count, uint32_t lo, uint32_t hi) {
+   uint32_t last = first + count - 1;
+   uint32_t from = (int32_t)(lo - first) > 0 ? lo : first;
+   uint32_t to = (int32_t)(hi - last) < 0 ? hi : last;
+
+   return (int32_t)(to - from) >= 0 ? to - from + 1 : 0;
+}
+
+// Fiber side: flush everything, waiting for the socket as needed and
+// collecting completions on the way. Buffers still waiting for their
+// completion stay queued. 0 when all was sent, -1 on error
+int onion_zc_fiber_flush(onion_zc_t *zc);
+
+// onion_fiber_await_readable() for a socket with zero-copy sends in flight:
+// a wake-up that only carries completions is consumed here instead of
+// looking like a dead peer, and returns 1 so the caller can recheck
+// onion_zc_pending()
+int onion_zc_fiber_await_readable(onion_zc_t *zc);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef COUNTER_H
+#define COUNTER_H
+
+#include <stdatomic.h>
+
+// Sharded statistics counter. Every thread adds into its own cache line,
+// the value is the sum of all slots, computed only when somebody reads it.
+// Adds never contend; a read costs COUNTER_SLOTS loads and may miss adds
+// that are in flight, which is fine for statistics and soft limits.
+//
+// Slots are handed out to threads round-robin on first use; past
+// COUNTER_SLOTS threads two of them share a slot (still exact, atomic).
+//
+// The price is the read: 4 KB over COUNTER_SLOTS cache lines, most of
+// them written by other cores. A limit checked on every accept uses
+// counter_read_approx(), which sums once per COUNTER_READ_EVERY calls of
+// a thread and returns the last sum in between.
+//
+// A zeroed counter_t (global, calloc) is ready to use.
+
+#define COUNTER_SLOTS 64
+#define COUNTER_CACHE_LINE 64
+#define COUNTER_READ_EVERY 64
+
+struct counter_slot {
+   atomic_long value;
+   atomic_uint reads; // counter_read_approx() calls of the owning thread
+} __attribute__((aligned(COUNTER_CACHE_LINE)));
+
+typedef struct {
+   struct counter_slot slots[COUNTER_SLOTS];
+   atomic_long cached; // Last sum of counter_read_approx()
+} counter_t;
+
+extern __thread int counter_thread_slot;
+int counter_slot_assign(void);
+
+int counter_init(counter_t **counter);
+void counter_exit(counter_t *counter);
+
+static inline void counter_add(counter_t *counter, long delta) {
+   int slot = counter_thread_slot;
+   if (__builtin_expect(slot < 0, 0)) {
+      slot = counter_slot_assign();
+   }
+   atomic_fetch_add_explicit(&counter->slots[slot].value, delta, memory_order_relaxed);
+}
+
+static inline void counter_inc(counter_t *counter) {
+   counter_add(counter, 1);
+}
+
+static inline void counter_dec(counter_t *counter) {
+   counter_add(counter, -1);
+}
+
+static inline long counter_read(counter_t *counter) {
+   long sum = 0;
+   for (int index = 0; index < COUNTER_SLOTS; index++) {
+      sum += atomic_load_explicit(&counter->slots[index].value, memory_order_relaxed);
+   }
+   return sum;
+}
+
+// counter_read() for soft limits on hot paths. Off by the adds since the
+// last sum of any thread, at most COUNTER_READ_EVERY calls per thread ago:
+// a hard bound still has to come from the allocator behind the limit.
+static inline long counter_read_approx(counter_t *counter) {
+   int slot = counter_thread_slot;
+   if (__builtin_expect(slot < 0, 0)) {
+      slot = counter_slot_assign();
+   }
+
+   // Only the owner writes its slot, a lost update past COUNTER_SLOTS
+   // threads just moves the next sum
+   unsigned reads = atomic_load_explicit(&counter->slots[slot].reads, memory_order_relaxed);
+   atomic_store_explicit(&counter->slots[slot].reads, reads + 1, memory_order_relaxed);
+
+   if (reads % COUNTER_READ_EVERY == 0) {
+      long sum = counter_read(counter);
+      atomic_store_explicit(&counter->cached, sum, memory_order_relaxed);
+      return sum;
+   }
+   return atomic_load_explicit(&counter->cached, memory_order_relaxed);
+}
+
+#endif
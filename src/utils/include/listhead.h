@@ -2,7 +2,11 @@
 #define LISTHEAD_H
 
 #include "stddef.h"
-#include <urcu/pointer.h>
+
+// Publish/subscribe for lock-free readers (was liburcu's rcu_assign_pointer
+// and rcu_dereference). Reclaiming removed entries is up to the caller.
+#define list_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define list_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
 
 #define LIST_POISON1  ((void *)0x00100100)
 #define LIST_POISON2  ((void *)0x00200200)
@@ -43,15 +47,15 @@ static inline void __list_add_rcu(struct list_head *new, struct list_head *prev,
    if (!__list_add_valid(prev, next)) {
       return;
    }
-   rcu_assign_pointer(next->prev, new);
-   rcu_assign_pointer(new->next, next);
-   rcu_assign_pointer(new->prev, prev);
-   rcu_assign_pointer(prev->next, new);
+   list_assign_pointer(next->prev, new);
+   list_assign_pointer(new->next, next);
+   list_assign_pointer(new->prev, prev);
+   list_assign_pointer(prev->next, new);
 }
 
 static inline void __list_del_rcu(struct list_head *prev, struct list_head *next) {
-   rcu_assign_pointer(next->prev, prev);
-   rcu_assign_pointer(prev->next, next);
+   list_assign_pointer(next->prev, prev);
+   list_assign_pointer(prev->next, next);
 }
 
 static inline void list_add(struct list_head *new, struct list_head *list) {
@@ -69,11 +73,11 @@ static inline void list_del(struct list_head *entry) {
 }
 
 static inline void list_add_rcu(struct list_head *new, struct list_head *list) {
-   __list_add_rcu(new, list, rcu_dereference(list->next));
+   __list_add_rcu(new, list, list_dereference(list->next));
 }
 
 static inline void list_del_rcu(struct list_head *entry) {
-   __list_del_rcu(rcu_dereference(entry->prev), rcu_dereference(entry->next));
+   __list_del_rcu(list_dereference(entry->prev), list_dereference(entry->next));
    entry->next = LIST_POISON1;
    entry->prev = LIST_POISON2;
 }
@@ -106,12 +110,12 @@ static inline int list_is_head(struct list_head *entry, struct list_head *head)
    for (pos = (head)->next; pos != (head); pos = pos->next)
 
 #define list_for_each_rcu(pos, head) \
-   for (pos = rcu_dereference((head)->next); pos != (head); pos = rcu_dereference(pos->next))
+   for (pos = list_dereference((head)->next); pos != (head); pos = list_dereference(pos->next))
 
 #define list_for_each_entry_rcu(pos, head, member) \
-   for (pos = container_of(rcu_dereference((head)->next), typeof(*pos), member); \
+   for (pos = container_of(list_dereference((head)->next), typeof(*pos), member); \
         &pos->member != (head); \
-        pos = container_of(rcu_dereference(pos->member.next), typeof(*pos), member))
+        pos = container_of(list_dereference(pos->member.next), typeof(*pos), member))
 
 #define list_for_each_entry_safe(pos, temp, head, member)                   \
    for (pos = list_first_entry(head, typeof(*pos), member),                \
@@ -5,7 +5,6 @@
 
 #include <pthread.h>
 #include <stdatomic.h>
-#include "urcu.h"
 
 typedef struct {
    pthread_mutex_t lock;
@@ -30,4 +29,80 @@ int mutex_unlock(mutex_t *mutex);
 
 void mutex_synchronise(mutex_t *mutex);
 
+// Spin-wait hint for busy loops; 'pause' is x86 only
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause();
+#elif defined(__aarch64__)
+   __asm__ __volatile__("yield" ::: "memory");
+#else
+   __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+// Seqlock for small POD snapshots (config and the like). Readers never
+// write: they take the sequence, copy, and retry if a writer was in the
+// middle (odd sequence) or finished in between (sequence changed).
+//
+//    unsigned seq;
+//    do {
+//       seq = seqlock_read_begin(&lock);
+//       copy = shared;
+//    } while (seqlock_read_retry(&lock, seq));
+
+typedef struct {
+   atomic_uint seq;
+} seqlock_t;
+
+#define SEQLOCK_INIT { 0 }
+
+void seqlock_init(seqlock_t *lock);
+
+static inline unsigned seqlock_read_begin(seqlock_t *lock) {
+   unsigned seq;
+   while ((seq = atomic_load_explicit(&lock->seq, memory_order_acquire)) & 1) {
+      cpu_relax();
+   }
+   return seq;
+}
+
+static inline bool seqlock_read_retry(seqlock_t *lock, unsigned seq) {
+   atomic_thread_fence(memory_order_acquire);
+   return atomic_load_explicit(&lock->seq, memory_order_relaxed) != seq;
+}
+
+void seqlock_write_lock(seqlock_t *lock);
+void seqlock_write_unlock(seqlock_t *lock);
+
+// Reader-writer lock for read-mostly state. Every reader thread gets its
+// own slot (its own cache line) and only touches that one, so readers on
+// different cores never bounce a line between each other. Writers are
+// rare and pay for it: they raise the writer flag and wait until every
+// slot drains.
+//
+// Threads pick slots round-robin on first use; past RWLOCK_SLOTS threads
+// two of them share a slot, which is still correct, just not free.
+
+#define RWLOCK_SLOTS 64
+#define RWLOCK_CACHE_LINE 64
+
+struct rwlock_slot {
+   atomic_int readers;
+} __attribute__((aligned(RWLOCK_CACHE_LINE)));
+
+typedef struct {
+   struct rwlock_slot slots[RWLOCK_SLOTS];
+   atomic_int writer __attribute__((aligned(RWLOCK_CACHE_LINE)));
+   pthread_mutex_t writer_lock;
+} rwlock_t;
+
+int rwlock_init(rwlock_t *lock);
+void rwlock_destroy(rwlock_t *lock);
+
+int rwlock_read_lock(rwlock_t *lock);
+void rwlock_read_unlock(rwlock_t *lock, int slot);
+
+void rwlock_write_lock(rwlock_t *lock);
+void rwlock_write_unlock(rwlock_t *lock);
+
 #endif
@@ -0,0 +1,36 @@
+#ifndef ONION_LOG_H
+#define ONION_LOG_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ONION_LOG_RING_SIZE    (64 * 1024)
+#define ONION_LOG_BATCH_SIZE   (64 * 1024)
+#define ONION_LOG_MAX_THREADS  64
+#define ONION_LOG_LINE_MAX     1024
+#define ONION_LOG_FLUSH_MS     10
+#define ONION_LOG_SLOTS        64
+
+typedef enum {
+   ONION_LOG_OVERFLOW_DROP,
+   ONION_LOG_OVERFLOW_BLOCK
+} onion_log_overflow_t;
+
+typedef struct {
+   _Atomic size_t head __attribute__((aligned(64)));
+   _Atomic size_t dropped;
+
+   _Atomic size_t tail __attribute__((aligned(64)));
+
+   _Atomic int orphan __attribute__((aligned(64)));
+   uint8_t *data;
+} onion_log_ring_t;
+
+int onion_log_async_init(int fd, onion_log_overflow_t policy, size_t flush_ms);
+void onion_log_async_exit(void);
+
+void onion_log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+size_t onion_log_dropped(void);
+
+#endif
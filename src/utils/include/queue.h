@@ -0,0 +1,163 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded lock-free queues for messages between threads.
+//
+//   spsc_queue_t  one producer, one consumer. Each side keeps a private
+//                 copy of the other side's index and only rereads it when
+//                 the copy says full/empty, so in steady state producer
+//                 and consumer never touch each other's cache line.
+//   mpsc_queue_t  any number of producers, one consumer (Vyukov's bounded
+//                 queue, every cell has its own sequence number).
+//
+// Head, tail and the slots live on separate cache lines. Capacity is
+// rounded up to a power of two.
+
+#define QUEUE_CACHE_LINE 64
+
+typedef struct {
+   void (*func)(void *arg);
+   void *arg;
+} queue_msg_t;
+
+typedef struct {
+   // Producer line
+   _Alignas(QUEUE_CACHE_LINE) atomic_size_t tail;
+   size_t head_cache;
+
+   // Consumer line
+   _Alignas(QUEUE_CACHE_LINE) atomic_size_t head;
+   size_t tail_cache;
+
+   _Alignas(QUEUE_CACHE_LINE) size_t mask;
+   queue_msg_t *slots;
+} spsc_queue_t;
+
+struct mpsc_cell {
+   atomic_size_t seq;
+   queue_msg_t msg;
+};
+
+typedef struct {
+   _Alignas(QUEUE_CACHE_LINE) atomic_size_t tail;
+
+   _Alignas(QUEUE_CACHE_LINE) size_t head;
+
+   // Consumer is (about to be) asleep and wants a doorbell. Written only
+   // when the consumer parks, so producers mostly read a shared line.
+   _Alignas(QUEUE_CACHE_LINE) atomic_int parked;
+
+   _Alignas(QUEUE_CACHE_LINE) size_t mask;
+   struct mpsc_cell *cells;
+} mpsc_queue_t;
+
+int spsc_queue_init(spsc_queue_t **queue, size_t capacity);
+void spsc_queue_exit(spsc_queue_t *queue);
+
+int mpsc_queue_init(mpsc_queue_t **queue, size_t capacity);
+void mpsc_queue_exit(mpsc_queue_t *queue);
+
+static inline bool spsc_queue_push(spsc_queue_t *queue, const queue_msg_t *msg) {
+   size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+   if (tail - queue->head_cache > queue->mask) {
+      queue->head_cache = atomic_load_explicit(&queue->head, memory_order_acquire);
+      if (tail - queue->head_cache > queue->mask) {
+         return false;
+      }
+   }
+   queue->slots[tail & queue->mask] = *msg;
+   atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+   return true;
+}
+
+static inline bool spsc_queue_pop(spsc_queue_t *queue, queue_msg_t *msg) {
+   size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+   if (head == queue->tail_cache) {
+      queue->tail_cache = atomic_load_explicit(&queue->tail, memory_order_acquire);
+      if (head == queue->tail_cache) {
+         return false;
+      }
+   }
+   *msg = queue->slots[head & queue->mask];
+   atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+   return true;
+}
+
+static inline bool mpsc_queue_push(mpsc_queue_t *queue, const queue_msg_t *msg) {
+   size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+   struct mpsc_cell *cell;
+
+   for (;;) {
+      cell = &queue->cells[pos & queue->mask];
+      size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+         if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                  memory_order_relaxed, memory_order_relaxed)) {
+            break;
+         }
+      } else if (diff < 0) {
+         // The consumer has not freed this cell for a full lap yet
+         return false;
+      } else {
+         pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+      }
+   }
+
+   cell->msg = *msg;
+   atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+   return true;
+}
+
+static inline bool mpsc_queue_pop(mpsc_queue_t *queue, queue_msg_t *msg) {
+   struct mpsc_cell *cell = &queue->cells[queue->head & queue->mask];
+   size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+   if (seq != queue->head + 1) {
+      return false;
+   }
+   *msg = cell->msg;
+   atomic_store_explicit(&cell->seq, queue->head + queue->mask + 1, memory_order_release);
+   queue->head++;
+   return true;
+}
+
+static inline bool mpsc_queue_empty(mpsc_queue_t *queue) {
+   struct mpsc_cell *cell = &queue->cells[queue->head & queue->mask];
+   return atomic_load_explicit(&cell->seq, memory_order_acquire) != queue->head + 1;
+}
+
+// Doorbell coalescing. The consumer calls mpsc_queue_park() before it goes
+// to sleep; false means a message slipped in and it must not sleep. The
+// producer calls mpsc_queue_ring() after a push; true means the consumer is
+// parked and this producer (only this one) has to wake it up.
+// The seq_cst fences pair up: either the consumer sees the message or the
+// producer sees 'parked'.
+
+static inline bool mpsc_queue_park(mpsc_queue_t *queue) {
+   atomic_store_explicit(&queue->parked, 1, memory_order_relaxed);
+   atomic_thread_fence(memory_order_seq_cst);
+   if (!mpsc_queue_empty(queue)) {
+      atomic_store_explicit(&queue->parked, 0, memory_order_relaxed);
+      return false;
+   }
+   return true;
+}
+
+static inline void mpsc_queue_unpark(mpsc_queue_t *queue) {
+   if (atomic_load_explicit(&queue->parked, memory_order_relaxed)) {
+      atomic_store_explicit(&queue->parked, 0, memory_order_relaxed);
+   }
+}
+
+static inline bool mpsc_queue_ring(mpsc_queue_t *queue) {
+   atomic_thread_fence(memory_order_seq_cst);
+   return atomic_load_explicit(&queue->parked, memory_order_relaxed)
+      && atomic_exchange_explicit(&queue->parked, 0, memory_order_relaxed);
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define UTILS_H
 
 #include "pool.h"
+#include "log.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -145,16 +146,18 @@ static inline void onion_clear_bit64(uint64_t *bitmap, size_t offset) {
 }
 
 
+// All debug output goes through onion_log_printf: plain printf until
+// onion_log_async_init() starts the ring-buffered backend.
 #define DEBUG_INFO(fmt, ...) do { \
-   printf(fmt, ##__VA_ARGS__); \
+   onion_log_printf(fmt, ##__VA_ARGS__); \
 } while(0)
 
 #define DEBUG_FUNC(fmt, ...) do { \
-   printf("\n%s: " fmt, __func__, ##__VA_ARGS__); \
+   onion_log_printf("\n%s: " fmt, __func__, ##__VA_ARGS__); \
 } while(0)
 
 #define DEBUG_ERR(fmt, ...) do { \
-   printf("\n%s: err:  %s  " fmt, __func__, strerror(errno), ##__VA_ARGS__); \
+   onion_log_printf("\n%s: err:  %s  " fmt, __func__, strerror(errno), ##__VA_ARGS__); \
 } while(0)
 
 #define CHECK_NULL_RETURN(ptr, msg) do { \
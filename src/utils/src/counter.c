@@ -0,0 +1,31 @@
+#include "counter.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+__thread int counter_thread_slot = -1;
+
+static atomic_int counter_next_slot;
+
+int counter_slot_assign(void) {
+   counter_thread_slot = atomic_fetch_add_explicit(&counter_next_slot, 1, memory_order_relaxed) % COUNTER_SLOTS;
+   return counter_thread_slot;
+}
+
+int counter_init(counter_t **ptr) {
+   if (!ptr) {
+      return -1;
+   }
+   counter_t *counter = aligned_alloc(COUNTER_CACHE_LINE, sizeof(*counter));
+   if (!counter) {
+      DEBUG_ERR("Failed to allocate counter.\n");
+      return -1;
+   }
+   memset(counter, 0, sizeof(*counter));
+   *ptr = counter;
+   return 0;
+}
+
+void counter_exit(counter_t *counter) {
+   free(counter);
+}
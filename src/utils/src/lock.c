@@ -1,6 +1,7 @@
 #include "lock.h"
 #include "utils.h"
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdatomic.h>
 
@@ -75,3 +76,91 @@ void mutex_synchronise(mutex_t *mutex) {
    }
    pthread_mutex_unlock(&mutex->lock);
 }
+
+void seqlock_init(seqlock_t *lock) {
+   atomic_store_explicit(&lock->seq, 0, memory_order_relaxed);
+}
+
+void seqlock_write_lock(seqlock_t *lock) {
+   // Even -> odd; a CAS so concurrent writers serialize on the sequence itself
+   unsigned seq = atomic_load_explicit(&lock->seq, memory_order_relaxed);
+   for (;;) {
+      if (!(seq & 1) && atomic_compare_exchange_weak_explicit(&lock->seq, &seq, seq + 1,
+               memory_order_acquire, memory_order_relaxed)) {
+         break;
+      }
+      cpu_relax();
+      seq = atomic_load_explicit(&lock->seq, memory_order_relaxed);
+   }
+   // Data stores must not move above the odd sequence
+   atomic_thread_fence(memory_order_release);
+}
+
+void seqlock_write_unlock(seqlock_t *lock) {
+   atomic_fetch_add_explicit(&lock->seq, 1, memory_order_release);
+}
+
+static atomic_int rwlock_next_slot;
+static __thread int rwlock_slot = -1;
+
+int rwlock_init(rwlock_t *lock) {
+   if (!lock) {
+      return -1;
+   }
+   for (int index = 0; index < RWLOCK_SLOTS; index++) {
+      atomic_store(&lock->slots[index].readers, 0);
+   }
+   atomic_store(&lock->writer, 0);
+   if (pthread_mutex_init(&lock->writer_lock, NULL) != 0) {
+      DEBUG_FUNC("no writer mutex!\n");
+      return -1;
+   }
+   return 0;
+}
+
+void rwlock_destroy(rwlock_t *lock) {
+   if (!lock) {
+      return;
+   }
+   pthread_mutex_destroy(&lock->writer_lock);
+}
+
+// Returns the slot to pass to rwlock_read_unlock()
+int rwlock_read_lock(rwlock_t *lock) {
+   if (rwlock_slot < 0) {
+      rwlock_slot = atomic_fetch_add_explicit(&rwlock_next_slot, 1, memory_order_relaxed) % RWLOCK_SLOTS;
+   }
+   struct rwlock_slot *slot = &lock->slots[rwlock_slot];
+
+   for (;;) {
+      // seq_cst: the increment must be visible before we look at the
+      // writer flag, the writer does the mirror image
+      atomic_fetch_add(&slot->readers, 1);
+      if (!atomic_load(&lock->writer)) {
+         return rwlock_slot;
+      }
+      atomic_fetch_sub_explicit(&slot->readers, 1, memory_order_release);
+      while (atomic_load_explicit(&lock->writer, memory_order_relaxed)) {
+         cpu_relax();
+      }
+   }
+}
+
+void rwlock_read_unlock(rwlock_t *lock, int slot) {
+   atomic_fetch_sub_explicit(&lock->slots[slot].readers, 1, memory_order_release);
+}
+
+void rwlock_write_lock(rwlock_t *lock) {
+   pthread_mutex_lock(&lock->writer_lock);
+   atomic_store(&lock->writer, 1);
+   for (int index = 0; index < RWLOCK_SLOTS; index++) {
+      while (atomic_load_explicit(&lock->slots[index].readers, memory_order_acquire) > 0) {
+         sched_yield();
+      }
+   }
+}
+
+void rwlock_write_unlock(rwlock_t *lock) {
+   atomic_store_explicit(&lock->writer, 0, memory_order_release);
+   pthread_mutex_unlock(&lock->writer_lock);
+}
@@ -0,0 +1,379 @@
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Same scheme as the opium async log: one SPSC ring per thread, one flusher
+// thread that batches everything into large writes. Without onion_log_async_init
+// onion_log_printf behaves exactly like printf.
+//
+// This is a copy on purpose, not a second design: libonion is built and
+// shipped on its own by the top-level Makefile and never links the opium
+// core (project/core/opium_log_async.c), which in turn knows nothing about
+// libonion. What is here is the single-destination subset of that file;
+// a fix to the ring, the drain or the shutdown order belongs in both.
+
+#define ONION_LOG_RING_MASK (ONION_LOG_RING_SIZE - 1)
+#define ONION_LOG_RECORD_SKIP 0xFFFFFFFF
+#define onion_log_align(n) (((n) + 7) & ~((size_t)7))
+
+typedef struct {
+   uint32_t len;
+   uint32_t skip;
+} onion_log_record_t;
+
+typedef struct {
+   onion_log_ring_t rings[ONION_LOG_MAX_THREADS];
+   _Atomic size_t nrings;
+
+   onion_log_overflow_t policy;
+   size_t flush_ms;
+   int fd;
+
+   uint8_t *batch;
+   size_t batch_len;
+   size_t reported;
+
+   pthread_key_t key;
+   pthread_t flow;
+   _Atomic bool stop;
+} onion_log_async_t;
+
+// Threads that loaded onion_log_async and may still touch its rings,
+// counted per slot so producers on different cores never share a line.
+// Past ONION_LOG_SLOTS threads two of them share a slot.
+typedef struct {
+   _Atomic size_t busy __attribute__((aligned(64)));
+} onion_log_slot_t;
+
+static onion_log_async_t *_Atomic onion_log_async;
+static onion_log_slot_t onion_log_slots[ONION_LOG_SLOTS];
+static _Atomic unsigned onion_log_next_slot;
+static __thread int onion_log_slot = -1;
+static _Atomic uint64_t onion_log_generation;
+static uint64_t onion_log_current_gen;
+
+static __thread onion_log_ring_t *onion_log_ring;
+static __thread uint64_t onion_log_ring_gen;
+
+static void onion_log_leave(void) {
+   atomic_fetch_sub_explicit(&onion_log_slots[onion_log_slot].busy, 1, memory_order_release);
+}
+
+// NULL while logging synchronously, at the cost of one load. Otherwise the
+// backend stays alive until onion_log_leave().
+static onion_log_async_t *onion_log_enter(void) {
+   if (!atomic_load_explicit(&onion_log_async, memory_order_relaxed)) {
+      return NULL;
+   }
+   if (onion_log_slot < 0) {
+      onion_log_slot = atomic_fetch_add_explicit(&onion_log_next_slot, 1, memory_order_relaxed) % ONION_LOG_SLOTS;
+   }
+
+   // Both sequentially consistent, like the exchange and the slot loads in
+   // onion_log_async_exit: either exit sees the slot busy or this sees NULL
+   atomic_fetch_add(&onion_log_slots[onion_log_slot].busy, 1);
+   onion_log_async_t *async = atomic_load(&onion_log_async);
+   if (!async) {
+      onion_log_leave();
+   }
+   return async;
+}
+
+// Runs at thread exit, possibly during onion_log_async_exit: counted as a
+// producer, and the ring of a backend that is already gone is left alone
+static void onion_log_ring_release(void *data) {
+   onion_log_ring_t *ring = data;
+   onion_log_async_t *async = onion_log_enter();
+   if (!async) {
+      return;
+   }
+   if (onion_log_ring_gen == onion_log_current_gen) {
+      atomic_store_explicit(&ring->orphan, 1, memory_order_release);
+   }
+   onion_log_leave();
+}
+
+static onion_log_ring_t *onion_log_ring_get(onion_log_async_t *async) {
+   if (onion_log_ring && onion_log_ring_gen == onion_log_current_gen) {
+      return onion_log_ring;
+   }
+
+   onion_log_ring_t *ring = NULL;
+   size_t count = atomic_load_explicit(&async->nrings, memory_order_acquire);
+
+   for (size_t index = 0; index < count && index < ONION_LOG_MAX_THREADS; index++) {
+      onion_log_ring_t *current = &async->rings[index];
+      int expected = 1;
+      if (atomic_load_explicit(&current->head, memory_order_relaxed) != atomic_load_explicit(&current->tail, memory_order_acquire)) {
+         continue;
+      }
+      if (atomic_compare_exchange_strong(&current->orphan, &expected, 0)) {
+         ring = current;
+         break;
+      }
+   }
+
+   if (!ring) {
+      size_t index = atomic_fetch_add(&async->nrings, 1);
+      if (index >= ONION_LOG_MAX_THREADS) {
+         atomic_fetch_sub(&async->nrings, 1);
+         return NULL;
+      }
+      ring = &async->rings[index];
+   }
+
+   // Buffers come with the first owner of a ring, not with init: the
+   // flusher only reads one after the first record moved its head
+   if (!ring->data) {
+      ring->data = malloc(ONION_LOG_RING_SIZE);
+      if (!ring->data) {
+         atomic_store_explicit(&ring->orphan, 1, memory_order_release);
+         return NULL;
+      }
+   }
+
+   pthread_setspecific(async->key, ring);
+   onion_log_ring = ring;
+   onion_log_ring_gen = onion_log_current_gen;
+   return ring;
+}
+
+static void onion_log_write_fd(int fd, uint8_t *data, size_t len) {
+   while (len > 0) {
+      ssize_t ret = write(fd, data, len);
+      if (ret < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return;
+      }
+      data += ret;
+      len -= ret;
+   }
+}
+
+static void onion_log_batch_add(onion_log_async_t *async, uint8_t *data, size_t len) {
+   if (async->batch_len + len > ONION_LOG_BATCH_SIZE) {
+      onion_log_write_fd(async->fd, async->batch, async->batch_len);
+      async->batch_len = 0;
+   }
+   memcpy(async->batch + async->batch_len, data, len);
+   async->batch_len += len;
+}
+
+static size_t onion_log_drain(onion_log_async_t *async) {
+   size_t count = atomic_load_explicit(&async->nrings, memory_order_acquire);
+   size_t records = 0;
+   size_t dropped = 0;
+
+   if (count > ONION_LOG_MAX_THREADS) {
+      count = ONION_LOG_MAX_THREADS;
+   }
+
+   for (size_t index = 0; index < count; index++) {
+      onion_log_ring_t *ring = &async->rings[index];
+      size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+      while (tail != head) {
+         onion_log_record_t *record = (onion_log_record_t*)(ring->data + (tail & ONION_LOG_RING_MASK));
+         if (record->skip != ONION_LOG_RECORD_SKIP) {
+            onion_log_batch_add(async, (uint8_t*)(record + 1), record->len);
+            records++;
+         }
+         tail += onion_log_align(sizeof(onion_log_record_t) + record->len);
+      }
+
+      atomic_store_explicit(&ring->tail, tail, memory_order_release);
+      dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+   }
+
+   if (dropped != async->reported) {
+      char line[96];
+      int len = snprintf(line, sizeof(line), "\nonion_log: dropped %zu records\n", dropped - async->reported);
+      if (len > 0) {
+         onion_log_batch_add(async, (uint8_t*)line, len);
+      }
+      async->reported = dropped;
+   }
+
+   if (async->batch_len > 0) {
+      onion_log_write_fd(async->fd, async->batch, async->batch_len);
+      async->batch_len = 0;
+   }
+
+   return records;
+}
+
+static void *onion_log_flusher(void *arg) {
+   onion_log_async_t *async = arg;
+   struct timespec ts = {
+      .tv_sec = async->flush_ms / 1000,
+      .tv_nsec = (async->flush_ms % 1000) * 1000000
+   };
+
+   while (!atomic_load_explicit(&async->stop, memory_order_acquire)) {
+      if (onion_log_drain(async) == 0) {
+         nanosleep(&ts, NULL);
+      }
+   }
+   onion_log_drain(async);
+   return NULL;
+}
+
+static void onion_log_async_free(onion_log_async_t *async) {
+   for (size_t index = 0; index < ONION_LOG_MAX_THREADS; index++) {
+      free(async->rings[index].data);
+   }
+   free(async->batch);
+   free(async);
+}
+
+int onion_log_async_init(int fd, onion_log_overflow_t policy, size_t flush_ms) {
+   if (atomic_load(&onion_log_async)) {
+      fprintf(stderr, "onion_log_async_init: already running\n");
+      return -1;
+   }
+
+   onion_log_async_t *async;
+   if (posix_memalign((void**)&async, 64, sizeof(*async)) != 0) {
+      fprintf(stderr, "onion_log_async_init: no memory\n");
+      return -1;
+   }
+   memset(async, 0, sizeof(*async));
+
+   async->fd = fd >= 0 ? fd : STDOUT_FILENO;
+   async->policy = policy;
+   async->flush_ms = flush_ms > 0 ? flush_ms : ONION_LOG_FLUSH_MS;
+
+   async->batch = malloc(ONION_LOG_BATCH_SIZE);
+   if (!async->batch) {
+      goto unsuccessfull;
+   }
+
+   if (pthread_key_create(&async->key, onion_log_ring_release) != 0) {
+      goto unsuccessfull;
+   }
+
+   fflush(stdout);
+   onion_log_current_gen = atomic_fetch_add(&onion_log_generation, 1) + 1;
+
+   if (pthread_create(&async->flow, NULL, onion_log_flusher, async) != 0) {
+      pthread_key_delete(async->key);
+      goto unsuccessfull;
+   }
+
+   atomic_store_explicit(&onion_log_async, async, memory_order_release);
+   return 0;
+unsuccessfull:
+   fprintf(stderr, "onion_log_async_init: initialization failed\n");
+   onion_log_async_free(async);
+   return -1;
+}
+
+void onion_log_async_exit(void) {
+   onion_log_async_t *async = atomic_exchange(&onion_log_async, NULL);
+   if (!async) {
+      return;
+   }
+
+   // Quiesce before the rings go away: stop makes a producer blocked on a
+   // full ring give up, and whoever loaded the pointer before the exchange
+   // is waited for
+   atomic_store(&async->stop, true);
+   for (int index = 0; index < ONION_LOG_SLOTS; index++) {
+      while (atomic_load(&onion_log_slots[index].busy) > 0) {
+         sched_yield();
+      }
+   }
+
+   pthread_join(async->flow, NULL);
+   // The flusher may have made its last pass before the last producer left
+   onion_log_drain(async);
+   pthread_key_delete(async->key);
+   onion_log_async_free(async);
+}
+
+size_t onion_log_dropped(void) {
+   onion_log_async_t *async = onion_log_enter();
+   size_t dropped = 0;
+   if (async) {
+      size_t count = atomic_load_explicit(&async->nrings, memory_order_acquire);
+      for (size_t index = 0; index < count && index < ONION_LOG_MAX_THREADS; index++) {
+         dropped += atomic_load_explicit(&async->rings[index].dropped, memory_order_relaxed);
+      }
+      onion_log_leave();
+   }
+   return dropped;
+}
+
+static void onion_log_push(onion_log_async_t *async, const char *line, size_t len) {
+   onion_log_ring_t *ring = onion_log_ring_get(async);
+   if (!ring) {
+      onion_log_write_fd(async->fd, (uint8_t*)line, len);
+      return;
+   }
+
+   size_t need = onion_log_align(sizeof(onion_log_record_t) + len);
+
+   while (1) {
+      size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+      size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+      size_t free_bytes = ONION_LOG_RING_SIZE - (head - tail);
+      size_t offset = head & ONION_LOG_RING_MASK;
+      size_t room = ONION_LOG_RING_SIZE - offset;
+
+      if (need > room && free_bytes >= room + need) {
+         onion_log_record_t *skip = (onion_log_record_t*)(ring->data + offset);
+         skip->len = room - sizeof(onion_log_record_t);
+         skip->skip = ONION_LOG_RECORD_SKIP;
+         head += room;
+         offset = 0;
+      } else if (need > room || free_bytes < need) {
+         if (async->policy == ONION_LOG_OVERFLOW_DROP || atomic_load_explicit(&async->stop, memory_order_relaxed)) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+         }
+         sched_yield();
+         continue;
+      }
+
+      onion_log_record_t *record = (onion_log_record_t*)(ring->data + offset);
+      record->len = len;
+      record->skip = 0;
+      memcpy(record + 1, line, len);
+      atomic_store_explicit(&ring->head, head + need, memory_order_release);
+      return;
+   }
+}
+
+void onion_log_printf(const char *fmt, ...) {
+   va_list args;
+   onion_log_async_t *async = onion_log_enter();
+
+   if (!async) {
+      va_start(args, fmt);
+      vprintf(fmt, args);
+      va_end(args);
+      return;
+   }
+
+   char line[ONION_LOG_LINE_MAX];
+   va_start(args, fmt);
+   int ret = vsnprintf(line, sizeof(line), fmt, args);
+   va_end(args);
+   if (ret > 0) {
+      size_t len = (size_t)ret < sizeof(line) ? (size_t)ret : sizeof(line) - 1;
+      onion_log_push(async, line, len);
+   }
+   onion_log_leave();
+}
@@ -0,0 +1,86 @@
+#include "queue.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+static size_t queue_capacity(size_t capacity) {
+   return round_size_pow2(capacity < 2 ? 2 : capacity);
+}
+
+int spsc_queue_init(spsc_queue_t **ptr, size_t capacity) {
+   if (!ptr) {
+      return -1;
+   }
+   capacity = queue_capacity(capacity);
+
+   spsc_queue_t *queue = aligned_alloc(QUEUE_CACHE_LINE, sizeof(*queue));
+   if (!queue) {
+      DEBUG_ERR("Failed to allocate spsc queue.\n");
+      goto unsuccessfull;
+   }
+   memset(queue, 0, sizeof(*queue));
+
+   queue->slots = calloc(capacity, sizeof(queue_msg_t));
+   if (!queue->slots) {
+      DEBUG_ERR("Failed to allocate spsc queue slots.\n");
+      goto please_free;
+   }
+   queue->mask = capacity - 1;
+
+   *ptr = queue;
+   return 0;
+
+please_free:
+   free(queue);
+unsuccessfull:
+   return -1;
+}
+
+void spsc_queue_exit(spsc_queue_t *queue) {
+   if (!queue) {
+      return;
+   }
+   free(queue->slots);
+   free(queue);
+}
+
+int mpsc_queue_init(mpsc_queue_t **ptr, size_t capacity) {
+   if (!ptr) {
+      return -1;
+   }
+   capacity = queue_capacity(capacity);
+
+   mpsc_queue_t *queue = aligned_alloc(QUEUE_CACHE_LINE, sizeof(*queue));
+   if (!queue) {
+      DEBUG_ERR("Failed to allocate mpsc queue.\n");
+      goto unsuccessfull;
+   }
+   memset(queue, 0, sizeof(*queue));
+
+   queue->cells = calloc(capacity, sizeof(struct mpsc_cell));
+   if (!queue->cells) {
+      DEBUG_ERR("Failed to allocate mpsc queue cells.\n");
+      goto please_free;
+   }
+   // Cell i is free for the producer that gets ticket i
+   for (size_t index = 0; index < capacity; index++) {
+      atomic_store_explicit(&queue->cells[index].seq, index, memory_order_relaxed);
+   }
+   queue->mask = capacity - 1;
+
+   *ptr = queue;
+   return 0;
+
+please_free:
+   free(queue);
+unsuccessfull:
+   return -1;
+}
+
+void mpsc_queue_exit(mpsc_queue_t *queue) {
+   if (!queue) {
+      return;
+   }
+   free(queue->cells);
+   free(queue);
+}
@@ -0,0 +1,140 @@
+#include "core/opium_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// 100K+ connections held at once through the memory transport, opened and
+// closed over several cycles. The pool is sized once from the config, so
+// the resident size after the first fill must not move, and every handle
+// of a closed connection must stop resolving.
+
+#define TOTAL_CONNECTIONS (128 * 1024)
+#define TOTAL_CYCLES      5
+#define BATCH             4096
+#define BUFSIZE           256
+
+// Allocator noise between cycles, the pool itself never grows
+#define RSS_SLACK         (4 * 1024 * 1024)
+
+static size_t rss_bytes(void) {
+   long pages = 0, resident = 0;
+   FILE *file = fopen("/proc/self/statm", "r");
+   if (!file) {
+      return 0;
+   }
+   if (fscanf(file, "%ld %ld", &pages, &resident) != 2) {
+      resident = 0;
+   }
+   fclose(file);
+   return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static int connect_batch(opium_network_t *net, struct sockaddr_un *addr, socklen_t len,
+      opium_socket_t *clients, int from, int count) {
+   opium_family family = { .family = AF_UNIX };
+
+   for (int index = from; index < from + count; index++) {
+      clients[index] = opium_net_socket(net, family, SOCK_STREAM, 0);
+      if (clients[index].fd < 0 || opium_net_connect(net, clients[index], (struct sockaddr*)addr, len) != OPIUM_RET_OK) {
+         printf("connect %d failed: %s\n", index, strerror(errno));
+         return -1;
+      }
+   }
+   return 0;
+}
+
+int main() {
+   // Every allocation is logged at debug level, keep the report readable
+   opium_log_t *log = opium_log_init("/dev/null", NULL, NULL);
+   opium_network_t net;
+   opium_server_t server;
+   opium_server_conf_t conf;
+   struct sockaddr_un addr;
+   socklen_t len = opium_net_unix_addr(&addr, "@opium-conn-stress");
+   int failed = 0;
+
+   opium_server_conf_default(&conf);
+   conf.connections = TOTAL_CONNECTIONS;
+   conf.backlog = BATCH;
+
+   // Both ends of every connection, the listener and one refused client
+   if (opium_network_memory_init(&net, TOTAL_CONNECTIONS * 2 + 3, BUFSIZE, log) != OPIUM_RET_OK
+         || opium_server_init(&server, &conf, &net, (struct sockaddr*)&addr, len, log) != OPIUM_RET_OK) {
+      printf("init failed\n");
+      return 1;
+   }
+
+   opium_socket_t *clients = calloc(TOTAL_CONNECTIONS + 1, sizeof(opium_socket_t));
+   opium_conn_handle_t *handles = calloc(TOTAL_CONNECTIONS, sizeof(opium_conn_handle_t));
+   if (!clients || !handles) {
+      return 1;
+   }
+
+   size_t first_rss = 0;
+
+   for (int cycle = 0; cycle < TOTAL_CYCLES && !failed; cycle++) {
+      for (int from = 0; from < TOTAL_CONNECTIONS; from += BATCH) {
+         if (connect_batch(&net, &addr, len, clients, from, BATCH) < 0) {
+            return 1;
+         }
+         if (opium_server_accept(&server, BATCH) != BATCH) {
+            printf("cycle %d: short accept at %d\n", cycle, from);
+            return 1;
+         }
+      }
+
+      // One over the configured capacity is turned away, not queued
+      opium_u64_t refused = server.nrefused;
+      if (connect_batch(&net, &addr, len, clients, TOTAL_CONNECTIONS, 1) < 0
+            || opium_server_accept(&server, 1) != 0 || server.nrefused != refused + 1) {
+         printf("cycle %d: connection over capacity was not refused\n", cycle);
+         failed = 1;
+      }
+      opium_net_close(&net, clients[TOTAL_CONNECTIONS]);
+
+      size_t rss = rss_bytes();
+      if (cycle == 0) {
+         first_rss = rss;
+      }
+      printf("cycle %d: %u connections open, rss %zu KB\n", cycle, server.conns.used, rss / 1024);
+
+      if (server.conns.used != TOTAL_CONNECTIONS) {
+         failed = 1;
+      }
+      if (rss > first_rss + RSS_SLACK) {
+         printf("cycle %d: rss grew by %zu KB\n", cycle, (rss - first_rss) / 1024);
+         failed = 1;
+      }
+
+      int index = 0;
+      for (opium_u32_t slot = 0; slot < server.conns.capacity; slot++) {
+         opium_connection_t *conn = &server.conns.conns[slot];
+         if (conn->used) {
+            handles[index++] = conn->handle;
+            opium_server_close(&server, conn);
+         }
+      }
+      for (int client = 0; client < TOTAL_CONNECTIONS; client++) {
+         opium_net_close(&net, clients[client]);
+      }
+
+      for (int handle = 0; handle < index; handle++) {
+         if (opium_conn_lookup(&server.conns, handles[handle])) {
+            printf("cycle %d: handle %08x still resolves after close\n", cycle, handles[handle]);
+            failed = 1;
+            break;
+         }
+      }
+   }
+
+   printf("peak %u, stale lookups %llu, refused %llu\n", server.conns.peak,
+         (unsigned long long)server.conns.nstale, (unsigned long long)server.nrefused);
+   opium_server_exit(&server);
+   opium_network_memory_exit(&net);
+   free(clients);
+   free(handles);
+
+   printf("%s\n", failed ? "FAIL" : "OK");
+   return failed;
+}
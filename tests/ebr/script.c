@@ -0,0 +1,259 @@
+#include "core/opium_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Epoch-based reclamation under load: readers walk a shared table without
+// a lock while writers keep replacing its entries and retiring the old
+// ones. Half of the readers run like an event loop (quiescent once per
+// pass, offline now and then), the other half bracket every pass with
+// enter/leave.
+//
+// The deferred free marks a node dead and parks it on its writer's free
+// list, from where the writer reuses it. A reader that ever finds a dead
+// node, or sees one change under it, was handed memory that went back too
+// early. Every retired node has to be freed exactly once, and reclamation
+// has to keep up while the readers run, not only at exit.
+
+#define RUN_MS      200
+#define READERS     4
+#define WRITERS     2
+#define SLOTS       256
+
+#define NODE_LIVE   0x4c495645u
+#define NODE_DEAD   0x44454144u
+
+typedef struct node_s node_t;
+
+struct node_s {
+   _Atomic opium_u32_t magic;
+   opium_u64_t value;
+   opium_u64_t check;         // ~value, written before the node is published
+   node_t *next;              // Writer's free list
+};
+
+typedef struct {
+   pthread_t thread;
+   int loop;                  // Reader: event loop style
+   opium_u64_t passes;
+   opium_u64_t bad;
+} reader_t;
+
+typedef struct {
+   pthread_t thread;
+   node_t *free;
+   opium_u64_t allocated;     // malloc()ed, not reused
+   opium_u64_t retired;
+   opium_u64_t freed;
+   opium_u64_t double_freed;
+   opium_u32_t max_pending;
+   opium_u64_t seed;
+} writer_t;
+
+static opium_ebr_t ebr;
+static _Atomic(node_t *) table[SLOTS];
+static _Atomic int stop;
+
+static node_t *node_get(writer_t *writer, opium_u64_t value) {
+   node_t *node = writer->free;
+
+   if (node) {
+      writer->free = node->next;
+   } else {
+      node = malloc(sizeof(*node));
+      if (!node) {
+         abort();
+      }
+      writer->allocated++;
+   }
+
+   node->value = value;
+   node->check = ~value;
+   atomic_store_explicit(&node->magic, NODE_LIVE, memory_order_relaxed);
+   return node;
+}
+
+static void node_free(void *ctx, void *ptr) {
+   writer_t *writer = ctx;
+   node_t *node = ptr;
+
+   if (atomic_exchange_explicit(&node->magic, NODE_DEAD, memory_order_relaxed) != NODE_LIVE) {
+      writer->double_freed++;
+      return;
+   }
+   writer->freed++;
+   node->next = writer->free;
+   writer->free = node;
+}
+
+static opium_u64_t reader_pass(reader_t *reader) {
+   opium_u64_t sum = 0;
+
+   for (int slot = 0; slot < SLOTS; slot++) {
+      node_t *node = atomic_load_explicit(&table[slot], memory_order_acquire);
+      if (!node) {
+         continue;
+      }
+      opium_u64_t value = node->value;
+      sum += value;
+      // Look twice, a node recycled in between would show it
+      if (atomic_load_explicit(&node->magic, memory_order_relaxed) != NODE_LIVE
+            || node->check != ~value || node->value != value) {
+         reader->bad++;
+      }
+   }
+   return sum;
+}
+
+static void *reader_run(void *data) {
+   reader_t *reader = data;
+   opium_ebr_thread_t *thr = opium_ebr_register(&ebr);
+   volatile opium_u64_t sink = 0;
+
+   if (!thr) {
+      reader->bad++;
+      return NULL;
+   }
+   if (!reader->loop) {
+      opium_ebr_leave(thr);
+   }
+
+   while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+      if (reader->loop) {
+         sink += reader_pass(reader);
+         opium_ebr_quiescent(thr);
+         // An idle loop goes offline around its wait
+         if ((reader->passes & 63) == 0) {
+            opium_ebr_offline(thr);
+            sched_yield();
+            opium_ebr_online(thr);
+         }
+      } else {
+         opium_ebr_enter(thr);
+         sink += reader_pass(reader);
+         opium_ebr_leave(thr);
+      }
+      reader->passes++;
+   }
+
+   opium_ebr_unregister(thr);
+   return NULL;
+}
+
+static void *writer_run(void *data) {
+   writer_t *writer = data;
+   opium_ebr_thread_t *thr = opium_ebr_register(&ebr);
+   opium_u64_t value = 0;
+
+   if (!thr) {
+      writer->double_freed++;
+      return NULL;
+   }
+
+   while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+      writer->seed = writer->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      int slot = (int)(writer->seed >> 33) % SLOTS;
+
+      node_t *old = atomic_exchange_explicit(&table[slot], node_get(writer, ++value), memory_order_acq_rel);
+      if (old) {
+         if (opium_ebr_retire(thr, old, node_free, writer) != OPIUM_RET_OK) {
+            abort();
+         }
+         writer->retired++;
+      }
+
+      opium_ebr_quiescent(thr);
+      writer->max_pending = opium_max(writer->max_pending, thr->pending);
+   }
+
+   // Frees run on the retiring thread: stay until the readers are gone
+   // and the epoch has moved past everything
+   for (int round = 0; round < 8 && thr->pending > 0; round++) {
+      opium_ebr_quiescent(thr);
+   }
+
+   opium_ebr_unregister(thr);
+   return NULL;
+}
+
+int main() {
+   opium_log_t *log = opium_log_init("/dev/null", NULL, NULL);
+   reader_t readers[READERS] = { 0 };
+   writer_t writers[WRITERS] = { 0 };
+   struct timespec pause = { 0, RUN_MS * 1000000L };
+   int failed = 0;
+
+   if (opium_ebr_init(&ebr, log) != OPIUM_RET_OK) {
+      return 1;
+   }
+
+   for (int index = 0; index < WRITERS; index++) {
+      writers[index].seed = (opium_u64_t)index + 1;
+      pthread_create(&writers[index].thread, NULL, writer_run, &writers[index]);
+   }
+   for (int index = 0; index < READERS; index++) {
+      readers[index].loop = index % 2 == 0;
+      pthread_create(&readers[index].thread, NULL, reader_run, &readers[index]);
+   }
+
+   nanosleep(&pause, NULL);
+   atomic_store(&stop, 1);
+
+   for (int index = 0; index < READERS; index++) {
+      pthread_join(readers[index].thread, NULL);
+   }
+   for (int index = 0; index < WRITERS; index++) {
+      pthread_join(writers[index].thread, NULL);
+   }
+
+   opium_u64_t freed_running = 0;
+   for (int index = 0; index < WRITERS; index++) {
+      freed_running += writers[index].freed;
+   }
+
+   // Whatever is still in limbo goes now
+   opium_ebr_exit(&ebr);
+
+   opium_u64_t passes = 0, bad = 0, retired = 0, freed = 0, doubles = 0, allocated = 0;
+   opium_u32_t max_pending = 0;
+   for (int index = 0; index < READERS; index++) {
+      passes += readers[index].passes;
+      bad += readers[index].bad;
+   }
+   for (int index = 0; index < WRITERS; index++) {
+      retired += writers[index].retired;
+      freed += writers[index].freed;
+      doubles += writers[index].double_freed;
+      allocated += writers[index].allocated;
+      max_pending = opium_max(max_pending, writers[index].max_pending);
+   }
+
+   printf("readers: %lu passes over %d slots, %lu bad reads\n",
+         (unsigned long)passes, SLOTS, (unsigned long)bad);
+   printf("writers: %lu retired, %lu freed while running, %lu at exit, %lu double frees\n",
+         (unsigned long)retired, (unsigned long)freed_running, (unsigned long)(freed - freed_running),
+         (unsigned long)doubles);
+   printf("memory:  %lu nodes allocated, at most %u waiting per writer\n",
+         (unsigned long)allocated, max_pending);
+
+   if (bad || doubles || freed != retired || (retired > 0 && freed_running == 0)) {
+      failed = 1;
+   }
+
+   for (int index = 0; index < WRITERS; index++) {
+      while (writers[index].free) {
+         node_t *next = writers[index].free->next;
+         free(writers[index].free);
+         writers[index].free = next;
+      }
+   }
+   for (int slot = 0; slot < SLOTS; slot++) {
+      free(atomic_load(&table[slot]));
+   }
+
+   opium_log_exit(log);
+
+   printf("%s\n", failed ? "FAILED" : "OK");
+   return failed;
+}
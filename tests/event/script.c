@@ -0,0 +1,284 @@
+#include "core/opium_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Event loop over a socketpair, driven on the main thread, once per
+// backend. A kernel without io_uring runs the epoll fallback twice, and
+// says so.
+//
+//   ping-pong: one side sends PING_SIZE bytes, the other echoes them back,
+//              ROUNDS times; round trips per second and loop syscalls per
+//              round trip are reported
+//   order:     LINKED_SENDS linked sends, each much larger than the socket
+//              buffer, queued back to back on one fd. The peer has to read
+//              every byte in submission order and every send has to
+//              complete in full.
+
+#define ROUNDS        100000
+#define PING_SIZE     64
+
+#define LINKED_SENDS  8
+#define LINKED_SIZE   (256 * 1024)
+#define SNDBUF        (16 * 1024)
+
+// Idle wait per iteration, a stalled test fails instead of hanging
+#define WAIT_MS       1000
+
+typedef struct pingpong_s pingpong_t;
+
+typedef struct {
+   opium_event_op_t recv;
+   opium_event_op_t send;
+   pingpong_t *test;
+   int fd;
+   size_t got;
+   u_char buf[PING_SIZE];
+} side_t;
+
+struct pingpong_s {
+   side_t sides[2];
+   opium_u32_t rounds;
+   int done;
+   int failed;
+};
+
+typedef struct {
+   opium_event_op_t sends[LINKED_SENDS];
+   opium_event_op_t recv;
+   u_char *bufs[LINKED_SENDS];
+   size_t received;
+   opium_u32_t completed;
+   int failed;
+} order_t;
+
+static double now_sec(void) {
+   struct timespec time;
+   clock_gettime(CLOCK_MONOTONIC, &time);
+   return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static int make_pair(int fds[2]) {
+   if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+      printf("socketpair failed: %s\n", strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+static void ping_sent(opium_event_op_t *op) {
+   pingpong_t *test = op->data;
+
+   if (op->res != PING_SIZE) {
+      printf("ping-pong: send returned %d\n", op->res);
+      test->failed = test->done = 1;
+   }
+}
+
+static void ping_received(opium_event_op_t *op) {
+   side_t *side = op->data;
+   pingpong_t *test = side->test;
+
+   if (op->res <= 0) {
+      if (!test->done) {
+         printf("ping-pong: recv ended with %d\n", op->res);
+         test->failed = test->done = 1;
+      }
+      return;
+   }
+
+   side->got += (size_t)op->res;
+   if (side->got < PING_SIZE) {
+      return;
+   }
+   side->got -= PING_SIZE;
+
+   // Side 0 counts the round trip, side 1 echoes
+   if (side == &test->sides[0] && ++test->rounds == ROUNDS) {
+      test->done = 1;
+      return;
+   }
+
+   opium_event_send(op->event, &side->send, side->fd, side->buf, PING_SIZE, 0, ping_sent, test);
+}
+
+static int pingpong(opium_event_t *event, const char *name) {
+   pingpong_t test = { 0 };
+   int fds[2];
+
+   if (make_pair(fds) < 0) {
+      return 1;
+   }
+
+   for (int index = 0; index < 2; index++) {
+      side_t *side = &test.sides[index];
+      side->fd = fds[index];
+      side->test = &test;
+      memset(side->buf, 'a' + index, PING_SIZE);
+      if (opium_event_recv(event, &side->recv, side->fd, ping_received, side) != OPIUM_RET_OK) {
+         printf("%s: recv failed\n", name);
+         return 1;
+      }
+   }
+
+   opium_u64_t syscalls = event->nsyscalls;
+   double start = now_sec();
+
+   opium_event_send(event, &test.sides[0].send, fds[0], test.sides[0].buf, PING_SIZE, 0, ping_sent, &test);
+
+   while (!test.done) {
+      if (opium_event_process(event, WAIT_MS) == 0 && !test.done) {
+         printf("%s: ping-pong stalled after %u rounds\n", name, test.rounds);
+         test.failed = 1;
+         break;
+      }
+   }
+
+   double elapsed = now_sec() - start;
+
+   printf("%-8s ping-pong: %u rounds, %.0f round trips/s, %.2f syscalls/round\n", name, test.rounds,
+         test.rounds / elapsed, (double)(event->nsyscalls - syscalls) / opium_max(test.rounds, 1u));
+
+   for (int index = 0; index < 2; index++) {
+      opium_event_cancel(&test.sides[index].recv);
+   }
+   opium_event_process(event, 0);
+   close(fds[0]);
+   close(fds[1]);
+
+   return test.failed;
+}
+
+// Byte 'offset' of the whole linked stream
+static u_char order_byte(size_t offset) {
+   return (u_char)(offset * 131 + offset / LINKED_SIZE);
+}
+
+static void order_sent(opium_event_op_t *op) {
+   order_t *test = op->data;
+   opium_u32_t index = (opium_u32_t)(op - test->sends);
+
+   if (op->res != LINKED_SIZE) {
+      printf("order: send %u returned %d\n", index, op->res);
+      test->failed = 1;
+   }
+   if (index != test->completed) {
+      printf("order: send %u completed as number %u\n", index, test->completed);
+      test->failed = 1;
+   }
+   test->completed++;
+}
+
+static void order_received(opium_event_op_t *op) {
+   order_t *test = op->data;
+
+   if (op->res <= 0) {
+      if (test->received < LINKED_SENDS * LINKED_SIZE) {
+         printf("order: recv ended with %d at byte %zu\n", op->res, test->received);
+         test->failed = 1;
+      }
+      return;
+   }
+
+   for (opium_s32_t index = 0; index < op->res && !test->failed; index++) {
+      if (((u_char *)op->buf)[index] != order_byte(test->received + index)) {
+         printf("order: byte %zu out of order\n", test->received + index);
+         test->failed = 1;
+      }
+   }
+   test->received += (size_t)op->res;
+}
+
+static int order(opium_event_t *event, const char *name) {
+   order_t test = { 0 };
+   int fds[2], sndbuf = SNDBUF;
+
+   if (make_pair(fds) < 0) {
+      return 1;
+   }
+   setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+   for (int index = 0; index < LINKED_SENDS; index++) {
+      test.bufs[index] = malloc(LINKED_SIZE);
+      if (!test.bufs[index]) {
+         return 1;
+      }
+      for (size_t offset = 0; offset < LINKED_SIZE; offset++) {
+         test.bufs[index][offset] = order_byte((size_t)index * LINKED_SIZE + offset);
+      }
+   }
+
+   // All queued before the peer reads a byte: the first one fills the socket
+   for (int index = 0; index < LINKED_SENDS; index++) {
+      if (opium_event_send(event, &test.sends[index], fds[0], test.bufs[index], LINKED_SIZE,
+               OPIUM_EVENT_LINK, order_sent, &test) != OPIUM_RET_OK) {
+         printf("%s: send %d failed\n", name, index);
+         return 1;
+      }
+   }
+
+   if (opium_event_recv(event, &test.recv, fds[1], order_received, &test) != OPIUM_RET_OK) {
+      printf("%s: recv failed\n", name);
+      return 1;
+   }
+
+   while (!test.failed && (test.completed < LINKED_SENDS || test.received < LINKED_SENDS * LINKED_SIZE)) {
+      if (opium_event_process(event, WAIT_MS) == 0 && test.completed < LINKED_SENDS) {
+         printf("%s: order stalled, %u sends done, %zu bytes read\n", name, test.completed, test.received);
+         test.failed = 1;
+      }
+   }
+
+   printf("%-8s order: %u linked sends, %zu bytes in order\n", name, test.completed, test.received);
+
+   opium_event_cancel(&test.recv);
+   for (int index = 0; index < LINKED_SENDS; index++) {
+      opium_event_cancel(&test.sends[index]);
+   }
+   opium_event_process(event, 0);
+   close(fds[0]);
+   close(fds[1]);
+
+   for (int index = 0; index < LINKED_SENDS; index++) {
+      free(test.bufs[index]);
+   }
+
+   return test.failed;
+}
+
+static int run(opium_event_backend_t backend, const char *name, opium_log_t *log) {
+   opium_arena_t arena;
+   opium_event_t event;
+   int failed = 0;
+
+   opium_arena_init(&arena, log);
+   if (opium_event_init(&event, &arena, 64, backend, log) != OPIUM_RET_OK) {
+      printf("%s: init failed\n", name);
+      return 1;
+   }
+   if (event.backend != backend) {
+      printf("%s: unavailable, the loop fell back to epoll\n", name);
+   }
+
+   failed |= pingpong(&event, name);
+   failed |= order(&event, name);
+
+   opium_event_exit(&event);
+   opium_arena_exit(&arena);
+
+   return failed;
+}
+
+int main() {
+   opium_log_t *log = opium_log_init("/dev/null", NULL, NULL);
+   int failed = 0;
+
+   failed |= run(OPIUM_EVENT_EPOLL, "epoll", log);
+   failed |= run(OPIUM_EVENT_URING, "io_uring", log);
+
+   opium_log_exit(log);
+
+   printf("%s\n", failed ? "FAILED" : "OK");
+   return failed;
+}
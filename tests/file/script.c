@@ -0,0 +1,204 @@
+#include "core/opium_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// The static file cache on a scratch root under /tmp, driven without an
+// event loop: opium_file_cache_process() reads whatever inotify queued.
+//
+//   cache:      a second open is a hit on the same fd
+//   invalidate: a write, an mtime change, a rename over and a delete of a
+//               cached file each drop its entry, the next open sees the
+//               new file; an entry still sending keeps its old fd
+//   resolve:    "..", absolute and outward symlinks are refused, an
+//               inward one is served but never cached
+//   validators: If-None-Match and If-Modified-Since in all three
+//               HTTP-date forms, compared against the mtime
+
+// Tue, 14 Nov 2023 22:13:20 GMT
+#define MTIME 1700000000
+
+static char root[] = "/tmp/opium_file_XXXXXX";
+static int failed;
+
+static void check(int ok, const char *what) {
+   printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+   if (!ok) {
+      failed = 1;
+   }
+}
+
+static int put(const char *name, const char *data) {
+   char path[512];
+   snprintf(path, sizeof(path), "%s/%s", root, name);
+
+   FILE *file = fopen(path, "w");
+   if (!file) {
+      return -1;
+   }
+   fputs(data, file);
+   return fclose(file);
+}
+
+static int stamp(const char *name, time_t mtime) {
+   struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+   return utimensat(AT_FDCWD, name, times, 0);
+}
+
+static opium_off_t size_of(opium_file_cache_t *cache, const char *uri) {
+   opium_file_t *file = opium_file_open(cache, uri);
+   if (!file) {
+      return -1;
+   }
+   opium_off_t size = file->size;
+   opium_file_close(cache, file);
+   return size;
+}
+
+static void test_cache(opium_file_cache_t *cache) {
+   opium_file_t *first = opium_file_open(cache, "/");
+   opium_file_t *second = opium_file_open(cache, "/index.html?v=2");
+
+   check(first && first == second && cache->nhits == 1, "second open of / is a hit");
+   check(first && strcmp(first->mime, "text/html; charset=utf-8") == 0, "index.html served as text/html");
+
+   if (first) {
+      opium_file_close(cache, first);
+      opium_file_close(cache, second);
+   }
+}
+
+static void test_invalidate(opium_file_cache_t *cache) {
+   char path[512], tmp[512];
+
+   check(size_of(cache, "/css/a.css") == 4, "css/a.css cached");
+
+   put("css/a.css", "body{}\n");
+   check(opium_file_cache_process(cache) >= 1, "write drops the entry");
+   check(size_of(cache, "/css/a.css") == 7, "reopened with the new size");
+
+   snprintf(path, sizeof(path), "%s/css/a.css", root);
+   stamp(path, MTIME);
+   check(opium_file_cache_process(cache) >= 1, "mtime change drops the entry");
+
+   opium_file_t *held = opium_file_open(cache, "/css/a.css");
+   check(held && held->mtime == MTIME, "reopened with the new mtime");
+
+   snprintf(tmp, sizeof(tmp), "%s/css/b.tmp", root);
+   put("css/b.tmp", "p{}\n");
+   rename(tmp, path);
+   check(opium_file_cache_process(cache) >= 1, "rename over drops the entry");
+
+   opium_file_t *renamed = opium_file_open(cache, "/css/a.css");
+   check(renamed && renamed != held && renamed->size == 4, "rename over serves the new file");
+
+   if (held) {
+      char buf[16] = { 0 };
+      check(pread(held->fd, buf, sizeof(buf), 0) == 7 && strcmp(buf, "body{}\n") == 0,
+            "dropped entry still reads the old file");
+      opium_file_close(cache, held);
+   }
+   if (renamed) {
+      opium_file_close(cache, renamed);
+   }
+
+   unlink(path);
+   check(opium_file_cache_process(cache) >= 1, "delete drops the entry");
+   check(!opium_file_open(cache, "/css/a.css") && errno == ENOENT, "deleted file is ENOENT");
+}
+
+static void test_resolve(opium_file_cache_t *cache) {
+   opium_u64_t hits;
+
+   check(!opium_file_open(cache, "/css/../../etc/hostname") && errno == EACCES, "\"..\" is EACCES");
+   check(!opium_file_open(cache, "/abs") && errno == EACCES, "absolute symlink is EACCES");
+   check(!opium_file_open(cache, "/up/hostname") && errno == EACCES, "symlinked directory outside is EACCES");
+   check(!opium_file_open(cache, "/css") && errno == EACCES, "directory is EACCES");
+
+   hits = cache->nhits;
+   check(size_of(cache, "/in.html") > 0 && size_of(cache, "/in.html") > 0, "inward symlink served");
+   check(cache->nhits == hits, "inward symlink never cached");
+}
+
+static void test_validators(opium_file_cache_t *cache) {
+   opium_file_t *file = opium_file_open(cache, "/");
+   char etag[64];
+
+   if (!file) {
+      check(0, "open / for validators");
+      return;
+   }
+
+   check(strcmp(file->last_modified, "Tue, 14 Nov 2023 22:13:20 GMT") == 0, "Last-Modified formatted");
+
+   snprintf(etag, sizeof(etag), "\"x\", %s", file->etag);
+   check(opium_file_not_modified(file, etag, NULL), "If-None-Match in a list");
+   check(opium_file_not_modified(file, "*", NULL), "If-None-Match: *");
+   check(!opium_file_not_modified(file, "\"x\"", "Tue, 14 Nov 2023 22:13:20 GMT"),
+         "If-None-Match wins over If-Modified-Since");
+
+   check(opium_file_not_modified(file, NULL, "Tue, 14 Nov 2023 22:13:20 GMT"), "IMF-fixdate, same second");
+   check(opium_file_not_modified(file, NULL, "Wed, 15 Nov 2023 08:00:00 GMT"), "IMF-fixdate, later");
+   check(!opium_file_not_modified(file, NULL, "Tue, 14 Nov 2023 22:13:19 GMT"), "IMF-fixdate, a second earlier");
+   check(opium_file_not_modified(file, NULL, "Tuesday, 14-Nov-23 22:13:20 GMT"), "RFC 850 date");
+   check(opium_file_not_modified(file, NULL, "Tue Nov 14 22:13:20 2023"), "asctime() date");
+   check(opium_file_not_modified(file, NULL, "Thu Nov  7 22:13:20 2024"), "asctime() date, padded day");
+   check(!opium_file_not_modified(file, NULL, "Fri, 01 Jan 2100 00:00:00 GMT"), "date in the future");
+   check(!opium_file_not_modified(file, NULL, "yesterday"), "not a date");
+   check(!opium_file_not_modified(file, NULL, NULL), "no validators");
+
+   opium_file_close(cache, file);
+}
+
+int main() {
+   opium_log_t *log = opium_log_init("/dev/null", NULL, NULL);
+   opium_file_cache_t cache;
+   char path[512], link[512];
+
+   if (!mkdtemp(root)) {
+      printf("mkdtemp failed: %s\n", strerror(errno));
+      return 1;
+   }
+
+   snprintf(path, sizeof(path), "%s/css", root);
+   mkdir(path, 0755);
+   put("index.html", "<html></html>\n");
+   put("css/a.css", "a{}\n");
+
+   snprintf(path, sizeof(path), "%s/index.html", root);
+   stamp(path, MTIME);
+
+   snprintf(link, sizeof(link), "%s/in.html", root);
+   symlink("index.html", link);
+   snprintf(link, sizeof(link), "%s/abs", root);
+   symlink("/etc/hostname", link);
+   snprintf(link, sizeof(link), "%s/up", root);
+   symlink("/etc", link);
+
+   if (opium_file_cache_init(&cache, root, NULL, 16, log) != OPIUM_RET_OK || cache.inotify < 0) {
+      printf("file cache init failed\n");
+      return 1;
+   }
+
+   test_cache(&cache);
+   test_invalidate(&cache);
+   test_resolve(&cache);
+   test_validators(&cache);
+
+   opium_file_cache_stats(&cache);
+   printf("hits %llu, misses %llu, invalidated %llu\n", (unsigned long long)cache.nhits,
+         (unsigned long long)cache.nmisses, (unsigned long long)cache.ninvalidated);
+
+   opium_file_cache_exit(&cache);
+   opium_log_exit(log);
+
+   const char *names[] = { "in.html", "abs", "up", "index.html", "css/a.css", "css/b.tmp", "css" };
+   for (size_t index = 0; index < sizeof(names) / sizeof(names[0]); index++) {
+      snprintf(path, sizeof(path), "%s/%s", root, names[index]);
+      remove(path);
+   }
+   rmdir(root);
+
+   printf("%s\n", failed ? "FAILED" : "OK");
+   return failed;
+}
@@ -0,0 +1,122 @@
+#include "core/opium_core.h"
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// The HTTP parser fed from the memory transport: a client connects to an
+// in-process listener, sends requests, and the server side reads them back
+// in odd-sized pieces so every request is split at a different byte. No
+// kernel sockets, the bytes only cross the transport's ring buffers.
+
+#define TOTAL_REQUESTS 10000
+#define BUFSIZE        4096
+#define MAX_PIECE      61
+
+static double now_sec(void) {
+   struct timespec time;
+   clock_gettime(CLOCK_MONOTONIC, &time);
+   return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main() {
+   opium_log_t *log = opium_log_init("/dev/null", NULL, NULL);
+   opium_network_t net;
+   opium_family family = { .family = AF_UNIX };
+   struct sockaddr_un addr;
+   socklen_t len = opium_net_unix_addr(&addr, "@onion-http");
+   int failed = 0;
+
+   if (opium_network_memory_init(&net, 4, BUFSIZE, log) != OPIUM_RET_OK) {
+      fprintf(stderr, "memory transport init failed\n");
+      return 1;
+   }
+
+   opium_socket_t listener = opium_net_socket(&net, family, SOCK_STREAM, 0);
+   opium_socket_t client = opium_net_socket(&net, family, SOCK_STREAM, 0);
+   if (opium_net_bind(&net, listener, (struct sockaddr*)&addr, len) != OPIUM_RET_OK
+         || opium_net_listen(&net, listener, 1) != OPIUM_RET_OK
+         || opium_net_connect(&net, client, (struct sockaddr*)&addr, len) != OPIUM_RET_OK) {
+      fprintf(stderr, "connect failed: %s\n", strerror(errno));
+      return 1;
+   }
+   opium_socket_t server = opium_net_accept(&net, listener, NULL, NULL);
+
+   struct onion_slab *allocator = onion_slab_memory_init(ONION_HTTP_MAX_MESSAGE_SIZE);
+   struct onion_slab *msg_allocator = onion_slab_memory_init(ONION_HTTP_MAX_MESSAGE_SIZE);
+   onion_http_parser_t parser;
+   memset(&parser, 0, sizeof(parser));
+   if (server.fd < 0 || !allocator || !msg_allocator
+         || onion_http_parser_init(&parser, allocator, msg_allocator) < 0) {
+      fprintf(stderr, "server side init failed\n");
+      return 1;
+   }
+
+   char request[512];
+   char piece[MAX_PIECE];
+   char url[64];
+   char body[64];
+   size_t bytes = 0;
+   double started = now_sec();
+
+   for (int index = 0; index < TOTAL_REQUESTS && !failed; index++) {
+      snprintf(url, sizeof(url), "/item/%d", index);
+      int body_len = snprintf(body, sizeof(body), "value=%d", index * 7);
+      int request_len = snprintf(request, sizeof(request),
+            "POST %s HTTP/1.1\r\nHost: onion\r\nContent-Length: %d\r\n\r\n%s", url, body_len, body);
+
+      if (opium_net_send(&net, client, request, request_len) != request_len) {
+         fprintf(stderr, "request %d: send failed: %s\n", index, strerror(errno));
+         failed = 1;
+         break;
+      }
+
+      // 1 to MAX_PIECE bytes per read, moving with the request number
+      size_t piece_len = 1 + (size_t)(index * 7) % MAX_PIECE;
+      ssize_t got;
+      while ((got = opium_net_recv(&net, server, piece, piece_len)) > 0) {
+         bytes += got;
+         if (onion_http_parser_request(&parser, piece, got) != ONION_HTTP_PARSER_REQUEST_OK) {
+            fprintf(stderr, "request %d: parser error\n", index);
+            failed = 1;
+            break;
+         }
+      }
+      if (got < 0 && errno != EAGAIN) {
+         fprintf(stderr, "request %d: recv failed: %s\n", index, strerror(errno));
+         failed = 1;
+      }
+
+      onion_http_request_t *parsed = &parser.requests[0];
+      if (!parsed->isReady || !parsed->start_line.url || strcmp(parsed->start_line.url, url) != 0
+            || parsed->body_capacity != (size_t)body_len || memcmp(parsed->body, body, body_len) != 0) {
+         fprintf(stderr, "request %d: %s not parsed back\n", index, url);
+         failed = 1;
+      }
+      onion_http_request_exit(parsed);
+   }
+
+   double elapsed = now_sec() - started;
+
+   // The client hanging up reads as EOF on the server side
+   opium_net_close(&net, client);
+   if (!failed && opium_net_recv(&net, server, piece, sizeof(piece)) != 0) {
+      fprintf(stderr, "no EOF after the client closed\n");
+      failed = 1;
+   }
+
+   fprintf(stderr, "%d requests, %zu bytes in %.3f s, %.0f req/s\n", TOTAL_REQUESTS, bytes, elapsed,
+         TOTAL_REQUESTS / elapsed);
+
+   onion_http_parser_exit(&parser);
+   opium_net_close(&net, server);
+   opium_net_close(&net, listener);
+   opium_network_memory_exit(&net);
+   onion_slab_memory_exit(allocator);
+   onion_slab_memory_exit(msg_allocator);
+   opium_log_exit(log);
+
+   fprintf(stderr, "%s\n", failed ? "FAIL" : "OK");
+   return failed;
+}
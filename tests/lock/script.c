@@ -0,0 +1,136 @@
+#include "core/opium_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Contention harness for the hot-path locks: every thread increments one
+// shared counter under the lock for a fixed time. Throughput is reported
+// per lock and thread count, and the counter has to equal the sum of what
+// the threads counted, or the lock let two owners in.
+
+#define RUN_MS        100
+#define MAX_THREADS   64
+
+// A few cache lines touched under the lock, like a list splice
+#define SECTION_WORDS 16
+
+enum { LOCK_SPIN, LOCK_TICKET, LOCK_AMUTEX, LOCK_PTHREAD, LOCK_TOTAL };
+
+static const char *lock_names[LOCK_TOTAL] = { "ttas", "ticket", "futex", "pthread" };
+static const int thread_counts[] = { 2, 4, 8, 16, 32, 64 };
+
+static opium_spinlock_t spin = OPIUM_SPINLOCK_INIT;
+static opium_ticketlock_t ticket = OPIUM_TICKETLOCK_INIT;
+static opium_amutex_t amutex = OPIUM_AMUTEX_INIT;
+static opium_mutex_t pthread_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static opium_u64_t shared[SECTION_WORDS];
+static _Atomic int stop;
+static _Atomic int started;
+
+typedef struct {
+   pthread_t thread;
+   int kind;
+   opium_u64_t count;
+} worker_t;
+
+static void lock_take(int kind) {
+   switch (kind) {
+   case LOCK_SPIN: opium_spin_lock(&spin); break;
+   case LOCK_TICKET: opium_ticket_lock(&ticket); break;
+   case LOCK_AMUTEX: opium_amutex_lock(&amutex); break;
+   default: pthread_mutex_lock(&pthread_lock); break;
+   }
+}
+
+static void lock_release(int kind) {
+   switch (kind) {
+   case LOCK_SPIN: opium_spin_unlock(&spin); break;
+   case LOCK_TICKET: opium_ticket_unlock(&ticket); break;
+   case LOCK_AMUTEX: opium_amutex_unlock(&amutex); break;
+   default: pthread_mutex_unlock(&pthread_lock); break;
+   }
+}
+
+static void *worker_run(void *arg) {
+   worker_t *worker = arg;
+
+   atomic_fetch_add(&started, 1);
+   while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+      lock_take(worker->kind);
+      for (int word = 0; word < SECTION_WORDS; word++) {
+         shared[word]++;
+      }
+      lock_release(worker->kind);
+      worker->count++;
+   }
+   return NULL;
+}
+
+static int run(int kind, int threads, double *mops) {
+   static worker_t workers[MAX_THREADS];
+   struct timespec pause = { .tv_sec = 0, .tv_nsec = RUN_MS * 1000000L };
+   opium_u64_t total = 0;
+
+   memset(shared, 0, sizeof(shared));
+   atomic_store(&stop, 0);
+   atomic_store(&started, 0);
+
+   for (int index = 0; index < threads; index++) {
+      workers[index].kind = kind;
+      workers[index].count = 0;
+      if (pthread_create(&workers[index].thread, NULL, worker_run, &workers[index]) != 0) {
+         printf("pthread_create failed\n");
+         return -1;
+      }
+   }
+
+   while (atomic_load(&started) < threads) {
+      sched_yield();
+   }
+   nanosleep(&pause, NULL);
+   atomic_store(&stop, 1);
+
+   for (int index = 0; index < threads; index++) {
+      pthread_join(workers[index].thread, NULL);
+      total += workers[index].count;
+   }
+
+   *mops = (double)total / (RUN_MS * 1000.0);
+
+   for (int word = 0; word < SECTION_WORDS; word++) {
+      if (shared[word] != total) {
+         printf("%s, %d threads: counter %llu, expected %llu\n", lock_names[kind], threads,
+               (unsigned long long)shared[word], (unsigned long long)total);
+         return -1;
+      }
+   }
+   return 0;
+}
+
+int main() {
+   int failed = 0;
+
+   printf("%-8s", "threads");
+   for (int kind = 0; kind < LOCK_TOTAL; kind++) {
+      printf("%10s", lock_names[kind]);
+   }
+   printf("   (Mops/s, %ld cpus)\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+   for (size_t index = 0; index < sizeof(thread_counts) / sizeof(thread_counts[0]); index++) {
+      printf("%-8d", thread_counts[index]);
+      for (int kind = 0; kind < LOCK_TOTAL; kind++) {
+         double mops = 0;
+         if (run(kind, thread_counts[index], &mops) < 0) {
+            failed = 1;
+         }
+         printf("%10.2f", mops);
+         fflush(stdout);
+      }
+      printf("\n");
+   }
+
+   printf("%s\n", failed ? "FAIL" : "OK");
+   return failed;
+}
@@ -15,7 +15,7 @@
 #define TOTAL_SOCKETS_PER_CORE 1
 
 int main() {
-   onion_config_t onion_config1;
+   onion_config_t onion_config1 = {0};
    onion_config_init(&onion_config1);
    DEBUG_FUNC("dfsdfds : %d\n", onion_config.core_count);
    struct onion_worker_head *head;
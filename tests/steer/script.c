@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+#include "socket.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// The SO_REUSEPORT steering program on a real group of loopback listeners.
+// The client runs pinned to one CPU, and loopback handles its SYN on that
+// same CPU. The test lists that CPU at each position of the cpus array
+// in turn, and only the listener at that position may accept. A second
+// round lists only CPUs that don't exist, so the connection has to land
+// on cpu % count. Works with a single CPU: the other entries are fake.
+
+#define LISTENERS 4
+
+// Never a CPU of this machine
+#define NO_CPU    100000
+
+static int listeners_open(int *fds, uint16_t *port) {
+   struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+   socklen_t len = sizeof(addr);
+   int on = 1;
+
+   for (int index = 0; index < LISTENERS; index++) {
+      fds[index] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fds[index] < 0 || setsockopt(fds[index], SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0
+            || bind(fds[index], (struct sockaddr*)&addr, sizeof(addr)) < 0
+            || listen(fds[index], 16) < 0) {
+         return -1;
+      }
+      // The first bind picks the port, the rest of the group joins it
+      if (index == 0) {
+         if (getsockname(fds[0], (struct sockaddr*)&addr, &len) < 0) {
+            return -1;
+         }
+         *port = addr.sin_port;
+      }
+   }
+   return 0;
+}
+
+// Index of the listener that got the connection, -1 for none
+static int connect_once(uint16_t port, int *fds) {
+   struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = port, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+   int client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   int found = -1;
+
+   if (client < 0 || connect(client, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      printf("connect failed: %s\n", strerror(errno));
+      return -1;
+   }
+
+   for (int index = 0; index < LISTENERS; index++) {
+      int fd = accept4(fds[index], NULL, NULL, SOCK_CLOEXEC);
+      if (fd >= 0) {
+         close(fd);
+         found = found < 0 ? index : -2;
+      }
+   }
+
+   close(client);
+   return found;
+}
+
+int main() {
+   int fds[LISTENERS], cpus[LISTENERS];
+   uint16_t port = 0;
+   int failed = 0;
+
+   int cpu = sched_getcpu();
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   if (cpu < 0 || sched_setaffinity(0, sizeof(set), &set) < 0 || listeners_open(fds, &port) < 0) {
+      printf("setup failed: %s\n", strerror(errno));
+      return 1;
+   }
+
+   for (int expect = 0; expect < LISTENERS; expect++) {
+      for (int index = 0; index < LISTENERS; index++) {
+         cpus[index] = index == expect ? cpu : NO_CPU + index;
+      }
+
+      // Attached to one member, the program serves the whole group
+      if (onion_net_sock_reuseport_steer(fds[LISTENERS - 1 - expect], cpus, LISTENERS) < 0) {
+         return 1;
+      }
+
+      int got = connect_once(port, fds);
+      printf("cpu %d at index %d: accepted by listener %d\n", cpu, expect, got);
+      if (got != expect) {
+         failed = 1;
+      }
+   }
+
+   for (int index = 0; index < LISTENERS; index++) {
+      cpus[index] = NO_CPU + index;
+   }
+   if (onion_net_sock_reuseport_steer(fds[0], cpus, LISTENERS) < 0) {
+      return 1;
+   }
+   int got = connect_once(port, fds);
+   printf("cpu %d unlisted: accepted by listener %d\n", cpu, got);
+   if (got != cpu % LISTENERS) {
+      failed = 1;
+   }
+
+   for (int index = 0; index < LISTENERS; index++) {
+      close(fds[index]);
+   }
+
+   printf("%s\n", failed ? "FAILED" : "OK");
+   return failed;
+}
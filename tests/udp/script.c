@@ -0,0 +1,221 @@
+#include "core/opium_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// The ping handler behind a loopback listener, one run per batch size.
+// A client keeps WINDOW pings in flight with sendmmsg(), the listener
+// answers them WINDOW / batch recvmmsg() calls at a time. Every reply has
+// to come back once, as a response, with its seq and stamp untouched;
+// pps is replies per second.
+//
+// Then offloads: SEGMENTS * SEGMENT bytes go out with opium_udp_send(),
+// with and without GSO, to a listener with and without GRO. Either way
+// the handler has to see SEGMENTS messages of SEGMENT bytes, in order.
+
+#define PINGS    (256 * 1024)
+#define WINDOW   OPIUM_UDP_BATCH_MAX
+
+#define SEGMENTS 64
+#define SEGMENT  1200
+
+static const opium_u32_t batch_sizes[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+typedef struct {
+   opium_u32_t count;
+   int failed;
+} segments_t;
+
+static double now_sec(void) {
+   struct timespec time;
+   clock_gettime(CLOCK_MONOTONIC, &time);
+   return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static int loopback(opium_udp_t *udp, opium_u32_t batch, opium_u32_t flags, opium_udp_handler_pt handler,
+      void *data, struct sockaddr_in *addr, socklen_t *len, opium_log_t *log) {
+   opium_memzero(addr, sizeof(*addr));
+   addr->sin_family = AF_INET;
+   addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   // Port 0: the kernel picks one, read it back for the client
+   if (opium_udp_init(udp, (struct sockaddr*)addr, sizeof(*addr), batch, flags, handler, data, log) != OPIUM_RET_OK) {
+      return -1;
+   }
+   *len = sizeof(*addr);
+   return getsockname(udp->fd, (struct sockaddr*)addr, len);
+}
+
+static int client_socket(void) {
+   int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   int size = 4 * 1024 * 1024;
+
+   if (fd >= 0) {
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+   }
+   return fd;
+}
+
+static int ping_run(opium_u32_t batch, opium_log_t *log) {
+   opium_udp_t udp;
+   struct sockaddr_in addr;
+   socklen_t len;
+   opium_net_ping_t pings[WINDOW];
+   struct mmsghdr msgs[WINDOW];
+   struct iovec iov[WINDOW];
+   opium_u32_t seq = 0, replies = 0;
+   int failed = 0;
+
+   int fd = client_socket();
+   if (fd < 0 || loopback(&udp, batch, 0, opium_udp_ping, NULL, &addr, &len, log) < 0) {
+      printf("batch %u: setup failed: %s\n", batch, strerror(errno));
+      return 1;
+   }
+
+   double start = now_sec();
+
+   while (seq < PINGS && !failed) {
+      opium_memzero(msgs, sizeof(msgs));
+      for (int index = 0; index < WINDOW; index++) {
+         pings[index].type = NET_PACKET_PING_REQUEST;
+         pings[index].seq = htonl(seq + index);
+         pings[index].stamp = seq + index;
+         iov[index].iov_base = &pings[index];
+         iov[index].iov_len = sizeof(pings[index]);
+         msgs[index].msg_hdr.msg_iov = &iov[index];
+         msgs[index].msg_hdr.msg_iovlen = 1;
+         msgs[index].msg_hdr.msg_name = &addr;
+         msgs[index].msg_hdr.msg_namelen = len;
+      }
+      if (sendmmsg(fd, msgs, WINDOW, 0) != WINDOW) {
+         printf("batch %u: client send failed\n", batch);
+         failed = 1;
+         break;
+      }
+
+      // Loopback delivers right away: the whole window is queued
+      for (opium_u32_t handled = 0; handled < WINDOW; ) {
+         opium_s32_t n = opium_udp_process(&udp);
+         if (n <= 0) {
+            printf("batch %u: listener got %u of %u pings\n", batch, handled, WINDOW);
+            failed = 1;
+            break;
+         }
+         handled += (opium_u32_t)n;
+      }
+
+      for (int index = 0; index < WINDOW; index++) {
+         msgs[index].msg_hdr.msg_name = NULL;
+         msgs[index].msg_hdr.msg_namelen = 0;
+      }
+      int got = recvmmsg(fd, msgs, WINDOW, MSG_DONTWAIT, NULL);
+      for (int index = 0; index < got; index++) {
+         opium_net_ping_t *pong = &pings[index];
+         if (msgs[index].msg_len != sizeof(*pong) || pong->type != NET_PACKET_PING_RESPONSE
+               || ntohl(pong->seq) != seq + index || pong->stamp != seq + index) {
+            printf("batch %u: bad reply %d in window %u\n", batch, index, seq / WINDOW);
+            failed = 1;
+            break;
+         }
+      }
+      if (got != WINDOW) {
+         printf("batch %u: %d of %u replies\n", batch, got, WINDOW);
+         failed = 1;
+      }
+
+      replies += got > 0 ? (opium_u32_t)got : 0;
+      seq += WINDOW;
+   }
+
+   double elapsed = now_sec() - start;
+
+   printf("batch %2u: %u replies, %.0f pps, %.1f pings per recvmmsg, %lu dropped\n", batch, replies,
+         replies / elapsed, (double)udp.nrecv / opium_max(udp.nbatches, (opium_u64_t)1), (unsigned long)udp.ndropped);
+
+   if (udp.ndropped != 0) {
+      failed = 1;
+   }
+
+   opium_udp_exit(&udp);
+   close(fd);
+
+   return failed;
+}
+
+static ssize_t segment_received(opium_udp_t *udp, opium_udp_msg_t *msg) {
+   segments_t *test = udp->data;
+
+   if (msg->len != SEGMENT || (msg->flags & MSG_TRUNC)) {
+      printf("segment %u: %zu bytes\n", test->count, msg->len);
+      test->failed = 1;
+   } else if (msg->buf[0] != (u_char)test->count || msg->buf[SEGMENT - 1] != (u_char)test->count) {
+      printf("segment %u: carries segment %u\n", test->count, msg->buf[0]);
+      test->failed = 1;
+   }
+
+   test->count++;
+   return 0;
+}
+
+static int segments_run(opium_u32_t send_flags, opium_u32_t recv_flags, opium_log_t *log) {
+   static u_char buf[SEGMENTS * SEGMENT];
+   opium_udp_t sender, receiver;
+   struct sockaddr_in addr, from;
+   socklen_t len, from_len;
+   segments_t test = { 0 };
+   int size = 4 * 1024 * 1024;
+
+   for (int index = 0; index < SEGMENTS; index++) {
+      memset(buf + index * SEGMENT, index, SEGMENT);
+   }
+
+   if (loopback(&receiver, OPIUM_UDP_BATCH, recv_flags, segment_received, &test, &addr, &len, log) < 0
+         || loopback(&sender, 1, send_flags, opium_udp_ping, NULL, &from, &from_len, log) < 0) {
+      printf("segments: setup failed: %s\n", strerror(errno));
+      return 1;
+   }
+   setsockopt(receiver.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+   ssize_t sent = opium_udp_send(&sender, (struct sockaddr*)&addr, len, buf, sizeof(buf), SEGMENT);
+   if (sent != (ssize_t)sizeof(buf)) {
+      printf("segments: opium_udp_send() sent %zd of %zu\n", sent, sizeof(buf));
+      test.failed = 1;
+   }
+
+   while (opium_udp_process(&receiver) > 0) {
+      // Loopback delivers right away, an empty queue means all is here
+   }
+
+   printf("send %-4s recv %-4s: %u segments of %d bytes, %lu gso sends, %lu super-packets\n",
+         (sender.flags & OPIUM_UDP_GSO) ? "gso" : "-", (receiver.flags & OPIUM_UDP_GRO) ? "gro" : "-",
+         test.count, SEGMENT, (unsigned long)sender.ngso, (unsigned long)receiver.nsuper);
+
+   if (test.count != SEGMENTS) {
+      test.failed = 1;
+   }
+
+   opium_udp_exit(&sender);
+   opium_udp_exit(&receiver);
+
+   return test.failed;
+}
+
+int main() {
+   opium_log_t *log = opium_log_init("/dev/null", NULL, NULL);
+   int failed = 0;
+
+   for (size_t index = 0; index < sizeof(batch_sizes) / sizeof(batch_sizes[0]); index++) {
+      failed |= ping_run(batch_sizes[index], log);
+   }
+
+   for (int gso = 0; gso < 2; gso++) {
+      failed |= segments_run(gso ? OPIUM_UDP_GSO : 0, 0, log);
+      failed |= segments_run(gso ? OPIUM_UDP_GSO : 0, OPIUM_UDP_GRO, log);
+   }
+
+   opium_log_exit(log);
+
+   printf("%s\n", failed ? "FAILED" : "OK");
+   return failed;
+}
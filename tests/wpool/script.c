@@ -0,0 +1,143 @@
+#include "core/opium_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Fork-join over the work-stealing pool. Every group lives on the stack
+// of the function that waits on it and is gone as soon as the wait
+// returns, the pattern that needs the last task to stay off the group
+// after its wake-up.
+//
+//   sum:    recursive split of an array sum, nested waits inside workers
+//   rounds: an outside thread forking ROUND_TASKS tiny tasks and joining,
+//           the cost of one fork-join
+
+#define SUM_COUNT    (1 << 24)
+#define SUM_LEAF     (1 << 14)
+#define ROUNDS       100000
+#define ROUND_TASKS  4
+
+typedef struct {
+   opium_wpool_t *pool;
+   const opium_u32_t *values;
+   size_t count;
+   opium_u64_t sum;
+   opium_task_t task;
+} sum_job_t;
+
+static double now_sec(void) {
+   struct timespec time;
+   clock_gettime(CLOCK_MONOTONIC, &time);
+   return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static opium_u64_t sum_serial(const opium_u32_t *values, size_t count) {
+   opium_u64_t sum = 0;
+   for (size_t index = 0; index < count; index++) {
+      sum += values[index];
+   }
+   return sum;
+}
+
+static void sum_run(void *data) {
+   sum_job_t *job = data;
+
+   if (job->count <= SUM_LEAF) {
+      job->sum = sum_serial(job->values, job->count);
+      return;
+   }
+
+   opium_task_group_t group = { 0 };
+   sum_job_t halves[2];
+   size_t half = job->count / 2;
+
+   for (int index = 0; index < 2; index++) {
+      halves[index].pool = job->pool;
+      halves[index].values = job->values + (index ? half : 0);
+      halves[index].count = index ? job->count - half : half;
+      halves[index].task.handler = sum_run;
+      halves[index].task.data = &halves[index];
+      halves[index].task.group = &group;
+      opium_wpool_submit(job->pool, &halves[index].task);
+   }
+
+   opium_wpool_wait(job->pool, &group);
+   job->sum = halves[0].sum + halves[1].sum;
+}
+
+static void tick(void *data) {
+   atomic_fetch_add_explicit((_Atomic opium_u64_t *)data, 1, memory_order_relaxed);
+}
+
+int main() {
+   opium_log_t *log = opium_log_init("/dev/null", NULL, NULL);
+   opium_wpool_t pool;
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   opium_u32_t workers = cpus < 2 ? 2 : (opium_u32_t)opium_min(cpus, OPIUM_WPOOL_MAX_WORKERS);
+   int failed = 0;
+
+   if (opium_wpool_init(&pool, workers, 0, log) != OPIUM_RET_OK) {
+      printf("wpool init failed\n");
+      return 1;
+   }
+
+   opium_u32_t *values = malloc(SUM_COUNT * sizeof(opium_u32_t));
+   if (!values) {
+      return 1;
+   }
+   for (size_t index = 0; index < SUM_COUNT; index++) {
+      values[index] = (opium_u32_t)(index * 2654435761u) >> 8;
+   }
+
+   double started = now_sec();
+   opium_u64_t expected = sum_serial(values, SUM_COUNT);
+   double serial = now_sec() - started;
+
+   opium_task_group_t group = { 0 };
+   sum_job_t root = { .pool = &pool, .values = values, .count = SUM_COUNT };
+   root.task.handler = sum_run;
+   root.task.data = &root;
+   root.task.group = &group;
+
+   started = now_sec();
+   opium_wpool_submit(&pool, &root.task);
+   opium_wpool_wait(&pool, &group);
+   double parallel = now_sec() - started;
+
+   if (root.sum != expected) {
+      printf("sum: %llu, expected %llu\n", (unsigned long long)root.sum, (unsigned long long)expected);
+      failed = 1;
+   }
+   printf("sum:    %d workers, serial %.1f ms, fork-join %.1f ms (%.2fx)\n", workers,
+         serial * 1e3, parallel * 1e3, serial / parallel);
+
+   _Atomic opium_u64_t ticks = 0;
+   opium_task_t tasks[ROUND_TASKS];
+
+   started = now_sec();
+   for (int round = 0; round < ROUNDS; round++) {
+      opium_task_group_t round_group = { 0 };
+      for (int index = 0; index < ROUND_TASKS; index++) {
+         tasks[index].handler = tick;
+         tasks[index].data = (void*)&ticks;
+         tasks[index].group = &round_group;
+         opium_wpool_submit(&pool, &tasks[index]);
+      }
+      opium_wpool_wait(&pool, &round_group);
+   }
+   double rounds = now_sec() - started;
+
+   if (atomic_load(&ticks) != (opium_u64_t)ROUNDS * ROUND_TASKS) {
+      printf("rounds: %llu tasks ran, expected %d\n", (unsigned long long)atomic_load(&ticks), ROUNDS * ROUND_TASKS);
+      failed = 1;
+   }
+   printf("rounds: %d x %d tasks, %.2f us per fork-join\n", ROUNDS, ROUND_TASKS, rounds * 1e6 / ROUNDS);
+
+   opium_wpool_exit(&pool);
+   free(values);
+   opium_log_exit(log);
+
+   printf("%s\n", failed ? "FAIL" : "OK");
+   return failed;
+}
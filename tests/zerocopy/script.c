@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include "zerocopy.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// The zero-copy send queue over a loopback TCP connection. Loopback
+// copies at delivery, but the completions still come back on the error
+// queue, so the queue goes through the same steps as with a NIC.
+//
+//   overlap: completion ranges against send ranges, across the 2^32 wrap
+//   stream:  BUFFERS buffers around the threshold through a small send
+//            buffer; the peer has to read every byte in order, and every
+//            buffer has to be released exactly once, in queue order,
+//            only after its send and completions
+//   enobufs: the same with every other zero-copy send() failing ENOBUFS,
+//            which has to fall back to a copy of that part
+//   exit:    buffers still queued on a stalled socket are released once
+//            by onion_zc_exit()
+
+#define BUFFERS    48
+#define THRESHOLD  (16 * 1024)
+#define SNDBUF     (64 * 1024)
+
+// Idle wait per iteration, a stalled test fails instead of hanging
+#define WAIT_MS    1000
+
+typedef struct {
+   uint8_t *bufs[BUFFERS];
+   size_t sizes[BUFFERS];
+   int released[BUFFERS];
+   int next_release;
+   int failed;
+} stream_t;
+
+static int failed;
+
+// Every other zero-copy send() fails with ENOBUFS while set
+static int inject_enobufs;
+static uint64_t ninjected;
+
+// Takes the place of the libc send() for the queue linked into this binary
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+   if (inject_enobufs && (flags & MSG_ZEROCOPY) && ninjected++ % 2 == 0) {
+      errno = ENOBUFS;
+      return -1;
+   }
+   return sendto(fd, buf, len, flags, NULL, 0);
+}
+
+static void check(int ok, const char *what) {
+   printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+   if (!ok) {
+      failed = 1;
+   }
+}
+
+static uint8_t stream_byte(size_t offset) {
+   return (uint8_t)(offset * 131 + offset / 4093);
+}
+
+static void stream_release(void *allocator, void *buf) {
+   stream_t *stream = allocator;
+   int index = 0;
+
+   while (index < BUFFERS && stream->bufs[index] != buf) {
+      index++;
+   }
+   if (index == BUFFERS) {
+      printf("released a buffer that was never queued\n");
+      stream->failed = 1;
+      return;
+   }
+   if (stream->released[index]++ > 0) {
+      printf("buffer %d released twice\n", index);
+      stream->failed = 1;
+   }
+   if (index != stream->next_release) {
+      printf("buffer %d released before buffer %d\n", index, stream->next_release);
+      stream->failed = 1;
+   }
+   stream->next_release = index + 1;
+}
+
+static int tcp_pair(int *sender, int *receiver) {
+   struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+   socklen_t len = sizeof(addr);
+   int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   int sndbuf = SNDBUF;
+
+   if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0
+         || getsockname(listener, (struct sockaddr*)&addr, &len) < 0) {
+      return -1;
+   }
+
+   *sender = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (*sender < 0) {
+      return -1;
+   }
+   setsockopt(*sender, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+   if (connect(*sender, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      return -1;
+   }
+
+   *receiver = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+   close(listener);
+   return *receiver < 0 ? -1 : 0;
+}
+
+static int stream_fill(stream_t *stream) {
+   size_t offset = 0;
+
+   memset(stream, 0, sizeof(*stream));
+   for (int index = 0; index < BUFFERS; index++) {
+      // Below, at and well above the threshold, in turn
+      size_t sizes[] = { 1000, THRESHOLD, 200 * 1024 + 7 };
+      stream->sizes[index] = sizes[index % 3];
+      stream->bufs[index] = malloc(stream->sizes[index]);
+      if (!stream->bufs[index]) {
+         return -1;
+      }
+      for (size_t pos = 0; pos < stream->sizes[index]; pos++) {
+         stream->bufs[index][pos] = stream_byte(offset++);
+      }
+   }
+   return 0;
+}
+
+static void stream_free(stream_t *stream) {
+   for (int index = 0; index < BUFFERS; index++) {
+      free(stream->bufs[index]);
+   }
+}
+
+static void test_overlap(void) {
+   check(onion_zc_overlap(10, 5, 0, 9) == 0, "range before the sends");
+   check(onion_zc_overlap(10, 5, 12, 20) == 3, "range over the tail");
+   check(onion_zc_overlap(10, 5, 11, 12) == 2, "range inside");
+   check(onion_zc_overlap(UINT32_MAX - 1, 4, UINT32_MAX, 0) == 2, "range across the wrap");
+   check(onion_zc_overlap(UINT32_MAX - 1, 4, UINT32_MAX - 5, 5) == 4, "range around a wrapped run");
+   check(onion_zc_overlap(UINT32_MAX - 1, 4, 2, 9) == 0, "range after a wrapped run");
+   check(onion_zc_overlap(0, 3, UINT32_MAX - 2, UINT32_MAX) == 0, "range before, across the wrap");
+}
+
+static int stream_run(const char *name, onion_zc_t *zc, stream_t *stream, int sender, int receiver) {
+   static uint8_t buf[256 * 1024];
+   size_t total = 0, received = 0;
+   int queued = 0;
+
+   for (int index = 0; index < BUFFERS; index++) {
+      total += stream->sizes[index];
+   }
+
+   while (!stream->failed && (received < total || onion_zc_pending(zc) > 0)) {
+      // Refill as slots come back, the queue holds fewer than BUFFERS
+      while (queued < BUFFERS && onion_zc_pending(zc) < ONION_ZC_QUEUE_CAPABLE / 4) {
+         if (onion_zc_queue(zc, stream->bufs[queued], stream->sizes[queued], stream_release, stream) < 0) {
+            printf("%s: queue refused buffer %d\n", name, queued);
+            return -1;
+         }
+         queued++;
+      }
+
+      ssize_t sent = onion_zc_flush(zc);
+      int completions = onion_zc_complete(zc);
+      if (sent < 0 || completions < 0) {
+         printf("%s: socket error\n", name);
+         return -1;
+      }
+
+      size_t before = received;
+      ssize_t n;
+      while ((n = recv(receiver, buf, sizeof(buf), 0)) > 0) {
+         for (ssize_t pos = 0; pos < n; pos++) {
+            if (buf[pos] != stream_byte(received + pos)) {
+               printf("%s: byte %zu out of order\n", name, received + pos);
+               return -1;
+            }
+         }
+         received += (size_t)n;
+      }
+
+      // Nothing moved: wait for room, bytes or a completion (POLLERR)
+      struct pollfd pfds[2] = {
+         { .fd = sender, .events = onion_zc_unsent(zc) ? POLLOUT : 0 },
+         { .fd = receiver, .events = POLLIN }
+      };
+      if (sent == 0 && completions == 0 && received == before && poll(pfds, 2, WAIT_MS) == 0) {
+         printf("%s: stalled, %zu of %zu bytes read, %d buffers pending\n", name, received, total,
+               onion_zc_pending(zc));
+         return -1;
+      }
+   }
+
+   return stream->failed ? -1 : 0;
+}
+
+static void test_stream(const char *name, int enobufs) {
+   onion_zc_t zc;
+   stream_t stream;
+   int sender, receiver;
+   char what[64];
+
+   if (stream_fill(&stream) < 0 || tcp_pair(&sender, &receiver) < 0) {
+      printf("%s: setup failed: %s\n", name, strerror(errno));
+      failed = 1;
+      return;
+   }
+   onion_zc_init(&zc, sender, THRESHOLD);
+
+   inject_enobufs = enobufs;
+   ninjected = 0;
+   int ret = stream_run(name, &zc, &stream, sender, receiver);
+   inject_enobufs = 0;
+
+   int once = 1;
+   for (int index = 0; index < BUFFERS; index++) {
+      once &= stream.released[index] == 1;
+   }
+
+   printf("%-8s %lu zero-copy sends, %lu copied, %lu copied by the kernel, %lu ENOBUFS\n", name,
+         (unsigned long)zc.nzerocopy, (unsigned long)zc.ncopied, (unsigned long)zc.nfallback,
+         (unsigned long)(enobufs ? (ninjected + 1) / 2 : 0));
+
+   snprintf(what, sizeof(what), "%s: every byte in order", name);
+   check(ret == 0, what);
+   snprintf(what, sizeof(what), "%s: every buffer released once", name);
+   check(once && zc.nreleased == BUFFERS, what);
+   if (zc.threshold > 0) {
+      snprintf(what, sizeof(what), "%s: large buffers went zero-copy", name);
+      check(zc.nzerocopy > 0, what);
+   } else {
+      printf("%s: SO_ZEROCOPY unavailable, every buffer copied\n", name);
+   }
+   if (enobufs) {
+      snprintf(what, sizeof(what), "%s: ENOBUFS parts copied", name);
+      check(ninjected > 0 && zc.ncopied > (BUFFERS / 3), what);
+   }
+
+   close(sender);
+   onion_zc_exit(&zc);
+   close(receiver);
+   stream_free(&stream);
+}
+
+static void test_exit(void) {
+   onion_zc_t zc;
+   stream_t stream;
+   int sender, receiver;
+
+   if (stream_fill(&stream) < 0 || tcp_pair(&sender, &receiver) < 0) {
+      printf("exit: setup failed: %s\n", strerror(errno));
+      failed = 1;
+      return;
+   }
+   onion_zc_init(&zc, sender, THRESHOLD);
+
+   // Nobody reads: the socket fills and the rest stays queued
+   int queued = 0;
+   while (queued < BUFFERS && onion_zc_pending(&zc) < ONION_ZC_QUEUE_CAPABLE
+         && onion_zc_queue(&zc, stream.bufs[queued], stream.sizes[queued], stream_release, &stream) == 0) {
+      queued++;
+   }
+   onion_zc_flush(&zc);
+   int pending = onion_zc_pending(&zc);
+
+   close(sender);
+   onion_zc_exit(&zc);
+   close(receiver);
+
+   int once = 1;
+   for (int index = 0; index < queued; index++) {
+      once &= stream.released[index] == 1;
+   }
+   check(pending > 0 && once && !stream.failed, "exit: stalled buffers released once");
+
+   stream_free(&stream);
+}
+
+int main() {
+   test_overlap();
+   test_stream("zerocopy", 0);
+   test_stream("enobufs", 1);
+   test_exit();
+
+   printf("%s\n", failed ? "FAILED" : "OK");
+   return failed;
+}